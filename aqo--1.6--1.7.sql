@@ -0,0 +1,286 @@
+/* contrib/aqo/aqo--1.6--1.7.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "ALTER EXTENSION aqo UPDATE TO '1.7'" to load this file. \quit
+
+--
+-- Remove knowledge which wasn't used during the given interval.
+-- Returns number of removed query classes and feature subspaces.
+--
+CREATE FUNCTION aqo_expire(age interval, OUT nfs integer, OUT nfss integer)
+RETURNS record
+AS 'MODULE_PATHNAME', 'aqo_expire'
+LANGUAGE C STRICT VOLATILE;
+COMMENT ON FUNCTION aqo_expire(interval) IS
+'Remove knowledge unused during the given interval from the AQO ML storage';
+
+--
+-- Distribution of entries of each AQO storage by the time of last usage.
+--
+CREATE FUNCTION aqo_knowledge_age(
+  OUT store   text,
+  OUT age     text,
+  OUT entries bigint,
+  OUT hits    bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_knowledge_age'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_knowledge_age AS SELECT * FROM aqo_knowledge_age();
+
+--
+-- Show memory of DSA areas of query texts and ML data in aqo_memory_usage().
+--
+CREATE FUNCTION aqo_dsa_usage(
+  OUT name           text,
+  OUT allocated_size bigint,
+  OUT used_size      bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_dsa_usage'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Sizes of DSA areas may exceed the range of int
+DROP FUNCTION aqo_memory_usage;
+CREATE FUNCTION aqo_memory_usage(
+  OUT name text,
+  OUT allocated_size bigint,
+  OUT used_size bigint
+)
+RETURNS SETOF record
+AS $$
+  SELECT name, total_bytes, used_bytes FROM pg_backend_memory_contexts
+  WHERE name LIKE 'AQO%'
+  UNION
+  SELECT name, allocated_size, size FROM pg_shmem_allocations
+  WHERE name LIKE 'AQO%'
+  UNION
+  SELECT name, allocated_size, used_size FROM aqo_dsa_usage();
+$$ LANGUAGE SQL;
+COMMENT ON FUNCTION aqo_memory_usage() IS
+'Show allocated sizes and used sizes of aqo`s memory contexts, hash tables and DSA areas';
+
+--
+-- Percentiles of execution and planning time of query classes, in seconds.
+--
+CREATE FUNCTION aqo_query_latency(
+  OUT queryid  bigint,
+  OUT use_aqo  boolean,
+  OUT nexecs   bigint,
+  OUT exec_p50 double precision,
+  OUT exec_p95 double precision,
+  OUT exec_p99 double precision,
+  OUT plan_p50 double precision,
+  OUT plan_p95 double precision,
+  OUT plan_p99 double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_query_latency'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_query_latency AS SELECT * FROM aqo_query_latency();
+
+--
+-- Show posterior of the auto tuning bandit in aqo_query_stat.
+--
+DROP VIEW aqo_query_stat;
+DROP FUNCTION aqo_query_stat();
+
+CREATE FUNCTION aqo_query_stat (
+  OUT queryid						bigint,
+  OUT execution_time_with_aqo		double precision[],
+  OUT execution_time_without_aqo	double precision[],
+  OUT planning_time_with_aqo		double precision[],
+  OUT planning_time_without_aqo		double precision[],
+  OUT cardinality_error_with_aqo	double precision[],
+  OUT cardinality_error_without_aqo	double precision[],
+  OUT executions_with_aqo bigint,
+  OUT executions_without_aqo		bigint,
+  OUT posterior_time_with_aqo		double precision,
+  OUT posterior_time_without_aqo	double precision,
+  OUT probability_aqo_is_better		double precision,
+  OUT auto_tuning_regret			double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_query_stat'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_query_stat AS SELECT * FROM aqo_query_stat();
+
+--
+-- Plans of query classes, tracked by the plan regression guard.
+--
+CREATE FUNCTION aqo_query_plans(
+  OUT queryid		bigint,
+  OUT planid		bigint,
+  OUT executions	bigint,
+  OUT exec_time		double precision,
+  OUT is_good		boolean,
+  OUT pin_left		integer
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_query_plans'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_query_plans AS SELECT * FROM aqo_query_plans();
+
+--
+-- Memory demand of query classes, which had plan nodes spilled to disk.
+--
+CREATE FUNCTION aqo_query_memory(
+  OUT queryid	bigint,
+  OUT spills	bigint,
+  OUT work_mem	bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_query_memory'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_query_memory AS SELECT * FROM aqo_query_memory();
+
+--
+-- Parallel workers of query classes: planned and launched per Gather node.
+--
+CREATE FUNCTION aqo_query_workers(
+  OUT queryid			bigint,
+  OUT workers_planned	double precision,
+  OUT workers_launched	double precision,
+  OUT launch_rate		double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_query_workers'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_query_workers AS SELECT * FROM aqo_query_workers();
+
+--
+-- Errors of the shadow predictions and of the native estimates, which the
+-- planner used instead, in the log scale.
+--
+CREATE FUNCTION aqo_shadow_stat(
+  OUT queryid		bigint,
+  OUT nodes			bigint,
+  OUT error_aqo		double precision,
+  OUT error_native	double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_shadow_stat'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_shadow_stat AS SELECT * FROM aqo_shadow_stat();
+
+CREATE FUNCTION aqo_shadow_data(
+  OUT fs			bigint,
+  OUT fss			integer,
+  OUT nodes			bigint,
+  OUT error_aqo		double precision,
+  OUT error_native	double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_shadow_data'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_shadow_data AS SELECT * FROM aqo_shadow_data();
+
+--
+-- Buffer cache behaviour of relations, learned on scans.
+--
+CREATE FUNCTION aqo_relation_io(
+  OUT relid		oid,
+  OUT access	text,
+  OUT scans		bigint,
+  OUT hits		double precision,
+  OUT reads		double precision,
+  OUT hit_ratio	double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_relation_io'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_relation_io AS SELECT * FROM aqo_relation_io();
+
+--
+-- JIT setting of a query class. NULL means the choice of the planner or of
+-- the auto tuning.
+--
+DROP VIEW aqo_queries;
+DROP FUNCTION aqo_queries;
+
+CREATE FUNCTION aqo_queries (
+  OUT queryid                bigint,
+  OUT fs                     bigint,
+  OUT learn_aqo              boolean,
+  OUT use_aqo                boolean,
+  OUT auto_tuning            boolean,
+  OUT smart_timeout          bigint,
+  OUT count_increase_timeout bigint,
+  OUT jit                    boolean
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_queries'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_queries AS SELECT * FROM aqo_queries();
+
+CREATE FUNCTION aqo_set_class_jit(queryid bigint, jit boolean)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'aqo_set_class_jit'
+LANGUAGE C VOLATILE;
+
+--
+-- Model of a feature subspace and its model-specific state.
+--
+DROP VIEW aqo_data;
+DROP FUNCTION aqo_data;
+DROP FUNCTION aqo_data_update;
+
+CREATE FUNCTION aqo_data (
+  OUT fs			bigint,
+  OUT fss			integer,
+  OUT nfeatures		integer,
+  OUT features		double precision[][],
+  OUT targets		double precision[],
+  OUT reliability	double precision[],
+  OUT oids			Oid[],
+  OUT model			text,
+  OUT payload		double precision[]
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_data'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW aqo_data AS SELECT * FROM aqo_data();
+
+CREATE FUNCTION aqo_data_update(
+  fs		bigint,
+  fss		integer,
+  nfeatures	integer,
+  features	double precision[][],
+  targets	double precision[],
+  reliability	double precision[],
+  oids		Oid[],
+  model		text DEFAULT 'knn',
+  payload	double precision[] DEFAULT NULL)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'aqo_data_update'
+LANGUAGE C VOLATILE;
+
+--
+-- Offline harness of the learning: replay recorded samples of a feature
+-- subspace and show the convergence of predictions.
+--
+CREATE FUNCTION aqo_learning_replay(
+  features						double precision[][],
+  targets						double precision[],
+  OUT step						integer,
+  OUT prediction				double precision,
+  OUT error						double precision,
+  OUT learning_rate				double precision,
+  OUT selection_threshold		double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_learning_replay'
+LANGUAGE C STRICT VOLATILE;
+COMMENT ON FUNCTION aqo_learning_replay(double precision[][], double precision[]) IS
+'Learn the samples one by one. Show errors of predictions, made before the learning of each sample.';
@@ -10,15 +10,25 @@
 
 #include "postgres.h"
 
+#include <float.h>
+
 #include "aqo.h"
 
 #include "access/relation.h"
 #include "access/table.h"
 #include "catalog/objectaccess.h"
+#include "catalog/pg_class.h"
 #include "catalog/pg_extension.h"
 #include "commands/extension.h"
 #include "miscadmin.h"
+#include "postmaster/interrupt.h"
+#include "storage/latch.h"
+#include "storage/procarray.h"
+#include "tcop/tcopprot.h"
+#include "utils/lsyscache.h"
 #include "utils/selfuncs.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
 
 #include "aqo.h"
 #include "aqo_shared.h"
@@ -38,6 +48,7 @@ void _PG_init(void);
 /* Strategy of determining feature space for new queries. */
 int		aqo_mode = AQO_MODE_CONTROLLED;
 bool	force_collect_stat;
+bool	aqo_shadow_mode = false;
 bool	aqo_predict_with_few_neighbors;
 int 	aqo_statement_timeout;
 
@@ -66,6 +77,18 @@ static const struct config_enum_entry format_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry tuning_strategy_options[] = {
+	{"logistic", AQO_TUNING_LOGISTIC, false},
+	{"thompson", AQO_TUNING_THOMPSON, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry model_options[] = {
+	{"knn", AQO_MODEL_KNN, false},
+	{"ridge", AQO_MODEL_RIDGE, false},
+	{NULL, 0, false}
+};
+
 /* Parameters of autotuning */
 int			aqo_stat_size = STAT_SAMPLE_SIZE;
 int			auto_tuning_window_size = 5;
@@ -82,6 +105,16 @@ int			aqo_k;
 double		log_selectivity_lower_bound = -30;
 
 static bool		cleanup_bgworker = false;
+static int		maintenance_naptime = 60; /* in seconds */
+
+/*
+ * Relations, dropped by the current transaction, and the subtransactions
+ * which have dropped them. Live in the TopTransactionContext.
+ */
+static AqoDroppedRel   *dropped_rels = NULL;
+static int			   *dropped_nestlevels = NULL;
+static int				ndropped_rels = 0;
+static int				maxdropped_rels = 0;
 
 /*
  * Currently we use it only to store query_text string which is initialized
@@ -109,7 +142,9 @@ post_parse_analyze_hook_type				prev_post_parse_analyze_hook;
 planner_hook_type							prev_planner_hook;
 ExecutorStart_hook_type						prev_ExecutorStart_hook;
 ExecutorRun_hook_type						prev_ExecutorRun;
+ExecutorFinish_hook_type					prev_ExecutorFinish;
 ExecutorEnd_hook_type						prev_ExecutorEnd_hook;
+ProcessUtility_hook_type					prev_ProcessUtility_hook;
 set_baserel_rows_estimate_hook_type			prev_set_foreign_rows_estimate_hook;
 set_baserel_rows_estimate_hook_type			prev_set_baserel_rows_estimate_hook;
 get_parameterized_baserel_size_hook_type	prev_get_parameterized_baserel_size_hook;
@@ -120,8 +155,10 @@ ExplainOneNode_hook_type					prev_ExplainOneNode_hook;
 static shmem_request_hook_type				prev_shmem_request_hook = NULL;
 static object_access_hook_type				prev_object_access_hook;
 
-PGDLLEXPORT void aqo_bgworker_cleanup(Datum main_arg);
-static void aqo_bgworker_startup(void);
+PGDLLEXPORT void aqo_maintenance_main(Datum main_arg);
+static void aqo_maintenance_register(void);
+static bool check_plan_invalidation_factor(double *newval, void **extra,
+										   GucSource source);
 
 /*****************************************************************************
  *
@@ -142,6 +179,13 @@ aqo_free_callback(ResourceReleasePhase phase,
 	{
 		MemoryContextReset(AQOCacheMemCtx);
 		cur_classes = NIL;
+
+		/*
+		 * Planning could be interrupted by an error. Don't allow predictions,
+		 * cached by this planning, to survive until the next one.
+		 */
+		if (!isCommit)
+			MemoryContextReset(AQOPredictMemCtx);
 	}
 }
 
@@ -157,20 +201,149 @@ aqo_shmem_request(void)
 	RequestAddinShmemSpace(aqo_memsize());
 }
 
+static int
+dropped_rel_cmp(const void *a, const void *b)
+{
+	Oid		da = ((const AqoDroppedRel *) a)->dbid;
+	Oid		db = ((const AqoDroppedRel *) b)->dbid;
+
+	return (da > db) - (da < db);
+}
+
+static void
+aqo_maintenance_shmem_exit(int code, Datum arg)
+{
+	LWLockAcquire(&aqo_state->lock, LW_EXCLUSIVE);
+	aqo_state->maintenance_latch = NULL;
+	LWLockRelease(&aqo_state->lock);
+}
+
 /*
- * Entry point for CleanupWorker's process.
+ * Entry point of the maintenance worker. It wakes up each
+ * aqo.maintenance_naptime seconds and removes knowledge which wasn't used
+ * during aqo.knowledge_ttl. Also, it is woken up by transactions which have
+ * dropped some relations, to remove knowledge related to them.
  */
 void
-aqo_bgworker_cleanup(Datum main_arg)
+aqo_maintenance_main(Datum main_arg)
 {
-	int	fs_num;
-	int	fss_num;
+	MemoryContext	worker_ctx;
+	AqoDroppedRel  *rels;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	worker_ctx = AllocSetContextCreate(TopMemoryContext,
+									   "AQO maintenance",
+									   ALLOCSET_DEFAULT_SIZES);
+	rels = MemoryContextAlloc(TopMemoryContext,
+							  AQO_DROP_QUEUE_SIZE * sizeof(AqoDroppedRel));
+
+	before_shmem_exit(aqo_maintenance_shmem_exit, (Datum) 0);
+	LWLockAcquire(&aqo_state->lock, LW_EXCLUSIVE);
+	aqo_state->maintenance_latch = MyLatch;
+	LWLockRelease(&aqo_state->lock);
+
+	for (;;)
+	{
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 maintenance_naptime * 1000L,
+						 PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		/* Relations could be queued before the latch has been published */
+		if (aqo_drop_queue->len > 0)
+		{
+			MemoryContext	old_ctx = MemoryContextSwitchTo(worker_ctx);
+			AqoDroppedRel  *pending;
+			Oid			   *reloids;
+			int				nrels;
+			int				npending = 0;
+			int				n = 0;
+			int				i;
+
+			nrels = aqo_drop_queue_pop(rels);
+			pending = palloc(nrels * sizeof(AqoDroppedRel));
+			reloids = palloc(nrels * sizeof(Oid));
+
+			for (i = 0; i < nrels; i++)
+			{
+				if (TransactionIdIsValid(rels[i].xid))
+				{
+					/* Wait for the end of the prepared transaction */
+					if (TransactionIdIsInProgress(rels[i].xid))
+					{
+						pending[npending++] = rels[i];
+						continue;
+					}
+
+					if (!TransactionIdDidCommit(rels[i].xid))
+						continue;
+				}
+				rels[n++] = rels[i];
+			}
+
+			if (npending > 0 &&
+				aqo_drop_queue_push(pending, npending, false) < npending)
+				elog(LOG, "[AQO] Queue of dropped relations is full. Knowledge "
+					 "related to prepared transactions is left for aqo_cleanup().");
+
+			/* Clean up the knowledge of each database separately */
+			qsort(rels, n, sizeof(AqoDroppedRel), dropped_rel_cmp);
+			for (i = 0; i < n;)
+			{
+				Oid		dbid = rels[i].dbid;
+				int		nreloids = 0;
+				int		fs_num;
+				int		fss_num;
+
+				for (; i < n && rels[i].dbid == dbid; i++)
+					reloids[nreloids++] = rels[i].reloid;
+
+				aqo_cleanup_dropped(dbid, reloids, nreloids, &fs_num, &fss_num);
+
+				elog(DEBUG1, "[AQO] Cleanup after drop of %d relations: "
+					 "%d query classes and %d feature subspaces removed.",
+					 nreloids, fs_num, fss_num);
+			}
+
+			MemoryContextSwitchTo(old_ctx);
+			MemoryContextReset(worker_ctx);
+		}
+
+		if (knowledge_ttl > 0)
+		{
+			MemoryContext	old_ctx = MemoryContextSwitchTo(worker_ctx);
+			TimestampTz		horizon;
+			int				fs_num;
+			int				fss_num;
+
+			horizon = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+												  -((int64) knowledge_ttl * 1000));
+			aqo_expire_knowledge(horizon, &fs_num, &fss_num);
+
+			if (fs_num > 0 || fss_num > 0)
+				elog(LOG, "[AQO] %d query classes and %d feature subspaces expired.",
+					 fs_num, fss_num);
 
-	cleanup_aqo_database(true, &fs_num, &fss_num);
+			MemoryContextSwitchTo(old_ctx);
+			MemoryContextReset(worker_ctx);
+		}
+	}
 }
 
 /*
- * Object access hook
+ * Object access hook. Remember relations dropped by the transaction. Knowledge
+ * related to them will be removed by the maintenance worker after the commit.
  */
 static void
 aqo_drop_access_hook(ObjectAccessType access,
@@ -179,69 +352,169 @@ aqo_drop_access_hook(ObjectAccessType access,
 					 int subId,
 					 void *arg)
 {
+	char	relkind;
+
 	if (prev_object_access_hook)
 		(*prev_object_access_hook) (access, classId, objectId, subId, arg);
 
-	if (access == OAT_DROP && cleanup_bgworker)
+	if (access != OAT_DROP || classId != RelationRelationId || subId != 0 ||
+		!cleanup_bgworker)
+		return;
+
+	/* The relation still exists. AQO learns only on scans of tables */
+	relkind = get_rel_relkind(objectId);
+	if (relkind != RELKIND_RELATION && relkind != RELKIND_PARTITIONED_TABLE &&
+		relkind != RELKIND_MATVIEW && relkind != RELKIND_FOREIGN_TABLE)
+		return;
+
+	if (ndropped_rels >= maxdropped_rels)
 	{
-		MemoryContext old_ctx;
-		int status = BGWH_STOPPED;
-		pid_t pid;
+		if (dropped_rels == NULL)
+		{
+			maxdropped_rels = 16;
+			dropped_rels = MemoryContextAlloc(TopTransactionContext,
+										maxdropped_rels * sizeof(AqoDroppedRel));
+			dropped_nestlevels = MemoryContextAlloc(TopTransactionContext,
+										maxdropped_rels * sizeof(int));
+		}
+		else
+		{
+			maxdropped_rels *= 2;
+			dropped_rels = repalloc(dropped_rels,
+									maxdropped_rels * sizeof(AqoDroppedRel));
+			dropped_nestlevels = repalloc(dropped_nestlevels,
+										  maxdropped_rels * sizeof(int));
+		}
+	}
+
+	dropped_rels[ndropped_rels].dbid = MyDatabaseId;
+	dropped_rels[ndropped_rels].reloid = objectId;
+	dropped_rels[ndropped_rels].xid = InvalidTransactionId;
+	dropped_nestlevels[ndropped_rels] = GetCurrentTransactionNestLevel();
+	ndropped_rels++;
+}
 
-		old_ctx = MemoryContextSwitchTo(AQOTopMemCtx);
-		LWLockAcquire(&aqo_state->lock, LW_EXCLUSIVE);
-		if (aqo_state->bgw_handle != NULL)
+/*
+ * Forget relations dropped by an aborted subtransaction. On commit of a
+ * subtransaction, pass its relations to the parent.
+ */
+static void
+aqo_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					 SubTransactionId parentSubid, void *arg)
+{
+	int		nestlevel = GetCurrentTransactionNestLevel();
+	int		i;
+	int		n = 0;
+
+	if (ndropped_rels == 0)
+		return;
+
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+	{
+		for (i = 0; i < ndropped_rels; i++)
 		{
-			status = GetBackgroundWorkerPid(aqo_state->bgw_handle, &pid);
+			if (dropped_nestlevels[i] < nestlevel)
+			{
+				dropped_rels[n] = dropped_rels[i];
+				dropped_nestlevels[n] = dropped_nestlevels[i];
+				n++;
+			}
 		}
-		LWLockRelease(&aqo_state->lock);
-		if (status != BGWH_STARTED)
+		ndropped_rels = n;
+	}
+	else if (event == SUBXACT_EVENT_COMMIT_SUB)
+	{
+		for (i = 0; i < ndropped_rels; i++)
 		{
-			aqo_bgworker_startup();
+			if (dropped_nestlevels[i] >= nestlevel)
+				dropped_nestlevels[i] = nestlevel - 1;
 		}
-		MemoryContextSwitchTo(old_ctx);
+	}
+}
+
+/*
+ * Pass relations dropped by the transaction to the maintenance worker, when
+ * the drop can't be rolled back anymore. Relations of a prepared transaction
+ * are passed with its xid: the worker waits for the COMMIT PREPARED, which
+ * may be made by another backend.
+ */
+static void
+aqo_xact_callback(XactEvent event, void *arg)
+{
+	int		i;
+	int		nqueued;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_PREPARE:
+			for (i = 0; i < ndropped_rels; i++)
+				dropped_rels[i].xid = GetTopTransactionId();
+			break;
+
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_PREPARE:
+			if (ndropped_rels == 0)
+				break;
+
+			/* Don't raise an error: the transaction is already finished */
+			nqueued = aqo_drop_queue_push(dropped_rels, ndropped_rels, true);
+			if (nqueued < ndropped_rels)
+				elog(LOG, "[AQO] Queue of dropped relations is full. Knowledge "
+					 "related to %d relations is left for aqo_cleanup().",
+					 ndropped_rels - nqueued);
+
+			/* Memory is released with the TopTransactionContext */
+			dropped_rels = NULL;
+			dropped_nestlevels = NULL;
+			ndropped_rels = 0;
+			maxdropped_rels = 0;
+			break;
+
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			dropped_rels = NULL;
+			dropped_nestlevels = NULL;
+			ndropped_rels = 0;
+			maxdropped_rels = 0;
+			break;
+
+		default:
+			break;
 	}
 }
 
 static void
-aqo_bgworker_startup(void)
+aqo_maintenance_register(void)
 {
-	BackgroundWorker		worker;
-	BackgroundWorkerHandle	*handle;
-	BgwHandleStatus			status;
-	pid_t					pid;
+	BackgroundWorker	worker;
 
 	MemSet(&worker, 0, sizeof(worker));
 
-	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
-		BGWORKER_BACKEND_DATABASE_CONNECTION;
-	worker.bgw_start_time = BgWorkerStart_ConsistentState;
-	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
 	worker.bgw_main_arg = Int32GetDatum(0);
-	worker.bgw_extra[0] = 0;
-	memcpy(worker.bgw_function_name, "aqo_bgworker_cleanup", 21);
-	memcpy(worker.bgw_library_name, "aqo", 4);
-	memcpy(worker.bgw_name, "aqo cleanup", 12);
-
-	/* must set notify PID to wait for startup */
-	worker.bgw_notify_pid = MyProcPid;
-
-	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
-		ereport(NOTICE,
-				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
-				 errmsg("could not register background process"),
-				 errhint("You might need to increase max_worker_processes.")));
-
-	status = WaitForBackgroundWorkerStartup(handle, &pid);
-	if (status != BGWH_STARTED)
-		ereport(NOTICE,
-				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
-				 errmsg("could not start background process"),
-				 errhint("More details may be available in the server log.")));
+	strlcpy(worker.bgw_function_name, "aqo_maintenance_main", BGW_MAXLEN);
+	strlcpy(worker.bgw_library_name, "aqo", MAXPGPATH);
+	strlcpy(worker.bgw_name, "aqo maintenance", BGW_MAXLEN);
+	strlcpy(worker.bgw_type, "aqo maintenance", BGW_MAXLEN);
 
-	LWLockAcquire(&aqo_state->lock, LW_EXCLUSIVE);
-	aqo_state->bgw_handle = handle;
-	LWLockRelease(&aqo_state->lock);
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * A prediction is changed at least by the factor 1. So, the factor must be
+ * greater than 1, and zero disables the invalidation.
+ */
+static bool
+check_plan_invalidation_factor(double *newval, void **extra, GucSource source)
+{
+	if (*newval == 0. || *newval > 1.)
+		return true;
+
+	GUC_check_errdetail("The factor must be greater than 1, or zero to disable the invalidation.");
+	return false;
 }
 
 void
@@ -276,6 +549,117 @@ _PG_init(void)
 							 NULL
 	);
 
+	DefineCustomEnumVariable("aqo.auto_tuning_strategy",
+							 "Strategy of the auto tuning to decide whether to use AQO for a query class.",
+							 NULL,
+							 &auto_tuning_strategy,
+							 AQO_TUNING_LOGISTIC,
+							 tuning_strategy_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomRealVariable("aqo.auto_tuning_regret_budget",
+							 "Time, in seconds, which the thompson auto tuning may lose on exploration of a query class.",
+							 NULL,
+							 &auto_tuning_regret_budget,
+							 10.0,
+							 0.0, DBL_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomRealVariable("aqo.auto_tuning_drift_threshold",
+							 "Change of the log-time of a query class which re-opens the thompson auto tuning exploration.",
+							 NULL,
+							 &auto_tuning_drift_threshold,
+							 0.5,
+							 0.0, DBL_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomBoolVariable("aqo.auto_tuning_plan_cache",
+							 "Choose between custom and generic plans of prepared statements for each query class.",
+							 "Compares time of executions with planning against executions of a cached plan.",
+							 &auto_tuning_plan_cache,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomBoolVariable("aqo.auto_tuning_jit",
+							 "Learn for each query class whether JIT compilation chosen by the planner pays off.",
+							 "Explicit setting of the class in aqo_queries takes precedence.",
+							 &auto_tuning_jit,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomBoolVariable("aqo.auto_tuning_parallel_workers",
+							 "Request for a query class as many parallel workers as its Gather nodes actually launch.",
+							 NULL,
+							 &auto_tuning_parallel_workers,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomBoolVariable("aqo.relation_io",
+							 "Learn buffer cache hit ratio of relations and use it in costing of index scans.",
+							 NULL,
+							 &aqo_relation_io,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomIntVariable("aqo.work_mem_limit",
+							"Sets the maximum work_mem, AQO may set for a query class with plan nodes spilled to disk.",
+							"Zero value disables the tuning of work_mem.",
+							&aqo_work_mem_limit,
+							0, 0, MAX_KILOBYTES,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("aqo.plan_invalidation_factor",
+							 "Change of a prediction after learning which invalidates cached plans built with the old one.",
+							 "Zero value disables the invalidation.",
+							 &plan_invalidation_factor,
+							 0.0,
+							 0.0, DBL_MAX,
+							 PGC_USERSET,
+							 0,
+							 check_plan_invalidation_factor,
+							 NULL,
+							 NULL
+	);
+
 	DefineCustomBoolVariable(
 							 "aqo.force_collect_stat",
 							 "Collect statistics at all AQO modes",
@@ -289,6 +673,19 @@ _PG_init(void)
 							 NULL
 	);
 
+	DefineCustomBoolVariable(
+							 "aqo.shadow_mode",
+							 "Make predictions for query classes, which don't use AQO, without using them.",
+							 "Errors of the predictions and of the planner's estimates are compared in aqo_shadow_stat and aqo_shadow_data.",
+							 &aqo_shadow_mode,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
 	DefineCustomBoolVariable(
 							 "aqo.show_hash",
 							 "Show query and node hash on explain.",
@@ -341,6 +738,31 @@ _PG_init(void)
 							 NULL
 	);
 
+	DefineCustomBoolVariable("aqo.relation_size_aware",
+							 "Learn cardinalities relative to sizes of the relations.",
+							 "Predictions follow the growth of the tables, counted by VACUUM and ANALYZE.",
+							 &aqo_relation_size_aware,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomRealVariable("aqo.confidence_threshold",
+							 "Sets the confidence of a prediction, below which it is blended with the planner's estimate.",
+							 "Zero value disables the blending.",
+							 &aqo_confidence_threshold,
+							 0.0,
+							 0.0, 1.0,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
 	DefineCustomIntVariable("aqo.join_threshold",
 							"Sets the threshold of number of JOINs in query beyond which AQO is used.",
 							NULL,
@@ -405,6 +827,43 @@ _PG_init(void)
 							NULL,
 							NULL
 	);
+
+	DefineCustomIntVariable("aqo.querytext_dsm_size_max",
+							"Maximum size of dynamic shared memory which AQO could allocate to store query texts.",
+							"Least recently used query texts are evicted if the limit is reached.",
+							&querytext_dsm_size_max,
+							20,
+							0, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL
+	);
+
+	DefineCustomBoolVariable("aqo.querytext_compression",
+							 "Compress query texts stored by AQO.",
+							 NULL,
+							 &querytext_compression,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomBoolVariable("aqo.querytext_resident",
+							 "Keep query texts in shared memory.",
+							 "If off, texts are read from the storage file on demand.",
+							 &querytext_resident,
+							 true,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
 	DefineCustomIntVariable("aqo.statement_timeout",
 							"Time limit on learning.",
 							NULL,
@@ -418,7 +877,7 @@ _PG_init(void)
 							NULL);
 
 	DefineCustomBoolVariable("aqo.cleanup_bgworker",
-							 "Enable bgworker which responsible for doing cleanup after drop",
+							 "Pass dropped relations to the maintenance worker to cleanup related knowledge",
 							 NULL,
 							 &cleanup_bgworker,
 							 false,
@@ -429,6 +888,18 @@ _PG_init(void)
 							 NULL
 	);
 
+	DefineCustomIntVariable("aqo.cleanup_batch_size",
+							"Number of relations checked by a step of the cleanup.",
+							"Locks of the storage aren't held between the steps.",
+							&aqo_cleanup_batch_size,
+							1000,
+							1, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomIntVariable("aqo.min_neighbors_for_predicting",
 							"Set how many neighbors the cardinality prediction will be calculated",
 							NULL,
@@ -440,6 +911,31 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomEnumVariable("aqo.model",
+							 "Model, which is learned for new feature subspaces.",
+							 "Subspaces, which are learned already, keep their models.",
+							 &aqo_model,
+							 AQO_MODEL_KNN,
+							 model_options,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomBoolVariable("aqo.adaptive_learning",
+							 "Adapt learning rate and selection threshold of each feature subspace to errors of its predictions.",
+							 NULL,
+							 &aqo_adaptive_learning,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
 	DefineCustomBoolVariable("aqo.predict_with_few_neighbors",
 							"Establish the ability to make predictions with fewer neighbors than were found.",
 							 NULL,
@@ -451,6 +947,102 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomIntVariable("aqo.admission_threshold",
+							"Number of plannings of a new query class before AQO stores it in the intelligent and learn modes or with aqo.force_collect_stat.",
+							"The value 1 means that a class is stored on the first sight.",
+							&admission_threshold,
+							1, 1, INT_MAX / 1000,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.admission_window",
+							"Number of plannings of unknown query classes after which the admission filter forgets a half of its history.",
+							NULL,
+							&admission_window,
+							10000, 100, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.knowledge_ttl",
+							"Removes knowledge which wasn't used during this period.",
+							"Zero value disables the expiry.",
+							&knowledge_ttl,
+							0, 0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("aqo.maintenance_naptime",
+							"Sleep time between runs of the AQO maintenance worker.",
+							NULL,
+							&maintenance_naptime,
+							60, 1, INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("aqo.plan_regression_threshold",
+							 "Relative slowdown of a new plan of a query class against the best known plan which pins the class to the best plan.",
+							 "Zero value disables the plan regression guard.",
+							 &plan_regression_threshold,
+							 0.0,
+							 0.0, DBL_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomIntVariable("aqo.plan_regression_min_execs",
+							"Number of executions of a plan needed to compare it with other plans of the query class.",
+							NULL,
+							&plan_regression_min_execs,
+							3, 1, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("aqo.knowledge_drift_threshold",
+							 "Relative change of a relation size after ANALYZE or COPY, or of the cardinality error of a query class, which makes the learned knowledge stale.",
+							 "Zero value disables the drift detection.",
+							 &knowledge_drift_threshold,
+							 0.0,
+							 0.0, DBL_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	DefineCustomRealVariable("aqo.knowledge_drift_decay",
+							 "Factor of reliability of the stale knowledge.",
+							 "Zero value removes the stale knowledge.",
+							 &knowledge_drift_decay,
+							 0.5,
+							 0.0, 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+	);
+
+	aqo_maintenance_register();
+
 	prev_shmem_startup_hook						= shmem_startup_hook;
 	shmem_startup_hook							= aqo_init_shmem;
 	prev_planner_hook							= planner_hook;
@@ -459,8 +1051,12 @@ _PG_init(void)
 	ExecutorStart_hook							= aqo_ExecutorStart;
 	prev_ExecutorRun							= ExecutorRun_hook;
 	ExecutorRun_hook							= aqo_ExecutorRun;
+	prev_ExecutorFinish							= ExecutorFinish_hook;
+	ExecutorFinish_hook							= aqo_ExecutorFinish;
 	prev_ExecutorEnd_hook						= ExecutorEnd_hook;
 	ExecutorEnd_hook							= aqo_ExecutorEnd;
+	prev_ProcessUtility_hook					= ProcessUtility_hook;
+	ProcessUtility_hook							= aqo_ProcessUtility;
 
 	/* Cardinality prediction hooks. */
 	prev_set_baserel_rows_estimate_hook			= set_baserel_rows_estimate_hook;
@@ -487,6 +1083,8 @@ _PG_init(void)
 
 	prev_create_upper_paths_hook				= create_upper_paths_hook;
 	create_upper_paths_hook						= aqo_store_upper_signature_hook;
+	prev_set_rel_pathlist_hook					= set_rel_pathlist_hook;
+	set_rel_pathlist_hook						= aqo_set_rel_pathlist;
 
 	prev_shmem_request_hook = shmem_request_hook;
 	shmem_request_hook = aqo_shmem_request;
@@ -524,6 +1122,8 @@ _PG_init(void)
 											 "AQOLearnMemoryContext",
 											 ALLOCSET_DEFAULT_SIZES);
 	RegisterResourceReleaseCallback(aqo_free_callback, NULL);
+	RegisterXactCallback(aqo_xact_callback, NULL);
+	RegisterSubXactCallback(aqo_subxact_callback, NULL);
 	RegisterAQOPlanNodeMethods();
 
 	MarkGUCPrefixReserved("aqo");
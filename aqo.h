@@ -135,6 +135,7 @@
 #include "optimizer/cost.h"
 #include "parser/analyze.h"
 #include "parser/parsetree.h"
+#include "tcop/utility.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
 #include "utils/hsearch.h"
@@ -168,13 +169,35 @@ typedef enum
 	AQO_MODE_DISABLED,
 }	AQO_MODE;
 
+/* How auto tuning decides to use AQO for a query class */
+typedef enum
+{
+	/* Logistic function of mean times with fixed exploration */
+	AQO_TUNING_LOGISTIC,
+	/* Thompson sampling over log-time with a regret budget */
+	AQO_TUNING_THOMPSON,
+}	AQO_TUNING_STRATEGY;
+
+/* JIT setting of a query class */
+typedef enum
+{
+	/* Leave the choice to the planner or to the auto tuning */
+	AQO_JIT_AUTO = -1,
+	AQO_JIT_OFF,
+	AQO_JIT_ON,
+}	AQO_JIT;
+
 extern int	aqo_mode;
 extern bool	force_collect_stat;
+extern bool	aqo_shadow_mode;
 extern bool aqo_show_hash;
 extern bool aqo_show_details;
 extern int aqo_join_threshold;
 extern bool use_wide_search;
+extern bool aqo_relation_size_aware;
+extern double aqo_confidence_threshold;
 extern bool aqo_learn_statement_timeout;
+extern double plan_invalidation_factor;
 
 /* Parameters for current query */
 typedef struct QueryContextData
@@ -187,6 +210,10 @@ typedef struct QueryContextData
 	bool		collect_stat;
 	bool		adding_query;
 	bool		explain_only;
+	bool		shadow;	/* predict, but plan with the native estimates */
+	int			jit;	/* AQO_JIT value of the class */
+	int			work_mem;	/* work_mem for the class in kB, 0 - as is */
+	int			parallel_workers;	/* workers per Gather, -1 - as is */
 
 	/*
 	 * Timestamp of start of query planning process. Must be zeroed on execution
@@ -220,6 +247,18 @@ extern double auto_tuning_exploration;
 extern int	auto_tuning_max_iterations;
 extern int	auto_tuning_infinite_loop;
 extern double auto_tuning_convergence_error;
+extern int	auto_tuning_strategy;
+extern double auto_tuning_regret_budget;
+extern double auto_tuning_drift_threshold;
+extern bool auto_tuning_plan_cache;
+extern bool auto_tuning_jit;
+extern bool auto_tuning_parallel_workers;
+extern int	aqo_work_mem_limit;
+
+extern int aqo_plan_cache_choice(uint64 queryid);
+extern int aqo_jit_choice(uint64 queryid);
+extern int aqo_work_mem_choice(uint64 queryid);
+extern int aqo_parallel_workers_choice(uint64 queryid);
 
 /* Machine learning parameters */
 
@@ -242,7 +281,9 @@ extern post_parse_analyze_hook_type prev_post_parse_analyze_hook;
 extern planner_hook_type prev_planner_hook;
 extern ExecutorStart_hook_type prev_ExecutorStart_hook;
 extern ExecutorRun_hook_type prev_ExecutorRun;
+extern ExecutorFinish_hook_type prev_ExecutorFinish;
 extern ExecutorEnd_hook_type prev_ExecutorEnd_hook;
+extern ProcessUtility_hook_type prev_ProcessUtility_hook;
 extern set_baserel_rows_estimate_hook_type
 										prev_set_foreign_rows_estimate_hook;
 extern set_baserel_rows_estimate_hook_type
@@ -279,11 +320,21 @@ extern void print_node_explain(ExplainState *es, PlanState *ps, Plan *plan);
 
 /* Cardinality estimation */
 extern double predict_for_relation(List *restrict_clauses, List *selectivities,
-								   List *relsigns, int *fss);
+								   List *relsigns, List *reloids, int *fss,
+								   double *confidence);
+extern void relation_size_remember(Oid reloid, double tuples);
+extern bool size_aware_object(List *relsigns, List *reloids);
+extern double relations_log_size(List *reloids);
+extern double prediction_confidence(int fss);
+extern double prediction_made(int fss);
+extern double blend_prediction(double predicted, double confidence,
+							   double native);
+extern OkNNrdata *predict_cache_lookup(uint64 fs, int fss, int ncols);
 
 /* Query execution statistics collecting hooks */
 bool aqo_ExecutorStart(QueryDesc *queryDesc, int eflags);
 void aqo_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count);
+void aqo_ExecutorFinish(QueryDesc *queryDesc);
 void aqo_ExecutorEnd(QueryDesc *queryDesc);
 
 /* Automatic query tuning */
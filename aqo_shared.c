@@ -14,8 +14,12 @@
 
 shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 AQOSharedState *aqo_state = NULL;
+static AqoAdmissionSketch *admission_sketch = NULL;
+AqoDropQueue *aqo_drop_queue = NULL;
 int fs_max_items = 10000; /* Max number of different feature spaces in ML model */
 int fss_max_items = 100000; /* Max number of different feature subspaces in ML model */
+int admission_threshold = 1; /* Plannings of a class needed to store it */
+int admission_window = 10000; /* Plannings between decays of the sketch */
 
 static void on_shmem_shutdown(int code, Datum arg);
 
@@ -23,16 +27,27 @@ void
 aqo_init_shmem(void)
 {
 	bool		found;
+	bool		sketch_found;
+	bool		queue_found;
 	HASHCTL		info;
+	int			i;
+	int			j;
 
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
 
 	aqo_state = NULL;
+	admission_sketch = NULL;
+	aqo_drop_queue = NULL;
 	stat_htab = NULL;
 	qtexts_htab = NULL;
+	qtext_bodies_htab = NULL;
 	data_htab = NULL;
+	reloids_htab = NULL;
 	queries_htab = NULL;
+	plan_guard_htab = NULL;
+	relio_htab = NULL;
+	shadow_htab = NULL;
 
 	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 	aqo_state = ShmemInitStruct("AQO", sizeof(AQOSharedState), &found);
@@ -44,20 +59,45 @@ aqo_init_shmem(void)
 		aqo_state->data_dsa_handler = DSM_HANDLE_INVALID;
 
 		aqo_state->qtext_trancheid = LWLockNewTrancheId();
+		aqo_state->data_trancheid = LWLockNewTrancheId();
+		aqo_state->stat_trancheid = LWLockNewTrancheId();
 
 		aqo_state->qtexts_changed = false;
 		aqo_state->stat_changed = false;
 		aqo_state->data_changed = false;
+		aqo_state->reloids_index_valid = true;
+		aqo_state->cleanup_cursor = InvalidOid;
 		aqo_state->queries_changed = false;
-		aqo_state->bgw_handle = NULL;
+		pg_atomic_init_u64(&aqo_state->queries_generation, 0);
+		pg_atomic_init_u64(&aqo_state->queries_inserts, 0);
+		aqo_state->maintenance_latch = NULL;
 
 		LWLockInitialize(&aqo_state->lock, LWLockNewTrancheId());
 		LWLockInitialize(&aqo_state->stat_lock, LWLockNewTrancheId());
 		LWLockInitialize(&aqo_state->qtexts_lock, LWLockNewTrancheId());
 		LWLockInitialize(&aqo_state->data_lock, LWLockNewTrancheId());
 		LWLockInitialize(&aqo_state->queries_lock, LWLockNewTrancheId());
+		LWLockInitialize(&aqo_state->plan_guard_lock, LWLockNewTrancheId());
+		LWLockInitialize(&aqo_state->relio_lock, LWLockNewTrancheId());
+		LWLockInitialize(&aqo_state->shadow_lock, LWLockNewTrancheId());
 	}
 
+	admission_sketch = ShmemInitStruct("AQO Admission Sketch",
+									   sizeof(AqoAdmissionSketch),
+									   &sketch_found);
+	if (!sketch_found)
+	{
+		pg_atomic_init_u32(&admission_sketch->nobserved, 0);
+		for (i = 0; i < ADMISSION_SKETCH_DEPTH; i++)
+			for (j = 0; j < ADMISSION_SKETCH_WIDTH; j++)
+				pg_atomic_init_u32(&admission_sketch->counters[i][j], 0);
+	}
+
+	aqo_drop_queue = ShmemInitStruct("AQO Drop Queue", sizeof(AqoDropQueue),
+									 &queue_found);
+	if (!queue_found)
+		aqo_drop_queue->len = 0;
+
 	info.keysize = sizeof(((StatEntry *) 0)->queryid);
 	info.entrysize = sizeof(StatEntry);
 	stat_htab = ShmemInitHash("AQO Stat HTAB", fs_max_items, fs_max_items,
@@ -69,25 +109,62 @@ aqo_init_shmem(void)
 	qtexts_htab = ShmemInitHash("AQO Query Texts HTAB", fs_max_items, fs_max_items,
 								&info, HASH_ELEM | HASH_BLOBS);
 
+	/* Bodies of query texts, shared by query classes */
+	info.keysize = sizeof(((QueryTextBody *) 0)->key);
+	info.entrysize = sizeof(QueryTextBody);
+	qtext_bodies_htab = ShmemInitHash("AQO Query Text Bodies HTAB",
+									  fs_max_items, fs_max_items,
+									  &info, HASH_ELEM | HASH_BLOBS);
+
 	/* Shared memory hash table for the data */
 	info.keysize = sizeof(data_key);
 	info.entrysize = sizeof(DataEntry);
 	data_htab = ShmemInitHash("AQO Data HTAB", fss_max_items, fss_max_items,
 							  &info, HASH_ELEM | HASH_BLOBS);
 
+	/* Reverse index of the data by relations */
+	info.keysize = sizeof(RelOidIndexKey);
+	info.entrysize = sizeof(RelOidIndexEntry);
+	reloids_htab = ShmemInitHash("AQO Relations Index HTAB", fss_max_items,
+								 fss_max_items, &info, HASH_ELEM | HASH_BLOBS);
+
 	/* Shared memory hash table for queries */
 	info.keysize = sizeof(((QueriesEntry *) 0)->queryid);
 	info.entrysize = sizeof(QueriesEntry);
 	queries_htab = ShmemInitHash("AQO Queries HTAB", fs_max_items, fs_max_items,
 								 &info, HASH_ELEM | HASH_BLOBS);
 
+	/* Plans of query classes, isn't stored on disk */
+	info.keysize = sizeof(((PlanGuardEntry *) 0)->queryid);
+	info.entrysize = sizeof(PlanGuardEntry);
+	plan_guard_htab = ShmemInitHash("AQO Plan Guard HTAB", fs_max_items,
+									fs_max_items, &info,
+									HASH_ELEM | HASH_BLOBS);
+
+	/* Buffer cache behaviour of relations, isn't stored on disk */
+	info.keysize = sizeof(RelIOKey);
+	info.entrysize = sizeof(RelIOEntry);
+	relio_htab = ShmemInitHash("AQO Relations I/O HTAB", fs_max_items,
+							   fs_max_items, &info, HASH_ELEM | HASH_BLOBS);
+
+	/* Errors of shadow predictions, isn't stored on disk */
+	info.keysize = sizeof(data_key);
+	info.entrysize = sizeof(ShadowEntry);
+	shadow_htab = ShmemInitHash("AQO Shadow Predictions HTAB", fss_max_items,
+								fss_max_items, &info, HASH_ELEM | HASH_BLOBS);
+
 	LWLockRelease(AddinShmemInitLock);
 	LWLockRegisterTranche(aqo_state->lock.tranche, "AQO");
 	LWLockRegisterTranche(aqo_state->stat_lock.tranche, "AQO Stat Lock Tranche");
+	LWLockRegisterTranche(aqo_state->stat_trancheid, "AQO Stat Entries Tranche");
 	LWLockRegisterTranche(aqo_state->qtexts_lock.tranche, "AQO QTexts Lock Tranche");
 	LWLockRegisterTranche(aqo_state->qtext_trancheid, "AQO Query Texts Tranche");
 	LWLockRegisterTranche(aqo_state->data_lock.tranche, "AQO Data Lock Tranche");
+	LWLockRegisterTranche(aqo_state->data_trancheid, "AQO Data Tranche");
 	LWLockRegisterTranche(aqo_state->queries_lock.tranche, "AQO Queries Lock Tranche");
+	LWLockRegisterTranche(aqo_state->plan_guard_lock.tranche, "AQO Plan Guard Lock Tranche");
+	LWLockRegisterTranche(aqo_state->relio_lock.tranche, "AQO Relations I/O Lock Tranche");
+	LWLockRegisterTranche(aqo_state->shadow_lock.tranche, "AQO Shadow Predictions Lock Tranche");
 
 	if (!IsUnderPostmaster && !found)
 	{
@@ -117,17 +194,124 @@ on_shmem_shutdown(int code, Datum arg)
 	return;
 }
 
+/*
+ * Halve all counters of the admission sketch. Concurrent increments may be
+ * lost here, it's not a problem for an estimation.
+ */
+static void
+admission_sketch_decay(void)
+{
+	int		i;
+	int		j;
+
+	for (i = 0; i < ADMISSION_SKETCH_DEPTH; i++)
+		for (j = 0; j < ADMISSION_SKETCH_WIDTH; j++)
+		{
+			pg_atomic_uint32   *counter = &admission_sketch->counters[i][j];
+			uint32				value = pg_atomic_read_u32(counter);
+
+			while (value > 0 &&
+				   !pg_atomic_compare_exchange_u32(counter, &value, value >> 1))
+				;
+		}
+}
+
+/*
+ * Admission filter for new query classes.
+ *
+ * Ad-hoc workloads produce a lot of one-off query classes. To not flood the
+ * knowledge base with them, we count plannings of unknown classes in a
+ * count-min sketch and admit a class only if it has been planned
+ * admission_threshold times. Each admission_window plannings the counters are
+ * halved, so the sketch forgets classes which don't come anymore.
+ */
+bool
+aqo_admit_query_class(uint64 queryid)
+{
+	uint32	h1 = (uint32) queryid;
+	uint32	h2 = ((uint32) (queryid >> 32)) | 1;
+	uint32	estimate = PG_UINT32_MAX;
+	int		i;
+
+	if (admission_threshold <= 1)
+		/* Filter is switched off */
+		return true;
+
+	for (i = 0; i < ADMISSION_SKETCH_DEPTH; i++)
+	{
+		uint32	idx = (h1 + i * h2) % ADMISSION_SKETCH_WIDTH;
+		uint32	value;
+
+		value = pg_atomic_add_fetch_u32(&admission_sketch->counters[i][idx], 1);
+		estimate = Min(estimate, value);
+	}
+
+	if (pg_atomic_add_fetch_u32(&admission_sketch->nobserved, 1) %
+													admission_window == 0)
+		admission_sketch_decay();
+
+	return estimate >= (uint32) admission_threshold;
+}
+
+/*
+ * Pass relations, dropped by a transaction, to the maintenance worker.
+ * Returns number of the queued relations. The relations, which don't fit into
+ * the queue, are skipped: their knowledge remains until aqo_cleanup().
+ * Doesn't raise errors, so it can be called after the commit.
+ */
+int
+aqo_drop_queue_push(const AqoDroppedRel *rels, int nrels, bool wakeup)
+{
+	Latch  *latch;
+
+	LWLockAcquire(&aqo_state->lock, LW_EXCLUSIVE);
+	nrels = Min(nrels, AQO_DROP_QUEUE_SIZE - aqo_drop_queue->len);
+	memcpy(&aqo_drop_queue->rels[aqo_drop_queue->len], rels,
+		   nrels * sizeof(AqoDroppedRel));
+	aqo_drop_queue->len += nrels;
+	latch = aqo_state->maintenance_latch;
+	LWLockRelease(&aqo_state->lock);
+
+	if (wakeup && latch != NULL && nrels > 0)
+		SetLatch(latch);
+	return nrels;
+}
+
+/*
+ * Move all the queued relations into the given array of AQO_DROP_QUEUE_SIZE
+ * elements. Returns number of the relations.
+ */
+int
+aqo_drop_queue_pop(AqoDroppedRel *rels)
+{
+	int		nrels;
+
+	LWLockAcquire(&aqo_state->lock, LW_EXCLUSIVE);
+	nrels = aqo_drop_queue->len;
+	memcpy(rels, aqo_drop_queue->rels, nrels * sizeof(AqoDroppedRel));
+	aqo_drop_queue->len = 0;
+	LWLockRelease(&aqo_state->lock);
+
+	return nrels;
+}
+
 Size
 aqo_memsize(void)
 {
 	Size		size;
 
 	size = MAXALIGN(sizeof(AQOSharedState));
-	size = add_size(size, hash_estimate_size(fs_max_items, sizeof(AQOSharedState)));
+	size = add_size(size, MAXALIGN(sizeof(AqoAdmissionSketch)));
+	size = add_size(size, MAXALIGN(sizeof(AqoDropQueue)));
 	size = add_size(size, hash_estimate_size(fs_max_items, sizeof(StatEntry)));
 	size = add_size(size, hash_estimate_size(fs_max_items, sizeof(QueryTextEntry)));
+	size = add_size(size, hash_estimate_size(fs_max_items, sizeof(QueryTextBody)));
 	size = add_size(size, hash_estimate_size(fss_max_items, sizeof(DataEntry)));
+	size = add_size(size, hash_estimate_size(fss_max_items, sizeof(RelOidIndexEntry)));
 	size = add_size(size, hash_estimate_size(fs_max_items, sizeof(QueriesEntry)));
+	size = add_size(size, hash_estimate_size(fs_max_items, sizeof(PlanGuardEntry)));
+	size = add_size(size, hash_estimate_size(fs_max_items, sizeof(RelIOEntry)));
+	size = add_size(size, hash_estimate_size(fss_max_items, sizeof(ShadowEntry)));
 
 	return size;
 }
@@ -2,20 +2,60 @@
 #define AQO_SHARED_H
 
 #include "lib/dshash.h"
-#include "postmaster/bgworker.h"
+#include "port/atomics.h"
 #include "storage/dsm.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lwlock.h"
 #include "utils/dsa.h"
 
 #define AQO_SHARED_MAGIC	0x053163
 
+/* Dimensions of the count-min sketch used by the admission filter */
+#define ADMISSION_SKETCH_DEPTH	(4)
+#define ADMISSION_SKETCH_WIDTH	(4096)
+
+/* Max number of dropped relations waiting for the maintenance worker */
+#define AQO_DROP_QUEUE_SIZE		(4096)
+
+/*
+ * Relation, dropped by a committed or a prepared transaction.
+ */
+typedef struct AqoDroppedRel
+{
+	Oid				dbid;
+	Oid				reloid;
+	TransactionId	xid; /* Prepared transaction, which has dropped it, or invalid */
+} AqoDroppedRel;
+
+/*
+ * Count-min sketch of plannings of unknown query classes. Lives in its own
+ * shared memory segment, apart from the AQOSharedState.
+ */
+typedef struct AqoAdmissionSketch
+{
+	pg_atomic_uint32 nobserved;
+	pg_atomic_uint32 counters[ADMISSION_SKETCH_DEPTH][ADMISSION_SKETCH_WIDTH];
+} AqoAdmissionSketch;
+
+/*
+ * Relations dropped by committed and prepared transactions. The maintenance
+ * worker removes knowledge related to them. Lives in its own shared memory
+ * segment and is protected by the lock of the AQOSharedState.
+ */
+typedef struct AqoDropQueue
+{
+	int				len;
+	AqoDroppedRel	rels[AQO_DROP_QUEUE_SIZE];
+} AqoDropQueue;
+
 typedef struct AQOSharedState
 {
 	LWLock		lock;			/* mutual exclusion */
 
 	/* Storage fields */
 	LWLock		stat_lock; /* lock for access to stat storage */
+	int			stat_trancheid; /* locks of the stat storage entries */
 	bool		stat_changed;
 
 	LWLock		qtexts_lock; /* Lock for shared fields below */
@@ -24,23 +64,50 @@ typedef struct AQOSharedState
 	bool		qtexts_changed;
 
 	LWLock		data_lock; /* Lock for shared fields below */
-	dsa_handle	data_dsa_handler;
+	dsa_handle	data_dsa_handler; /* DSA area for storing of ML data */
+	int			data_trancheid;
 	bool		data_changed;
+	bool		reloids_index_valid; /* all the data is in the reloids_htab */
+	Oid			cleanup_cursor; /* next relation to check by the cleanup */
 
 	LWLock		queries_lock;  /* lock for access to queries storage */
 	bool		queries_changed;
 
-	BackgroundWorkerHandle	*bgw_handle;
+	/*
+	 * Incremented on each change or removal of a stored query class. Backends
+	 * use it to validate their local copies of aqo_queries settings.
+	 */
+	pg_atomic_uint64 queries_generation;
+
+	/*
+	 * Incremented on each new query class. It invalidates only the cached
+	 * negative results of lookups.
+	 */
+	pg_atomic_uint64 queries_inserts;
+
+	LWLock		plan_guard_lock; /* lock for access to the plan guard */
+	LWLock		relio_lock; /* lock for access to the relations I/O storage */
+	LWLock		shadow_lock; /* lock for access to the shadow predictions */
+
+	/* Protected by the lock */
+	Latch	   *maintenance_latch; /* NULL, if the worker isn't running */
 } AQOSharedState;
 
 
 extern shmem_startup_hook_type prev_shmem_startup_hook;
 extern AQOSharedState *aqo_state;
+extern AqoDropQueue *aqo_drop_queue;
 
 extern int fs_max_items; /* Max number of feature spaces that AQO can operate */
 extern int fss_max_items;
+extern int admission_threshold;
+extern int admission_window;
 
 extern Size aqo_memsize(void);
 extern void aqo_init_shmem(void);
+extern bool aqo_admit_query_class(uint64 queryid);
+extern int aqo_drop_queue_push(const AqoDroppedRel *rels, int nrels,
+								bool wakeup);
+extern int aqo_drop_queue_pop(AqoDroppedRel *rels);
 
 #endif /* AQO_SHARED_H */
@@ -18,6 +18,10 @@
 #include "postgres.h"
 
 #include "common/pg_prng.h"
+#include "miscadmin.h"
+#include "utils/float.h"
+#include "utils/plancache.h"
+
 #include "aqo.h"
 #include "storage.h"
 
@@ -27,10 +31,38 @@
  */
 double auto_tuning_convergence_error = 0.01;
 
+/* Parameters of the Thompson sampling strategy */
+int		auto_tuning_strategy = AQO_TUNING_LOGISTIC;
+double	auto_tuning_regret_budget = 10.0;	/* in seconds */
+double	auto_tuning_drift_threshold = 0.5;	/* in log-time */
+bool	auto_tuning_plan_cache = false;
+bool	auto_tuning_jit = false;
+bool	auto_tuning_parallel_workers = false;
+
+/* Upper bound of work_mem, raised for a query class, in kB. Zero disables. */
+int		aqo_work_mem_limit = 0;
+
+/* Weight of the last observation in the recent mean of an arm */
+#define BANDIT_RECENT_WEIGHT	(0.1)
+
+/* Variance of log-time of an arm with a single observation */
+#define BANDIT_PRIOR_VARIANCE	(1.0)
+
+/* Headroom over the memory demand, estimated on a spilled execution */
+#define WORK_MEM_HEADROOM		(1.25)
+
+/* Launch rate of parallel workers, which is considered as a full one */
+#define WORKERS_LAUNCH_RATE_FULL	(0.95)
+
 static double get_estimation(double *elems, int nelems);
+static double get_time_estimation(const AqoHistogram *exec_hist,
+								  const AqoHistogram *plan_hist,
+								  double *exec_time, double *plan_time,
+								  int nelems);
 static bool is_stable(double *elems, int nelems);
 static bool converged_cq(double *elems, int nelems);
 static bool is_in_infinite_loop_cq(double *elems, int nelems);
+static double bandit_sample(const AqoBanditArm *arm);
 
 /*
  * Returns mean value of the array of doubles.
@@ -67,6 +99,33 @@ get_estimation(double *elems, int nelems)
 	return get_mean(&elems[start], nelems - start);
 }
 
+/*
+ * Typical time of a query execution, including planning. Use medians of the
+ * recent history of the class: it is robust to outliers which can make mean
+ * value of a short window meaningless. A histogram is empty, if the
+ * statistics was set by aqo_query_stat_update() without any samples, or if
+ * the time is unknown, like the planning time of cached plans.
+ */
+static double
+get_time_estimation(const AqoHistogram *exec_hist,
+					const AqoHistogram *plan_hist,
+					double *exec_time, double *plan_time, int nelems)
+{
+	double	t;
+
+	if (exec_hist->count > 0)
+		t = aqo_hist_percentile(exec_hist, 0.5);
+	else
+		t = get_estimation(exec_time, nelems);
+
+	if (plan_hist->count > 0)
+		t += aqo_hist_percentile(plan_hist, 0.5);
+	else
+		t += Max(get_estimation(plan_time, nelems), 0.);
+
+	return t;
+}
+
 /*
  * Checks whether the series is stable with absolute or relative error.
  */
@@ -117,6 +176,236 @@ is_in_infinite_loop_cq(double *elems, int nelems)
 		   !converged_cq(elems, nelems - auto_tuning_window_size);
 }
 
+/*
+ * Add an observation of the query class time to the arm.
+ */
+void
+aqo_bandit_arm_add(AqoBanditArm *arm, double time)
+{
+	double	x = log(Max(time, AQO_HIST_MIN_VALUE));
+	double	delta = x - arm->mean;
+
+	arm->recent = (arm->n == 0) ? x :
+				  arm->recent + BANDIT_RECENT_WEIGHT * (x - arm->recent);
+	arm->n++;
+	arm->mean += delta / arm->n;
+	arm->m2 += delta * (x - arm->mean);
+}
+
+/*
+ * Keep only the latest window of observations in the arm, preserving its
+ * variance.
+ */
+static void
+bandit_arm_forget(AqoBanditArm *arm)
+{
+	if (arm->n <= auto_tuning_window_size)
+		return;
+
+	arm->m2 *= (double) auto_tuning_window_size / arm->n;
+	arm->n = auto_tuning_window_size;
+}
+
+/*
+ * Expected time of an execution with the arm, in seconds. Log-time of an arm
+ * is assumed to be normal, so the time itself is log-normal. Regret and the
+ * choice of the best arm use this value, so they are in the same scale as
+ * the aqo.auto_tuning_regret_budget.
+ */
+double
+aqo_bandit_expected_time(const AqoBanditArm *arm)
+{
+	double	var = (arm->n > 1) ? arm->m2 / (arm->n - 1) : 0.;
+
+	return exp(arm->mean + var / 2.);
+}
+
+/*
+ * Account an execution of the query class with the played arm. Regret is the
+ * expected time lost in comparison with another arm. When the regret budget
+ * is exhausted, the choice is made. Drift of the played arm (schema, data or
+ * workload change) re-opens the exploration, whether the budget is exhausted
+ * or not.
+ * A negative planning time means the plan was taken from a plan cache, such
+ * an execution doesn't pay for the planning.
+ */
+void
+aqo_bandit_observe(AqoBanditArm *played, AqoBanditArm *other, double *regret,
+				   double plan_time, double exec_time)
+{
+	aqo_bandit_arm_add(played, exec_time + Max(plan_time, 0.));
+
+	if (other->n > 0)
+		*regret += Max(0., aqo_bandit_expected_time(played) -
+						   aqo_bandit_expected_time(other));
+
+	if (played->n > auto_tuning_window_size &&
+		fabs(played->recent - played->mean) > auto_tuning_drift_threshold)
+	{
+		/* Old observations of both arms are hardly relevant anymore */
+		played->mean = played->recent;
+		bandit_arm_forget(played);
+		bandit_arm_forget(other);
+		*regret = 0.;
+	}
+}
+
+/*
+ * Draw a mean log-time of the arm from its posterior: normal distribution with
+ * the sample mean and variance of the mean.
+ * An arm without observations is optimistic: it wins any comparison, so it is
+ * played first.
+ */
+static double
+bandit_sample(const AqoBanditArm *arm)
+{
+	double	var;
+
+	if (arm->n <= 0)
+		return -get_float8_infinity();
+
+	var = (arm->n > 1) ? arm->m2 / (arm->n - 1) : BANDIT_PRIOR_VARIANCE;
+
+	return arm->mean +
+		   sqrt(var / arm->n) * pg_prng_double_normal(&pg_global_prng_state);
+}
+
+/*
+ * Account an execution of the query class for the choice between custom and
+ * generic plans. A negative planning time means that the plan was taken from
+ * a plan cache: such executions go to the cached arm. Others pay for the
+ * planning. If forget is true, the arm keeps only a window of recent
+ * observations.
+ */
+void
+aqo_plan_cache_observe(StatEntry *entry, double plan_time, double exec_time,
+					   bool forget)
+{
+	AqoBanditArm *arm;
+
+	if (plan_time < 0.)
+	{
+		arm = &entry->arm_cached;
+		aqo_bandit_arm_add(arm, exec_time);
+	}
+	else
+	{
+		arm = &entry->arm_planned;
+		aqo_bandit_arm_add(arm, plan_time + exec_time);
+	}
+
+	if (forget)
+		bandit_arm_forget(arm);
+}
+
+/*
+ * Choose plan_cache_mode for the next execution of a prepared statement of the
+ * query class. Custom plans are planned each time, and so can use fresh AQO
+ * predictions. A generic plan saves the planning time. Make
+ * auto_tuning_window_size executions of each kind, then play the arm which
+ * wins in a draw from posteriors. The arms keep only recent observations, so
+ * the loser is still checked from time to time.
+ */
+int
+aqo_plan_cache_choice(uint64 queryid)
+{
+	StatEntry	stat;
+
+	if (!aqo_stat_find(queryid, &stat))
+		return PLAN_CACHE_MODE_AUTO;
+
+	if (stat.arm_planned.n < auto_tuning_window_size)
+		return PLAN_CACHE_MODE_FORCE_CUSTOM_PLAN;
+	if (stat.arm_cached.n < auto_tuning_window_size)
+		return PLAN_CACHE_MODE_FORCE_GENERIC_PLAN;
+
+	return (bandit_sample(&stat.arm_cached) < bandit_sample(&stat.arm_planned)) ?
+				PLAN_CACHE_MODE_FORCE_GENERIC_PLAN :
+				PLAN_CACHE_MODE_FORCE_CUSTOM_PLAN;
+}
+
+/*
+ * Account an execution of the query class with or without JIT compilation.
+ * Compilation happens at the execution stage, so the planning time isn't
+ * considered.
+ */
+void
+aqo_jit_observe(StatEntry *entry, bool jit, double exec_time)
+{
+	AqoBanditArm *arm = jit ? &entry->arm_jit : &entry->arm_nojit;
+
+	aqo_bandit_arm_add(arm, exec_time);
+	bandit_arm_forget(arm);
+}
+
+/*
+ * Decide whether the query class should use JIT, when the planner wants it.
+ * Until JIT is observed for auto_tuning_window_size executions, keep the
+ * planner's choice. Then try executions without JIT, and after that play
+ * the arm which wins in a draw from posteriors.
+ * Returns AQO_JIT_AUTO if the planner's choice should be kept.
+ */
+int
+aqo_jit_choice(uint64 queryid)
+{
+	StatEntry	stat;
+
+	if (!aqo_stat_find(queryid, &stat) ||
+		stat.arm_jit.n < auto_tuning_window_size)
+		return AQO_JIT_AUTO;
+
+	if (stat.arm_nojit.n < auto_tuning_window_size)
+		return AQO_JIT_OFF;
+
+	return (bandit_sample(&stat.arm_jit) < bandit_sample(&stat.arm_nojit)) ?
+				AQO_JIT_ON : AQO_JIT_OFF;
+}
+
+/*
+ * Choose work_mem for the query class, in kB. The memory demand is learned on
+ * executions where Hash, Sort or HashAgg nodes spilled to disk. Returns zero,
+ * if the current work_mem is enough as far as we know.
+ */
+int
+aqo_work_mem_choice(uint64 queryid)
+{
+	StatEntry	stat;
+	double		need;
+
+	if (aqo_work_mem_limit <= 0 || !aqo_stat_find(queryid, &stat) ||
+		stat.nspills == 0)
+		return 0;
+
+	need = Min(stat.work_mem * WORK_MEM_HEADROOM, (double) aqo_work_mem_limit);
+	return (need > (double) work_mem) ? (int) need : 0;
+}
+
+/*
+ * Choose max_parallel_workers_per_gather for the query class. If Gather nodes
+ * of the class launch fewer workers than planned, request as many workers as
+ * they actually get: the planner divides rows and costs of parallel nodes by
+ * the planned number of workers.
+ * When the workers launch as planned, the limit is lifted, so the class probes
+ * a wider plan again as soon as the decayed launch rate recovers.
+ * The limit never drops below one worker: without a Gather node the class
+ * wouldn't update its launch statistics and would stay serial forever.
+ * Returns -1 if the current setting should be kept.
+ */
+int
+aqo_parallel_workers_choice(uint64 queryid)
+{
+	StatEntry	stat;
+	int			nworkers;
+
+	if (!auto_tuning_parallel_workers || !aqo_stat_find(queryid, &stat) ||
+		stat.ngathers <= 0. ||
+		stat.workers_launched >= stat.workers_planned * WORKERS_LAUNCH_RATE_FULL)
+		return -1;
+
+	nworkers = Max((int) rint(stat.workers_launched / stat.ngathers), 1);
+	return (nworkers < max_parallel_workers_per_gather) ? nworkers : -1;
+}
+
 /*
  * Here we use execution statistics for the given query tuning. Note that now
  * we cannot execute queries on our own wish, so the tuning now is in setting
@@ -167,11 +456,42 @@ automatical_query_tuning(uint64 queryid, StatEntry *stat)
 		 * by execution time. It is volatile, probabilistic part of code.
 		 * XXX: this logic of auto tuning may be reworked later.
 		 */
-		t_aqo = get_estimation(stat->exec_time_aqo, stat->cur_stat_slot_aqo) +
-				get_estimation(stat->plan_time_aqo, stat->cur_stat_slot_aqo);
+		if (auto_tuning_strategy == AQO_TUNING_THOMPSON)
+		{
+			/*
+			 * Both arms have enough observations: the first step gives
+			 * executions without AQO, the second one - with AQO.
+			 * Within the regret budget, play the arm which wins in a draw from
+			 * posteriors. Afterwards, play the best arm.
+			 */
+			bool	explore = stat->regret < auto_tuning_regret_budget;
+
+			if (explore)
+				query_context.use_aqo =
+					bandit_sample(&stat->arm_aqo) < bandit_sample(&stat->arm);
+			else
+				query_context.use_aqo =
+					aqo_bandit_expected_time(&stat->arm_aqo) <
+					aqo_bandit_expected_time(&stat->arm);
+
+			/* Keep learning while AQO may be chosen */
+			query_context.learn_aqo = query_context.use_aqo || explore;
+
+			if (!aqo_queries_store(queryid, query_context.fspace_hash,
+								   query_context.learn_aqo,
+								   query_context.use_aqo, true,
+								   &aqo_queries_nulls))
+				elog(LOG, "[AQO] Can't store the auto tuning choice of the query class "
+					 UINT64_FORMAT ".", queryid);
+			return;
+		}
 
-		t_not_aqo = get_estimation(stat->exec_time, stat->cur_stat_slot) +
-					get_estimation(stat->plan_time, stat->cur_stat_slot);
+		t_aqo = get_time_estimation(&stat->exec_hist_aqo, &stat->plan_hist_aqo,
+									stat->exec_time_aqo, stat->plan_time_aqo,
+									stat->cur_stat_slot_aqo);
+		t_not_aqo = get_time_estimation(&stat->exec_hist, &stat->plan_hist,
+										stat->exec_time, stat->plan_time,
+										stat->cur_stat_slot);
 
 		p_use = t_not_aqo / (t_not_aqo + t_aqo);
 
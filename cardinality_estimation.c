@@ -17,7 +17,10 @@
 
 #include "postgres.h"
 
+#include "catalog/pg_class.h"
 #include "optimizer/optimizer.h"
+#include "utils/hsearch.h"
+#include "utils/syscache.h"
 
 #include "aqo.h"
 #include "hash.h"
@@ -27,10 +30,366 @@
 
 bool use_wide_search = false;
 
+/*
+ * Learn cardinality of a relation as the negated log selectivity relative to
+ * the Cartesian product of sizes of its base relations. Such knowledge
+ * survives growth of the tables.
+ */
+bool aqo_relation_size_aware = false;
+
+/*
+ * Predictions with a lower confidence are blended with the estimate of the
+ * planner. Zero value disables the blending.
+ */
+double aqo_confidence_threshold = 0.;
+
+/*
+ * Planning-scope cache of the ML data.
+ *
+ * During a join search the optimizer asks for the same subspace many times:
+ * each new join level re-estimates parameterized paths built over the relations
+ * seen on a previous level. So, the data loaded from the shared storage is kept
+ * in the AQOPredictMemCtx until the end of the planning.
+ * Also, for each feature space we remember the set of subspaces requested
+ * during the last planning of the query. On the next planning all of them are
+ * resolved by a single batched request to the storage, so the hooks
+ * of a join level don't acquire the storage lock at all.
+ */
+typedef struct PredictCacheEntry
+{
+	data_key	key;
+	OkNNrdata  *data; /* NULL, if the storage doesn't contain such a key */
+} PredictCacheEntry;
+
+/* Fake fss value marks a feature space which working set was prefetched */
+#define PREFETCH_MARK		(PG_INT64_MAX)
+
+#define WORKSET_MAX_FSS		(128)
+#define WORKSET_MAX_SPACES	(256)
+
+typedef struct FSSWorkSet
+{
+	uint64	fs;
+	int		nfss;
+	int		fss[WORKSET_MAX_FSS]; /* sorted */
+} FSSWorkSet;
+
+static HTAB *predict_cache = NULL;
+static HTAB *fss_worksets = NULL;
+static MemoryContextCallback predict_cache_cb;
+
+/*
+ * Predictions made during the planning and their confidence, to show them in
+ * the plan. Lives as long as the predictions cache.
+ */
+typedef struct ConfidenceEntry
+{
+	int		fss;
+	double	rows;
+	double	confidence;
+} ConfidenceEntry;
+
+static HTAB *confidence_cache = NULL;
+
+/*
+ * Logarithms of sizes of the relations for the size aware knowledge.
+ *
+ * The planning puts here the sizes of its base relations, so predictions and
+ * learning of the query use the same sizes and don't look into the syscache.
+ * A plan, cached before, is learned with the sizes from pg_class. Lives until
+ * the end of the transaction.
+ */
+typedef struct RelSizeEntry
+{
+	Oid		reloid;
+	double	log_size;
+} RelSizeEntry;
+
+static HTAB *relsize_cache = NULL;
+static MemoryContextCallback relsize_cache_cb;
+
+/*
+ * Snapshot of predictions of the good plan, if the plan regression guard
+ * pinned the query class. Lives as long as the predictions cache.
+ */
+static int	guard_nfss = -1;
+static int	guard_fss[AQO_PLAN_GUARD_NFSS];
+static double guard_rows[AQO_PLAN_GUARD_NFSS];
+
+static void
+predict_cache_reset_callback(void *arg)
+{
+	/* The memory context was reset, hash tables are gone */
+	predict_cache = NULL;
+	confidence_cache = NULL;
+	guard_nfss = -1;
+}
+
+static void
+predict_cache_init(void)
+{
+	HASHCTL		ctl;
+
+	Assert(predict_cache == NULL);
+
+	ctl.keysize = sizeof(data_key);
+	ctl.entrysize = sizeof(PredictCacheEntry);
+	ctl.hcxt = AQOPredictMemCtx;
+	predict_cache = hash_create("AQO predictions cache", 64, &ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	ctl.keysize = sizeof(int);
+	ctl.entrysize = sizeof(ConfidenceEntry);
+	confidence_cache = hash_create("AQO predictions confidence", 64, &ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	predict_cache_cb.func = predict_cache_reset_callback;
+	predict_cache_cb.arg = NULL;
+	MemoryContextRegisterResetCallback(AQOPredictMemCtx, &predict_cache_cb);
+
+	if (plan_regression_threshold > 0.)
+		guard_nfss = aqo_plan_guard_snapshot(query_context.query_hash,
+											 guard_fss, guard_rows);
+}
+
+/*
+ * If the query class is pinned to its good plan, replay the predictions which
+ * produced the plan. Subspaces, absent in the snapshot, weren't in the plan, or
+ * were estimated by the planner itself. Returns false, if the class isn't
+ * pinned.
+ */
+static bool
+guard_snapshot_lookup(int fss, double *rows)
+{
+	int i;
+
+	if (predict_cache == NULL)
+		predict_cache_init();
+
+	if (guard_nfss < 0)
+		return false;
+
+	*rows = -1.;
+	for (i = 0; i < guard_nfss; i++)
+	{
+		if (guard_fss[i] == fss)
+		{
+			*rows = guard_rows[i];
+			break;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Remember the subspace in the working set of the feature space.
+ */
+static void
+workset_add(uint64 fs, int fss)
+{
+	FSSWorkSet *ws;
+	bool		found;
+	int			lo = 0;
+	int			hi;
+
+	if (fss_worksets == NULL ||
+		hash_get_num_entries(fss_worksets) >= WORKSET_MAX_SPACES)
+	{
+		HASHCTL		ctl;
+
+		/* Don't bother with an eviction strategy, just start from scratch */
+		if (fss_worksets != NULL)
+			hash_destroy(fss_worksets);
+
+		ctl.keysize = sizeof(uint64);
+		ctl.entrysize = sizeof(FSSWorkSet);
+		ctl.hcxt = AQOTopMemCtx;
+		fss_worksets = hash_create("AQO fss working sets", 64, &ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	ws = (FSSWorkSet *) hash_search(fss_worksets, &fs, HASH_ENTER, &found);
+	if (!found)
+		ws->nfss = 0;
+
+	/* Binary search of a position in the sorted array */
+	hi = ws->nfss;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+
+		if (ws->fss[mid] < fss)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if ((lo < ws->nfss && ws->fss[lo] == fss) || ws->nfss >= WORKSET_MAX_FSS)
+		return;
+
+	memmove(&ws->fss[lo + 1], &ws->fss[lo], (ws->nfss - lo) * sizeof(int));
+	ws->fss[lo] = fss;
+	ws->nfss++;
+}
+
+/*
+ * Load all the subspaces, used by the feature space during the previous
+ * planning, by one request to the storage. Do it once per planning.
+ */
+static void
+workset_prefetch(uint64 fs)
+{
+	data_key			key = {.fs = fs, .fss = PREFETCH_MARK};
+	PredictCacheEntry  *entry;
+	FSSWorkSet		   *ws;
+	OkNNrdata		  **result;
+	bool				found;
+	int					i;
+
+	entry = (PredictCacheEntry *) hash_search(predict_cache, &key,
+											  HASH_ENTER, &found);
+	if (found)
+		return;
+	entry->data = NULL;
+
+	if (fss_worksets == NULL)
+		return;
+
+	ws = (FSSWorkSet *) hash_search(fss_worksets, &fs, HASH_FIND, NULL);
+	if (ws == NULL || ws->nfss == 0)
+		return;
+
+	result = palloc(ws->nfss * sizeof(OkNNrdata *));
+	(void) load_aqo_data_batch(fs, ws->nfss, ws->fss, result);
+
+	for (i = 0; i < ws->nfss; i++)
+	{
+		key.fss = ws->fss[i];
+		entry = (PredictCacheEntry *) hash_search(predict_cache, &key,
+												  HASH_ENTER, NULL);
+		entry->data = result[i];
+	}
+	pfree(result);
+}
+
+/*
+ * Get ML data for the (fs, fss) pair through the planning-scope cache.
+ * Returns NULL if the knowledge base doesn't contain suitable data.
+ * Must be called in the AQOPredictMemCtx.
+ */
+OkNNrdata *
+predict_cache_lookup(uint64 fs, int fss, int ncols)
+{
+	data_key			key = {.fs = fs, .fss = fss};
+	PredictCacheEntry  *entry;
+
+	Assert(CurrentMemoryContext == AQOPredictMemCtx);
+
+	if (predict_cache == NULL)
+		predict_cache_init();
+
+	workset_prefetch(fs);
+
+	entry = (PredictCacheEntry *) hash_search(predict_cache, &key,
+											  HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		OkNNrdata  *data = OkNNr_allocate(ncols);
+
+		if (!load_fss_ext(fs, fss, data, NULL))
+			/* The memory will be released at the end of planning */
+			data = NULL;
+
+		entry = (PredictCacheEntry *) hash_search(predict_cache, &key,
+												  HASH_ENTER, NULL);
+		entry->data = data;
+		workset_add(fs, fss);
+	}
+
+	if (entry->data != NULL && entry->data->cols != ncols)
+		/* Collision happened? Don't use such data for prediction */
+		return NULL;
+
+	return entry->data;
+}
+
+/*
+ * Remember the prediction for the subspace and its confidence.
+ */
+static void
+confidence_store(int fss, double rows, double confidence)
+{
+	ConfidenceEntry	   *entry;
+
+	Assert(confidence_cache != NULL);
+
+	entry = (ConfidenceEntry *) hash_search(confidence_cache, &fss,
+											HASH_ENTER, NULL);
+	entry->rows = rows;
+	entry->confidence = confidence;
+}
+
+/*
+ * Confidence of the prediction, made for the subspace during the planning.
+ * Returns 1, if nothing is known about it.
+ */
+double
+prediction_confidence(int fss)
+{
+	ConfidenceEntry	   *entry;
+
+	if (confidence_cache == NULL)
+		return 1.;
+
+	entry = (ConfidenceEntry *) hash_search(confidence_cache, &fss,
+											HASH_FIND, NULL);
+	return (entry != NULL) ? entry->confidence : 1.;
+}
+
+/*
+ * Prediction, made for the subspace during the planning, even if the planner
+ * hasn't used it. Returns -1, if nothing was predicted.
+ */
+double
+prediction_made(int fss)
+{
+	ConfidenceEntry	   *entry;
+
+	if (confidence_cache == NULL)
+		return -1.;
+
+	entry = (ConfidenceEntry *) hash_search(confidence_cache, &fss,
+											HASH_FIND, NULL);
+	return (entry != NULL) ? entry->rows : -1.;
+}
+
+/*
+ * Blend a prediction of a low confidence with the estimate of the planner in
+ * the logarithmic scale. Weight of the prediction falls linearly with the
+ * confidence, so the planner's estimate is used as is at zero.
+ */
+double
+blend_prediction(double predicted, double confidence, double native)
+{
+	double	w;
+
+	if (aqo_confidence_threshold <= 0. ||
+		confidence >= aqo_confidence_threshold || native <= 0.)
+		return predicted;
+
+	w = confidence / aqo_confidence_threshold;
+	elog(DEBUG5, "[AQO] Blend prediction %.0f of confidence %.2f with "
+		 "estimate %.0f of the planner.", predicted, confidence, native);
+
+	return clamp_row_est(exp(w * log(predicted) + (1. - w) * log(native)));
+}
+
 #ifdef AQO_DEBUG_PRINT
 static void
 predict_debug_output(List *clauses, List *selectivities,
-					 List *reloids, int fss, double result)
+					 List *reloids, int fss, double result,
+					 double confidence)
 {
 	StringInfoData debug_str;
 	ListCell *lc;
@@ -53,23 +412,123 @@ predict_debug_output(List *clauses, List *selectivities,
 		appendStringInfo(&debug_str, "%d ", relname);
 	}
 
-	appendStringInfo(&debug_str, "}, result: %lf", result);
+	appendStringInfo(&debug_str, "}, result: %lf, confidence: %lf",
+					 result, confidence);
 	elog(DEBUG1, "Prediction: %s", debug_str.data);
 }
 #endif
 
+static void
+relsize_cache_reset_callback(void *arg)
+{
+	/* The memory context was reset, the hash table is gone */
+	relsize_cache = NULL;
+}
+
+static RelSizeEntry *
+relsize_cache_enter(Oid reloid, bool *found)
+{
+	if (relsize_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(RelSizeEntry);
+		ctl.hcxt = AQOCacheMemCtx;
+		relsize_cache = hash_create("AQO relation sizes cache", 16, &ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		relsize_cache_cb.func = relsize_cache_reset_callback;
+		relsize_cache_cb.arg = NULL;
+		MemoryContextRegisterResetCallback(AQOCacheMemCtx, &relsize_cache_cb);
+	}
+
+	return (RelSizeEntry *) hash_search(relsize_cache, &reloid, HASH_ENTER,
+										found);
+}
+
+/*
+ * Remember the size of a base relation, estimated by the planner.
+ */
+void
+relation_size_remember(Oid reloid, double tuples)
+{
+	RelSizeEntry   *entry;
+
+	if (!aqo_relation_size_aware)
+		return;
+
+	entry = relsize_cache_enter(reloid, NULL);
+	entry->log_size = (tuples > 1.) ? log(tuples) : 0.;
+}
+
+/*
+ * Should the cardinality of the object be learned relative to the sizes of its
+ * relations? Each persistent relation has a signature and an oid. A temporary
+ * table or a relation without an oid (a function scan, a subquery) has only a
+ * signature: its size is unknown, so the target would be meaningless.
+ */
+bool
+size_aware_object(List *relsigns, List *reloids)
+{
+	return aqo_relation_size_aware &&
+		list_length(relsigns) == list_length(reloids);
+}
+
+/*
+ * Logarithm of the Cartesian product of sizes of the relations. A relation of
+ * unknown size contributes nothing.
+ */
+double
+relations_log_size(List *reloids)
+{
+	double		result = 0.;
+	ListCell   *lc;
+
+	foreach(lc, reloids)
+	{
+		Oid				reloid = lfirst_oid(lc);
+		RelSizeEntry   *entry;
+		bool			found;
+
+		entry = relsize_cache_enter(reloid, &found);
+		if (!found)
+		{
+			HeapTuple	tuple;
+			float4		reltuples = 0.;
+
+			tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(reloid));
+			if (HeapTupleIsValid(tuple))
+			{
+				reltuples = ((Form_pg_class) GETSTRUCT(tuple))->reltuples;
+				ReleaseSysCache(tuple);
+			}
+			entry->log_size = (reltuples > 1.) ? log(reltuples) : 0.;
+		}
+
+		result += entry->log_size;
+	}
+
+	return result;
+}
+
 /*
  * General method for prediction the cardinality of given relation.
+ * Confidence of the prediction is returned too, if the caller wants it.
  */
 double
 predict_for_relation(List *clauses, List *selectivities, List *relsigns,
-					 int *fss)
+					 List *reloids, int *fss, double *confidence)
 {
 	double	   *features;
 	double		result;
+	double		conf = 1.;
 	int			ncols;
 	OkNNrdata  *data;
 
+	if (confidence != NULL)
+		*confidence = 1.;
+
 	if (relsigns == NIL)
 		/*
 		 * Don't make prediction for query plans without any underlying plane
@@ -77,12 +536,16 @@ predict_for_relation(List *clauses, List *selectivities, List *relsigns,
 		 */
 		return -4.;
 
-	*fss = get_fss_for_object(relsigns, clauses, selectivities,
+	*fss = get_fss_for_object(relsigns, reloids, clauses, selectivities,
 							  &ncols, &features);
-	data = OkNNr_allocate(ncols);
 
-	if (load_fss_ext(query_context.fspace_hash, *fss, data, NULL))
-		result = OkNNr_predict(data, features);
+	if (guard_snapshot_lookup(*fss, &result))
+		return (result > 0.) ? result : -1.;
+
+	data = predict_cache_lookup(query_context.fspace_hash, *fss, ncols);
+
+	if (data != NULL)
+		result = aqo_model_predict(data, features, &conf);
 	else
 	{
 		/*
@@ -93,6 +556,7 @@ predict_for_relation(List *clauses, List *selectivities, List *relsigns,
 		 */
 
 		/* Try to search in surrounding feature spaces for the same node */
+		data = OkNNr_allocate(ncols);
 		if (!load_aqo_data(query_context.fspace_hash, *fss, data, NULL, use_wide_search, features))
 			result = -1;
 		else
@@ -100,16 +564,25 @@ predict_for_relation(List *clauses, List *selectivities, List *relsigns,
 			elog(DEBUG5, "[AQO] Make prediction for fss %d by a neighbour "
 				 "includes %d feature(s) and %d fact(s).",
 				 *fss, data->cols, data->rows);
-			result = OkNNr_predict(data, features);
+			result = aqo_model_predict(data, features, &conf);
 		}
 	}
 
 #ifdef AQO_DEBUG_PRINT
-	predict_debug_output(clauses, selectivities, relsigns, *fss, result);
+	predict_debug_output(clauses, selectivities, relsigns, *fss, result, conf);
 #endif
 
 	if (result < 0)
 		return -1;
+
+	if (size_aware_object(relsigns, reloids))
+		result = clamp_row_est(exp(relations_log_size(reloids) - result));
 	else
-		return clamp_row_est(exp(result));
+		result = clamp_row_est(exp(result));
+
+	confidence_store(*fss, result, conf);
+	if (confidence != NULL)
+		*confidence = conf;
+
+	return result;
 }
@@ -15,6 +15,9 @@
  * to be true cardinality for given relation. Negative returned value means
  * refusal to predict cardinality. In this case hooks also use default
  * postgreSQL cardinality estimator.
+ * In the shadow mode hooks make the prediction, but always use the default
+ * estimator. The prediction is only compared with the real cardinality after
+ * the execution.
  *
  *******************************************************************************
  *
@@ -119,7 +122,8 @@ default_estimate_num_groups(PlannerInfo *root, List *groupExprs,
 							Path *subpath, RelOptInfo *grouped_rel,
 							List **pgset, EstimationInfo *estinfo)
 {
-	double input_rows = subpath->rows;
+	double input_rows = IsA(subpath, MemoizePath) ?
+						((MemoizePath *) subpath)->calls : subpath->rows;
 
 	if (prev_estimate_num_groups_hook != NULL)
 			return (*prev_estimate_num_groups_hook)(root, groupExprs,
@@ -144,6 +148,7 @@ aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
 	List		   *selectivities = NULL;
 	List		   *clauses;
 	int				fss = 0;
+	double			confidence = 1.;
 	MemoryContext old_ctx_m;
 
 	if (IsQueryDisabled())
@@ -152,11 +157,12 @@ aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
 
 	old_ctx_m = MemoryContextSwitchTo(AQOPredictMemCtx);
 
-	if (query_context.use_aqo || query_context.learn_aqo)
+	if (query_context.use_aqo || query_context.learn_aqo ||
+		query_context.shadow)
 		selectivities = get_selectivities(root, rel->baserestrictinfo, 0,
 										  JOIN_INNER, NULL);
 
-	if (!query_context.use_aqo)
+	if (!query_context.use_aqo && !query_context.shadow)
 	{
 		MemoryContextSwitchTo(old_ctx_m);
 		goto default_estimator;
@@ -172,7 +178,10 @@ aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
 
 	clauses = aqo_get_clauses(root, rel->baserestrictinfo);
 	predicted = predict_for_relation(clauses, selectivities, rels.signatures,
-									 &fss);
+									 rels.hrels, &fss, &confidence);
+	if (query_context.shadow)
+		/* Remember the prediction for the plan only */
+		predicted = -1.;
 	rel->fss_hash = fss;
 
 	/* Return to the caller's memory context. */
@@ -180,6 +189,11 @@ aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
 
 	if (predicted >= 0)
 	{
+		if (confidence < aqo_confidence_threshold)
+		{
+			default_set_baserel_rows_estimate(root, rel);
+			predicted = blend_prediction(predicted, confidence, rel->rows);
+		}
 		rel->rows = predicted;
 		rel->predicted_cardinality = predicted;
 		return;
@@ -223,6 +237,7 @@ aqo_get_parameterized_baserel_size(PlannerInfo *root,
 	int		   *eclass_hash;
 	int			current_hash;
 	int			fss = 0;
+	double		confidence = 1.;
 	MemoryContext oldctx;
 
 	if (IsQueryDisabled())
@@ -231,7 +246,8 @@ aqo_get_parameterized_baserel_size(PlannerInfo *root,
 
 	oldctx = MemoryContextSwitchTo(AQOPredictMemCtx);
 
-	if (query_context.use_aqo || query_context.learn_aqo)
+	if (query_context.use_aqo || query_context.learn_aqo ||
+		query_context.shadow)
 	{
 
 		selectivities = list_concat(
@@ -258,7 +274,7 @@ aqo_get_parameterized_baserel_size(PlannerInfo *root,
 		}
 	}
 
-	if (!query_context.use_aqo)
+	if (!query_context.use_aqo && !query_context.shadow)
 	{
 		MemoryContextSwitchTo(oldctx);
 
@@ -272,11 +288,20 @@ aqo_get_parameterized_baserel_size(PlannerInfo *root,
 		get_list_of_relids(root, rel->relids, &rels);
 	}
 
-	predicted = predict_for_relation(allclauses, selectivities, rels.signatures, &fss);
+	predicted = predict_for_relation(allclauses, selectivities, rels.signatures,
+									 rels.hrels, &fss, &confidence);
+	if (query_context.shadow)
+		/* Remember the prediction for the plan only */
+		predicted = -1.;
 
 	/* Return to the caller's memory context */
 	MemoryContextSwitchTo(oldctx);
 
+	if (predicted >= 0 && confidence < aqo_confidence_threshold)
+		predicted = blend_prediction(predicted, confidence,
+						default_get_parameterized_baserel_size(root, rel,
+															   param_clauses));
+
 	predicted_ppi_rows = predicted;
 	fss_ppi_hash = fss;
 
@@ -309,6 +334,7 @@ aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
 	List	   *outer_selectivities;
 	List	   *current_selectivities = NULL;
 	int			fss = 0;
+	double		confidence = 1.;
 	MemoryContext old_ctx_m;
 
 	if (IsQueryDisabled())
@@ -317,10 +343,11 @@ aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
 
 	old_ctx_m = MemoryContextSwitchTo(AQOPredictMemCtx);
 
-	if (query_context.use_aqo || query_context.learn_aqo)
+	if (query_context.use_aqo || query_context.learn_aqo ||
+		query_context.shadow)
 		current_selectivities = get_selectivities(root, restrictlist, 0,
 												  sjinfo->jointype, sjinfo);
-	if (!query_context.use_aqo)
+	if (!query_context.use_aqo && !query_context.shadow)
 	{
 		MemoryContextSwitchTo(old_ctx_m);
 		goto default_estimator;
@@ -338,7 +365,10 @@ aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
 											inner_selectivities));
 
 	predicted = predict_for_relation(allclauses, selectivities, rels.signatures,
-									 &fss);
+									 rels.hrels, &fss, &confidence);
+	if (query_context.shadow)
+		/* Remember the prediction for the plan only */
+		predicted = -1.;
 
 	/* Return to the caller's memory context */
 	MemoryContextSwitchTo(old_ctx_m);
@@ -347,6 +377,13 @@ aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
 
 	if (predicted >= 0)
 	{
+		if (confidence < aqo_confidence_threshold)
+		{
+			default_set_joinrel_size_estimates(root, rel,
+											   outer_rel, inner_rel,
+											   sjinfo, restrictlist);
+			predicted = blend_prediction(predicted, confidence, rel->rows);
+		}
 		rel->predicted_cardinality = predicted;
 		rel->rows = predicted;
 		return;
@@ -382,6 +419,7 @@ aqo_get_parameterized_joinrel_size(PlannerInfo *root,
 	List	   *outer_selectivities;
 	List	   *current_selectivities = NULL;
 	int			fss = 0;
+	double		confidence = 1.;
 	MemoryContext old_ctx_m;
 
 	if (IsQueryDisabled())
@@ -390,11 +428,12 @@ aqo_get_parameterized_joinrel_size(PlannerInfo *root,
 
 	old_ctx_m = MemoryContextSwitchTo(AQOPredictMemCtx);
 
-	if (query_context.use_aqo || query_context.learn_aqo)
+	if (query_context.use_aqo || query_context.learn_aqo ||
+		query_context.shadow)
 		current_selectivities = get_selectivities(root, clauses, 0,
 												  sjinfo->jointype, sjinfo);
 
-	if (!query_context.use_aqo)
+	if (!query_context.use_aqo && !query_context.shadow)
 	{
 		MemoryContextSwitchTo(old_ctx_m);
 		goto default_estimator;
@@ -410,10 +449,21 @@ aqo_get_parameterized_joinrel_size(PlannerInfo *root,
 											inner_selectivities));
 
 	predicted = predict_for_relation(allclauses, selectivities, rels.signatures,
-									 &fss);
+									 rels.hrels, &fss, &confidence);
+	if (query_context.shadow)
+		/* Remember the prediction for the plan only */
+		predicted = -1.;
 	/* Return to the caller's memory context */
 	MemoryContextSwitchTo(old_ctx_m);
 
+	if (predicted >= 0 && confidence < aqo_confidence_threshold)
+		predicted = blend_prediction(predicted, confidence,
+						default_get_parameterized_joinrel_size(root, rel,
+															   outer_path,
+															   inner_path,
+															   sjinfo,
+															   clauses));
+
 	predicted_ppi_rows = predicted;
 	fss_ppi_hash = fss;
 
@@ -432,7 +482,7 @@ predict_num_groups(PlannerInfo *root, Path *subpath, List *group_exprs,
 {
 	int			child_fss = 0;
 	double		prediction;
-	OkNNrdata	data;
+	OkNNrdata  *data;
 
 	if (subpath->parent->predicted_cardinality > 0.)
 		/* A fast path. Here we can use a fss hash of a leaf. */
@@ -446,20 +496,54 @@ predict_num_groups(PlannerInfo *root, Path *subpath, List *group_exprs,
 		get_list_of_relids(root, subpath->parent->relids, &rels);
 		clauses = get_path_clauses(subpath, root, &selectivities);
 		(void) predict_for_relation(clauses, selectivities, rels.signatures,
-									&child_fss);
+									rels.hrels, &child_fss, NULL);
 	}
 
 	*fss = get_grouped_exprs_hash(child_fss, group_exprs);
-	memset(&data, 0, sizeof(OkNNrdata));
+	data = predict_cache_lookup(query_context.fspace_hash, *fss, 0);
 
-	if (!load_fss_ext(query_context.fspace_hash, *fss, &data, NULL))
+	if (data == NULL)
 		return -1;
 
-	Assert(data.rows == 1);
-	prediction = exp(data.targets[0]);
+	Assert(data->rows == 1);
+	prediction = exp(data->targets[0]);
 	return (prediction <= 0) ? -1 : prediction;
 }
 
+/*
+ * Predict the number of distinct cache keys of a Memoize path. The knowledge
+ * is stored like the number of groups: under the hash of the key expressions,
+ * combined with the fss of the cached subpath.
+ */
+static double
+predict_memoize_keys(PlannerInfo *root, MemoizePath *mpath, List *param_exprs,
+					 int *fss)
+{
+	RelSortOut	rels = {NIL, NIL};
+	List	   *clauses;
+	List	   *selectivities = NIL;
+	int			child_fss;
+	double		prediction;
+	OkNNrdata  *data;
+
+	get_list_of_relids(root, mpath->subpath->parent->relids, &rels);
+	clauses = get_path_clauses(mpath->subpath, root, &selectivities);
+	child_fss = get_fss_for_object(rels.signatures, rels.hrels, clauses, NIL,
+								   NULL, NULL);
+
+	*fss = get_grouped_exprs_hash(child_fss, param_exprs);
+	data = predict_cache_lookup(query_context.fspace_hash, *fss, 0);
+
+	if (data == NULL)
+		return -1;
+
+	Assert(data->rows == 1);
+	prediction = exp(data->targets[0]);
+
+	/* Each call can't bring more than one new key */
+	return (prediction <= 0) ? -1 : Min(prediction, mpath->calls);
+}
+
 double
 aqo_estimate_num_groups_hook(PlannerInfo *root, List *groupExprs,
 							 Path *subpath, RelOptInfo *grouped_rel,
@@ -488,6 +572,18 @@ aqo_estimate_num_groups_hook(PlannerInfo *root, List *groupExprs,
 
 	old_ctx_m = MemoryContextSwitchTo(AQOPredictMemCtx);
 
+	if (IsA(subpath, MemoizePath))
+	{
+		/* Cache keys of a Memoize node. There is no grouped relation. */
+		predicted = predict_memoize_keys(root, (MemoizePath *) subpath,
+										 groupExprs, &fss);
+		MemoryContextSwitchTo(old_ctx_m);
+
+		if (predicted > 0.)
+			return predicted;
+		goto default_estimator;
+	}
+
 	predicted = predict_num_groups(root, subpath, groupExprs, &fss);
 	if (predicted > 0.)
 	{
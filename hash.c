@@ -28,6 +28,9 @@
 #include "aqo.h"
 #include "hash.h"
 
+/* Mixed into a feature subspace hash of the relation size aware knowledge */
+#define AQO_SIZE_AWARE_SALT	(0x53495a45)
+
 static int	get_str_hash(const char *str);
 static int	get_node_hash(Node *node);
 static int	get_unsorted_unsafe_int_array_hash(int *arr, int len);
@@ -170,7 +173,7 @@ get_grouped_exprs_hash(int child_fss, List *group_exprs)
  * Special case for nfeatures == NULL: don't calculate features.
  */
 int
-get_fss_for_object(List *relsigns, List *clauselist,
+get_fss_for_object(List *relsigns, List *reloids, List *clauselist,
 				   List *selectivities, int *nfeatures, double **features)
 {
 	int			n;
@@ -282,6 +285,22 @@ get_fss_for_object(List *relsigns, List *clauselist,
 	relations_hash = get_relations_hash(relsigns);
 	fss_hash = get_fss_hash(clauses_hash, eclasses_hash, relations_hash);
 
+	/*
+	 * Keep the size aware knowledge apart: its targets have another meaning.
+	 * An object with a relation of unknown size learns absolute targets, so
+	 * it shares the subspace with the ordinary mode.
+	 * Subspaces of aggregates and Memoize nodes are derived from the subspace
+	 * of their input, so it is salted even if features aren't requested.
+	 */
+	if (size_aware_object(relsigns, reloids))
+	{
+		int		hashes[2];
+
+		hashes[0] = fss_hash;
+		hashes[1] = AQO_SIZE_AWARE_SALT;
+		fss_hash = get_int_array_hash(hashes, 2);
+	}
+
 	if (nfeatures != NULL)
 	{
 		*nfeatures = n - sh;
@@ -9,6 +9,11 @@
  * It is guaranteed that number of rows in the matrix will not exceed aqo_K
  * setting after learning procedure. This property also allows to adapt to
  * workloads which properties are slowly changed.
+ * Besides the kNN, an online ridge regression is available. It learns a linear
+ * dependency of the target on features and so extrapolates over ranges of
+ * features, which aren't seen yet.
+ * With aqo.adaptive_learning, each feature subspace adapts its learning rate
+ * and selection threshold to the errors of its predictions.
  *
  *******************************************************************************
  *
@@ -35,11 +40,49 @@
 const double	object_selection_threshold = 0.1;
 const double	learning_rate = 1e-1;
 
+/*
+ * Regularization of the ridge regression and the forgetting factor, which
+ * allows it to follow changes of the data. The intercept is hardly
+ * regularized: targets are logarithms of cardinalities, far away from zero.
+ */
+static const double	ridge_lambda = 1.;
+static const double	ridge_intercept_lambda = 1e-4;
+static const double	ridge_forgetting = 0.95;
+
+/*
+ * Adaptive learning. AdaGrad-like, the learning rate of a feature subspace
+ * falls with the sum of squared errors of its predictions, observed during the
+ * learning: stable subspaces keep a high rate and converge fast, noisy ones
+ * smooth their targets. Selection threshold grows with the mean squared error,
+ * so noisy samples are merged into neighbors instead of churning the matrix.
+ */
+static const double	adaptive_learning_rate = 1.;
+static const double	adaptive_learning_rate_min = 1e-2;
+static const double	adaptive_threshold_max = 1.;
+
+/* Model of new feature subspaces */
+int aqo_model = AQO_MODEL_KNN;
+bool aqo_adaptive_learning = false;
 
 static double fs_distance(double *a, double *b, int len);
 static double fs_similarity(double dist);
 static double compute_weights(double *distances, int nrows, double *w, int *idx);
 
+static int knn_size(int ncols);
+static void knn_allocate(OkNNrdata *data);
+static int ridge_size(int ncols);
+static void ridge_allocate(OkNNrdata *data);
+static double ridge_predict(OkNNrdata *data, double *features,
+							double *confidence);
+static int ridge_learn(OkNNrdata *data, double *features, double target,
+					   double rfactor);
+
+static const AqoModelRoutine aqo_models[AQO_MODEL_NKINDS] =
+{
+	{"knn", knn_size, knn_allocate, OkNNr_predict_confidence, OkNNr_learn},
+	{"ridge", ridge_size, ridge_allocate, ridge_predict, ridge_learn}
+};
+
 
 OkNNrdata*
 OkNNr_allocate(int ncols)
@@ -56,9 +99,44 @@ OkNNr_allocate(int ncols)
 
 	data->cols = ncols;
 	data->rows  = -1;
+
+	/* Nothing to regress on without features */
+	data->model = (ncols > 0) ? aqo_model : AQO_MODEL_KNN;
+	data->payload = NULL;
+
+	data->err_sum = 0.;
+	data->nsteps = 0;
 	return data;
 }
 
+/*
+ * Learning rate of the feature subspace.
+ */
+double
+OkNNr_learning_rate(OkNNrdata *data)
+{
+	if (!aqo_adaptive_learning)
+		return learning_rate;
+
+	return Max(adaptive_learning_rate / sqrt(1. + data->err_sum),
+			   adaptive_learning_rate_min);
+}
+
+/*
+ * Distance to the nearest neighbor, below which a new sample is merged into
+ * the neighbor.
+ */
+double
+OkNNr_selection_threshold(OkNNrdata *data)
+{
+	if (!aqo_adaptive_learning || data->nsteps == 0)
+		return object_selection_threshold;
+
+	return Min(object_selection_threshold *
+			   sqrt(1. + data->err_sum / data->nsteps),
+			   adaptive_threshold_max);
+}
+
 /*
  * Computes L2-distance between two given vectors.
  */
@@ -138,6 +216,19 @@ compute_weights(double *distances, int nrows, double *w, int *idx)
  */
 double
 OkNNr_predict(OkNNrdata *data, double *features)
+{
+	return OkNNr_predict_confidence(data, features, NULL);
+}
+
+/*
+ * Makes prediction and estimates its confidence in (0, 1]. The confidence
+ * falls with the weighted standard deviation of targets of the neighbors and
+ * with the distance to the nearest one: if the neighbors are far away or
+ * disagree, the prediction is hardly better than a guess.
+ */
+double
+OkNNr_predict_confidence(OkNNrdata *data, double *features,
+						 double *confidence)
 {
 	double	distances[aqo_K];
 	int		i;
@@ -145,9 +236,13 @@ OkNNr_predict(OkNNrdata *data, double *features)
 	double	w[aqo_K];
 	double	w_sum;
 	double	result = 0.;
+	double	variance = 0.;
 
 	Assert(data != NULL);
 
+	if (confidence != NULL)
+		*confidence = 0.;
+
 	if (!aqo_predict_with_few_neighbors && data->rows < aqo_k)
 		return -1.;
 
@@ -160,12 +255,22 @@ OkNNr_predict(OkNNrdata *data, double *features)
 		if (idx[i] != -1)
 			result += data->targets[idx[i]] * w[i] / w_sum;
 
-	if (result < 0.)
-		result = 0.;
-
 	/* this should never happen */
 	if (idx[0] == -1)
-		result = -1.;
+		return -1.;
+
+	if (confidence != NULL)
+	{
+		for (i = 0; i < aqo_k; ++i)
+			if (idx[i] != -1)
+				variance += (data->targets[idx[i]] - result) *
+							(data->targets[idx[i]] - result) * w[i] / w_sum;
+
+		*confidence = 1. / (1. + sqrt(variance) + distances[idx[0]]);
+	}
+
+	if (result < 0.)
+		result = 0.;
 
 	return result;
 }
@@ -189,6 +294,7 @@ OkNNr_learn(OkNNrdata *data, double *features, double target, double rfactor)
 	int		j;
 	int		mid = 0; /* index of row with minimum distance value */
 	int		idx[aqo_K];
+	double	rate;
 
 	/*
 	 * For each neighbor compute distance and search for nearest object.
@@ -200,18 +306,36 @@ OkNNr_learn(OkNNrdata *data, double *features, double target, double rfactor)
 			mid = i;
 	}
 
+	/* Account the error of the prediction, made before the learning */
+	if (data->rows > 0)
+	{
+		double	w[aqo_K];
+		double	w_sum;
+		double	prediction = 0.;
+
+		w_sum = compute_weights(distances, data->rows, w, idx);
+		for (i = 0; i < aqo_k && idx[i] != -1; ++i)
+			prediction += data->targets[idx[i]] * w[i] / w_sum;
+
+		data->err_sum += (target - prediction) * (target - prediction);
+		data->nsteps++;
+	}
+	rate = OkNNr_learning_rate(data);
+
 	/*
 	 * We do not want to add new very similar neighbor. And we can't
 	 * replace data for the neighbor to avoid some fluctuations.
 	 * We will change it's row with linear smoothing by learning_rate.
 	 */
-	if (data->rows > 0 && distances[mid] < object_selection_threshold)
+	if (data->rows > 0 && distances[mid] < OkNNr_selection_threshold(data))
 	{
-		double lr = learning_rate * rfactor / data->rfactors[mid];
+		double lr = rate * rfactor / data->rfactors[mid];
 
+		/* The adaptive rate reaches the limit legally */
 		if (lr > 1.)
 		{
-			elog(WARNING, "[AQO] Something goes wrong in the ML core: learning rate = %lf", lr);
+			if (!aqo_adaptive_learning)
+				elog(WARNING, "[AQO] Something goes wrong in the ML core: learning rate = %lf", lr);
 			lr = 1.;
 		}
 
@@ -272,16 +396,17 @@ OkNNr_learn(OkNNrdata *data, double *features, double target, double rfactor)
 		 * */
 		for (i = 0; i < aqo_k && idx[i] != -1; ++i)
 			avg_target += data->targets[idx[i]] * w[i] / w_sum;
-		tc_coef = learning_rate * (avg_target - target);
+		tc_coef = rate * (avg_target - target);
 
 		/* Modify targets and features of each nearest neighbor row. */
 		for (i = 0; i < aqo_k && idx[i] != -1; ++i)
 		{
-			double lr = learning_rate * rfactor / data->rfactors[mid];
+			double lr = rate * rfactor / data->rfactors[mid];
 
 			if (lr > 1.)
 			{
-				elog(WARNING, "[AQO] Something goes wrong in the ML core: learning rate = %lf", lr);
+				if (!aqo_adaptive_learning)
+					elog(WARNING, "[AQO] Something goes wrong in the ML core: learning rate = %lf", lr);
 				lr = 1.;
 			}
 
@@ -302,3 +427,222 @@ OkNNr_learn(OkNNrdata *data, double *features, double target, double rfactor)
 	}
 	return data->rows;
 }
+
+/*
+ * The kNN has no state, except of the learning samples.
+ */
+static int
+knn_size(int ncols)
+{
+	return 0;
+}
+
+static void
+knn_allocate(OkNNrdata *data)
+{
+	data->payload = NULL;
+}
+
+/*
+ * Payload of the ridge regression for n = ncols + 1 coefficients, including
+ * the intercept:
+ * [0] - sum of weights of learned samples, zero if nothing is learned;
+ * [1, n] - coefficients;
+ * [n + 1, n + n * n] - inverse of the regularized covariance matrix.
+ */
+#define RIDGE_NCOEFS(ncols)	((ncols) + 1)
+#define RIDGE_WEIGHT(p)		((p)[0])
+#define RIDGE_COEFS(p)		(&(p)[1])
+#define RIDGE_INVCOV(p, n)	(&(p)[1 + (n)])
+
+static inline double
+ridge_initial_invcov(int i, int n)
+{
+	return (i == n - 1) ? 1. / ridge_intercept_lambda : 1. / ridge_lambda;
+}
+
+static int
+ridge_size(int ncols)
+{
+	int n = RIDGE_NCOEFS(ncols);
+
+	return 1 + n + n * n;
+}
+
+static void
+ridge_allocate(OkNNrdata *data)
+{
+	data->payload = palloc0(ridge_size(data->cols) * sizeof(double));
+}
+
+/*
+ * Prediction is a dot product of coefficients and features. Confidence falls
+ * with the variance of the prediction, which is large for features far away
+ * from the learned ones.
+ * Use the kNN until the model is learned.
+ */
+static double
+ridge_predict(OkNNrdata *data, double *features, double *confidence)
+{
+	int		n = RIDGE_NCOEFS(data->cols);
+	double *coefs;
+	double	result;
+	int		i;
+	int		j;
+
+	if (data->payload == NULL || RIDGE_WEIGHT(data->payload) <= 0.)
+		return OkNNr_predict_confidence(data, features, confidence);
+
+	if (confidence != NULL)
+		*confidence = 0.;
+
+	if (!aqo_predict_with_few_neighbors && data->rows < aqo_k)
+		return -1.;
+
+	coefs = RIDGE_COEFS(data->payload);
+	result = coefs[n - 1];
+	for (i = 0; i < data->cols; i++)
+		result += coefs[i] * features[i];
+
+	if (confidence != NULL)
+	{
+		double *invcov = RIDGE_INVCOV(data->payload, n);
+		double	variance = 0.;
+
+		for (i = 0; i < n; i++)
+		{
+			double xi = (i < data->cols) ? features[i] : 1.;
+
+			for (j = 0; j < n; j++)
+				variance += xi * invcov[i * n + j] *
+										((j < data->cols) ? features[j] : 1.);
+		}
+
+		*confidence = 1. / (1. + sqrt(Max(variance, 0.)));
+	}
+
+	if (result < 0.)
+		result = 0.;
+
+	return result;
+}
+
+/*
+ * Recursive least squares step, weighted by reliability of the sample. It
+ * costs O(ncols^2) and is equal to the ridge regression over all learned
+ * samples, discounted by the forgetting factor.
+ * Learning samples are kept by the kNN machinery.
+ */
+static int
+ridge_learn(OkNNrdata *data, double *features, double target, double rfactor)
+{
+	int		n = RIDGE_NCOEFS(data->cols);
+	double *coefs;
+	double *invcov;
+	double *x;
+	double *px;
+	double	denom;
+	double	error;
+	double	forgetting = ridge_forgetting;
+	int		rows;
+	int		i;
+	int		j;
+
+	rows = OkNNr_learn(data, features, target, rfactor);
+
+	if (data->payload == NULL)
+		ridge_allocate(data);
+
+	coefs = RIDGE_COEFS(data->payload);
+	invcov = RIDGE_INVCOV(data->payload, n);
+
+	if (RIDGE_WEIGHT(data->payload) <= 0.)
+	{
+		/* Regularization is the initial state of the model */
+		memset(coefs, 0, n * sizeof(double));
+		memset(invcov, 0, n * n * sizeof(double));
+		for (i = 0; i < n; i++)
+			invcov[i * n + i] = ridge_initial_invcov(i, n);
+	}
+
+	x = palloc(n * sizeof(double));
+	px = palloc(n * sizeof(double));
+	for (i = 0; i < data->cols; i++)
+		x[i] = features[i];
+	x[n - 1] = 1.;
+
+	for (i = 0; i < n; i++)
+	{
+		px[i] = 0.;
+		for (j = 0; j < n; j++)
+			px[i] += invcov[i * n + j] * x[j];
+
+		/*
+		 * Don't forget the directions, which aren't learned anymore: the
+		 * inverse covariance of them would grow without a limit.
+		 */
+		if (invcov[i * n + i] >= ridge_initial_invcov(i, n))
+			forgetting = 1.;
+	}
+
+	denom = forgetting / rfactor;
+	error = target;
+	for (i = 0; i < n; i++)
+	{
+		denom += x[i] * px[i];
+		error -= coefs[i] * x[i];
+	}
+
+	for (i = 0; i < n; i++)
+		coefs[i] += px[i] * error / denom;
+
+	/* invcov is symmetric, so px is also a row of the product x' * invcov */
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n; j++)
+			invcov[i * n + j] = (invcov[i * n + j] - px[i] * px[j] / denom) /
+																	forgetting;
+
+	RIDGE_WEIGHT(data->payload) += rfactor;
+
+	pfree(x);
+	pfree(px);
+	return rows;
+}
+
+const AqoModelRoutine *
+aqo_model_routine(int model)
+{
+	if (model < 0 || model >= AQO_MODEL_NKINDS)
+		elog(ERROR, "[AQO] Unknown model %d", model);
+
+	return &aqo_models[model];
+}
+
+/*
+ * Returns -1, if the name isn't known.
+ */
+int
+aqo_model_by_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < AQO_MODEL_NKINDS; i++)
+		if (strcmp(aqo_models[i].name, name) == 0)
+			return i;
+
+	return -1;
+}
+
+double
+aqo_model_predict(OkNNrdata *data, double *features, double *confidence)
+{
+	return aqo_model_routine(data->model)->predict(data, features, confidence);
+}
+
+int
+aqo_model_learn(OkNNrdata *data, double *features, double target,
+				double rfactor)
+{
+	return aqo_model_routine(data->model)->learn(data, features, target,
+												 rfactor);
+}
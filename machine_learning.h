@@ -10,6 +10,19 @@ extern const double learning_rate;
 #define RELIABILITY_MIN		(0.1)
 #define RELIABILITY_MAX		(1.0)
 
+/*
+ * Models, which can be learned for a feature subspace. Learning samples are
+ * kept in the matrix for any model: they are exported and merged by the wide
+ * search. A model other than the kNN keeps its state in the payload.
+ */
+typedef enum
+{
+	AQO_MODEL_KNN = 0,	/* k nearest neighbors regression */
+	AQO_MODEL_RIDGE,	/* online ridge regression */
+
+	AQO_MODEL_NKINDS
+} AqoModelKind;
+
 typedef struct OkNNrdata
 {
 	int		rows; /* Number of filled rows in the matrix */
@@ -19,8 +32,37 @@ typedef struct OkNNrdata
 							* value of (fs, fss), but different features. */
 	double	targets[aqo_K]; /* Right side of the equations system */
 	double	rfactors[aqo_K];
+
+	int		model; /* AqoModelKind */
+	double *payload; /* Model-specific state, NULL if isn't learned yet */
+
+	/* State of the adaptive learning */
+	double	err_sum; /* Sum of squared errors of predictions at learning */
+	int64	nsteps; /* Number of learning steps with a prediction */
 } OkNNrdata;
 
+/*
+ * Interface of a model. The payload is a flat array of doubles, so the
+ * storage saves and exports it as is.
+ */
+typedef struct AqoModelRoutine
+{
+	const char *name;
+
+	/* Number of doubles in the payload of a model with ncols features */
+	int		(*size) (int ncols);
+
+	/* Allocate and initialize the payload of a model, which isn't learned */
+	void	(*allocate) (OkNNrdata *data);
+
+	/* Returns negative value in the case of refusal to make a prediction */
+	double	(*predict) (OkNNrdata *data, double *features, double *confidence);
+
+	/* Returns new number of learning samples */
+	int		(*learn) (OkNNrdata *data, double *features, double target,
+					  double rfactor);
+} AqoModelRoutine;
+
 /*
  * Auxiliary struct, used for passing arguments
  * to aqo_data_store() function.
@@ -35,14 +77,35 @@ typedef struct AqoDataArgs
 	double	*targets;	/* Pointer to array of 'targets' */
 	double	*rfactors;	/* Pointer to array of 'rfactors' */
 	Oid		*oids;		/* Array of relation OIDs */
+
+	int		model;		/* AqoModelKind */
+	double	*payload;	/* Model-specific state, NULL means not learned */
+
+	double	err_sum;	/* State of the adaptive learning */
+	int64	nsteps;
 } AqoDataArgs;
 
+extern int aqo_model;
+extern bool aqo_adaptive_learning;
+
 extern OkNNrdata* OkNNr_allocate(int ncols);
 extern void OkNNr_free(OkNNrdata *data);
 
 /* Machine learning techniques */
 extern double OkNNr_predict(OkNNrdata *data, double *features);
+extern double OkNNr_predict_confidence(OkNNrdata *data, double *features,
+									   double *confidence);
 extern int OkNNr_learn(OkNNrdata *data,
 					   double *features, double target, double rfactor);
+extern double OkNNr_learning_rate(OkNNrdata *data);
+extern double OkNNr_selection_threshold(OkNNrdata *data);
+
+/* Models interface */
+extern const AqoModelRoutine *aqo_model_routine(int model);
+extern int aqo_model_by_name(const char *name);
+extern double aqo_model_predict(OkNNrdata *data, double *features,
+								double *confidence);
+extern int aqo_model_learn(OkNNrdata *data, double *features, double target,
+						   double rfactor);
 
 #endif /* MACHINE_LEARNING_H */
@@ -15,13 +15,17 @@
 
 #include "access/relation.h"
 #include "nodes/readfuncs.h"
+#include "optimizer/cost.h"
 #include "optimizer/optimizer.h"
+#include "optimizer/paths.h"
 #include "path_utils.h"
+#include "utils/spccache.h"
 #include "utils/syscache.h"
 #include "utils/lsyscache.h"
 
 #include "aqo.h"
 #include "hash.h"
+#include "storage.h"
 
 #include "postgres_fdw.h"
 
@@ -33,6 +37,11 @@ create_plan_hook_type prev_create_plan_hook = NULL;
 
 create_upper_paths_hook_type prev_create_upper_paths_hook = NULL;
 
+set_rel_pathlist_hook_type prev_set_rel_pathlist_hook = NULL;
+
+/* Use buffer cache behaviour of relations in costing of index scans */
+bool aqo_relation_io = false;
+
 static AQOPlanNode DefaultAQOPlanNode =
 {
 	.node.type = T_ExtensibleNode,
@@ -46,7 +55,9 @@ static AQOPlanNode DefaultAQOPlanNode =
 	.parallel_divisor = -1.,
 	.was_parametrized = false,
 	.fss = INT_MAX,
-	.prediction = -1
+	.prediction = -1,
+	.confidence = 1.,
+	.shadow_prediction = -1
 };
 
 static AQOPlanNode *
@@ -247,6 +258,11 @@ get_list_of_relids(PlannerInfo *root, Relids relids, RelSortOut *rels)
 											strlen(relname))));
 
 			hrels = lappend_oid(hrels, entry->relid);
+
+			if (index < root->simple_rel_array_size &&
+				root->simple_rel_array[index] != NULL)
+				relation_size_remember(entry->relid,
+									   root->simple_rel_array[index]->tuples);
 		}
 	}
 
@@ -590,6 +606,15 @@ aqo_create_plan_hook(PlannerInfo *root, Path *src, Plan **dest)
 		get_list_of_relids(root, ap->subpath->parent->relids, node->rels);
 		node->jointype = JOIN_INNER;
 	}
+	else if (IsA(src, MemoizePath))
+	{
+		/*
+		 * Store cache keys to learn the number of distinct keys. Take them
+		 * from the path, as the planner passes them to the estimation.
+		 */
+		node->grouping_exprs = copyObject(((MemoizePath *) src)->param_exprs);
+		node->jointype = JOIN_INNER;
+	}
 	else if (is_appropriate_path(src))
 	{
 		node->clauses = list_concat(
@@ -620,6 +645,10 @@ aqo_create_plan_hook(PlannerInfo *root, Path *src, Plan **dest)
 		node->fss = src->parent->fss_hash;
 	}
 
+	if (node->prediction > 0.)
+		node->confidence = prediction_confidence(node->fss);
+	else if (query_context.shadow && node->fss != 0)
+		node->shadow_prediction = prediction_made(node->fss);
 	node->had_path = true;
 }
 
@@ -739,6 +768,8 @@ AQOnodeRead(struct ExtensibleNode *enode)
 	local_node->jointype = 0;
 	local_node->parallel_divisor = 1.0;
 	local_node->was_parametrized = false;
+	local_node->confidence = 1.;
+	local_node->shadow_prediction = -1.;
 
 	local_node->rels = palloc0(sizeof(RelSortOut));
 	local_node->clauses = NIL;
@@ -799,7 +830,83 @@ aqo_store_upper_signature_hook(PlannerInfo *root,
 	get_list_of_relids(root, input_rel->relids, &rels);
 	fss_node->val.ival.type = T_Integer;
 	fss_node->location = -1;
-	fss_node->val.ival.ival = get_fss_for_object(rels.signatures, clauses, NIL,
-												NULL, NULL);
+	fss_node->val.ival.ival = get_fss_for_object(rels.signatures, rels.hrels,
+												clauses, NIL, NULL, NULL);
 	output_rel->ext_nodes = lappend(output_rel->ext_nodes, (void *) fss_node);
 }
+
+/*
+ * Reprice index and bitmap scans of a relation, which is mostly found in
+ * shared buffers. A cached block costs about as much as a sequential read, so
+ * random_page_cost is interpolated towards seq_page_cost by the learned hit
+ * ratio. Scans of the relation are rebuilt with the adjusted value.
+ */
+void
+aqo_set_rel_pathlist(PlannerInfo *root, RelOptInfo *rel, Index rti,
+					 RangeTblEntry *rte)
+{
+	double		hit_ratio;
+	double		spc_random_page_cost;
+	double		spc_seq_page_cost;
+	double		cached_page_cost;
+	double		save_random_page_cost = random_page_cost;
+	List	   *pathlist = NIL;
+	List	   *partial_pathlist = NIL;
+	ListCell   *lc;
+
+	if (prev_set_rel_pathlist_hook)
+		(*prev_set_rel_pathlist_hook)(root, rel, rti, rte);
+
+	if (!aqo_relation_io || !query_context.use_aqo ||
+		rte->rtekind != RTE_RELATION || rel->indexlist == NIL)
+		return;
+
+	/* Random page cost of a tablespace isn't changed */
+	get_tablespace_page_costs(rel->reltablespace, &spc_random_page_cost,
+							  &spc_seq_page_cost);
+	if (spc_random_page_cost != random_page_cost)
+		return;
+
+	/* Sequential scans tell about the cache, if no random access learned */
+	hit_ratio = aqo_relio_hit_ratio(rte->relid, AQO_ACCESS_RANDOM);
+	if (hit_ratio < 0.)
+		hit_ratio = aqo_relio_hit_ratio(rte->relid, AQO_ACCESS_SEQ);
+	if (hit_ratio <= 0.)
+		return;
+
+	cached_page_cost = hit_ratio * spc_seq_page_cost +
+									(1. - hit_ratio) * spc_random_page_cost;
+	if (cached_page_cost >= spc_random_page_cost)
+		return;
+
+	foreach(lc, rel->pathlist)
+	{
+		Path *path = (Path *) lfirst(lc);
+
+		if (!IsA(path, IndexPath) && !IsA(path, BitmapHeapPath))
+			pathlist = lappend(pathlist, path);
+	}
+	foreach(lc, rel->partial_pathlist)
+	{
+		Path *path = (Path *) lfirst(lc);
+
+		if (!IsA(path, IndexPath) && !IsA(path, BitmapHeapPath))
+			partial_pathlist = lappend(partial_pathlist, path);
+	}
+	rel->pathlist = pathlist;
+	rel->partial_pathlist = partial_pathlist;
+
+	elog(DEBUG1, "[AQO] Relation %u: hit ratio %.2f, random page cost %.2f",
+		 rte->relid, hit_ratio, cached_page_cost);
+
+	random_page_cost = cached_page_cost;
+	PG_TRY();
+	{
+		create_index_paths(root, rel);
+	}
+	PG_FINALLY();
+	{
+		random_page_cost = save_random_page_cost;
+	}
+	PG_END_TRY();
+}
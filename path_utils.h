@@ -3,6 +3,7 @@
 
 #include "nodes/extensible.h"
 #include "nodes/pathnodes.h"
+#include "optimizer/paths.h"
 #include "optimizer/planmain.h"
 #include "optimizer/planner.h"
 
@@ -32,7 +33,7 @@ typedef struct AQOPlanNode
 	List		   *clauses;
 	List		   *selectivities;
 
-	/* Grouping expressions from a target list. */
+	/* Grouping expressions from a target list or cache keys of a Memoize */
 	List		*grouping_exprs;
 
 	JoinType	jointype;
@@ -42,6 +43,8 @@ typedef struct AQOPlanNode
 	/* For Adaptive optimization DEBUG purposes */
 	int		fss;
 	double	prediction;
+	double	confidence;	/* of the prediction, in (0, 1] */
+	double	shadow_prediction;	/* made, but not used by the planner */
 } AQOPlanNode;
 
 
@@ -79,4 +82,9 @@ extern void aqo_store_upper_signature_hook(PlannerInfo *root,
 										   void *extra);
 extern List *aqo_get_clauses(PlannerInfo *root, List *restrictlist);
 
+extern bool aqo_relation_io;
+extern set_rel_pathlist_hook_type prev_set_rel_pathlist_hook;
+extern void aqo_set_rel_pathlist(PlannerInfo *root, RelOptInfo *rel,
+								 Index rti, RangeTblEntry *rte);
+
 #endif /* PATH_UTILS_H */
@@ -20,9 +20,15 @@
 
 #include "access/parallel.h"
 #include "commands/explain_format.h"
+#include "common/hashfn.h"
+#include "executor/hashjoin.h"
+#include "jit/jit.h"
 #include "optimizer/optimizer.h"
+#include "parser/parsetree.h"
 #include "postgres_fdw.h"
+#include "utils/plancache.h"
 #include "utils/queryenvironment.h"
+#include "utils/tuplesort.h"
 
 #include "aqo.h"
 #include "hash.h"
@@ -33,6 +39,7 @@
 
 
 bool aqo_learn_statement_timeout = false;
+double plan_invalidation_factor = 0.;
 
 typedef struct
 {
@@ -45,6 +52,9 @@ typedef struct
 
 static double cardinality_sum_errors;
 static int	cardinality_num_objects;
+static double shadow_sum_errors_aqo;
+static double shadow_sum_errors_native;
+static int	shadow_num_objects;
 static int64 max_timeout_value;
 static int64 growth_rate = 3;
 
@@ -59,27 +69,78 @@ static int64 growth_rate = 3;
 static char *AQOPrivateData = "AQOPrivateData";
 static char *PlanStateInfo = "PlanStateInfo";
 
+/* In-memory tuples take more space than their on-disk image */
+#define SPILL_MEMORY_FACTOR	(2.0)
+
+/* Executions with AQO needed to trust the mean cardinality error of a class */
+#define DRIFT_MIN_EXECS	(3)
+
+/*
+ * Predictions of a cached plan changed materially after the learning.
+ */
+static bool track_stale_plan = false;
+static bool stale_plan = false;
+
 
 /* Query execution statistics collecting utilities */
 static void atomic_fss_learn_step(uint64 fhash, int fss, OkNNrdata *data,
 								  double *features, double target,
-								  double rfactor, List *reloids);
+								  double rfactor, double predicted,
+								  bool size_aware, List *reloids);
 static bool learnOnPlanState(PlanState *p, void *context);
 static void learn_agg_sample(aqo_obj_stat *ctx, RelSortOut *rels,
-							 double learned, double rfactor, Plan *plan,
-							 bool notExecuted);
+							 double learned, double rfactor, double predicted,
+							 Plan *plan, bool notExecuted);
+static void learn_memoize_sample(aqo_obj_stat *ctx, MemoizeState *mstate,
+								 AQOPlanNode *aqo_node, double rfactor);
 static void learn_sample(aqo_obj_stat *ctx, RelSortOut *rels,
-						 double learned, double rfactor,
+						 double learned, double rfactor, double predicted,
 						 Plan *plan, bool notExecuted);
 static List *restore_selectivities(List *clauselist,
 								   List *relidslist,
 								   JoinType join_type,
 								   bool was_parametrized);
+static void register_query_class(QueryDesc *queryDesc);
+static void invalidate_stale_plan(void);
+static void guard_query_plan(QueryDesc *queryDesc, double execution_time);
+static bool memoryDemandWalker(PlanState *ps, void *context);
+static bool relationIOWalker(PlanState *ps, void *context);
+static bool parallelWorkersWalker(PlanState *ps, void *context);
+static bool cardinality_error_drifted(StatEntry *stat);
+static int class_work_mem(QueryDesc *queryDesc);
 static void StoreToQueryEnv(QueryDesc *queryDesc);
 static void StorePlanInternals(QueryDesc *queryDesc);
 static bool ExtractFromQueryEnv(QueryDesc *queryDesc);
 
 
+/*
+ * If the plan came from a plan cache, check how the prediction of the plan
+ * node changed after the learning. If the change is material, the plan should
+ * be rebuilt.
+ */
+static void
+check_stale_prediction(OkNNrdata *data, double *features, double predicted,
+					   bool size_aware, List *reloids)
+{
+	double	prediction;
+
+	if (!track_stale_plan)
+		return;
+
+	prediction = aqo_model_predict(data, features, NULL);
+	if (prediction < 0.)
+		return;
+
+	if (size_aware)
+		prediction = relations_log_size(reloids) - prediction;
+	prediction = clamp_row_est(exp(prediction));
+	if (Max(prediction / predicted, predicted / prediction) <=
+													plan_invalidation_factor)
+		return;
+
+	stale_plan = true;
+}
+
 /*
  * This is the critical section: only one runner is allowed to be inside this
  * function for one feature subspace.
@@ -88,18 +149,21 @@ static bool ExtractFromQueryEnv(QueryDesc *queryDesc);
 static void
 atomic_fss_learn_step(uint64 fs, int fss, OkNNrdata *data,
 					  double *features, double target, double rfactor,
-					  List *reloids)
+					  double predicted, bool size_aware, List *reloids)
 {
 	if (!load_fss_ext(fs, fss, data, NULL))
 		data->rows = 0;
 
-	data->rows = OkNNr_learn(data, features, target, rfactor);
+	data->rows = aqo_model_learn(data, features, target, rfactor);
 	update_fss_ext(fs, fss, data, reloids);
+
+	check_stale_prediction(data, features, predicted, size_aware, reloids);
 }
 
 static void
 learn_agg_sample(aqo_obj_stat *ctx, RelSortOut *rels,
-			 double learned, double rfactor, Plan *plan, bool notExecuted)
+			 double learned, double rfactor, double predicted, Plan *plan,
+			 bool notExecuted)
 {
 	AQOPlanNode	   *aqo_node = get_aqo_plan_node(plan, false);
 	uint64			fs = query_context.fspace_hash;
@@ -116,14 +180,48 @@ learn_agg_sample(aqo_obj_stat *ctx, RelSortOut *rels,
 		return;
 
 	target = log(learned);
-	child_fss = get_fss_for_object(rels->signatures, ctx->clauselist,
-								   NIL, NULL,NULL);
+	child_fss = get_fss_for_object(rels->signatures, rels->hrels,
+								   ctx->clauselist, NIL, NULL, NULL);
 	fss = get_grouped_exprs_hash(child_fss,
 								 aqo_node ? aqo_node->grouping_exprs : NIL);
 
 	/* Critical section */
 	atomic_fss_learn_step(fs, fss, data, NULL,
-						  target, rfactor, rels->hrels);
+						  target, rfactor, predicted, false, rels->hrels);
+	/* End of critical section */
+}
+
+/*
+ * Learn the number of distinct cache keys of a Memoize node. It is the number
+ * of cache misses, if nothing was evicted from the cache. The knowledge is
+ * stored like the number of groups of an aggregate.
+ */
+static void
+learn_memoize_sample(aqo_obj_stat *ctx, MemoizeState *mstate,
+					 AQOPlanNode *aqo_node, double rfactor)
+{
+	uint64			fs = query_context.fspace_hash;
+	int				child_fss;
+	double			nkeys;
+	OkNNrdata	   *data;
+	int				fss;
+
+	/* Statistics of parallel workers aren't accumulated by the leader */
+	if (mstate->shared_info != NULL || aqo_node->grouping_exprs == NIL ||
+		mstate->stats.cache_misses == 0 ||
+		mstate->stats.cache_evictions > 0 || mstate->stats.cache_overflows > 0)
+		return;
+
+	nkeys = (double) mstate->stats.cache_misses;
+	child_fss = get_fss_for_object(aqo_node->rels->signatures,
+								   aqo_node->rels->hrels, ctx->clauselist,
+								   NIL, NULL, NULL);
+	fss = get_grouped_exprs_hash(child_fss, aqo_node->grouping_exprs);
+	data = OkNNr_allocate(0);
+
+	/* Critical section */
+	atomic_fss_learn_step(fs, fss, data, NULL, log(nkeys), rfactor, nkeys,
+						  false, aqo_node->rels->hrels);
 	/* End of critical section */
 }
 
@@ -133,18 +231,29 @@ learn_agg_sample(aqo_obj_stat *ctx, RelSortOut *rels,
  */
 static void
 learn_sample(aqo_obj_stat *ctx, RelSortOut *rels,
-			 double learned, double rfactor, Plan *plan, bool notExecuted)
+			 double learned, double rfactor, double predicted, Plan *plan,
+			 bool notExecuted)
 {
 	AQOPlanNode	   *aqo_node = get_aqo_plan_node(plan, false);
 	uint64			fs = query_context.fspace_hash;
 	double		   *features;
 	double			target;
+	bool			size_aware;
 	OkNNrdata	   *data;
 	int				fss;
 	int				ncols;
 
-	target = log(learned);
-	fss = get_fss_for_object(rels->signatures, ctx->clauselist,
+	/*
+	 * Size aware target is a negated log selectivity relative to the Cartesian
+	 * product of the relations. Stale sizes may make it negative: the model
+	 * can't predict below zero anyway.
+	 */
+	size_aware = size_aware_object(rels->signatures, rels->hrels);
+	if (size_aware)
+		target = Max(relations_log_size(rels->hrels) - log(learned), 0.);
+	else
+		target = log(learned);
+	fss = get_fss_for_object(rels->signatures, rels->hrels, ctx->clauselist,
 							 ctx->selectivities, &ncols, &features);
 
 	/* Only Agg nodes can have non-empty a grouping expressions list. */
@@ -160,7 +269,8 @@ learn_sample(aqo_obj_stat *ctx, RelSortOut *rels,
 	data = OkNNr_allocate(ncols);
 
 	/* Critical section */
-	atomic_fss_learn_step(fs, fss, data, features, target, rfactor, rels->hrels);
+	atomic_fss_learn_step(fs, fss, data, features, target, rfactor,
+						  predicted, size_aware, rels->hrels);
 	/* End of critical section */
 }
 
@@ -445,6 +555,24 @@ learnOnPlanState(PlanState *p, void *context)
 		/* No AQO prediction. Parallel workers not used for this plan node. */
 		predicted = p->plan->plan_rows;
 
+	if (query_context.shadow && aqo_node->shadow_prediction > 0. &&
+		!notExecuted)
+	{
+		double	error_aqo;
+		double	error_native;
+
+		/* The planner used its own estimate. Compare both with the fact. */
+		error_aqo = fabs(log(clamp_row_est(aqo_node->shadow_prediction)) -
+						 log(clamp_row_est(learn_rows)));
+		error_native = fabs(log(clamp_row_est(predicted)) -
+							log(clamp_row_est(learn_rows)));
+		aqo_shadow_store(query_context.fspace_hash, aqo_node->fss,
+						 error_aqo, error_native);
+		shadow_sum_errors_aqo += error_aqo;
+		shadow_sum_errors_native += error_native;
+		shadow_num_objects += 1;
+	}
+
 	if (!ctx->learn && query_context.collect_stat)
 	{
 		double p,l;
@@ -516,12 +644,17 @@ learnOnPlanState(PlanState *p, void *context)
 					if (IsA(p, AggState))
 						learn_agg_sample(&SubplanCtx,
 										 aqo_node->rels, learn_rows, rfactor,
-										 p->plan, notExecuted);
+										 predicted, p->plan, notExecuted);
 
 					else
 						learn_sample(&SubplanCtx,
 									 aqo_node->rels, learn_rows, rfactor,
-									 p->plan, notExecuted);
+									 predicted, p->plan, notExecuted);
+
+					/* The cache statistics is complete at the end only */
+					if (IsA(p, MemoizeState) && !ctx->isTimedOut)
+						learn_memoize_sample(&SubplanCtx, (MemoizeState *) p,
+											 aqo_node, rfactor);
 				}
 			}
 		}
@@ -549,6 +682,7 @@ aqo_ExecutorStart(QueryDesc *queryDesc, int eflags)
 	instr_time	now;
 	bool		use_aqo;
 	bool		plan_valid;
+	int			save_nestlevel = 0;
 
 	/*
 	 * If the plan pulled from a plan cache, planning don't needed. Restore
@@ -592,8 +726,18 @@ aqo_ExecutorStart(QueryDesc *queryDesc, int eflags)
 			!query_context.explain_only)
 			queryDesc->instrument_options |= INSTRUMENT_ROWS;
 
+		if (aqo_relation_io && query_context.learn_aqo &&
+			!query_context.explain_only)
+			queryDesc->instrument_options |= INSTRUMENT_BUFFERS;
+
+		/* A cached plan could be planned before the memory demand is known */
+		query_context.work_mem = aqo_work_mem_choice(query_context.query_hash);
+
 		/* Save all query-related parameters into the query context. */
 		StoreToQueryEnv(queryDesc);
+
+		/* HashAgg sizes its memory limit at the node initialization */
+		save_nestlevel = aqo_set_class_work_mem(query_context.work_mem);
 	}
 
 	if (prev_ExecutorStart_hook)
@@ -601,6 +745,9 @@ aqo_ExecutorStart(QueryDesc *queryDesc, int eflags)
 	else
 		plan_valid = standard_ExecutorStart(queryDesc, eflags);
 
+	if (save_nestlevel > 0)
+		AtEOXact_GUC(true, save_nestlevel);
+
 	if (use_aqo)
 		StorePlanInternals(queryDesc);
 
@@ -626,6 +773,13 @@ aqo_timeout_handler(void)
 	if (!timeoutCtl.queryDesc || !ExtractFromQueryEnv(timeoutCtl.queryDesc))
 		return;
 
+	/* Don't send invalidations from the timeout handler */
+	track_stale_plan = false;
+
+	/* The query will not reach the ExecutorEnd, register its class here. */
+	if (query_context.adding_query)
+		register_query_class(timeoutCtl.queryDesc);
+
 	/* Now we can analyze execution state of the query. */
 
 	ctx.learn = query_context.learn_aqo;
@@ -714,6 +868,7 @@ void
 aqo_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count)
 {
 	bool		timeout_enabled = false;
+	int			save_nestlevel;
 
 	if (exec_nested_level <= 0)
 		timeout_enabled = set_timeout_if_need(queryDesc);
@@ -722,6 +877,7 @@ aqo_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count)
 		   (timeoutCtl.queryDesc && timeoutCtl.id >= USER_TIMEOUT));
 
 	exec_nested_level++;
+	save_nestlevel = aqo_set_class_work_mem(class_work_mem(queryDesc));
 
 	PG_TRY();
 	{
@@ -739,6 +895,65 @@ aqo_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count)
 			disable_timeout(timeoutCtl.id, false);
 	}
 	PG_END_TRY();
+
+	/* In the case of an error the transaction abort reverts the setting */
+	if (save_nestlevel > 0)
+		AtEOXact_GUC(true, save_nestlevel);
+}
+
+/*
+ * ExecutorFinish hook. AFTER triggers and the rest of modifying CTEs are
+ * executed here, so they get the work_mem of the query class too.
+ */
+void
+aqo_ExecutorFinish(QueryDesc *queryDesc)
+{
+	int			save_nestlevel;
+
+	save_nestlevel = aqo_set_class_work_mem(class_work_mem(queryDesc));
+
+	if (prev_ExecutorFinish)
+		prev_ExecutorFinish(queryDesc);
+	else
+		standard_ExecutorFinish(queryDesc);
+
+	/* In the case of an error the transaction abort reverts the setting */
+	if (save_nestlevel > 0)
+		AtEOXact_GUC(true, save_nestlevel);
+}
+
+/*
+ * Has the cardinality error of the last execution of the query class jumped
+ * over the mean error of the previous ones? Errors are means of logarithms, so
+ * the jump means predictions (1 + aqo.knowledge_drift_threshold) times worse
+ * than usual.
+ */
+static bool
+cardinality_error_drifted(StatEntry *stat)
+{
+	int		last = stat->cur_stat_slot_aqo - 1;
+	double	mean = 0.;
+	int		n = 0;
+	int		i;
+
+	if (last < 0 || stat->est_error_aqo[last] < 0.)
+		return false;
+
+	for (i = 0; i < last; i++)
+	{
+		/* Executions without learned objects */
+		if (stat->est_error_aqo[i] < 0.)
+			continue;
+
+		mean += stat->est_error_aqo[i];
+		n++;
+	}
+
+	if (n < DRIFT_MIN_EXECS)
+		return false;
+
+	mean /= n;
+	return stat->est_error_aqo[last] - mean > log(1. + knowledge_drift_threshold);
 }
 
 /*
@@ -759,6 +974,9 @@ aqo_ExecutorEnd(QueryDesc *queryDesc)
 
 	cardinality_sum_errors = 0.;
 	cardinality_num_objects = 0;
+	shadow_sum_errors_aqo = 0.;
+	shadow_sum_errors_native = 0.;
+	shadow_num_objects = 0;
 
 	if (IsQueryDisabled() || !ExtractFromQueryEnv(queryDesc))
 		/* AQO keep all query-related preferences at the query context.
@@ -773,6 +991,9 @@ aqo_ExecutorEnd(QueryDesc *queryDesc)
 
 	Assert(!IsParallelWorker());
 
+	if (query_context.adding_query)
+		register_query_class(queryDesc);
+
 	if (query_context.explain_only)
 	{
 		query_context.learn_aqo = false;
@@ -784,10 +1005,25 @@ aqo_ExecutorEnd(QueryDesc *queryDesc)
 	{
 		aqo_obj_stat ctx = {NIL, NIL, NIL, query_context.learn_aqo, false};
 
+		/*
+		 * Negative planning time means that the plan was taken from a plan
+		 * cache. Only such plans are checked for stale predictions.
+		 */
+		track_stale_plan = (plan_invalidation_factor > 0. &&
+							query_context.use_aqo &&
+							query_context.planning_time < 0.);
+		stale_plan = false;
+
 		/*
 		 * Analyze plan if AQO need to learn or need to collect statistics only.
 		 */
 		learnOnPlanState(queryDesc->planstate, (void *) &ctx);
+		track_stale_plan = false;
+
+		if (aqo_relation_io && query_context.learn_aqo)
+			relationIOWalker(queryDesc->planstate, (void *) queryDesc);
+
+		invalidate_stale_plan();
 	}
 
 	/* Calculate execution time. */
@@ -800,6 +1036,9 @@ aqo_ExecutorEnd(QueryDesc *queryDesc)
 	else
 		cardinality_error = -1;
 
+	if (plan_regression_threshold > 0. && !query_context.explain_only)
+		guard_query_plan(queryDesc, execution_time);
+
 	if (query_context.collect_stat)
 	{
 		/*
@@ -811,7 +1050,24 @@ aqo_ExecutorEnd(QueryDesc *queryDesc)
 		AqoStatArgs stat_arg = { 0, 0, 0,
 			&execution_time, &query_context.planning_time, &cardinality_error,
 			0,
-			&execution_time, &query_context.planning_time, &cardinality_error};
+			&execution_time, &query_context.planning_time, &cardinality_error,
+			(queryDesc->plannedstmt->jitFlags & PGJIT_PERFORM) != 0, 0.,
+			0, 0, 0,
+			shadow_num_objects, shadow_sum_errors_aqo, shadow_sum_errors_native};
+
+		/* Learn the memory demand of the nodes, which spilled to disk */
+		if (!query_context.explain_only)
+			memoryDemandWalker(queryDesc->planstate, &stat_arg.work_mem);
+
+		/* Outside of the parallel mode Gather nodes don't launch workers */
+		if (!query_context.explain_only &&
+			queryDesc->estate->es_use_parallel_mode)
+			parallelWorkersWalker(queryDesc->planstate, &stat_arg);
+
+		/* The raised work_mem wasn't enough: the estimation was too low */
+		if (stat_arg.work_mem > 0. && query_context.work_mem > 0)
+			stat_arg.work_mem = Max(stat_arg.work_mem,
+									2. * query_context.work_mem);
 
 		/* Write AQO statistics to the aqo_query_stat table */
 		stat = aqo_stat_store(query_context.query_hash,
@@ -832,6 +1088,16 @@ aqo_ExecutorEnd(QueryDesc *queryDesc)
 				elog(NOTICE, "[AQO] Time limit for execution of the statement was increased. Current timeout is "UINT64_FORMAT, fintime);
 			}
 
+			if (knowledge_drift_threshold > 0. && query_context.use_aqo &&
+				!query_context.explain_only && cardinality_error_drifted(stat))
+			{
+				int naffected = aqo_data_decay_fs(query_context.fspace_hash);
+
+				if (naffected > 0)
+					elog(LOG, "[AQO] Knowledge of %d feature subspaces of the query class "UINT64_FORMAT" is stale after a jump of the cardinality error.",
+						 naffected, query_context.query_hash);
+			}
+
 			pfree(stat);
 		}
 	}
@@ -857,6 +1123,251 @@ end:
 	timeoutCtl.queryDesc = NULL;
 }
 
+/*
+ * Estimate work_mem which would let a Hash, Sort or HashAgg node to avoid
+ * a spill to disk. Collects the maximum over the spilled nodes, in kB.
+ */
+static bool
+memoryDemandWalker(PlanState *ps, void *context)
+{
+	double *demand = (double *) context;
+	double	need = 0.;
+
+	if (ps == NULL)
+		return false;
+
+	if (IsA(ps, HashState))
+	{
+		HashState  *hstate = (HashState *) ps;
+		int			nbatch = 0;
+		Size		space_peak = 0;
+
+		if (hstate->hinstrument != NULL)
+		{
+			nbatch = hstate->hinstrument->nbatch;
+			space_peak = hstate->hinstrument->space_peak;
+		}
+		else if (hstate->hashtable != NULL)
+		{
+			nbatch = hstate->hashtable->nbatch;
+			space_peak = hstate->hashtable->spacePeak;
+		}
+
+		/* All the batches should fit into the hash table at once */
+		if (nbatch > 1)
+			need = (double) space_peak * nbatch / 1024. / hash_mem_multiplier;
+	}
+	else if (IsA(ps, SortState))
+	{
+		SortState  *sstate = (SortState *) ps;
+		TuplesortInstrumentation stats;
+
+		if (sstate->sort_Done && sstate->tuplesortstate != NULL)
+		{
+			tuplesort_get_stats((Tuplesortstate *) sstate->tuplesortstate,
+								&stats);
+			if (stats.spaceType == SORT_SPACE_TYPE_DISK)
+				need = stats.spaceUsed * SPILL_MEMORY_FACTOR;
+		}
+	}
+	else if (IsA(ps, AggState))
+	{
+		AggState   *astate = (AggState *) ps;
+
+		if (astate->hash_disk_used > 0)
+			need = ((double) astate->hash_mem_peak / 1024. +
+					astate->hash_disk_used * SPILL_MEMORY_FACTOR) /
+															hash_mem_multiplier;
+	}
+
+	*demand = Max(*demand, need);
+	return planstate_tree_walker(ps, memoryDemandWalker, context);
+}
+
+/*
+ * Learn buffer cache hits and reads of scanned relations. Buffer usage of
+ * a bitmap heap scan includes its index scans.
+ */
+static bool
+relationIOWalker(PlanState *ps, void *context)
+{
+	QueryDesc	   *queryDesc = (QueryDesc *) context;
+	int				access;
+	double			hits;
+	double			reads;
+	RangeTblEntry  *rte;
+	int				i;
+
+	if (ps == NULL)
+		return false;
+
+	switch (nodeTag(ps))
+	{
+		case T_SeqScanState:
+			access = AQO_ACCESS_SEQ;
+			break;
+		case T_IndexScanState:
+		case T_IndexOnlyScanState:
+		case T_BitmapHeapScanState:
+			access = AQO_ACCESS_RANDOM;
+			break;
+		default:
+			access = -1;
+			break;
+	}
+
+	if (access >= 0 && ps->instrument != NULL &&
+		(queryDesc->instrument_options & INSTRUMENT_BUFFERS))
+	{
+		hits = ps->instrument->bufusage.shared_blks_hit;
+		reads = ps->instrument->bufusage.shared_blks_read;
+		if (ps->worker_instrument)
+		{
+			WorkerInstrumentation *wi = ps->worker_instrument;
+
+			for (i = 0; i < wi->num_workers; i++)
+			{
+				hits += wi->instrument[i].bufusage.shared_blks_hit;
+				reads += wi->instrument[i].bufusage.shared_blks_read;
+			}
+		}
+
+		rte = rt_fetch(((Scan *) ps->plan)->scanrelid,
+					   queryDesc->plannedstmt->rtable);
+
+		/*
+		 * Only scans of relations are learned. Temporary relations use local
+		 * buffers, so they have no shared hits and reads and are skipped too.
+		 */
+		if (rte->rtekind == RTE_RELATION && hits + reads > 0.)
+			aqo_relio_store(rte->relid, access, hits, reads);
+	}
+
+	return planstate_tree_walker(ps, relationIOWalker, context);
+}
+
+/*
+ * Count parallel workers, planned and launched by executed Gather and Gather
+ * Merge nodes. If max_parallel_workers is exhausted, a Gather launches fewer
+ * workers than planned, or none of them.
+ */
+static bool
+parallelWorkersWalker(PlanState *ps, void *context)
+{
+	AqoStatArgs *stat_arg = (AqoStatArgs *) context;
+
+	if (ps == NULL)
+		return false;
+
+	if (IsA(ps, GatherState) && ((GatherState *) ps)->initialized)
+	{
+		stat_arg->ngathers++;
+		stat_arg->workers_planned += ((Gather *) ps->plan)->num_workers;
+		stat_arg->workers_launched += ((GatherState *) ps)->nworkers_launched;
+	}
+	else if (IsA(ps, GatherMergeState) && ((GatherMergeState *) ps)->initialized)
+	{
+		stat_arg->ngathers++;
+		stat_arg->workers_planned += ((GatherMerge *) ps->plan)->num_workers;
+		stat_arg->workers_launched +=
+								((GatherMergeState *) ps)->nworkers_launched;
+	}
+
+	return planstate_tree_walker(ps, parallelWorkersWalker, context);
+}
+
+/*
+ * Get work_mem, chosen for the query class at the execution start, without
+ * changing the global query context.
+ */
+static int
+class_work_mem(QueryDesc *queryDesc)
+{
+	EphemeralNamedRelation	enr;
+
+	if (IsParallelWorker() || queryDesc->queryEnv == NULL)
+		return 0;
+
+	enr = get_ENR(queryDesc->queryEnv, AQOPrivateData);
+	if (enr == NULL)
+		return 0;
+
+	return ((QueryContextData *) enr->reldata)->work_mem;
+}
+
+/*
+ * Invalidate the cached plan of the prepared statement, if its predictions
+ * changed. Only the plan source in this backend is invalidated: plans of other
+ * queries and backends, built on the same relations, don't suffer. So, the
+ * next execution replans the query with the new knowledge.
+ * Plans, cached by SPI or by the extended query protocol, can't be found here
+ * and stay as is.
+ */
+static void
+invalidate_stale_plan(void)
+{
+	CachedPlanSource   *plansource = executed_plansource;
+	Query			   *query;
+
+	if (!stale_plan)
+		return;
+	stale_plan = false;
+
+	if (plansource == NULL || list_length(plansource->query_list) != 1)
+		return;
+
+	/* The query may be nested into the prepared statement */
+	query = linitial_node(Query, plansource->query_list);
+	if (query->queryId != query_context.query_hash)
+		return;
+
+	elog(DEBUG1, "[AQO] Invalidate the cached plan: predictions of the query "
+		 "class "UINT64_FORMAT" changed", query_context.query_hash);
+	plansource->is_valid = false;
+	if (plansource->gplan != NULL)
+		plansource->gplan->is_valid = false;
+}
+
+/*
+ * Add a new query class into the AQO knowledge base. The planner postpones it
+ * until the end of execution. A query, failed or cancelled before that, isn't
+ * registered: nothing is learned on it anyway, and storing at abort time could
+ * raise an error in the middle of the transaction cleanup.
+ */
+static void
+register_query_class(QueryDesc *queryDesc)
+{
+	QueryContextData	ctx;
+
+	if (aqo_queries_find(query_context.query_hash, &ctx))
+		/* Plan was taken from a plan cache or the class was added concurrently */
+		return;
+
+	if (aqo_queries_store(query_context.query_hash, query_context.fspace_hash,
+						  query_context.learn_aqo, query_context.use_aqo,
+						  query_context.auto_tuning, &aqo_queries_nulls))
+	{
+		/*
+		 * Add query text into the ML-knowledge base. Just for further
+		 * analysis. In the case of cached plans we may have NULL query text.
+		 */
+		(void) aqo_qtext_store(query_context.query_hash, queryDesc->sourceText);
+	}
+	else
+	{
+		/*
+		 * In the case of problems (shmem overflow, as a typical issue) -
+		 * don't learn on the query and switch AQO to controlled mode. In this
+		 * mode we wouldn't add new query classes, just use and learn on
+		 * existed set.
+		 */
+		query_context.learn_aqo = false;
+		query_context.auto_tuning = false;
+		query_context.collect_stat = false;
+		aqo_mode = AQO_MODE_CONTROLLED;
+	}
+}
+
 /*
  * Store into a query environment field an AQO data related to the query.
  * We introduce this machinery to avoid problems with subqueries, induced by
@@ -914,6 +1425,117 @@ calculateJoinNum(PlanState *ps, void *context)
 	return false;
 }
 
+/*
+ * Shape of a plan and predictions used for its nodes.
+ */
+typedef struct PlanShapeCtx
+{
+	List   *rtable;
+	uint64	hash;
+
+	int		nfss;	/* -1, if the plan has too many nodes */
+	int		fss[AQO_PLAN_GUARD_NFSS];
+	double	rows[AQO_PLAN_GUARD_NFSS];
+} PlanShapeCtx;
+
+/*
+ * Hash node types, join types, scanned relations and indexes in the order of
+ * the plan tree walk.
+ */
+static bool
+planShapeWalker(PlanState *ps, void *context)
+{
+	PlanShapeCtx   *ctx = (PlanShapeCtx *) context;
+	Plan		   *plan = ps->plan;
+	AQOPlanNode	   *aqo_node;
+	uint64			h = (uint64) nodeTag(plan);
+
+	switch (nodeTag(plan))
+	{
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			h = hash_combine64(h, (uint64) ((Join *) plan)->jointype);
+			break;
+		case T_IndexScan:
+			h = hash_combine64(h, (uint64) ((IndexScan *) plan)->indexid);
+			break;
+		case T_IndexOnlyScan:
+			h = hash_combine64(h, (uint64) ((IndexOnlyScan *) plan)->indexid);
+			break;
+		case T_BitmapIndexScan:
+			h = hash_combine64(h, (uint64) ((BitmapIndexScan *) plan)->indexid);
+			break;
+		default:
+			break;
+	}
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_TidRangeScan:
+		case T_ForeignScan:
+		case T_CustomScan:
+		{
+			Index scanrelid = ((Scan *) plan)->scanrelid;
+
+			if (scanrelid > 0)
+				h = hash_combine64(h, (uint64) rt_fetch(scanrelid, ctx->rtable)->relid);
+			break;
+		}
+		default:
+			break;
+	}
+
+	ctx->hash = hash_combine64(ctx->hash, h);
+
+	aqo_node = get_aqo_plan_node(plan, false);
+	if (aqo_node != NULL && aqo_node->had_path && ctx->nfss >= 0)
+	{
+		if (ctx->nfss < AQO_PLAN_GUARD_NFSS)
+		{
+			ctx->fss[ctx->nfss] = aqo_node->fss;
+			ctx->rows[ctx->nfss] = (aqo_node->prediction > 0.) ?
+												aqo_node->prediction : -1.;
+			ctx->nfss++;
+		}
+		else
+			ctx->nfss = -1;
+	}
+
+	planstate_tree_walker(ps, planShapeWalker, context);
+
+	/* Mark end of the subtree, so different trees get different hashes */
+	ctx->hash = hash_combine64(ctx->hash, UINT64CONST(0x7FFF));
+	return false;
+}
+
+/*
+ * Pass the executed plan to the plan regression guard.
+ */
+static void
+guard_query_plan(QueryDesc *queryDesc, double execution_time)
+{
+	PlanShapeCtx	ctx;
+
+	ctx.rtable = queryDesc->plannedstmt->rtable;
+	ctx.hash = 0;
+	ctx.nfss = 0;
+	(void) planShapeWalker(queryDesc->planstate, &ctx);
+
+	/* Zero means an empty slot */
+	if (ctx.hash == 0)
+		ctx.hash = 1;
+
+	aqo_plan_guard_store(query_context.query_hash, ctx.hash, execution_time,
+						 ctx.nfss, ctx.fss, ctx.rows);
+}
+
 static void
 StorePlanInternals(QueryDesc *queryDesc)
 {
@@ -1027,6 +1649,10 @@ explain_print:
 	{
 		appendStringInfo(es->str, "AQO: rows=%.0lf", aqo_node->prediction);
 
+		if (aqo_confidence_threshold > 0.)
+			appendStringInfo(es->str, ", confidence=%.2lf",
+							 aqo_node->confidence);
+
 		if (ps->instrument && ps->instrument->nloops > 0.)
 		{
 			double rows = ps->instrument->ntuples / ps->instrument->nloops;
@@ -1037,8 +1663,14 @@ explain_print:
 		}
 	}
 	else
+	{
 		appendStringInfo(es->str, "AQO not used");
 
+		if (aqo_node->shadow_prediction > 0.)
+			appendStringInfo(es->str, ", shadow rows=%.0lf",
+							 aqo_node->shadow_prediction);
+	}
+
 explain_end:
 	/* XXX: Do we really have situations when the plan is a NULL pointer? */
 	if (plan && aqo_show_hash)
@@ -58,11 +58,23 @@
 
 #include "postgres.h"
 
+#include <math.h>
+
 #include "access/parallel.h"
 #include "access/table.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits.h"
+#include "commands/defrem.h"
 #include "commands/extension.h"
+#include "commands/prepare.h"
+#include "jit/jit.h"
+#include "miscadmin.h"
 #include "parser/scansup.h"
+#include "utils/plancache.h"
+#include "utils/syscache.h"
 #include "aqo.h"
+#include "aqo_shared.h"
 #include "hash.h"
 #include "preprocessing.h"
 #include "storage.h"
@@ -72,7 +84,12 @@ List *cur_classes = NIL;
 
 int aqo_join_threshold = 0;
 
+/* Plan source of the prepared statement under EXECUTE, if any */
+CachedPlanSource *executed_plansource = NULL;
+
 static bool isQueryUsingSystemRelation(Query *query);
+static void apply_class_jit(PlannedStmt *stmt);
+static int set_class_parallel_workers(int nworkers, int save_nestlevel);
 static bool isQueryUsingSystemRelation_walker(Node *node, void *context);
 
 /*
@@ -126,6 +143,7 @@ aqo_planner(Query *parse,
 			ParamListInfo boundParams)
 {
 	bool			query_is_stored = false;
+	bool			admission_rejected = false;
 	MemoryContext	oldctx;
 
 	 /*
@@ -161,6 +179,10 @@ aqo_planner(Query *parse,
 	Assert(parse->utilityStmt == NULL);
 	Assert(parse->queryId != UINT64CONST(0));
 	query_context.query_hash = parse->queryId;
+	query_context.jit = AQO_JIT_AUTO;
+	query_context.work_mem = 0;
+	query_context.parallel_workers = -1;
+	query_context.shadow = false;
 
 	/* By default, they should be equal */
 	query_context.fspace_hash = query_context.query_hash;
@@ -190,7 +212,16 @@ aqo_planner(Query *parse,
 
 	if (aqo_mode == AQO_MODE_DISABLED)
 	{
-		/* Skip access to a database in this mode. */
+		/*
+		 * Skip access to a database in this mode. The forced collection of
+		 * statistics only needs to know, whether the class is stored.
+		 */
+		if (force_collect_stat)
+		{
+			QueryContextData	ctx = query_context;
+
+			query_is_stored = aqo_queries_find(query_context.query_hash, &ctx);
+		}
 		disable_aqo_for_query();
 		goto ignore_query_settings;
 	}
@@ -245,6 +276,21 @@ aqo_planner(Query *parse,
 		}
 		query_context.count_increase_timeout = 0;
 		query_context.smart_timeout = 0;
+
+		if (query_context.adding_query &&
+			!aqo_admit_query_class(query_context.query_hash))
+		{
+			/*
+			 * The class hasn't been planned often enough to spend
+			 * the knowledge base on it. Treat it as in the controlled mode.
+			 */
+			query_context.adding_query = false;
+			query_context.learn_aqo = false;
+			query_context.use_aqo = false;
+			query_context.auto_tuning = false;
+			query_context.collect_stat = false;
+			admission_rejected = true;
+		}
 	}
 	else /* Query class exists in a ML knowledge base. */
 	{
@@ -296,58 +342,62 @@ aqo_planner(Query *parse,
 	}
 
 ignore_query_settings:
-	if (!query_is_stored && (query_context.adding_query || force_collect_stat))
-	{
-		/*
-		 * Add query into the AQO knowledge base. To process an error with
-		 * concurrent addition from another backend we will try to restart
-		 * preprocessing routine.
-		 */
-		if (aqo_queries_store(query_context.query_hash, query_context.fspace_hash,
-						  query_context.learn_aqo, query_context.use_aqo,
-						  query_context.auto_tuning, &aqo_queries_nulls))
-		{
-			/*
-			 * Add query text into the ML-knowledge base. Just for further
-			 * analysis. In the case of cached plans we may have NULL query text.
-			 */
-			if (!aqo_qtext_store(query_context.query_hash, query_string))
-			{
-				Assert(0); /* panic only on debug installation */
-				elog(ERROR, "[AQO] Impossible situation was detected. Maybe not enough of shared memory?");
-			}
-		}
-		else
-		{
-			/*
-			 * In the case of problems (shmem overflow, as a typical issue) -
-			 * disable AQO for the query class.
-			 */
-			disable_aqo_for_query();
-
-			/*
-			 * Switch AQO to controlled mode. In this mode we wouldn't add new
-			 * query classes, just use and learn on existed set.
-			 */
-			aqo_mode = AQO_MODE_CONTROLLED;
-		}
-	}
-
-	if (force_collect_stat)
+	/*
+	 * Add query into the AQO knowledge base. Storing of the class and copying
+	 * of its text are postponed until the end of execution to keep the
+	 * planning path free of the storage writes.
+	 * The forced collection of statistics adds a new class in any mode, but
+	 * one-off queries don't pass the admission filter as in the learning
+	 * modes.
+	 */
+	if (!query_is_stored && !query_context.adding_query &&
+		force_collect_stat && !admission_rejected)
+		query_context.adding_query =
+						aqo_admit_query_class(query_context.query_hash);
+
+	if (force_collect_stat && (query_is_stored || query_context.adding_query))
 		/*
 		 * If this GUC is set, AQO will analyze query results and collect
 		 * query execution statistics in any mode.
 		 */
 		query_context.collect_stat = true;
 
+	/*
+	 * Errors of shadow predictions are accounted at the end of execution with
+	 * the execution statistics.
+	 */
+	query_context.shadow = (aqo_shadow_mode && !query_context.use_aqo &&
+							(query_context.learn_aqo ||
+							 query_context.collect_stat));
+
 	if (!IsQueryDisabled())
+	{
 		/* It's good place to set timestamp of start of a planning process. */
 		INSTR_TIME_SET_CURRENT(query_context.start_planning_time);
+
+		/* Cost the plan with the memory the class will be executed with */
+		query_context.work_mem =
+						aqo_work_mem_choice(query_context.query_hash);
+
+		/* Plan for as many parallel workers as the class actually gets */
+		query_context.parallel_workers =
+						aqo_parallel_workers_choice(query_context.query_hash);
+	}
 	{
-		PlannedStmt *stmt;
+		PlannedStmt	   *stmt;
+		int				save_nestlevel;
 
+		save_nestlevel = aqo_set_class_work_mem(query_context.work_mem);
+		save_nestlevel = set_class_parallel_workers(
+									query_context.parallel_workers,
+									save_nestlevel);
 		stmt = call_default_planner(parse, query_string,
 												 cursorOptions, boundParams);
+		if (save_nestlevel > 0)
+			AtEOXact_GUC(true, save_nestlevel);
+
+		if (!IsQueryDisabled())
+			apply_class_jit(stmt);
 
 		/* Release the memory, allocated for AQO predictions */
 		MemoryContextReset(AQOPredictMemCtx);
@@ -355,6 +405,85 @@ ignore_query_settings:
 	}
 }
 
+/*
+ * Apply JIT setting of the query class to the plan. The explicit setting from
+ * aqo_queries wins. Otherwise, the auto tuning can only turn off JIT, chosen
+ * by the planner.
+ */
+static void
+apply_class_jit(PlannedStmt *stmt)
+{
+	int		jit = query_context.jit;
+	Cost	total_cost = stmt->planTree->total_cost;
+
+	if (jit == AQO_JIT_AUTO && auto_tuning_jit &&
+		(stmt->jitFlags & PGJIT_PERFORM))
+		jit = aqo_jit_choice(query_context.query_hash);
+
+	if (jit == AQO_JIT_OFF)
+		stmt->jitFlags = PGJIT_NONE;
+	else if (jit == AQO_JIT_ON && jit_enabled &&
+			 !(stmt->jitFlags & PGJIT_PERFORM))
+	{
+		/* Same flags as the planner sets for an expensive query */
+		stmt->jitFlags = PGJIT_PERFORM;
+		if (jit_optimize_above_cost >= 0 &&
+			total_cost > jit_optimize_above_cost)
+			stmt->jitFlags |= PGJIT_OPT3;
+		if (jit_inline_above_cost >= 0 &&
+			total_cost > jit_inline_above_cost)
+			stmt->jitFlags |= PGJIT_INLINE;
+		if (jit_expressions)
+			stmt->jitFlags |= PGJIT_EXPR;
+		if (jit_tuple_deforming)
+			stmt->jitFlags |= PGJIT_DEFORM;
+	}
+}
+
+/*
+ * Raise work_mem up to the memory demand, learned for the query class.
+ * Returns the GUC nest level to revert the setting by AtEOXact_GUC(), or zero
+ * if nothing was changed. In the case of an error the transaction abort
+ * reverts the setting.
+ */
+int
+aqo_set_class_work_mem(int class_work_mem)
+{
+	char	buf[32];
+	int		save_nestlevel;
+
+	if (class_work_mem <= work_mem)
+		return 0;
+
+	save_nestlevel = NewGUCNestLevel();
+	snprintf(buf, sizeof(buf), "%d", class_work_mem);
+	(void) set_config_option("work_mem", buf, PGC_USERSET, PGC_S_SESSION,
+							 GUC_ACTION_SAVE, true, 0, false);
+	return save_nestlevel;
+}
+
+/*
+ * Lower max_parallel_workers_per_gather down to the number of workers, learned
+ * for the query class. Opens a new GUC nest level, if the caller hasn't done
+ * it yet. Returns the nest level to revert the settings, or zero.
+ */
+static int
+set_class_parallel_workers(int nworkers, int save_nestlevel)
+{
+	char	buf[32];
+
+	if (nworkers < 0 || nworkers >= max_parallel_workers_per_gather)
+		return save_nestlevel;
+
+	if (save_nestlevel == 0)
+		save_nestlevel = NewGUCNestLevel();
+	snprintf(buf, sizeof(buf), "%d", nworkers);
+	(void) set_config_option("max_parallel_workers_per_gather", buf,
+							 PGC_USERSET, PGC_S_SESSION,
+							 GUC_ACTION_SAVE, true, 0, false);
+	return save_nestlevel;
+}
+
 /*
  * Turn off all AQO functionality for the current query.
  */
@@ -367,11 +496,250 @@ disable_aqo_for_query(void)
 	query_context.collect_stat = false;
 	query_context.adding_query = false;
 	query_context.explain_only = false;
+	query_context.shadow = false;
 
 	INSTR_TIME_SET_ZERO(query_context.start_planning_time);
 	query_context.planning_time = -1.;
 }
 
+/*
+ * Size of the relation as the last VACUUM or ANALYZE saw it. A relation of
+ * unknown size is considered as an empty one.
+ */
+static double
+relation_tuples(Oid relid)
+{
+	HeapTuple	tuple;
+	float4		reltuples;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		return 0.;
+
+	reltuples = ((Form_pg_class) GETSTRUCT(tuple))->reltuples;
+	ReleaseSysCache(tuple);
+	return Max(reltuples, 0.);
+}
+
+/*
+ * Has the relation grown or shrunk more than (1 + aqo.knowledge_drift_threshold)
+ * times?
+ */
+static bool
+relation_size_drifted(double old_size, double new_size)
+{
+	return fabs(log((new_size + 1.) / (old_size + 1.))) >
+										log(1. + knowledge_drift_threshold);
+}
+
+/*
+ * Does the statement collect statistics of relations?
+ */
+static bool
+is_analyze_stmt(VacuumStmt *stmt)
+{
+	ListCell   *lc;
+
+	if (!stmt->is_vacuumcmd)
+		return true;
+
+	foreach(lc, stmt->options)
+	{
+		DefElem	   *opt = lfirst_node(DefElem, lc);
+
+		if (strcmp(opt->defname, "analyze") == 0)
+			return defGetBoolean(opt);
+	}
+	return false;
+}
+
+/*
+ * Relations, which statistics will be collected by the statement: the listed
+ * ones with their inheritors. Without a list, all the relations of the
+ * database are analyzed, so take the relations known to AQO.
+ */
+static Oid *
+analyzed_relations(VacuumStmt *stmt, int *nrels)
+{
+	List	   *relids = NIL;
+	Oid		   *reloids;
+	ListCell   *lc;
+	int			n = 0;
+
+	if (stmt->rels == NIL)
+		return aqo_data_reloids(nrels);
+
+	foreach(lc, stmt->rels)
+	{
+		VacuumRelation *vrel = lfirst_node(VacuumRelation, lc);
+		Oid				relid = vrel->oid;
+
+		if (!OidIsValid(relid) && vrel->relation != NULL)
+			relid = RangeVarGetRelid(vrel->relation, NoLock, true);
+		if (!OidIsValid(relid))
+			continue;
+
+		relids = list_concat_unique_oid(relids,
+										find_all_inheritors(relid, NoLock,
+															NULL));
+	}
+
+	*nrels = list_length(relids);
+	if (*nrels == 0)
+		return NULL;
+
+	reloids = palloc(*nrels * sizeof(Oid));
+	foreach(lc, relids)
+		reloids[n++] = lfirst_oid(lc);
+	list_free(relids);
+	return reloids;
+}
+
+/*
+ * Decay the knowledge depending on the relations, which sizes have drifted
+ * from the old ones. New sizes are taken from the pg_class, if not passed.
+ */
+static void
+decay_drifted_knowledge(const Oid *reloids, const double *old_sizes,
+						const double *new_sizes, int nrels)
+{
+	Oid	   *drifted = palloc(nrels * sizeof(Oid));
+	int		ndrifted = 0;
+	int		naffected;
+	int		i;
+
+	for (i = 0; i < nrels; i++)
+	{
+		double	new_size = (new_sizes != NULL) ? new_sizes[i] :
+												 relation_tuples(reloids[i]);
+
+		if (relation_size_drifted(old_sizes[i], new_size))
+			drifted[ndrifted++] = reloids[i];
+	}
+
+	naffected = aqo_data_decay_relations(drifted, ndrifted);
+	if (naffected > 0)
+		elog(LOG, "[AQO] Knowledge of %d feature subspaces is stale after changes of %d relations.",
+			 naffected, ndrifted);
+	pfree(drifted);
+}
+
+/*
+ * For EXECUTE of a prepared statement, apply the plan_cache_mode chosen by
+ * the auto tuning for the query class. The setting is reverted after the
+ * statement.
+ * Statements, prepared by the extended query protocol, don't pass this hook.
+ * The plan source of the statement is exposed during the execution: its plan
+ * can be invalidated by the learning.
+ *
+ * Also, watch sizes of the relations, changed by ANALYZE or COPY FROM. If the
+ * size has drifted a lot, the knowledge depending on the relation is stale.
+ */
+void
+aqo_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+				   bool readOnlyTree, ProcessUtilityContext context,
+				   ParamListInfo params, QueryEnvironment *queryEnv,
+				   DestReceiver *dest, QueryCompletion *qc)
+{
+	Node			   *parsetree = pstmt->utilityStmt;
+	CachedPlanSource   *save_plansource = executed_plansource;
+	CachedPlanSource   *plansource = NULL;
+	int					save_nestlevel = 0;
+	Oid				   *drift_reloids = NULL;
+	double			   *drift_sizes = NULL;
+	int					drift_nrels = 0;
+	Oid					copy_relid = InvalidOid;
+	double				copy_size = 0.;
+
+	if (aqo_mode != AQO_MODE_DISABLED && IsA(parsetree, ExecuteStmt))
+	{
+		PreparedStatement  *entry;
+		Query			   *query;
+		int					mode = PLAN_CACHE_MODE_AUTO;
+
+		entry = FetchPreparedStatement(((ExecuteStmt *) parsetree)->name,
+									   false);
+		plansource = (entry != NULL) ? entry->plansource : NULL;
+
+		if (auto_tuning_plan_cache && plansource != NULL &&
+			list_length(plansource->query_list) == 1)
+		{
+			query = linitial_node(Query, plansource->query_list);
+			if (query->queryId != UINT64CONST(0))
+				mode = aqo_plan_cache_choice(query->queryId);
+		}
+
+		if (mode != PLAN_CACHE_MODE_AUTO)
+		{
+			save_nestlevel = NewGUCNestLevel();
+			(void) set_config_option("plan_cache_mode",
+									 (mode == PLAN_CACHE_MODE_FORCE_GENERIC_PLAN) ?
+											"force_generic_plan" :
+											"force_custom_plan",
+									 PGC_USERSET, PGC_S_SESSION,
+									 GUC_ACTION_SAVE, true, 0, false);
+		}
+	}
+
+	if (knowledge_drift_threshold > 0. && aqo_mode != AQO_MODE_DISABLED)
+	{
+		if (IsA(parsetree, VacuumStmt) &&
+			is_analyze_stmt((VacuumStmt *) parsetree))
+		{
+			int		i;
+
+			drift_reloids = analyzed_relations((VacuumStmt *) parsetree,
+											   &drift_nrels);
+			if (drift_nrels > 0)
+				drift_sizes = palloc(drift_nrels * sizeof(double));
+			for (i = 0; i < drift_nrels; i++)
+				drift_sizes[i] = relation_tuples(drift_reloids[i]);
+		}
+		else if (IsA(parsetree, CopyStmt) && ((CopyStmt *) parsetree)->is_from &&
+				 ((CopyStmt *) parsetree)->relation != NULL)
+		{
+			copy_relid = RangeVarGetRelid(((CopyStmt *) parsetree)->relation,
+										  NoLock, true);
+			if (OidIsValid(copy_relid))
+				copy_size = relation_tuples(copy_relid);
+		}
+	}
+
+	executed_plansource = plansource;
+	PG_TRY();
+	{
+		if (prev_ProcessUtility_hook)
+			prev_ProcessUtility_hook(pstmt, queryString, readOnlyTree, context,
+									 params, queryEnv, dest, qc);
+		else
+			standard_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+									params, queryEnv, dest, qc);
+	}
+	PG_FINALLY();
+	{
+		executed_plansource = save_plansource;
+	}
+	PG_END_TRY();
+
+	/*
+	 * The memory is allocated in a portal context, which survives transactions
+	 * of a VACUUM.
+	 */
+	if (drift_nrels > 0)
+		decay_drifted_knowledge(drift_reloids, drift_sizes, NULL, drift_nrels);
+	else if (OidIsValid(copy_relid) && qc != NULL)
+	{
+		/* The bulk load isn't visible in the pg_class until the next ANALYZE */
+		double	new_size = copy_size + qc->nprocessed;
+
+		decay_drifted_knowledge(&copy_relid, &copy_size, &new_size, 1);
+	}
+
+	/* In the case of an error the transaction abort reverts the setting */
+	if (save_nestlevel > 0)
+		AtEOXact_GUC(true, save_nestlevel);
+}
+
 typedef struct AQOPreWalkerCtx
 {
 	bool	trivQuery;
@@ -3,10 +3,22 @@
 
 #include "nodes/pathnodes.h"
 #include "nodes/plannodes.h"
+#include "tcop/utility.h"
+#include "utils/plancache.h"
+
+extern CachedPlanSource *executed_plansource;
+
 extern PlannedStmt *aqo_planner(Query *parse,
 								const char *query_string,
 								int cursorOptions,
 								ParamListInfo boundParams);
 extern void disable_aqo_for_query(void);
+extern int aqo_set_class_work_mem(int class_work_mem);
+extern void aqo_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+							   bool readOnlyTree,
+							   ProcessUtilityContext context,
+							   ParamListInfo params,
+							   QueryEnvironment *queryEnv,
+							   DestReceiver *dest, QueryCompletion *qc);
 
 #endif /* __PREPROCESSING_H__ */
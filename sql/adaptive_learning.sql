@@ -0,0 +1,35 @@
+-- Replay recorded samples of a feature subspace with and without the
+-- adaptive learning. All the samples have the same features, so each of them
+-- is merged into the only row of the matrix.
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE FUNCTION replay(targets double precision[])
+RETURNS TABLE (step integer, prediction numeric, error numeric,
+			   rate numeric, threshold numeric) AS $$
+	SELECT step, round(prediction::numeric, 3), round(error::numeric, 3),
+		   round(learning_rate::numeric, 3),
+		   round(selection_threshold::numeric, 3)
+	FROM aqo_learning_replay(
+		(SELECT array_agg(ARRAY[0.]::double precision[]) FROM unnest(targets)),
+		targets);
+$$ LANGUAGE SQL;
+
+-- A stable subspace: the cardinality changes once.
+SET aqo.adaptive_learning = 'off';
+SELECT * FROM replay('{5,5,5,8,8,8,8,8,8}');
+SET aqo.adaptive_learning = 'on';
+SELECT * FROM replay('{5,5,5,8,8,8,8,8,8}');
+
+-- A noisy subspace: the prediction converges to the mean without a bias.
+SET aqo.adaptive_learning = 'off';
+SELECT * FROM replay('{4,6,4,6,4,6,4,6,4,6}');
+SET aqo.adaptive_learning = 'on';
+SELECT * FROM replay('{4,6,4,6,4,6,4,6,4,6}');
+
+-- Features must be a matrix with a row for each target
+SELECT * FROM aqo_learning_replay('{{0},{0}}', '{1}');
+
+RESET aqo.adaptive_learning;
+DROP FUNCTION replay;
+DROP EXTENSION aqo;
@@ -0,0 +1,39 @@
+-- Check the admission filter for new query classes
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE adm AS SELECT x FROM generate_series(1,100) AS x;
+ANALYZE adm;
+
+SET aqo.mode = 'learn';
+SET aqo.admission_threshold = 3;
+
+-- Two plannings isn't enough to add the class into the knowledge base
+SELECT count(*) FROM adm WHERE x < 10;
+SELECT count(*) FROM adm WHERE x < 20;
+SELECT count(*) FROM aqo_query_texts
+WHERE query_text LIKE 'SELECT count(*) FROM adm%'; -- Must be zero
+SELECT count(*) FROM aqo_data; -- Nothing learned
+
+-- The third one admits the class
+SELECT count(*) FROM adm WHERE x < 30;
+SELECT count(*) FROM aqo_query_texts
+WHERE query_text LIKE 'SELECT count(*) FROM adm%'; -- Must be one
+
+-- The forced collection of statistics passes the filter too
+SET aqo.mode = 'controlled';
+SET aqo.force_collect_stat = 'on';
+SELECT count(*) FROM adm WHERE x > 10;
+SELECT count(*) FROM adm WHERE x > 20;
+SELECT count(*) FROM aqo_query_texts
+WHERE query_text LIKE 'SELECT count(*) FROM adm WHERE x >%'; -- Must be zero
+SELECT count(*) FROM adm WHERE x > 30;
+SELECT count(*) FROM aqo_query_texts
+WHERE query_text LIKE 'SELECT count(*) FROM adm WHERE x >%'; -- Must be one
+RESET aqo.force_collect_stat;
+RESET aqo.mode;
+RESET aqo.admission_threshold;
+DROP TABLE adm;
+
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
@@ -0,0 +1,53 @@
+-- Check the Thompson sampling strategy of auto tuning
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE bt AS SELECT x AS a FROM generate_series(1, 100) x;
+ANALYZE bt;
+
+-- Register the class
+SET aqo.mode = 'intelligent';
+SET aqo.auto_tuning_strategy = 'thompson';
+SELECT count(*) FROM bt;
+SELECT queryid AS bt_qid FROM aqo_query_texts
+WHERE query_text = 'SELECT count(*) FROM bt;' \gset
+
+-- Zero budget means no exploration: the best arm is played. Executions with
+-- AQO are faster, and cardinality error is converged.
+SET aqo.auto_tuning_regret_budget = 0;
+SELECT aqo_query_stat_update(:bt_qid,
+  array_fill(0.001::float8, ARRAY[10]), array_fill(0.1::float8, ARRAY[10]),
+  array_fill(0.0001::float8, ARRAY[10]), array_fill(0.0001::float8, ARRAY[10]),
+  array_fill(0::float8, ARRAY[10]), array_fill(0::float8, ARRAY[10]),
+  10, 10);
+SELECT count(*) FROM bt;
+SELECT executions_with_aqo, executions_without_aqo,
+       probability_aqo_is_better > 0.5 AS aqo_better,
+       posterior_time_with_aqo < posterior_time_without_aqo AS faster,
+       auto_tuning_regret > 0 AS regret
+FROM aqo_query_stat WHERE queryid = :bt_qid;
+SELECT learn_aqo, use_aqo, auto_tuning FROM aqo_queries
+WHERE queryid = :bt_qid;
+
+-- Now executions with AQO are slower. The plans were cached: unknown planning
+-- time (-1) doesn't make them look faster.
+SELECT aqo_query_stat_update(:bt_qid,
+  array_fill(0.1::float8, ARRAY[10]), array_fill(0.001::float8, ARRAY[10]),
+  array_fill(-1::float8, ARRAY[10]), array_fill(0.0001::float8, ARRAY[10]),
+  array_fill(0::float8, ARRAY[10]), array_fill(0::float8, ARRAY[10]),
+  10, 10);
+SELECT count(*) FROM bt;
+SELECT executions_with_aqo, executions_without_aqo,
+       probability_aqo_is_better < 0.5 AS aqo_worse,
+       posterior_time_with_aqo > posterior_time_without_aqo AS slower,
+       auto_tuning_regret > 0 AS regret
+FROM aqo_query_stat WHERE queryid = :bt_qid;
+SELECT learn_aqo, use_aqo, auto_tuning FROM aqo_queries
+WHERE queryid = :bt_qid;
+
+RESET aqo.auto_tuning_regret_budget;
+RESET aqo.auto_tuning_strategy;
+RESET aqo.mode;
+DROP TABLE bt;
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
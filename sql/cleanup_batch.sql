@@ -0,0 +1,35 @@
+-- Check the cleanup, made by batches of relations
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE cb_t1 AS SELECT x FROM generate_series(1, 100) x;
+CREATE TABLE cb_t2 AS SELECT x FROM generate_series(1, 100) x;
+CREATE TABLE cb_t3 AS SELECT x FROM generate_series(1, 100) x;
+ANALYZE cb_t1, cb_t2, cb_t3;
+SELECT 'cb_t1'::regclass::oid AS t1_oid, 'cb_t2'::regclass::oid AS t2_oid,
+	'cb_t3'::regclass::oid AS t3_oid \gset
+
+SET aqo.mode = 'learn';
+SELECT count(*) FROM cb_t1 WHERE x < 10;
+SELECT count(*) FROM cb_t2 WHERE x < 10;
+SELECT count(*) FROM cb_t3 WHERE x < 10;
+SELECT count(*) FROM cb_t1, cb_t2 WHERE cb_t1.x = cb_t2.x AND cb_t1.x < 10;
+RESET aqo.mode;
+SELECT count(*) FROM aqo_queries;
+
+-- Each step of the cleanup checks a single relation
+SET aqo.cleanup_batch_size = 1;
+DROP TABLE cb_t1, cb_t3;
+SELECT nfs FROM aqo_cleanup();
+
+SELECT count(*) FROM aqo_data WHERE :t1_oid = ANY(oids) OR :t3_oid = ANY(oids);
+SELECT count(*) > 0 AS kept FROM aqo_data WHERE :t2_oid = ANY(oids);
+SELECT count(*) FROM aqo_queries;
+
+-- Nothing to do at the next pass
+SELECT * FROM aqo_cleanup();
+
+RESET aqo.cleanup_batch_size;
+DROP TABLE cb_t2;
+SELECT true AS success FROM aqo_cleanup();
+DROP EXTENSION aqo;
@@ -0,0 +1,32 @@
+-- Check confidence of predictions and blending with the planner's estimate
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE cf_t AS SELECT x % 10 AS x FROM generate_series(1, 1000) x;
+ANALYZE cf_t;
+
+SET aqo.mode = 'learn';
+SET aqo.show_details = 'on';
+SET aqo.show_hash = 'off';
+SET aqo.min_neighbors_for_predicting = 1;
+
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF)
+SELECT * FROM cf_t WHERE x < 2;
+
+-- The only neighbour is far away: the prediction is close to the estimate
+SET aqo.confidence_threshold = 0.5;
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF)
+SELECT * FROM cf_t WHERE x < 6;
+
+-- The nearest neighbour is exact
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF)
+SELECT * FROM cf_t WHERE x < 2;
+
+RESET aqo.confidence_threshold;
+RESET aqo.min_neighbors_for_predicting;
+RESET aqo.show_hash;
+RESET aqo.show_details;
+RESET aqo.mode;
+DROP TABLE cf_t;
+SELECT true AS success FROM aqo_cleanup();
+DROP EXTENSION aqo;
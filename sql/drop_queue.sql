@@ -0,0 +1,47 @@
+-- Check the cleanup of the knowledge by the maintenance worker
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE dq_t1 AS SELECT x FROM generate_series(1, 100) x;
+CREATE TABLE dq_t2 AS SELECT x FROM generate_series(1, 100) x;
+ANALYZE dq_t1, dq_t2;
+SELECT 'dq_t1'::regclass::oid AS t1_oid, 'dq_t2'::regclass::oid AS t2_oid \gset
+
+-- Wait until the worker removes the knowledge of the relation
+CREATE FUNCTION dq_wait(rel oid) RETURNS bool AS $$
+DECLARE
+	endtime timestamptz := clock_timestamp() + interval '60 seconds';
+BEGIN
+	WHILE EXISTS (SELECT 1 FROM aqo_data WHERE rel = ANY(oids)) LOOP
+		IF clock_timestamp() > endtime THEN
+			RETURN false;
+		END IF;
+		PERFORM pg_sleep(0.01);
+	END LOOP;
+	RETURN true;
+END;
+$$ LANGUAGE PLPGSQL;
+
+SET aqo.mode = 'learn';
+SELECT count(*) FROM dq_t1 WHERE x < 10;
+SELECT count(*) FROM dq_t2 WHERE x < 10;
+RESET aqo.mode;
+SELECT count(*) > 0 AS learned FROM aqo_data WHERE :t1_oid = ANY(oids);
+
+SET aqo.cleanup_bgworker = 'on';
+
+-- The rolled back drop isn't passed to the worker
+BEGIN;
+DROP TABLE dq_t2;
+ROLLBACK;
+
+-- The queue is processed in order: a queued rolled back drop is done by now
+DROP TABLE dq_t1;
+SELECT dq_wait(:t1_oid);
+SELECT count(*) > 0 AS kept FROM aqo_data WHERE :t2_oid = ANY(oids);
+
+RESET aqo.cleanup_bgworker;
+DROP FUNCTION dq_wait;
+DROP TABLE dq_t2;
+SELECT true AS success FROM aqo_cleanup();
+DROP EXTENSION aqo;
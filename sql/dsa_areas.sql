@@ -0,0 +1,34 @@
+-- Check separate DSA areas of query texts and ML data
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE da_t AS SELECT x FROM generate_series(1, 100) x;
+ANALYZE da_t;
+
+-- Overflow the area of query texts (20MB by default) by 1MB texts
+SET aqo.querytext_max_size = 1048576;
+SELECT count(*) FILTER (WHERE stored) AS stored
+FROM (SELECT aqo_query_texts_update(i, i || repeat('x', 1000000)) AS stored
+	FROM generate_series(1, 30) AS i) AS s;
+
+-- The least recently used texts are evicted to make room for the new ones
+SELECT count(*) < 30 AS evicted FROM aqo_query_texts WHERE queryid > 0;
+SELECT length(query_text) FROM aqo_query_texts WHERE queryid = 30;
+SELECT allocated_size <= 20 * 1024 * 1024 AS limited
+FROM aqo_dsa_usage() WHERE name = 'AQO Query Texts DSA';
+
+-- Learning isn't affected by the full area of query texts
+SET aqo.mode = 'learn';
+SELECT count(*) FROM da_t WHERE x < 10;
+RESET aqo.mode;
+SELECT count(*) > 0 AS learned FROM aqo_data
+WHERE 'da_t'::regclass::oid = ANY(oids);
+
+-- Sizes are shown as bigint
+SELECT DISTINCT pg_typeof(allocated_size), pg_typeof(used_size)
+FROM aqo_memory_usage();
+
+RESET aqo.querytext_max_size;
+DROP TABLE da_t;
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
@@ -0,0 +1,40 @@
+-- Check the learning of parallel workers, launched by Gather nodes
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE gw_t AS SELECT x FROM generate_series(1, 10000) x;
+ANALYZE gw_t;
+
+SET aqo.mode = 'learn';
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+
+-- Gather can't launch any worker
+SET max_parallel_workers = 0;
+
+EXPLAIN (COSTS OFF) SELECT count(*) FROM gw_t;
+SELECT count(*) FROM gw_t;
+SELECT workers_planned, workers_launched, launch_rate FROM aqo_query_workers;
+
+-- By default AQO doesn't change the plan
+EXPLAIN (COSTS OFF) SELECT count(*) FROM gw_t;
+
+-- Plan the query class for the workers it actually gets
+SET aqo.auto_tuning_parallel_workers = 'on';
+EXPLAIN (COSTS OFF) SELECT count(*) FROM gw_t;
+SHOW max_parallel_workers_per_gather;
+
+RESET aqo.auto_tuning_parallel_workers;
+RESET max_parallel_workers;
+RESET max_parallel_workers_per_gather;
+RESET min_parallel_table_scan_size;
+RESET parallel_tuple_cost;
+RESET parallel_setup_cost;
+RESET aqo.mode;
+SELECT true AS success FROM aqo_reset();
+SELECT count(*) FROM aqo_query_workers;
+
+DROP TABLE gw_t;
+DROP EXTENSION aqo;
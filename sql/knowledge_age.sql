@@ -0,0 +1,31 @@
+-- Check usage accounting and expiry of the AQO knowledge
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE ka AS SELECT x FROM generate_series(1,100) AS x;
+ANALYZE ka;
+
+SET aqo.mode = 'learn';
+SELECT count(*) FROM ka WHERE x < 10;
+SELECT count(*) FROM ka WHERE x < 20;
+
+-- The class and its data were used just now
+SELECT store, sum(entries) > 0 AS used, sum(hits) > 0 AS hit
+FROM aqo_knowledge_age
+WHERE age = '1 hour' AND store IN ('queries', 'data')
+GROUP BY store ORDER BY store;
+
+-- Nothing to expire
+SELECT * FROM aqo_expire('1 hour');
+SELECT count(*) > 0 AS has_data FROM aqo_data;
+
+-- Negative interval expires all the knowledge except the default class
+SELECT nfs, nfss > 0 AS removed FROM aqo_expire('-1 hour');
+SELECT count(*) FROM aqo_data;
+SELECT queryid, fs FROM aqo_queries;
+SELECT queryid FROM aqo_query_texts;
+
+DROP TABLE ka;
+
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
@@ -0,0 +1,86 @@
+-- Check decay of the knowledge, which has become stale
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE kd_t1 (x int) WITH (autovacuum_enabled = off);
+INSERT INTO kd_t1 SELECT x % 10 FROM generate_series(1, 1000) x;
+ANALYZE kd_t1;
+CREATE TABLE kd_t2 (x int) WITH (autovacuum_enabled = off);
+INSERT INTO kd_t2 SELECT x % 10 FROM generate_series(1, 1000) x;
+ANALYZE kd_t2;
+
+-- Distinct reliabilities of the samples, learned on the relation
+CREATE FUNCTION kd_reliability(rel regclass) RETURNS SETOF double precision AS $$
+	SELECT DISTINCT unnest(reliability) FROM aqo_data
+	WHERE rel::oid = ANY(oids) ORDER BY 1;
+$$ LANGUAGE SQL;
+
+SET aqo.mode = 'learn';
+SET aqo.knowledge_drift_threshold = 1.0;
+SET aqo.knowledge_drift_decay = 0.5;
+
+SELECT count(*) FROM kd_t1 WHERE x < 5;
+SELECT count(*) FROM kd_t1 WHERE x < 5;
+SELECT count(*) FROM kd_t1 WHERE x < 5;
+SELECT count(*) FROM kd_t1 WHERE x < 5;
+SELECT count(*) FROM kd_t2 WHERE x < 5;
+SELECT count(*) FROM kd_t2 WHERE x < 5;
+SELECT * FROM kd_reliability('kd_t1');
+SELECT * FROM kd_reliability('kd_t2');
+
+-- The cardinality error jumps after a load without ANALYZE
+SET aqo.mode = 'disabled';
+INSERT INTO kd_t1 SELECT x % 10 FROM generate_series(1, 9000) x;
+SET aqo.mode = 'learn';
+SELECT count(*) FROM kd_t1 WHERE x < 5;
+SELECT * FROM kd_reliability('kd_t1');
+SELECT * FROM kd_reliability('kd_t2');
+
+-- ANALYZE sees the bulk load. Knowledge of other relations is kept
+SET aqo.mode = 'disabled';
+INSERT INTO kd_t2 SELECT x % 10 FROM generate_series(1, 9000) x;
+SET aqo.mode = 'learn';
+ANALYZE kd_t2;
+SELECT * FROM kd_reliability('kd_t1');
+SELECT * FROM kd_reliability('kd_t2');
+
+-- Small changes don't make the knowledge stale
+SET aqo.mode = 'disabled';
+INSERT INTO kd_t2 SELECT x % 10 FROM generate_series(1, 1000) x;
+SET aqo.mode = 'learn';
+ANALYZE kd_t2;
+SELECT * FROM kd_reliability('kd_t2');
+
+-- Zero decay removes the stale knowledge
+SET aqo.knowledge_drift_decay = 0.0;
+SET aqo.mode = 'disabled';
+DELETE FROM kd_t2 WHERE x > 0;
+SET aqo.mode = 'learn';
+VACUUM ANALYZE kd_t2;
+SELECT * FROM kd_reliability('kd_t2');
+SELECT * FROM kd_reliability('kd_t1');
+
+-- ANALYZE of a partitioned table sees the bulk load into its partition
+SET aqo.knowledge_drift_decay = 0.5;
+SET aqo.mode = 'disabled';
+CREATE TABLE kd_p (x int) PARTITION BY RANGE (x);
+CREATE TABLE kd_c PARTITION OF kd_p FOR VALUES FROM (0) TO (10)
+	WITH (autovacuum_enabled = off);
+INSERT INTO kd_p SELECT x % 10 FROM generate_series(1, 1000) x;
+ANALYZE kd_p;
+SET aqo.mode = 'learn';
+SELECT count(*) FROM kd_c WHERE x < 5;
+SELECT * FROM kd_reliability('kd_c');
+SET aqo.mode = 'disabled';
+INSERT INTO kd_p SELECT x % 10 FROM generate_series(1, 9000) x;
+SET aqo.mode = 'learn';
+ANALYZE kd_p;
+SELECT * FROM kd_reliability('kd_c');
+
+RESET aqo.knowledge_drift_decay;
+RESET aqo.knowledge_drift_threshold;
+RESET aqo.mode;
+DROP FUNCTION kd_reliability;
+DROP TABLE kd_t1, kd_t2, kd_p;
+SELECT true AS success FROM aqo_cleanup();
+DROP EXTENSION aqo;
@@ -0,0 +1,45 @@
+-- Check histograms of execution and planning time of query classes
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE lh AS SELECT x AS a FROM generate_series(1, 100) x;
+ANALYZE lh;
+
+SET aqo.mode = 'learn';
+SELECT count(*) FROM lh WHERE a < 10;
+SELECT count(*) FROM lh WHERE a < 10;
+SET aqo.mode = 'disabled';
+
+-- Percentiles of time are collected for each execution
+SELECT use_aqo, nexecs, exec_p50 > 0 AND exec_p50 <= exec_p99 AS valid
+FROM aqo_query_latency WHERE queryid = (
+  SELECT queryid FROM aqo_query_texts
+  WHERE query_text LIKE 'SELECT count(*) FROM lh WHERE a < 10;');
+
+-- Planning time of cached plans is unknown (-1). It doesn't get into the
+-- histogram.
+SELECT aqo_query_stat_update(42,
+  '{}', '{0.001, 0.002, 0.003}', '{}', '{-1, -1, 0.0005}', '{}', '{1, 1, 1}',
+  0, 3);
+SELECT use_aqo, nexecs, plan_p50 > 0.0001 AND plan_p50 < 0.001 AS plan_known,
+       exec_p50 > 0.001 AND exec_p50 < 0.003 AS exec_median
+FROM aqo_query_latency WHERE queryid = 42;
+
+-- Old executions decay: the histogram doesn't grow infinitely
+SET aqo.mode = 'learn';
+DO $$
+BEGIN
+  FOR i IN 1..1100 LOOP
+    EXECUTE 'SELECT count(*) FROM lh WHERE a < 20';
+  END LOOP;
+END $$;
+SET aqo.mode = 'disabled';
+SELECT use_aqo, nexecs > 0 AND nexecs < 1000 AS decayed
+FROM aqo_query_latency WHERE queryid = (
+  SELECT queryid FROM aqo_query_texts
+  WHERE query_text = 'SELECT count(*) FROM lh WHERE a < 20');
+
+RESET aqo.mode;
+DROP TABLE lh;
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
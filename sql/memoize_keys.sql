@@ -0,0 +1,50 @@
+-- Check the learning of distinct cache keys of Memoize nodes
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+-- The planner believes in 10 distinct keys, there are 100 ones
+CREATE TABLE mk_outer AS SELECT x, x % 100 AS b FROM generate_series(1, 10000) x;
+ALTER TABLE mk_outer ALTER COLUMN b SET (n_distinct = 10);
+CREATE TABLE mk_inner AS SELECT x AS a FROM generate_series(1, 1000) x;
+CREATE INDEX mk_inner_a_idx ON mk_inner (a);
+ANALYZE mk_outer, mk_inner;
+
+-- Returns the cost of the join, which rescans the Memoize node. NULL, if the
+-- plan has no Memoize node.
+CREATE FUNCTION mk_join_cost() RETURNS double precision AS $$
+DECLARE
+  plan jsonb;
+BEGIN
+  EXECUTE 'EXPLAIN (FORMAT JSON)
+    SELECT count(*) FROM mk_outer JOIN mk_inner ON mk_inner.a = mk_outer.b'
+  INTO plan;
+  IF NOT jsonb_path_exists(plan, '$.** ? (@."Node Type" == "Memoize")') THEN
+    RETURN NULL;
+  END IF;
+  RETURN jsonb_path_query_first(plan,
+    '$.** ? (@."Node Type" == "Nested Loop")."Total Cost"')::double precision;
+END;
+$$ LANGUAGE plpgsql;
+
+SET aqo.mode = 'learn';
+SET enable_hashjoin = 'off';
+SET enable_mergejoin = 'off';
+
+SELECT mk_join_cost() AS cost_before \gset
+SELECT :cost_before > 0 AS memoized;
+SELECT count(*) FROM mk_outer JOIN mk_inner ON mk_inner.a = mk_outer.b;
+
+-- The number of distinct keys is learned
+SELECT count(*) FROM aqo_data
+WHERE nfeatures = 0 AND 100 = ANY (SELECT round(exp(t)) FROM unnest(targets) t);
+
+-- More keys mean more cache misses: the rescans are more expensive now
+SELECT mk_join_cost() > :cost_before AS learned;
+
+RESET enable_mergejoin;
+RESET enable_hashjoin;
+RESET aqo.mode;
+DROP FUNCTION mk_join_cost;
+DROP TABLE mk_outer, mk_inner;
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
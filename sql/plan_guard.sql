@@ -0,0 +1,58 @@
+-- Check the plan regression guard
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE pg_t AS SELECT x FROM generate_series(1, 100) x;
+SET aqo.mode = 'learn';
+SET aqo.plan_regression_threshold = 0.5;
+
+SELECT count(*) FROM pg_t WHERE x < 10;
+SELECT count(*) FROM pg_t WHERE x < 10;
+SELECT count(*) FROM pg_t WHERE x < 10;
+
+-- The only plan of the class is the good one
+SELECT executions, is_good, pin_left
+FROM aqo_query_plans WHERE executions >= 3;
+
+-- EXPLAIN without execution isn't taken into account
+DO $$ BEGIN EXECUTE 'EXPLAIN SELECT count(*) FROM pg_t WHERE x < 10'; END $$;
+SELECT executions FROM aqo_query_plans WHERE executions >= 3;
+
+-- A plan, forced by the settings, is much slower than the good one
+CREATE TABLE pg_a AS SELECT x FROM generate_series(1, 2000) x;
+CREATE TABLE pg_b AS SELECT x FROM generate_series(1, 2000) x;
+ANALYZE pg_a, pg_b;
+SELECT count(*) FROM pg_a JOIN pg_b USING (x);
+SELECT count(*) FROM pg_a JOIN pg_b USING (x);
+SELECT count(*) FROM pg_a JOIN pg_b USING (x);
+SELECT queryid AS join_qid FROM aqo_query_texts
+WHERE query_text = 'SELECT count(*) FROM pg_a JOIN pg_b USING (x);' \gset
+
+SET enable_hashjoin = 'off';
+SET enable_mergejoin = 'off';
+SET enable_memoize = 'off';
+SELECT count(*) FROM pg_a JOIN pg_b USING (x);
+SELECT count(*) FROM pg_a JOIN pg_b USING (x);
+SELECT count(*) FROM pg_a JOIN pg_b USING (x);
+
+-- The slow plan regressed: the class is pinned to the good plan, statistics
+-- of the slow plan start from scratch
+SELECT executions, is_good, pin_left > 0 AS pinned
+FROM aqo_query_plans WHERE queryid = :join_qid ORDER BY is_good DESC;
+
+-- The pinned class is planned with the snapshot and executes the good plan
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+RESET enable_memoize;
+SELECT count(*) FROM pg_a JOIN pg_b USING (x);
+SELECT executions, is_good, pin_left
+FROM aqo_query_plans WHERE queryid = :join_qid ORDER BY is_good DESC;
+DROP TABLE pg_a, pg_b;
+
+RESET aqo.plan_regression_threshold;
+RESET aqo.mode;
+SELECT true AS success FROM aqo_reset();
+SELECT count(*) FROM aqo_query_plans;
+
+DROP TABLE pg_t;
+DROP EXTENSION aqo;
@@ -46,4 +46,53 @@ SELECT * FROM f1();
 DROP FUNCTION f1;
 DROP TABLE test CASCADE;
 
+-- Cached generic plan is invalidated, when AQO learns a prediction, which
+-- differs much from the estimation used in the plan.
+CREATE TABLE test2 AS
+  SELECT CASE WHEN x <= 100 THEN 1 ELSE x END AS x
+  FROM generate_series(1,1000) AS x;
+ANALYZE test2;
+
+SET aqo.mode = 'learn';
+-- Any change of a prediction is at least by the factor 1
+SET aqo.plan_invalidation_factor = 0.5;
+SET aqo.plan_invalidation_factor = 2;
+SET plan_cache_mode = 'force_generic_plan';
+PREPARE barplan (int) AS SELECT count(*) FROM test2 WHERE x = $1;
+EXECUTE barplan(1);
+EXECUTE barplan(1);
+EXECUTE barplan(1);
+
+-- The plan was built, reused and built again with the new knowledge
+SELECT (SELECT array_agg(pt > 0) FROM unnest(planning_time_with_aqo) pt)
+  AS planned
+FROM aqo_query_stat s JOIN aqo_query_texts t USING (queryid)
+WHERE query_text LIKE '%FROM test2 WHERE x%';
+
+DEALLOCATE barplan;
+RESET plan_cache_mode;
+RESET aqo.plan_invalidation_factor;
+DROP TABLE test2;
+
+-- Choice between custom and generic plans starts with a few executions of
+-- each kind. The first generic execution builds the plan.
+CREATE TABLE test3 AS SELECT x FROM generate_series(1,10) AS x;
+ANALYZE test3;
+SET aqo.auto_tuning_plan_cache = 'on';
+PREPARE bazplan (int) AS SELECT count(*) FROM test3 WHERE x = $1;
+DO $$ BEGIN
+  FOR i IN 1..11 LOOP
+    EXECUTE 'EXECUTE bazplan(1)';
+  END LOOP;
+END $$;
+
+SELECT (SELECT array_agg(pt > 0) FROM unnest(planning_time_with_aqo) pt)
+  AS planned
+FROM aqo_query_stat s JOIN aqo_query_texts t USING (queryid)
+WHERE query_text LIKE '%FROM test3 WHERE x%';
+
+DEALLOCATE bazplan;
+RESET aqo.auto_tuning_plan_cache;
+DROP TABLE test3;
+
 DROP EXTENSION aqo;
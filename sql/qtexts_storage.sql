@@ -0,0 +1,26 @@
+-- Check compression and deduplication of query texts
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+SET aqo.querytext_compression = 'on';
+
+-- The same long text of two classes
+SELECT aqo_query_texts_update(1, repeat('SELECT 1; ', 50));
+SELECT aqo_query_texts_update(2, repeat('SELECT 1; ', 50));
+
+-- Texts are restored as is
+SELECT queryid, query_text = repeat('SELECT 1; ', 50) AS equal
+FROM aqo_query_texts WHERE queryid > 0 ORDER BY queryid;
+
+-- The text is compressed and stored once
+SELECT used_size < 100 AS compressed
+FROM aqo_dsa_usage() WHERE name = 'AQO Query Texts DSA';
+
+-- Released text doesn't break storing of the same one
+SELECT true AS success FROM aqo_reset();
+SELECT aqo_query_texts_update(3, repeat('SELECT 1; ', 50));
+SELECT queryid, length(query_text) FROM aqo_query_texts ORDER BY queryid;
+
+RESET aqo.querytext_compression;
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
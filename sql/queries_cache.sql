@@ -0,0 +1,45 @@
+-- Check the backend-local cache of the query class settings
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE qc_t AS SELECT x FROM generate_series(1, 100) x;
+ANALYZE qc_t;
+
+-- Number of samples, learned on the relation
+CREATE FUNCTION qc_samples() RETURNS bigint AS $$
+	SELECT coalesce(sum(cardinality(targets)), 0) FROM aqo_data
+	WHERE nfeatures > 0 AND 'qc_t'::regclass::oid = ANY(oids);
+$$ LANGUAGE SQL;
+
+-- The absent class is cached, nothing is learned
+SET aqo.mode = 'controlled';
+SELECT count(*) FROM qc_t WHERE x < 10;
+SELECT qc_samples();
+
+SET aqo.mode = 'learn';
+SELECT count(*) FROM qc_t WHERE x < 10;
+SELECT qc_samples();
+
+-- The new class is visible through the cache
+SET aqo.mode = 'controlled';
+SELECT count(*) FROM qc_t WHERE x < 50;
+SELECT qc_samples();
+
+-- Changes of the settings are visible too
+SELECT count(*) FROM aqo_query_texts AS t,
+	LATERAL aqo_queries_update(t.queryid, NULL, false, false, false)
+WHERE t.query_text LIKE 'SELECT count(*) FROM qc_t%';
+SELECT count(*) FROM qc_t WHERE x < 90;
+SELECT qc_samples();
+
+SELECT count(*) FROM aqo_query_texts AS t,
+	LATERAL aqo_queries_update(t.queryid, NULL, true, false, false)
+WHERE t.query_text LIKE 'SELECT count(*) FROM qc_t%';
+SELECT count(*) FROM qc_t WHERE x < 90;
+SELECT qc_samples();
+
+RESET aqo.mode;
+DROP FUNCTION qc_samples;
+DROP TABLE qc_t;
+SELECT true AS success FROM aqo_cleanup();
+DROP EXTENSION aqo;
@@ -0,0 +1,30 @@
+-- Check the learning of buffer cache behaviour of relations
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE rio_t AS SELECT x FROM generate_series(1, 10000) x;
+ANALYZE rio_t;
+SET aqo.mode = 'learn';
+
+-- Nothing is learned by default
+SELECT count(*) FROM rio_t WHERE x < 10;
+SELECT count(*) FROM aqo_relation_io;
+
+SET aqo.relation_io = 'on';
+SELECT count(*) FROM rio_t WHERE x < 10;
+SELECT count(*) FROM rio_t WHERE x < 10;
+SELECT count(*) FROM rio_t WHERE x < 10;
+SELECT access, scans, hits + reads > 0 AS blocks
+FROM aqo_relation_io WHERE relid = 'rio_t'::regclass;
+
+-- EXPLAIN without execution isn't taken into account
+EXPLAIN (COSTS OFF) SELECT count(*) FROM rio_t WHERE x < 10;
+SELECT scans FROM aqo_relation_io WHERE relid = 'rio_t'::regclass;
+
+RESET aqo.relation_io;
+RESET aqo.mode;
+SELECT true AS success FROM aqo_reset();
+SELECT count(*) FROM aqo_relation_io;
+
+DROP TABLE rio_t;
+DROP EXTENSION aqo;
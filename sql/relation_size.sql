@@ -0,0 +1,63 @@
+-- Check predictions relative to sizes of relations
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE rs_t AS SELECT x % 10 AS x FROM generate_series(1, 1000) x;
+ANALYZE rs_t;
+
+SET aqo.mode = 'learn';
+SET aqo.show_details = 'on';
+SET aqo.show_hash = 'off';
+SET aqo.min_neighbors_for_predicting = 1;
+SET aqo.relation_size_aware = 'on';
+
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF)
+SELECT * FROM rs_t WHERE x = 5;
+
+-- The table grows four times. AQO predicts it without relearning.
+INSERT INTO rs_t SELECT x % 10 FROM generate_series(1, 3000) x;
+ANALYZE rs_t;
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF)
+SELECT * FROM rs_t WHERE x = 5;
+
+-- Groups of an aggregate are predicted over the size aware subspace
+CREATE FUNCTION rs_expln(query_string text) RETURNS SETOF text AS $$
+BEGIN
+    RETURN QUERY
+        EXECUTE format('EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF) %s', query_string);
+    RETURN;
+END;
+$$ LANGUAGE PLPGSQL;
+SELECT str AS result FROM rs_expln('SELECT x FROM rs_t WHERE x > 5 GROUP BY x')
+AS str WHERE str LIKE '%AQO%';
+SELECT str AS result FROM rs_expln('SELECT x FROM rs_t WHERE x > 5 GROUP BY x')
+AS str WHERE str LIKE '%AQO%';
+
+-- A function scan or a temporary table has no known size: learn absolute
+-- cardinalities for such objects.
+CREATE TEMP TABLE rs_tmp AS SELECT x % 10 AS x FROM generate_series(1, 100) x;
+ANALYZE rs_tmp;
+SELECT str AS result FROM rs_expln('SELECT * FROM generate_series(1, 100) g WHERE g > 10')
+AS str WHERE str LIKE '%AQO%';
+SELECT str AS result FROM rs_expln('SELECT * FROM generate_series(1, 100) g WHERE g > 10')
+AS str WHERE str LIKE '%AQO%';
+SELECT str AS result FROM rs_expln('SELECT * FROM rs_tmp WHERE x = 5')
+AS str WHERE str LIKE '%AQO%';
+SELECT str AS result FROM rs_expln('SELECT * FROM rs_tmp WHERE x = 5')
+AS str WHERE str LIKE '%AQO%';
+DROP TABLE rs_tmp;
+DROP FUNCTION rs_expln;
+
+-- The size aware knowledge is kept apart from the absolute one
+SET aqo.relation_size_aware = 'off';
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF)
+SELECT * FROM rs_t WHERE x = 5;
+
+RESET aqo.relation_size_aware;
+RESET aqo.min_neighbors_for_predicting;
+RESET aqo.show_hash;
+RESET aqo.show_details;
+RESET aqo.mode;
+DROP TABLE rs_t;
+SELECT true AS success FROM aqo_cleanup();
+DROP EXTENSION aqo;
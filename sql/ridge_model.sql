@@ -0,0 +1,72 @@
+-- Check the ridge regression model of feature subspaces
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+-- The planner underestimates correlated columns
+CREATE TABLE rm_knn AS SELECT x, x AS y FROM generate_series(1, 1000) x;
+CREATE TABLE rm_ridge AS SELECT x, x AS y FROM generate_series(1, 1000) x;
+ANALYZE rm_knn, rm_ridge;
+
+-- Returns prediction of AQO for the lowest node of the plan
+CREATE FUNCTION aqo_prediction(query text) RETURNS integer AS $$
+DECLARE
+  line text;
+  prediction integer;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF) ' || query
+  LOOP
+    IF line ~ 'AQO: rows=' THEN
+      prediction := substring(line FROM 'AQO: rows=(\d+)')::integer;
+    END IF;
+  END LOOP;
+  RETURN prediction;
+END;
+$$ LANGUAGE plpgsql;
+
+SET aqo.mode = 'learn';
+SET aqo.show_details = 'on';
+
+SET aqo.model = 'knn';
+SELECT count(*) FROM rm_knn WHERE x < 50 AND y < 50;
+SELECT count(*) FROM rm_knn WHERE x < 100 AND y < 100;
+SELECT count(*) FROM rm_knn WHERE x < 200 AND y < 200;
+SELECT count(*) FROM rm_knn WHERE x < 400 AND y < 400;
+
+SET aqo.model = 'ridge';
+SELECT count(*) FROM rm_ridge WHERE x < 50 AND y < 50;
+SELECT count(*) FROM rm_ridge WHERE x < 100 AND y < 100;
+SELECT count(*) FROM rm_ridge WHERE x < 200 AND y < 200;
+SELECT count(*) FROM rm_ridge WHERE x < 400 AND y < 400;
+
+-- Subspaces keep their models
+RESET aqo.model;
+SELECT model, nfeatures, array_length(payload, 1) AS payload_size
+FROM aqo_data WHERE nfeatures > 0 ORDER BY model;
+
+-- The ridge model extrapolates to a range, which wasn't seen yet
+SELECT abs(ridge - 799) < abs(knn - 799) AS ridge_is_closer FROM
+  aqo_prediction('SELECT count(*) FROM rm_knn WHERE x < 800 AND y < 800') AS knn,
+  aqo_prediction('SELECT count(*) FROM rm_ridge WHERE x < 800 AND y < 800') AS ridge;
+
+-- The payload is exported and imported with the rest of the data
+RESET aqo.mode;
+CREATE TABLE rm_dump AS SELECT * FROM aqo_data;
+SELECT true AS success FROM aqo_reset();
+SELECT count(*) = (SELECT count(*) FROM rm_dump) AS all_restored FROM rm_dump,
+  LATERAL aqo_data_update(fs, fss, nfeatures, features, targets, reliability,
+                          oids, model, payload) AS ret
+WHERE ret;
+SELECT count(*) FROM
+  ((TABLE rm_dump EXCEPT TABLE aqo_data)
+   UNION ALL
+   (TABLE aqo_data EXCEPT TABLE rm_dump)) AS q;
+
+-- Payload must fit the model
+SELECT aqo_data_update(1, 1, 1, '{{1}}', '{1}', '{1}', '{1}', 'ridge', '{1}');
+SELECT aqo_data_update(1, 1, 1, '{{1}}', '{1}', '{1}', '{1}', 'unknown');
+
+RESET aqo.show_details;
+DROP FUNCTION aqo_prediction;
+DROP TABLE rm_dump, rm_knn, rm_ridge;
+SELECT true AS success FROM aqo_reset();
+DROP EXTENSION aqo;
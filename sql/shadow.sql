@@ -0,0 +1,42 @@
+-- Check predictions made in the shadow of the planner's estimates
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+-- The planner underestimates correlated columns
+CREATE TABLE sh_t AS SELECT x % 10 AS x, x % 10 AS y
+	FROM generate_series(1, 1000) x;
+ANALYZE sh_t;
+
+SET aqo.mode = 'learn';
+SET aqo.show_details = 'on';
+SET aqo.show_hash = 'off';
+SELECT count(*) FROM sh_t WHERE x < 2 AND y < 2;
+
+-- Keep learning, but plan the query class with the native estimates
+SELECT count(*) FROM aqo_query_texts AS t,
+	LATERAL aqo_queries_update(t.queryid, NULL, true, false, false)
+WHERE t.query_text LIKE '%FROM sh_t WHERE%';
+
+SET aqo.shadow_mode = 'on';
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF)
+SELECT count(*) FROM sh_t WHERE x < 2 AND y < 2;
+
+-- The prediction would be better than the planner's estimate
+SELECT nodes, error_aqo < error_native AS aqo_is_better
+FROM aqo_shadow_stat;
+SELECT count(*) AS nfss, bool_and(error_aqo < error_native) AS aqo_is_better
+FROM aqo_shadow_data;
+
+-- Nothing is accounted without the shadow mode
+RESET aqo.shadow_mode;
+SELECT count(*) FROM sh_t WHERE x < 2 AND y < 2;
+SELECT nodes FROM aqo_shadow_stat;
+
+SELECT true AS success FROM aqo_reset();
+SELECT count(*) FROM aqo_shadow_data;
+
+RESET aqo.show_hash;
+RESET aqo.show_details;
+RESET aqo.mode;
+DROP TABLE sh_t;
+DROP EXTENSION aqo;
@@ -202,6 +202,14 @@ SELECT aqo_data_update(1, 1, 1, '{{1}}', '{1, 1}', '{1}', '{1, 2, 3}');
 SELECT aqo_data_update(1, 1, 1, '{{1}}', '{1}', '{1, 1}', '{1, 2, 3}');
 SELECT aqo_data_update(1, 1, 1, '{{1}, {2}}', '{1}', '{1}', '{1, 2, 3}');
 
+-- Explicit JIT setting of a query class.
+SELECT aqo_queries_update(42, 42, false, false, false);
+SELECT aqo_set_class_jit(42, false);
+SELECT queryid, jit FROM aqo_queries WHERE queryid = 42;
+SELECT aqo_set_class_jit(42, NULL);
+SELECT queryid, jit FROM aqo_queries WHERE queryid = 42;
+SELECT aqo_set_class_jit(43, true); -- unknown class
+
 SET aqo.mode='disabled';
 
 DROP EXTENSION aqo CASCADE;
@@ -0,0 +1,79 @@
+-- Check the learning of work_mem for plan nodes spilled to disk
+CREATE EXTENSION IF NOT EXISTS aqo;
+SELECT true AS success FROM aqo_reset();
+
+CREATE TABLE wm_t AS SELECT x FROM generate_series(1, 100000) x;
+ANALYZE wm_t;
+
+-- Execute the query and check whether the sort spilled to disk
+CREATE FUNCTION wm_spilled() RETURNS boolean AS $$
+DECLARE
+  line text;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF)
+    SELECT x FROM wm_t ORDER BY x DESC OFFSET 100000'
+  LOOP
+    IF line LIKE '%Sort Method: external%' THEN
+      RETURN true;
+    END IF;
+  END LOOP;
+  RETURN false;
+END;
+$$ LANGUAGE plpgsql;
+
+SET aqo.mode = 'learn';
+SET work_mem = '64kB';
+
+-- Without the limit AQO doesn't touch work_mem
+SELECT wm_spilled();
+SELECT wm_spilled();
+SELECT spills FROM aqo_query_memory;
+
+-- AQO raises work_mem for the class until the sort fits into memory
+SET aqo.work_mem_limit = '64MB';
+DO $$
+BEGIN
+  FOR i IN 1..5 LOOP
+    EXIT WHEN NOT wm_spilled();
+  END LOOP;
+END $$;
+SELECT wm_spilled();
+SELECT spills >= 2 AS learned, work_mem > 64 AS raised FROM aqo_query_memory;
+
+-- The session setting isn't changed
+SHOW work_mem;
+
+-- AFTER triggers are executed with the work_mem of the query class too
+CREATE TABLE wm_dst (x int);
+CREATE TABLE wm_log (id serial, setting text);
+CREATE FUNCTION wm_log_setting() RETURNS trigger AS $$
+BEGIN
+  INSERT INTO wm_log (setting) VALUES (current_setting('work_mem'));
+  RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+CREATE TRIGGER wm_dst_log AFTER INSERT ON wm_dst
+  FOR EACH STATEMENT EXECUTE FUNCTION wm_log_setting();
+DO $$
+BEGIN
+  FOR i IN 1..5 LOOP
+    EXECUTE 'INSERT INTO wm_dst SELECT x FROM wm_t ORDER BY x DESC OFFSET 100000';
+  END LOOP;
+END $$;
+SELECT setting <> '64kB' AS raised FROM wm_log ORDER BY id DESC LIMIT 1;
+DROP TABLE wm_dst, wm_log;
+DROP FUNCTION wm_log_setting;
+
+-- The raise is bounded by the limit
+SET aqo.work_mem_limit = '64kB';
+SELECT wm_spilled();
+
+RESET aqo.work_mem_limit;
+RESET work_mem;
+RESET aqo.mode;
+SELECT true AS success FROM aqo_reset();
+SELECT count(*) FROM aqo_query_memory;
+
+DROP FUNCTION wm_spilled;
+DROP TABLE wm_t;
+DROP EXTENSION aqo;
@@ -19,12 +19,17 @@
 
 #include <unistd.h>
 
+#include "common/hashfn.h"
+#include "common/pg_lzcompress.h"
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "storage/fd.h"
+#include "utils/timestamp.h"
 
 #include "aqo.h"
 #include "aqo_shared.h"
+#include "hash.h"
 #include "machine_learning.h"
 #include "preprocessing.h"
 #include "storage.h"
@@ -36,46 +41,154 @@
 #define PGAQO_DATA_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/pgaqo_data.stat"
 #define PGAQO_QUERIES_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/pgaqo_queries.stat"
 
+/* Size of the header of AQO storage files, see data_store() */
+#define AQO_FILE_HEADER_SIZE		(3 * sizeof(uint32) + sizeof(long))
+
+/*
+ * Versions of the formats of AQO storage files. Bump the version of a file on
+ * a change of its records: the file of an unknown version is skipped on load,
+ * the other files are still loaded.
+ */
+#define PGAQO_STAT_FILE_VERSION		(1)
+#define PGAQO_TEXT_FILE_VERSION		(1)
+#define PGAQO_DATA_FILE_VERSION		(1)
+#define PGAQO_QUERIES_FILE_VERSION	(1)
+
+/* Kinds of records in the file of query texts */
+#define QTEXT_RECORD_BODY			('B')
+#define QTEXT_RECORD_ENTRY			('Q')
+
+/* Seed of the hash, which checks equality of non-resident texts */
+#define QTEXT_CHECK_SEED			(1)
+
 #define AQO_DATA_COLUMNS			(7)
 #define FormVectorSz(v_name)		(form_vector((v_name), (v_name ## _size)))
 
 
 typedef enum {
 	QUERYID = 0, EXEC_TIME_AQO, EXEC_TIME, PLAN_TIME_AQO, PLAN_TIME,
-	EST_ERROR_AQO, EST_ERROR, NEXECS_AQO, NEXECS, TOTAL_NCOLS
+	EST_ERROR_AQO, EST_ERROR, NEXECS_AQO, NEXECS, POSTERIOR_TIME_AQO,
+	POSTERIOR_TIME, PROB_AQO_BETTER, REGRET, TOTAL_NCOLS
 } aqo_stat_cols;
 
+typedef enum {
+	QL_QUERYID = 0, QL_USE_AQO, QL_NEXECS, QL_EXEC_P50, QL_EXEC_P95,
+	QL_EXEC_P99, QL_PLAN_P50, QL_PLAN_P95, QL_PLAN_P99, QL_TOTAL_NCOLS
+} aqo_latency_cols;
+
+typedef enum {
+	RIO_RELID = 0, RIO_ACCESS, RIO_NSCANS, RIO_HITS, RIO_READS, RIO_HIT_RATIO,
+	RIO_TOTAL_NCOLS
+} aqo_relation_io_cols;
+
+typedef enum {
+	QM_QUERYID = 0, QM_NSPILLS, QM_WORK_MEM, QM_TOTAL_NCOLS
+} aqo_query_memory_cols;
+
+typedef enum {
+	QW_QUERYID = 0, QW_PLANNED, QW_LAUNCHED, QW_LAUNCH_RATE, QW_TOTAL_NCOLS
+} aqo_query_workers_cols;
+
+typedef enum {
+	SS_QUERYID = 0, SS_NOBJECTS, SS_ERROR_AQO, SS_ERROR_NATIVE, SS_TOTAL_NCOLS
+} aqo_shadow_stat_cols;
+
+typedef enum {
+	SD_FS = 0, SD_FSS, SD_NOBJECTS, SD_ERROR_AQO, SD_ERROR_NATIVE,
+	SD_TOTAL_NCOLS
+} aqo_shadow_data_cols;
+
+typedef enum {
+	QP_QUERYID = 0, QP_PLANID, QP_NEXECS, QP_EXEC_TIME, QP_GOOD, QP_PIN_LEFT,
+	QP_TOTAL_NCOLS
+} aqo_query_plans_cols;
+
 typedef enum {
 	QT_QUERYID = 0, QT_QUERY_STRING, QT_TOTAL_NCOLS
 } aqo_qtexts_cols;
 
 typedef enum {
 	AD_FS = 0, AD_FSS, AD_NFEATURES, AD_FEATURES, AD_TARGETS, AD_RELIABILITY,
-	AD_OIDS, AD_TOTAL_NCOLS
+	AD_OIDS, AD_MODEL, AD_PAYLOAD, AD_TOTAL_NCOLS
 } aqo_data_cols;
 
+typedef enum {
+	LR_STEP = 0, LR_PREDICTION, LR_ERROR, LR_LEARNING_RATE,
+	LR_SELECTION_THRESHOLD, LR_TOTAL_NCOLS
+} aqo_learning_replay_cols;
+
 typedef enum {
 	AQ_QUERYID = 0, AQ_FS, AQ_LEARN_AQO, AQ_USE_AQO, AQ_AUTO_TUNING, AQ_SMART_TIMEOUT, AQ_COUNT_INCREASE_TIMEOUT,
-	AQ_TOTAL_NCOLS
+	AQ_JIT, AQ_TOTAL_NCOLS
 } aqo_queries_cols;
 
+typedef enum {
+	KA_STORE = 0, KA_AGE, KA_ENTRIES, KA_HITS, KA_TOTAL_NCOLS
+} aqo_knowledge_age_cols;
+
+typedef enum {
+	DU_NAME = 0, DU_ALLOCATED, DU_USED, DU_TOTAL_NCOLS
+} aqo_dsa_usage_cols;
+
 typedef void* (*form_record_t) (void *ctx, size_t *size);
 typedef bool (*deform_record_t) (void *data, size_t size);
 
 
 int querytext_max_size = 1000;
 int dsm_size_max = 100; /* in MB */
+int querytext_dsm_size_max = 20; /* in MB */
+bool querytext_compression = false;
+bool querytext_resident = true;
+int knowledge_ttl = 0; /* in seconds, 0 - never expire */
+double plan_regression_threshold = 0.; /* 0 - the plan guard is disabled */
+int plan_regression_min_execs = 3;
+double knowledge_drift_threshold = 0.; /* 0 - drift of the knowledge isn't tracked */
+double knowledge_drift_decay = 0.5; /* 0 - drifted knowledge is removed */
+int aqo_cleanup_batch_size = 1000;
 
 HTAB *stat_htab = NULL;
 HTAB *queries_htab = NULL;
 HTAB *qtexts_htab = NULL;
+HTAB *qtext_bodies_htab = NULL;
 static dsa_area *qtext_dsa = NULL;
 HTAB *data_htab = NULL;
+HTAB *reloids_htab = NULL;
+HTAB *plan_guard_htab = NULL;
+HTAB *relio_htab = NULL;
+HTAB *shadow_htab = NULL;
 static dsa_area *data_dsa = NULL;
 static HTAB *deactivated_queries = NULL;
 
+/*
+ * Backend-local copy of aqo_queries settings. It is valid while shared
+ * generation of the queries storage equals to the queries_cache_generation.
+ */
+typedef struct QueriesCacheEntry
+{
+	uint64	queryid;
+
+	bool	found; /* The class doesn't exist in the storage, if false */
+	uint64	inserts; /* queries_inserts at the lookup of an absent class */
+	bool	learn_aqo;
+	bool	use_aqo;
+	bool	auto_tuning;
+	int64	smart_timeout;
+	int64	count_increase_timeout;
+	int		jit;
+
+	/* Hits not reported to the shared storage yet */
+	TimestampTz	touched;
+	uint64		nhits;
+} QueriesCacheEntry;
+
+/* Don't report usage of a cached query class more often, in milliseconds */
+#define QUERIES_TOUCH_INTERVAL	(1000)
+
+static HTAB *queries_cache = NULL;
+static uint64 queries_cache_generation = 0;
+
 /* Used to check data file consistency */
-static const uint32 PGAQO_FILE_HEADER = 123467589;
+static const uint32 PGAQO_FILE_HEADER = 123467590;
 static const uint32 PGAQO_PG_MAJOR_VERSION = PG_VERSION_NUM / 100;
 
 /*
@@ -87,24 +200,54 @@ AqoQueriesNullArgs aqo_queries_nulls = { false, false, false, false };
 
 static ArrayType *form_matrix(double *matrix, int nrows, int ncols);
 static void dsa_init(void);
-static int data_store(const char *filename, form_record_t callback,
+static int data_store(const char *filename, uint32 version,
+					  form_record_t callback,
 					  long nrecs, void *ctx);
-static void data_load(const char *filename, deform_record_t callback, void *ctx);
+static void data_load(const char *filename, uint32 version,
+					  deform_record_t callback, void *ctx);
 static size_t _compute_data_dsa(const DataEntry *entry);
 
 static bool _aqo_stat_remove(uint64 queryid);
+static void _plan_guard_remove(uint64 queryid);
+static void _plan_guard_reset(void);
+static void _relio_remove(Oid dbid, const Oid *reloids, int nreloids);
+static void _relio_reset(void);
+static void _shadow_remove(data_key *key);
+static void _shadow_reset(void);
 static bool _aqo_queries_remove(uint64 queryid);
 static bool _aqo_qtexts_remove(uint64 queryid);
+static int _qtexts_evict(uint64 queryid, size_t size);
+static char *_qtext_file_read(QueryTextBody *body, int *fd);
+static char *_qtext_body_get(QueryTextBody *body, int *fd);
+static uint64 _qtext_check(const char *text, int32 rawlen);
+static size_t _qtext_body_release(uint64 key);
+static size_t _qtext_body_bury(QueryTextBody *body);
+static void _qtext_body_purge(uint64 key);
 static bool _aqo_data_remove(data_key *key);
+static Oid *_data_entry_reloids(const DataEntry *entry);
+static void _reloids_index_add(const data_key *key, Oid dbid,
+							   const Oid *reloids, int nrels);
+static void _data_entry_release(DataEntry *entry);
 static bool neirest_neighbor(double **matrix, int old_rows, double *neighbor, int cols);
 static double fs_distance(double *a, double *b, int len);
+static void queries_storage_changed(void);
+static void queries_storage_added(void);
+static void queries_touch(uint64 queryid, TimestampTz now, uint64 nhits);
 
 PG_FUNCTION_INFO_V1(aqo_query_stat);
+PG_FUNCTION_INFO_V1(aqo_query_latency);
+PG_FUNCTION_INFO_V1(aqo_query_plans);
+PG_FUNCTION_INFO_V1(aqo_query_memory);
+PG_FUNCTION_INFO_V1(aqo_query_workers);
+PG_FUNCTION_INFO_V1(aqo_shadow_stat);
+PG_FUNCTION_INFO_V1(aqo_shadow_data);
+PG_FUNCTION_INFO_V1(aqo_relation_io);
 PG_FUNCTION_INFO_V1(aqo_query_texts);
 PG_FUNCTION_INFO_V1(aqo_data);
 PG_FUNCTION_INFO_V1(aqo_queries);
 PG_FUNCTION_INFO_V1(aqo_enable_query);
 PG_FUNCTION_INFO_V1(aqo_disable_query);
+PG_FUNCTION_INFO_V1(aqo_set_class_jit);
 PG_FUNCTION_INFO_V1(aqo_queries_update);
 PG_FUNCTION_INFO_V1(aqo_reset);
 PG_FUNCTION_INFO_V1(aqo_cleanup);
@@ -114,6 +257,10 @@ PG_FUNCTION_INFO_V1(aqo_execution_time);
 PG_FUNCTION_INFO_V1(aqo_query_texts_update);
 PG_FUNCTION_INFO_V1(aqo_query_stat_update);
 PG_FUNCTION_INFO_V1(aqo_data_update);
+PG_FUNCTION_INFO_V1(aqo_learning_replay);
+PG_FUNCTION_INFO_V1(aqo_knowledge_age);
+PG_FUNCTION_INFO_V1(aqo_expire);
+PG_FUNCTION_INFO_V1(aqo_dsa_usage);
 
 
 bool
@@ -132,7 +279,9 @@ update_fss_ext(uint64 fs, int fss, OkNNrdata *data, List *reloids)
 	 */
 	AqoDataArgs data_arg =
 			{data->rows, data->cols, 0, data->matrix,
-			 data->targets, data->rfactors, NULL};
+			 data->targets, data->rfactors, NULL,
+			 data->model, data->payload,
+			 data->err_sum, data->nsteps};
 	return aqo_data_store(fs, fss, &data_arg, reloids);
 }
 
@@ -232,6 +381,124 @@ reset_deactivated_queries(void)
 	}
 }
 
+/*
+ * Set up usage accounting of a new entry.
+ */
+static inline void
+usage_init(AqoUsage *usage, TimestampTz last_used, uint64 hits)
+{
+	pg_atomic_init_u64(&usage->last_used, (uint64) last_used);
+	pg_atomic_init_u64(&usage->hits, hits);
+}
+
+/*
+ * Register access to an entry. Concurrent callers can move the timestamp back
+ * a little, but it is not a problem for such coarse accounting.
+ */
+static inline void
+usage_touch(AqoUsage *usage, TimestampTz now, uint64 nhits)
+{
+	if ((TimestampTz) pg_atomic_read_u64(&usage->last_used) < now)
+		pg_atomic_write_u64(&usage->last_used, (uint64) now);
+	pg_atomic_fetch_add_u64(&usage->hits, nhits);
+}
+
+/*
+ * Entries loaded from disk contain a byte copy of the usage. Atomics must be
+ * initialized before the first access, so reinitialize them by these values.
+ * The copy isn't an initialized atomic and may be misaligned, so read its
+ * values directly.
+ */
+static inline void
+usage_restore(AqoUsage *usage, const AqoUsage *copy)
+{
+	usage_init(usage, (TimestampTz) copy->last_used.value, copy->hits.value);
+}
+
+static inline bool
+usage_expired(AqoUsage *usage, TimestampTz horizon)
+{
+	return (TimestampTz) pg_atomic_read_u64(&usage->last_used) < horizon;
+}
+
+/*
+ * Zero all fields of the stat entry except the key, the lock and usage.
+ */
+static inline void
+_stat_entry_clean(StatEntry *entry)
+{
+	memset((char *) entry + offsetof(StatEntry, execs_with_aqo), 0,
+		   sizeof(StatEntry) - offsetof(StatEntry, execs_with_aqo));
+}
+
+static int
+_hist_bucket(double value)
+{
+	double	idx;
+
+	if (!(value > AQO_HIST_MIN_VALUE))
+		return 0;
+
+	idx = log2(value / AQO_HIST_MIN_VALUE) * AQO_HIST_SUBBUCKETS;
+	return (idx >= AQO_HIST_NBUCKETS - 1) ? AQO_HIST_NBUCKETS - 1 : (int) idx;
+}
+
+/*
+ * Add a sample to the histogram. Negative values mean an unknown time, like
+ * the planning time of a cached plan, and are skipped.
+ *
+ * Once the histogram collects AQO_HIST_DECAY_COUNT samples, all the buckets
+ * are halved. So, the histogram follows changes of the workload: weight of an
+ * old execution decreases exponentially.
+ */
+void
+aqo_hist_add(AqoHistogram *hist, double value)
+{
+	int		i;
+
+	if (value < 0. || isnan(value))
+		return;
+
+	if (hist->count >= AQO_HIST_DECAY_COUNT)
+	{
+		hist->count = 0;
+		for (i = 0; i < AQO_HIST_NBUCKETS; i++)
+		{
+			hist->buckets[i] /= 2;
+			hist->count += hist->buckets[i];
+		}
+	}
+
+	hist->buckets[_hist_bucket(value)]++;
+	hist->count++;
+}
+
+/*
+ * Estimate the p-th quantile (0 < p <= 1) by the geometric middle of the
+ * bucket which contains it. Returns -1 for an empty histogram.
+ */
+double
+aqo_hist_percentile(const AqoHistogram *hist, double p)
+{
+	int64	rank;
+	int64	sum = 0;
+	int		i;
+
+	if (hist->count == 0)
+		return -1.;
+
+	rank = (int64) ceil(p * hist->count);
+	rank = Max(rank, 1);
+
+	for (i = 0; i < AQO_HIST_NBUCKETS - 1; i++)
+	{
+		sum += hist->buckets[i];
+		if (sum >= rank)
+			break;
+	}
+	return AQO_HIST_MIN_VALUE * pow(2., (i + 0.5) / AQO_HIST_SUBBUCKETS);
+}
+
 /*
  * Update AQO statistics.
  *
@@ -245,50 +512,64 @@ aqo_stat_store(uint64 queryid, bool use_aqo, AqoStatArgs *stat_arg,
 			   bool append_mode)
 {
 	StatEntry  *entry;
+	StatEntry  *result;
 	bool		found;
 	int			pos;
 	bool		tblOverflow;
 	HASHACTION	action;
+	TimestampTz	now = GetCurrentStatementStartTimestamp();
 
 	Assert(stat_htab);
 
-	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
-	tblOverflow = hash_get_num_entries(stat_htab) < fs_max_items ? false : true;
-	action = tblOverflow ? HASH_FIND : HASH_ENTER;
-	entry = (StatEntry *) hash_search(stat_htab, &queryid, action, &found);
+	/*
+	 * Usually the class is known already and the shared lock is enough:
+	 * the entry itself is protected by its own lock.
+	 */
+	LWLockAcquire(&aqo_state->stat_lock, LW_SHARED);
+	entry = (StatEntry *) hash_search(stat_htab, &queryid, HASH_FIND, &found);
 
-	/* Initialize entry on first usage */
 	if (!found)
 	{
-		uint64 qid;
+		/* Need exclusive lock to make a new entry */
+		LWLockRelease(&aqo_state->stat_lock);
+		LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
 
-		if (action == HASH_FIND)
+		tblOverflow = hash_get_num_entries(stat_htab) < fs_max_items ? false : true;
+		action = tblOverflow ? HASH_FIND : HASH_ENTER;
+		entry = (StatEntry *) hash_search(stat_htab, &queryid, action, &found);
+
+		/* Initialize entry on first usage */
+		if (!found)
 		{
-			/*
-			 * Hash table is full. To avoid possible problems - don't try to add
-			 * more, just exit
-			 */
-			LWLockRelease(&aqo_state->stat_lock);
-			ereport(LOG,
-				(errcode(ERRCODE_OUT_OF_MEMORY),
-				 errmsg("[AQO] Stat storage is full. No more feature spaces can be added."),
-				 errhint("Increase value of aqo.fs_max_items on restart of the instance")));
-			return NULL;
-		}
+			if (action == HASH_FIND)
+			{
+				/*
+				 * Hash table is full. To avoid possible problems - don't try to add
+				 * more, just exit
+				 */
+				LWLockRelease(&aqo_state->stat_lock);
+				ereport(LOG,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("[AQO] Stat storage is full. No more feature spaces can be added."),
+					 errhint("Increase value of aqo.fs_max_items on restart of the instance")));
+				return NULL;
+			}
 
-		qid = entry->queryid;
-		memset(entry, 0, sizeof(StatEntry));
-		entry->queryid = qid;
+			_stat_entry_clean(entry);
+			LWLockInitialize(&entry->lock, aqo_state->stat_trancheid);
+			usage_init(&entry->usage, now, 0);
+		}
 	}
 
+	result = palloc(sizeof(StatEntry));
+
+	LWLockAcquire(&entry->lock, LW_EXCLUSIVE);
+
 	if (!append_mode)
 	{
 		size_t sz;
 		if (found)
-		{
-			memset(entry, 0, sizeof(StatEntry));
-			entry->queryid = queryid;
-		}
+			_stat_entry_clean(entry);
 
 		sz = stat_arg->cur_stat_slot_aqo * sizeof(entry->est_error_aqo[0]);
 		memcpy(entry->plan_time_aqo, stat_arg->plan_time_aqo, sz);
@@ -304,15 +585,30 @@ aqo_stat_store(uint64 queryid, bool use_aqo, AqoStatArgs *stat_arg,
 		entry->execs_without_aqo = stat_arg->execs_without_aqo;
 		entry->cur_stat_slot = stat_arg->cur_stat_slot;
 
-		aqo_state->stat_changed = true;
-		LWLockRelease(&aqo_state->stat_lock);
-		return entry;
+		/* Only the passed samples are known about the distribution */
+		for (pos = 0; pos < entry->cur_stat_slot_aqo; pos++)
+		{
+			aqo_hist_add(&entry->exec_hist_aqo, entry->exec_time_aqo[pos]);
+			aqo_hist_add(&entry->plan_hist_aqo, entry->plan_time_aqo[pos]);
+			aqo_bandit_arm_add(&entry->arm_aqo, entry->exec_time_aqo[pos] +
+										Max(entry->plan_time_aqo[pos], 0.));
+			aqo_plan_cache_observe(entry, entry->plan_time_aqo[pos],
+								   entry->exec_time_aqo[pos], false);
+		}
+		for (pos = 0; pos < entry->cur_stat_slot; pos++)
+		{
+			aqo_hist_add(&entry->exec_hist, entry->exec_time[pos]);
+			aqo_hist_add(&entry->plan_hist, entry->plan_time[pos]);
+			aqo_bandit_arm_add(&entry->arm, entry->exec_time[pos] +
+											Max(entry->plan_time[pos], 0.));
+			aqo_plan_cache_observe(entry, entry->plan_time[pos],
+								   entry->exec_time[pos], false);
+		}
 	}
-
-	/* Update the entry data */
-
-	if (use_aqo)
+	else if (use_aqo)
 	{
+		/* Update the entry data */
+
 		Assert(entry->cur_stat_slot_aqo >= 0);
 		pos = entry->cur_stat_slot_aqo;
 		if (entry->cur_stat_slot_aqo < STAT_SAMPLE_SIZE - 1)
@@ -331,6 +627,13 @@ aqo_stat_store(uint64 queryid, bool use_aqo, AqoStatArgs *stat_arg,
 		entry->plan_time_aqo[pos] = *stat_arg->plan_time_aqo;
 		entry->exec_time_aqo[pos] = *stat_arg->exec_time_aqo;
 		entry->est_error_aqo[pos] = *stat_arg->est_error_aqo;
+		aqo_hist_add(&entry->exec_hist_aqo, *stat_arg->exec_time_aqo);
+		aqo_hist_add(&entry->plan_hist_aqo, *stat_arg->plan_time_aqo);
+		aqo_bandit_observe(&entry->arm_aqo, &entry->arm, &entry->regret,
+						   *stat_arg->plan_time_aqo, *stat_arg->exec_time_aqo);
+		aqo_plan_cache_observe(entry, *stat_arg->plan_time_aqo,
+							   *stat_arg->exec_time_aqo, true);
+		aqo_jit_observe(entry, stat_arg->jit, *stat_arg->exec_time_aqo);
 	}
 	else
 	{
@@ -352,12 +655,50 @@ aqo_stat_store(uint64 queryid, bool use_aqo, AqoStatArgs *stat_arg,
 		entry->plan_time[pos] = *stat_arg->plan_time;
 		entry->exec_time[pos] = *stat_arg->exec_time;
 		entry->est_error[pos] = *stat_arg->est_error;
+		aqo_hist_add(&entry->exec_hist, *stat_arg->exec_time);
+		aqo_hist_add(&entry->plan_hist, *stat_arg->plan_time);
+		aqo_bandit_observe(&entry->arm, &entry->arm_aqo, &entry->regret,
+						   *stat_arg->plan_time, *stat_arg->exec_time);
+		aqo_plan_cache_observe(entry, *stat_arg->plan_time,
+							   *stat_arg->exec_time, true);
+		aqo_jit_observe(entry, stat_arg->jit, *stat_arg->exec_time);
 	}
 
-	entry = memcpy(palloc(sizeof(StatEntry)), entry, sizeof(StatEntry));
+	if (append_mode && stat_arg->work_mem > 0.)
+	{
+		/*
+		 * Some plan nodes spilled to disk. The budget only grows: a spill
+		 * costs much more than an unused memory limit.
+		 */
+		entry->nspills++;
+		entry->work_mem = Max(entry->work_mem, stat_arg->work_mem);
+	}
+
+	if (append_mode && stat_arg->ngathers > 0)
+	{
+		entry->ngathers = entry->ngathers * AQO_WORKERS_DECAY +
+														stat_arg->ngathers;
+		entry->workers_planned = entry->workers_planned * AQO_WORKERS_DECAY +
+													stat_arg->workers_planned;
+		entry->workers_launched = entry->workers_launched * AQO_WORKERS_DECAY +
+													stat_arg->workers_launched;
+	}
+
+	if (append_mode && stat_arg->shadow_nobjects > 0)
+	{
+		entry->shadow_nobjects += stat_arg->shadow_nobjects;
+		entry->shadow_error_aqo += stat_arg->shadow_error_aqo;
+		entry->shadow_error_native += stat_arg->shadow_error_native;
+	}
+
+	memcpy(result, entry, sizeof(StatEntry));
+	LWLockRelease(&entry->lock);
+	usage_touch(&entry->usage, now, 1);
+
+	/* Concurrent writers can only set it to true, no race here */
 	aqo_state->stat_changed = true;
 	LWLockRelease(&aqo_state->stat_lock);
-	return entry;
+	return result;
 }
 
 /*
@@ -374,7 +715,8 @@ aqo_query_stat(PG_FUNCTION_ARGS)
 	Datum				values[TOTAL_NCOLS + 1];
 	bool				nulls[TOTAL_NCOLS + 1];
 	HASH_SEQ_STATUS		hash_seq;
-	StatEntry	   *entry;
+	StatEntry		   *sentry;
+	StatEntry		   *entry = palloc(sizeof(StatEntry));
 
 	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -405,8 +747,13 @@ aqo_query_stat(PG_FUNCTION_ARGS)
 	memset(nulls, 0, TOTAL_NCOLS + 1);
 	LWLockAcquire(&aqo_state->stat_lock, LW_SHARED);
 	hash_seq_init(&hash_seq, stat_htab);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	while ((sentry = hash_seq_search(&hash_seq)) != NULL)
 	{
+		/* Take a consistent snapshot of the entry */
+		LWLockAcquire(&sentry->lock, LW_SHARED);
+		memcpy(entry, sentry, sizeof(StatEntry));
+		LWLockRelease(&sentry->lock);
+
 		memset(nulls, 0, TOTAL_NCOLS + 1);
 
 		values[QUERYID] = Int64GetDatum(entry->queryid);
@@ -418,6 +765,31 @@ aqo_query_stat(PG_FUNCTION_ARGS)
 		values[PLAN_TIME] = PointerGetDatum(form_vector(entry->plan_time, entry->cur_stat_slot));
 		values[EST_ERROR_AQO] = PointerGetDatum(form_vector(entry->est_error_aqo, entry->cur_stat_slot_aqo));
 		values[EST_ERROR] = PointerGetDatum(form_vector(entry->est_error, entry->cur_stat_slot));
+
+		/* Posterior of the auto tuning bandit */
+		nulls[POSTERIOR_TIME_AQO] = (entry->arm_aqo.n == 0);
+		values[POSTERIOR_TIME_AQO] =
+			Float8GetDatum(aqo_bandit_expected_time(&entry->arm_aqo));
+		nulls[POSTERIOR_TIME] = (entry->arm.n == 0);
+		values[POSTERIOR_TIME] =
+			Float8GetDatum(aqo_bandit_expected_time(&entry->arm));
+		nulls[PROB_AQO_BETTER] = (entry->arm_aqo.n < 2 || entry->arm.n < 2);
+		if (!nulls[PROB_AQO_BETTER])
+		{
+			double	var = entry->arm_aqo.m2 / (entry->arm_aqo.n - 1) /
+						  entry->arm_aqo.n +
+						  entry->arm.m2 / (entry->arm.n - 1) / entry->arm.n;
+			double	diff = entry->arm.mean - entry->arm_aqo.mean;
+			double	prob;
+
+			/* Probability of the lower mean log-time with AQO */
+			if (var > 0.)
+				prob = 0.5 * erfc(-diff / sqrt(2. * var));
+			else
+				prob = (diff > 0.) ? 1. : (diff < 0.) ? 0. : 0.5;
+			values[PROB_AQO_BETTER] = Float8GetDatum(prob);
+		}
+		values[REGRET] = Float8GetDatum(entry->regret);
 		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
 	}
 
@@ -425,722 +797,3520 @@ aqo_query_stat(PG_FUNCTION_ARGS)
 	return (Datum) 0;
 }
 
-static long
-aqo_stat_reset(void)
+static void
+_put_latency_row(Tuplestorestate *tupstore, TupleDesc tupDesc, uint64 queryid,
+				 bool use_aqo, const AqoHistogram *exec_hist,
+				 const AqoHistogram *plan_hist)
 {
-	HASH_SEQ_STATUS	hash_seq;
-	StatEntry	   *entry;
-	long			num_remove = 0;
-	long			num_entries;
+	Datum	values[QL_TOTAL_NCOLS];
+	bool	nulls[QL_TOTAL_NCOLS] = {0};
 
-	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
-	num_entries = hash_get_num_entries(stat_htab);
-	hash_seq_init(&hash_seq, stat_htab);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	if (exec_hist->count == 0)
+		return;
+
+	values[QL_QUERYID] = Int64GetDatum(queryid);
+	values[QL_USE_AQO] = BoolGetDatum(use_aqo);
+	values[QL_NEXECS] = Int64GetDatum(exec_hist->count);
+	values[QL_EXEC_P50] = Float8GetDatum(aqo_hist_percentile(exec_hist, 0.5));
+	values[QL_EXEC_P95] = Float8GetDatum(aqo_hist_percentile(exec_hist, 0.95));
+	values[QL_EXEC_P99] = Float8GetDatum(aqo_hist_percentile(exec_hist, 0.99));
+	values[QL_PLAN_P50] = Float8GetDatum(aqo_hist_percentile(plan_hist, 0.5));
+	values[QL_PLAN_P95] = Float8GetDatum(aqo_hist_percentile(plan_hist, 0.95));
+	values[QL_PLAN_P99] = Float8GetDatum(aqo_hist_percentile(plan_hist, 0.99));
+	tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+}
+
+/*
+ * Get a copy of the statistics of the query class.
+ */
+bool
+aqo_stat_find(uint64 queryid, StatEntry *stat)
+{
+	StatEntry  *entry;
+
+	LWLockAcquire(&aqo_state->stat_lock, LW_SHARED);
+	entry = (StatEntry *) hash_search(stat_htab, &queryid, HASH_FIND, NULL);
+	if (entry != NULL)
 	{
-		if (!hash_search(stat_htab, &entry->queryid, HASH_REMOVE, NULL))
-			elog(PANIC, "[AQO] hash table corrupted");
-		num_remove++;
+		LWLockAcquire(&entry->lock, LW_SHARED);
+		memcpy(stat, entry, sizeof(StatEntry));
+		LWLockRelease(&entry->lock);
 	}
-	aqo_state->stat_changed = true;
 	LWLockRelease(&aqo_state->stat_lock);
 
-	if (num_remove != num_entries)
-		elog(ERROR, "[AQO] Stat memory storage is corrupted or parallel access without a lock was detected.");
-
-	aqo_stat_flush();
-
-	return num_remove;
+	return (entry != NULL);
 }
 
-static void *
-_form_stat_record_cb(void *ctx, size_t *size)
+/*
+ * Returns percentiles of execution and planning time of query classes, with
+ * and without AQO.
+ */
+Datum
+aqo_query_latency(PG_FUNCTION_ARGS)
 {
-	HASH_SEQ_STATUS *hash_seq = (HASH_SEQ_STATUS *) ctx;
-	StatEntry		*entry;
-
-	*size = sizeof(StatEntry);
-	entry = hash_seq_search(hash_seq);
-	if (entry == NULL)
-		return NULL;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	HASH_SEQ_STATUS		hash_seq;
+	StatEntry		   *entry;
+	StatEntry			stat;
 
-	return memcpy(palloc(*size), entry, *size);
-}
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
 
-/* Implement data flushing according to pgss_shmem_shutdown() */
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-void
-aqo_stat_flush(void)
-{
-	HASH_SEQ_STATUS	hash_seq;
-	int				ret;
-	long			entries;
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == QL_TOTAL_NCOLS);
 
-	/* Use exclusive lock to prevent concurrent flushing in different backends. */
-	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
 
-	if (!aqo_state->stat_changed)
-		/* Hash table wasn't changed, meaningless to store it in permanent storage */
-		goto end;
+	MemoryContextSwitchTo(oldcontext);
 
-	entries = hash_get_num_entries(stat_htab);
+	LWLockAcquire(&aqo_state->stat_lock, LW_SHARED);
 	hash_seq_init(&hash_seq, stat_htab);
-	ret = data_store(PGAQO_STAT_FILE, _form_stat_record_cb, entries,
-					 (void *) &hash_seq);
-	if (ret != 0)
-		hash_seq_term(&hash_seq);
-	else
-		/* Hash table and disk storage are now consistent */
-		aqo_state->stat_changed = false;
-
-end:
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		LWLockAcquire(&entry->lock, LW_SHARED);
+		memcpy(&stat, entry, sizeof(StatEntry));
+		LWLockRelease(&entry->lock);
+
+		_put_latency_row(tupstore, tupDesc, stat.queryid, true,
+						 &stat.exec_hist_aqo, &stat.plan_hist_aqo);
+		_put_latency_row(tupstore, tupDesc, stat.queryid, false,
+						 &stat.exec_hist, &stat.plan_hist);
+	}
 	LWLockRelease(&aqo_state->stat_lock);
+
+	return (Datum) 0;
 }
 
-static void *
-_form_qtext_record_cb(void *ctx, size_t *size)
+/*
+ * Returns memory demand of query classes, which had plan nodes spilled to
+ * disk.
+ */
+Datum
+aqo_query_memory(PG_FUNCTION_ARGS)
 {
-	HASH_SEQ_STATUS *hash_seq = (HASH_SEQ_STATUS *) ctx;
-	QueryTextEntry	*entry;
-	void		    *data;
-	char			*query_string;
-	char			*ptr;
-
-	entry = hash_seq_search(hash_seq);
-	if (entry == NULL)
-		return NULL;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[QM_TOTAL_NCOLS];
+	bool				nulls[QM_TOTAL_NCOLS] = {0};
+	HASH_SEQ_STATUS		hash_seq;
+	StatEntry		   *entry;
+	StatEntry			stat;
 
-	Assert(DsaPointerIsValid(entry->qtext_dp));
-	query_string = dsa_get_address(qtext_dsa, entry->qtext_dp);
-	Assert(query_string != NULL);
-	*size = sizeof(entry->queryid) + strlen(query_string) + 1;
-	ptr = data = palloc(*size);
-	Assert(ptr != NULL);
-	memcpy(ptr, &entry->queryid, sizeof(entry->queryid));
-	ptr += sizeof(entry->queryid);
-	memcpy(ptr, query_string, strlen(query_string) + 1);
-	return data;
-}
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
 
-void
-aqo_qtexts_flush(void)
-{
-	HASH_SEQ_STATUS	hash_seq;
-	int				ret;
-	long			entries;
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-	dsa_init();
-	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == QM_TOTAL_NCOLS);
 
-	if (!aqo_state->qtexts_changed)
-		/* XXX: mull over forced mode. */
-		goto end;
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
 
-	entries = hash_get_num_entries(qtexts_htab);
-	hash_seq_init(&hash_seq, qtexts_htab);
-	ret = data_store(PGAQO_TEXT_FILE, _form_qtext_record_cb, entries,
-					 (void *) &hash_seq);
-	if (ret != 0)
-		hash_seq_term(&hash_seq);
-	else
-		/* Hash table and disk storage are now consistent */
-		aqo_state->qtexts_changed = false;
+	MemoryContextSwitchTo(oldcontext);
 
-end:
-	LWLockRelease(&aqo_state->qtexts_lock);
+	LWLockAcquire(&aqo_state->stat_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, stat_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		LWLockAcquire(&entry->lock, LW_SHARED);
+		memcpy(&stat, entry, sizeof(StatEntry));
+		LWLockRelease(&entry->lock);
+
+		if (stat.nspills == 0)
+			continue;
+
+		values[QM_QUERYID] = Int64GetDatum(stat.queryid);
+		values[QM_NSPILLS] = Int64GetDatum(stat.nspills);
+		values[QM_WORK_MEM] = Int64GetDatum((int64) ceil(stat.work_mem));
+		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+	}
+	LWLockRelease(&aqo_state->stat_lock);
+
+	return (Datum) 0;
 }
 
 /*
- * Getting a hash table iterator, return a newly allocated memory chunk and its
- * size for subsequent writing into storage.
+ * Returns parallel workers of query classes with Gather nodes: planned and
+ * launched per a Gather node, on average over recent executions.
  */
-static void *
-_form_data_record_cb(void *ctx, size_t *size)
+Datum
+aqo_query_workers(PG_FUNCTION_ARGS)
 {
-	HASH_SEQ_STATUS	   *hash_seq = (HASH_SEQ_STATUS *) ctx;
-	DataEntry		   *entry;
-	char			   *data;
-	char			   *ptr,
-					   *dsa_ptr;
-	size_t				sz;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[QW_TOTAL_NCOLS];
+	bool				nulls[QW_TOTAL_NCOLS] = {0};
+	HASH_SEQ_STATUS		hash_seq;
+	StatEntry		   *entry;
+	StatEntry			stat;
 
-	entry = hash_seq_search(hash_seq);
-	if (entry == NULL)
-		return NULL;
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
 
-	/* Size of data is DataEntry (without DSA pointer) plus size of DSA chunk */
-	sz = offsetof(DataEntry, data_dp) + _compute_data_dsa(entry);
-	ptr = data = palloc(sz);
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-	/* Put the data into the chunk */
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == QW_TOTAL_NCOLS);
 
-	/* Plane copy of all bytes of hash table entry */
-	memcpy(ptr, entry, offsetof(DataEntry, data_dp));
-	ptr += offsetof(DataEntry, data_dp);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
 
-	Assert(DsaPointerIsValid(entry->data_dp));
-	dsa_ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
-	Assert((sz - (ptr - data)) == _compute_data_dsa(entry));
-	memcpy(ptr, dsa_ptr, sz - (ptr - data));
-	*size = sz;
-	return data;
-}
+	MemoryContextSwitchTo(oldcontext);
 
-void
-aqo_data_flush(void)
-{
-	HASH_SEQ_STATUS	hash_seq;
-	int				ret;
-	long			entries;
+	LWLockAcquire(&aqo_state->stat_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, stat_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		LWLockAcquire(&entry->lock, LW_SHARED);
+		memcpy(&stat, entry, sizeof(StatEntry));
+		LWLockRelease(&entry->lock);
 
-	dsa_init();
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+		if (stat.ngathers <= 0. || stat.workers_planned <= 0.)
+			continue;
 
-	if (!aqo_state->data_changed)
-		/* XXX: mull over forced mode. */
-		goto end;
+		values[QW_QUERYID] = Int64GetDatum(stat.queryid);
+		values[QW_PLANNED] = Float8GetDatum(stat.workers_planned /
+																stat.ngathers);
+		values[QW_LAUNCHED] = Float8GetDatum(stat.workers_launched /
+																stat.ngathers);
+		values[QW_LAUNCH_RATE] = Float8GetDatum(stat.workers_launched /
+														stat.workers_planned);
+		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+	}
+	LWLockRelease(&aqo_state->stat_lock);
 
-	entries = hash_get_num_entries(data_htab);
-	hash_seq_init(&hash_seq, data_htab);
-	ret = data_store(PGAQO_DATA_FILE, _form_data_record_cb, entries,
-					 (void *) &hash_seq);
-	if (ret != 0)
-		/*
-		 * Something happened and storing procedure hasn't finished walking
-		 * along all records of the hash table.
-		 */
-		hash_seq_term(&hash_seq);
-	else
-		/* Hash table and disk storage are now consistent */
-		aqo_state->data_changed = false;
-end:
-	LWLockRelease(&aqo_state->data_lock);
+	return (Datum) 0;
 }
 
-static void *
-_form_queries_record_cb(void *ctx, size_t *size)
+/*
+ * Returns mean errors of shadow predictions and of the native estimates of
+ * plan nodes, in the log scale, for query classes.
+ */
+Datum
+aqo_shadow_stat(PG_FUNCTION_ARGS)
 {
-	HASH_SEQ_STATUS *hash_seq = (HASH_SEQ_STATUS *) ctx;
-	QueriesEntry		*entry;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[SS_TOTAL_NCOLS];
+	bool				nulls[SS_TOTAL_NCOLS] = {0};
+	HASH_SEQ_STATUS		hash_seq;
+	StatEntry		   *entry;
+	StatEntry			stat;
 
-	*size = sizeof(QueriesEntry);
-	entry = hash_seq_search(hash_seq);
-	if (entry == NULL)
-		return NULL;
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
 
-	return memcpy(palloc(*size), entry, *size);
-}
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-void
-aqo_queries_flush(void)
-{
-	HASH_SEQ_STATUS	hash_seq;
-	int				ret;
-	long			entries;
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == SS_TOTAL_NCOLS);
 
-	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
 
-	if (!aqo_state->queries_changed)
-		goto end;
+	MemoryContextSwitchTo(oldcontext);
 
-	entries = hash_get_num_entries(queries_htab);
-	hash_seq_init(&hash_seq, queries_htab);
-	ret = data_store(PGAQO_QUERIES_FILE, _form_queries_record_cb, entries,
-					 (void *) &hash_seq);
-	if (ret != 0)
-		hash_seq_term(&hash_seq);
-	else
-		/* Hash table and disk storage are now consistent */
-		aqo_state->queries_changed = false;
+	LWLockAcquire(&aqo_state->stat_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, stat_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		LWLockAcquire(&entry->lock, LW_SHARED);
+		memcpy(&stat, entry, sizeof(StatEntry));
+		LWLockRelease(&entry->lock);
 
-end:
-	LWLockRelease(&aqo_state->queries_lock);
+		if (stat.shadow_nobjects == 0)
+			continue;
+
+		values[SS_QUERYID] = Int64GetDatum(stat.queryid);
+		values[SS_NOBJECTS] = Int64GetDatum(stat.shadow_nobjects);
+		values[SS_ERROR_AQO] = Float8GetDatum(stat.shadow_error_aqo /
+													stat.shadow_nobjects);
+		values[SS_ERROR_NATIVE] = Float8GetDatum(stat.shadow_error_native /
+													stat.shadow_nobjects);
+		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+	}
+	LWLockRelease(&aqo_state->stat_lock);
+
+	return (Datum) 0;
 }
 
-static int
-data_store(const char *filename, form_record_t callback,
-		   long nrecs, void *ctx)
+/*
+ * Find a slot for the plan. Evicts the least recently executed plan, except
+ * the good one.
+ */
+static AqoPlanStat *
+_plan_guard_slot(PlanGuardEntry *entry, uint64 planid)
 {
-	FILE   *file;
-	size_t	size;
-	uint32	counter = 0;
-	void   *data;
-	char   *tmpfile;
+	AqoPlanStat	   *victim = NULL;
+	int				i;
 
-	tmpfile = psprintf("%s.tmp", filename);
-	file = AllocateFile(tmpfile, PG_BINARY_W);
-	if (file == NULL)
-		goto error;
+	for (i = 0; i < AQO_PLAN_GUARD_NPLANS; i++)
+	{
+		AqoPlanStat *plan = &entry->plans[i];
 
-	if (fwrite(&PGAQO_FILE_HEADER, sizeof(uint32), 1, file) != 1 ||
-		fwrite(&PGAQO_PG_MAJOR_VERSION, sizeof(uint32), 1, file) != 1 ||
-		fwrite(&nrecs, sizeof(long), 1, file) != 1)
-		goto error;
+		if (plan->planid == planid)
+			return plan;
 
-	while ((data = callback(ctx, &size)) != NULL)
-	{
-		/* TODO: Add CRC code ? */
-		if (fwrite(&size, sizeof(size), 1, file) != 1 ||
-			fwrite(data, size, 1, file) != 1)
-			goto error;
-		counter++;
-	}
+		if (plan->planid == entry->good_planid && plan->planid != 0)
+			continue;
 
-	Assert(counter == nrecs);
-	if (FreeFile(file))
-	{
-		file = NULL;
-		goto error;
+		if (victim == NULL ||
+			(victim->planid != 0 &&
+			 (plan->planid == 0 || plan->last_exec < victim->last_exec)))
+			victim = plan;
 	}
 
-	/* Parallel (re)writing into a file haven't happen. */
-	(void) durable_rename(tmpfile, filename, PANIC);
-	elog(LOG, "[AQO] %d records stored in file %s.", counter, filename);
-	return 0;
+	Assert(victim != NULL);
+	memset(victim, 0, sizeof(AqoPlanStat));
+	victim->planid = planid;
+	return victim;
+}
 
-error:
-	ereport(LOG,
-			(errcode_for_file_access(),
-			 errmsg("could not write AQO file \"%s\": %m", tmpfile)));
+/*
+ * Register an execution of the plan of a query class.
+ *
+ * fss and rows describe predictions, used for the nodes of the plan. nfss is
+ * negative, if the plan has too many nodes to be reproduced by the snapshot.
+ *
+ * If the plan is the fastest known plan of the class, remember its
+ * predictions. If the plan is much slower than the best one, plan the class
+ * with the remembered predictions for the next AQO_PLAN_GUARD_PIN_EXECS
+ * executions. After that the regressed plan gets a new chance: AQO could
+ * learn something.
+ */
+void
+aqo_plan_guard_store(uint64 queryid, uint64 planid, double exec_time,
+					 int nfss, const int *fss, const double *rows)
+{
+	PlanGuardEntry *entry;
+	AqoPlanStat	   *plan;
+	AqoPlanStat	   *best = NULL;
+	bool			found;
+	int				i;
 
-	if (file)
-		FreeFile(file);
-	unlink(tmpfile);
-	pfree(tmpfile);
-	return -1;
+	Assert(nfss <= AQO_PLAN_GUARD_NFSS);
+
+	LWLockAcquire(&aqo_state->plan_guard_lock, LW_EXCLUSIVE);
+	entry = (PlanGuardEntry *) hash_search(plan_guard_htab, &queryid,
+										   HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+	{
+		/* Hash table is full. Don't guard the class. */
+		LWLockRelease(&aqo_state->plan_guard_lock);
+		return;
+	}
+
+	if (!found)
+		memset((char *) entry + sizeof(uint64), 0,
+			   sizeof(PlanGuardEntry) - sizeof(uint64));
+
+	entry->nexecs++;
+	if (entry->pin_left > 0)
+		entry->pin_left--;
+
+	plan = _plan_guard_slot(entry, planid);
+	plan->nexecs++;
+	plan->last_exec = entry->nexecs;
+	plan->exec_time += (exec_time - plan->exec_time) /
+								Min(plan->nexecs, AQO_PLAN_GUARD_WINDOW);
+
+	for (i = 0; i < AQO_PLAN_GUARD_NPLANS; i++)
+	{
+		AqoPlanStat *p = &entry->plans[i];
+
+		if (p->planid == 0 || p->nexecs < plan_regression_min_execs)
+			continue;
+
+		if (best == NULL || p->exec_time < best->exec_time)
+			best = p;
+	}
+
+	if (best == plan)
+	{
+		/* Refresh the snapshot: predictions might change since last time */
+		if (nfss >= 0)
+		{
+			entry->good_planid = planid;
+			entry->nfss = nfss;
+			memcpy(entry->fss, fss, nfss * sizeof(int));
+			memcpy(entry->rows, rows, nfss * sizeof(double));
+		}
+		else
+			/* Plan can't be reproduced */
+			entry->good_planid = 0;
+	}
+	else if (best != NULL && entry->pin_left == 0 &&
+			 best->planid == entry->good_planid &&
+			 plan->nexecs >= plan_regression_min_execs &&
+			 plan->exec_time > best->exec_time * (1. + plan_regression_threshold))
+	{
+		elog(DEBUG1, "[AQO] Plan "UINT64_FORMAT" of the query class "UINT64_FORMAT
+			 " regressed: %.3lf s against %.3lf s of the plan "UINT64_FORMAT,
+			 planid, queryid, plan->exec_time, best->exec_time, best->planid);
+
+		entry->pin_left = AQO_PLAN_GUARD_PIN_EXECS;
+
+		/* Collect the statistics from scratch after the pin */
+		plan->nexecs = 0;
+		plan->exec_time = 0.;
+	}
+
+	LWLockRelease(&aqo_state->plan_guard_lock);
 }
 
-static bool
-_deform_stat_record_cb(void *data, size_t size)
+/*
+ * Get the snapshot of predictions for the planning of a query class.
+ * Returns number of elements in the fss and rows arrays, or -1, if the class
+ * isn't pinned to its good plan.
+ */
+int
+aqo_plan_guard_snapshot(uint64 queryid, int *fss, double *rows)
 {
-	bool		found;
-	StatEntry  *entry;
-	uint64		queryid;
+	PlanGuardEntry *entry;
+	int				nfss = -1;
 
-	Assert(LWLockHeldByMeInMode(&aqo_state->stat_lock, LW_EXCLUSIVE));
-	Assert(size == sizeof(StatEntry));
+	LWLockAcquire(&aqo_state->plan_guard_lock, LW_SHARED);
+	entry = (PlanGuardEntry *) hash_search(plan_guard_htab, &queryid,
+										   HASH_FIND, NULL);
+	if (entry != NULL && entry->pin_left > 0 && entry->good_planid != 0)
+	{
+		nfss = entry->nfss;
+		memcpy(fss, entry->fss, nfss * sizeof(int));
+		memcpy(rows, entry->rows, nfss * sizeof(double));
+	}
+	LWLockRelease(&aqo_state->plan_guard_lock);
 
-	queryid = ((StatEntry *) data)->queryid;
-	entry = (StatEntry *) hash_search(stat_htab, &queryid, HASH_ENTER, &found);
-	Assert(!found && entry);
-	memcpy(entry, data, sizeof(StatEntry));
-	return true;
+	return nfss;
 }
 
-void
-aqo_stat_load(void)
+static void
+_plan_guard_remove(uint64 queryid)
 {
-	Assert(!LWLockHeldByMe(&aqo_state->stat_lock));
+	LWLockAcquire(&aqo_state->plan_guard_lock, LW_EXCLUSIVE);
+	(void) hash_search(plan_guard_htab, &queryid, HASH_REMOVE, NULL);
+	LWLockRelease(&aqo_state->plan_guard_lock);
+}
 
-	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
+static void
+_plan_guard_reset(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	PlanGuardEntry *entry;
 
-	/* Load on postmaster sturtup. So no any concurrent actions possible here. */
-	Assert(hash_get_num_entries(stat_htab) == 0);
+	LWLockAcquire(&aqo_state->plan_guard_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, plan_guard_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!hash_search(plan_guard_htab, &entry->queryid, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+	}
+	LWLockRelease(&aqo_state->plan_guard_lock);
+}
+
+/*
+ * Returns plans of query classes, tracked by the plan regression guard.
+ */
+Datum
+aqo_query_plans(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[QP_TOTAL_NCOLS];
+	bool				nulls[QP_TOTAL_NCOLS] = {0};
+	HASH_SEQ_STATUS		hash_seq;
+	PlanGuardEntry	   *entry;
+	int					i;
 
-	data_load(PGAQO_STAT_FILE, _deform_stat_record_cb, NULL);
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
 
-	LWLockRelease(&aqo_state->stat_lock);
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == QP_TOTAL_NCOLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(&aqo_state->plan_guard_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, plan_guard_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		for (i = 0; i < AQO_PLAN_GUARD_NPLANS; i++)
+		{
+			AqoPlanStat *plan = &entry->plans[i];
+
+			if (plan->planid == 0)
+				continue;
+
+			values[QP_QUERYID] = Int64GetDatum(entry->queryid);
+			values[QP_PLANID] = Int64GetDatum(plan->planid);
+			values[QP_NEXECS] = Int64GetDatum(plan->nexecs);
+			values[QP_EXEC_TIME] = Float8GetDatum(plan->exec_time);
+			values[QP_GOOD] = BoolGetDatum(plan->planid == entry->good_planid);
+			values[QP_PIN_LEFT] = Int32GetDatum(entry->pin_left);
+			tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+		}
+	}
+	LWLockRelease(&aqo_state->plan_guard_lock);
+
+	return (Datum) 0;
 }
 
-static bool
-_check_dsa_validity(dsa_pointer ptr)
+/*
+ * Account buffer usage of a scan of the relation.
+ */
+void
+aqo_relio_store(Oid relid, int access, double hits, double reads)
 {
-	if (DsaPointerIsValid(ptr))
-		return true;
+	RelIOKey	key;
+	RelIOEntry *entry;
+	bool		found;
 
-	elog(LOG, "[AQO] DSA Pointer isn't valid. Is the memory limit exceeded?");
-	return false;
+	Assert(access >= 0 && access < AQO_ACCESS_KINDS);
+
+	memset(&key, 0, sizeof(RelIOKey));
+	key.dbid = MyDatabaseId;
+	key.relid = relid;
+	key.access = access;
+
+	LWLockAcquire(&aqo_state->relio_lock, LW_EXCLUSIVE);
+	entry = (RelIOEntry *) hash_search(relio_htab, &key, HASH_ENTER_NULL,
+									   &found);
+	if (entry == NULL)
+	{
+		/* Hash table is full. Don't learn the relation. */
+		LWLockRelease(&aqo_state->relio_lock);
+		return;
+	}
+
+	if (!found)
+	{
+		entry->nscans = 0;
+		entry->hits = 0.;
+		entry->reads = 0.;
+	}
+
+	entry->nscans++;
+	entry->hits = entry->hits * AQO_RELIO_DECAY + hits;
+	entry->reads = entry->reads * AQO_RELIO_DECAY + reads;
+	LWLockRelease(&aqo_state->relio_lock);
 }
 
-static bool
-_deform_qtexts_record_cb(void *data, size_t size)
+/*
+ * Returns the share of blocks found in shared buffers by recent scans of the
+ * relation, or -1 if too few blocks were observed.
+ */
+double
+aqo_relio_hit_ratio(Oid relid, int access)
 {
-	bool			found;
-	QueryTextEntry *entry;
-	uint64			queryid = *(uint64 *) data;
-	char		   *query_string = (char *) data + sizeof(queryid);
-	size_t			len = size - sizeof(queryid);
-	char		   *strptr;
+	RelIOKey	key;
+	RelIOEntry *entry;
+	double		ratio = -1.;
+
+	memset(&key, 0, sizeof(RelIOKey));
+	key.dbid = MyDatabaseId;
+	key.relid = relid;
+	key.access = access;
+
+	LWLockAcquire(&aqo_state->relio_lock, LW_SHARED);
+	entry = (RelIOEntry *) hash_search(relio_htab, &key, HASH_FIND, NULL);
+	if (entry != NULL && entry->hits + entry->reads >= AQO_RELIO_MIN_BLOCKS)
+		ratio = entry->hits / (entry->hits + entry->reads);
+	LWLockRelease(&aqo_state->relio_lock);
+
+	return ratio;
+}
 
-	Assert(LWLockHeldByMeInMode(&aqo_state->qtexts_lock, LW_EXCLUSIVE));
-	Assert(strlen(query_string) + 1 == len);
-	entry = (QueryTextEntry *) hash_search(qtexts_htab, &queryid,
-										   HASH_ENTER, &found);
-	Assert(!found);
+/*
+ * Remove I/O statistics of the dropped relations of the database. Oids of
+ * relations are unique only within a database.
+ */
+static void
+_relio_remove(Oid dbid, const Oid *reloids, int nreloids)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	RelIOEntry	   *entry;
+	int				i;
 
-	entry->qtext_dp = dsa_allocate(qtext_dsa, len);
-	if (!_check_dsa_validity(entry->qtext_dp))
+	LWLockAcquire(&aqo_state->relio_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, relio_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		/*
-		 * DSA stuck into problems. Rollback changes. Return false in belief
-		 * that caller recognize it and don't try to call us more.
-		 */
-		(void) hash_search(qtexts_htab, &queryid, HASH_REMOVE, NULL);
-		return false;
+		if (entry->key.dbid != dbid)
+			continue;
+
+		for (i = 0; i < nreloids; i++)
+		{
+			if (entry->key.relid != reloids[i])
+				continue;
+
+			if (!hash_search(relio_htab, &entry->key, HASH_REMOVE, NULL))
+				elog(PANIC, "[AQO] hash table corrupted");
+			break;
+		}
 	}
+	LWLockRelease(&aqo_state->relio_lock);
+}
 
-	strptr = (char *) dsa_get_address(qtext_dsa, entry->qtext_dp);
-	strlcpy(strptr, query_string, len);
-	return true;
+static void
+_relio_reset(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	RelIOEntry	   *entry;
+
+	LWLockAcquire(&aqo_state->relio_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, relio_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!hash_search(relio_htab, &entry->key, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+	}
+	LWLockRelease(&aqo_state->relio_lock);
 }
 
-void
-aqo_qtexts_load(void)
+/*
+ * Returns buffer cache behaviour of relations of the current database.
+ */
+Datum
+aqo_relation_io(PG_FUNCTION_ARGS)
 {
-	uint64	queryid = 0;
-	bool	found;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[RIO_TOTAL_NCOLS];
+	bool				nulls[RIO_TOTAL_NCOLS] = {0};
+	HASH_SEQ_STATUS		hash_seq;
+	RelIOEntry		   *entry;
 
-	Assert(!LWLockHeldByMe(&aqo_state->qtexts_lock));
-	Assert(qtext_dsa != NULL);
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
 
-	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-	if (hash_get_num_entries(qtexts_htab) != 0)
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == RIO_TOTAL_NCOLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(&aqo_state->relio_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, relio_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		/* Someone have done it concurrently. */
-		elog(LOG, "[AQO] Another backend have loaded query texts concurrently.");
-		LWLockRelease(&aqo_state->qtexts_lock);
+		double	total = entry->hits + entry->reads;
+
+		if (entry->key.dbid != MyDatabaseId)
+			continue;
+
+		values[RIO_RELID] = ObjectIdGetDatum(entry->key.relid);
+		values[RIO_ACCESS] = CStringGetTextDatum(
+						(entry->key.access == AQO_ACCESS_SEQ) ? "seq" : "random");
+		values[RIO_NSCANS] = Int64GetDatum(entry->nscans);
+		values[RIO_HITS] = Float8GetDatum(entry->hits);
+		values[RIO_READS] = Float8GetDatum(entry->reads);
+		nulls[RIO_HIT_RATIO] = (total <= 0.);
+		values[RIO_HIT_RATIO] = Float8GetDatum((total > 0.) ?
+											   entry->hits / total : 0.);
+		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+	}
+	LWLockRelease(&aqo_state->relio_lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Account errors of a shadow prediction and of the native estimate of a plan
+ * node.
+ */
+void
+aqo_shadow_store(uint64 fs, int fss, double error_aqo, double error_native)
+{
+	data_key		key = {.fs = fs, .fss = fss};
+	ShadowEntry	   *entry;
+	bool			found;
+
+	LWLockAcquire(&aqo_state->shadow_lock, LW_EXCLUSIVE);
+	entry = (ShadowEntry *) hash_search(shadow_htab, &key, HASH_ENTER_NULL,
+										&found);
+	if (entry == NULL)
+	{
+		/* Hash table is full. Don't account the subspace. */
+		LWLockRelease(&aqo_state->shadow_lock);
 		return;
 	}
 
-	data_load(PGAQO_TEXT_FILE, _deform_qtexts_record_cb, NULL);
+	if (!found)
+	{
+		entry->nobjects = 0;
+		entry->error_aqo = 0.;
+		entry->error_native = 0.;
+	}
+
+	entry->nobjects++;
+	entry->error_aqo += error_aqo;
+	entry->error_native += error_native;
+	LWLockRelease(&aqo_state->shadow_lock);
+}
+
+static void
+_shadow_remove(data_key *key)
+{
+	LWLockAcquire(&aqo_state->shadow_lock, LW_EXCLUSIVE);
+	(void) hash_search(shadow_htab, key, HASH_REMOVE, NULL);
+	LWLockRelease(&aqo_state->shadow_lock);
+}
+
+static void
+_shadow_reset(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	ShadowEntry	   *entry;
+
+	LWLockAcquire(&aqo_state->shadow_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, shadow_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!hash_search(shadow_htab, &entry->key, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+	}
+	LWLockRelease(&aqo_state->shadow_lock);
+}
+
+/*
+ * Returns mean errors of shadow predictions and of the native estimates, in
+ * the log scale, for feature subspaces.
+ */
+Datum
+aqo_shadow_data(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[SD_TOTAL_NCOLS];
+	bool				nulls[SD_TOTAL_NCOLS] = {0};
+	HASH_SEQ_STATUS		hash_seq;
+	ShadowEntry		   *entry;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == SD_TOTAL_NCOLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(&aqo_state->shadow_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, shadow_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		values[SD_FS] = Int64GetDatum(entry->key.fs);
+		values[SD_FSS] = Int32GetDatum((int) entry->key.fss);
+		values[SD_NOBJECTS] = Int64GetDatum(entry->nobjects);
+		values[SD_ERROR_AQO] = Float8GetDatum(entry->error_aqo /
+															entry->nobjects);
+		values[SD_ERROR_NATIVE] = Float8GetDatum(entry->error_native /
+															entry->nobjects);
+		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+	}
+	LWLockRelease(&aqo_state->shadow_lock);
+
+	return (Datum) 0;
+}
+
+static long
+aqo_stat_reset(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	StatEntry	   *entry;
+	long			num_remove = 0;
+	long			num_entries;
+
+	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
+	num_entries = hash_get_num_entries(stat_htab);
+	hash_seq_init(&hash_seq, stat_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!hash_search(stat_htab, &entry->queryid, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+		num_remove++;
+	}
+	aqo_state->stat_changed = true;
+	LWLockRelease(&aqo_state->stat_lock);
+
+	if (num_remove != num_entries)
+		elog(ERROR, "[AQO] Stat memory storage is corrupted or parallel access without a lock was detected.");
+
+	_plan_guard_reset();
+
+	aqo_stat_flush();
+
+	return num_remove;
+}
+
+static void *
+_form_stat_record_cb(void *ctx, size_t *size)
+{
+	HASH_SEQ_STATUS *hash_seq = (HASH_SEQ_STATUS *) ctx;
+	StatEntry		*entry;
+
+	*size = sizeof(StatEntry);
+	entry = hash_seq_search(hash_seq);
+	if (entry == NULL)
+		return NULL;
+
+	return memcpy(palloc(*size), entry, *size);
+}
+
+/* Implement data flushing according to pgss_shmem_shutdown() */
+
+void
+aqo_stat_flush(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	int				ret;
+	long			entries;
+
+	/* Use exclusive lock to prevent concurrent flushing in different backends. */
+	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
+
+	if (!aqo_state->stat_changed)
+		/* Hash table wasn't changed, meaningless to store it in permanent storage */
+		goto end;
+
+	entries = hash_get_num_entries(stat_htab);
+	hash_seq_init(&hash_seq, stat_htab);
+	ret = data_store(PGAQO_STAT_FILE, PGAQO_STAT_FILE_VERSION,
+					 _form_stat_record_cb, entries,
+					 (void *) &hash_seq);
+	if (ret != 0)
+		hash_seq_term(&hash_seq);
+	else
+		/* Hash table and disk storage are now consistent */
+		aqo_state->stat_changed = false;
+
+end:
+	LWLockRelease(&aqo_state->stat_lock);
+}
+
+/*
+ * State of the flush of query texts. Bodies go first, then the entries
+ * referencing them. New positions of the bodies in the file become valid only
+ * after successful write of the whole file.
+ */
+typedef struct QtextFlushCtx
+{
+	HASH_SEQ_STATUS	bodies_seq;
+	HASH_SEQ_STATUS	entries_seq;
+	bool			bodies_done;
+	int64			pos;		/* position in the new file */
+	int				fd;			/* the old file, to read non-resident texts */
+	uint64		   *keys;
+	int64		   *offsets;
+	int				nbodies;
+} QtextFlushCtx;
+
+static void *
+_form_qtext_record_cb(void *ctx, size_t *size)
+{
+	QtextFlushCtx  *fctx = (QtextFlushCtx *) ctx;
+	char		   *data;
+	char		   *ptr;
+
+	if (!fctx->bodies_done)
+	{
+		QueryTextBody  *body = hash_seq_search(&fctx->bodies_seq);
+
+		if (body != NULL)
+		{
+			char	tag = QTEXT_RECORD_BODY;
+			char	compressed = body->compressed;
+			char   *text;
+
+			/* Tombstones are stored too, to keep probe chains on restart */
+			if (body->refcount == 0)
+				text = "";
+			else if (DsaPointerIsValid(body->dp))
+				text = dsa_get_address(qtext_dsa, body->dp);
+			else if ((text = _qtext_file_read(body, &fctx->fd)) == NULL)
+			{
+				/* Keep the storage consistent at the cost of the text */
+				body->rawlen = body->len = 1;
+				body->compressed = compressed = false;
+				text = "";
+				body->check = _qtext_check(text, body->rawlen);
+			}
+
+			*size = sizeof(tag) + sizeof(body->key) + sizeof(body->rawlen) +
+					sizeof(body->len) + sizeof(compressed) + body->len;
+			ptr = data = palloc(*size);
+			memcpy(ptr, &tag, sizeof(tag));
+			ptr += sizeof(tag);
+			memcpy(ptr, &body->key, sizeof(body->key));
+			ptr += sizeof(body->key);
+			memcpy(ptr, &body->rawlen, sizeof(body->rawlen));
+			ptr += sizeof(body->rawlen);
+			memcpy(ptr, &body->len, sizeof(body->len));
+			ptr += sizeof(body->len);
+			memcpy(ptr, &compressed, sizeof(compressed));
+			ptr += sizeof(compressed);
+			memcpy(ptr, text, body->len);
+
+			/* The text will be placed at the tail of the record */
+			fctx->keys[fctx->nbodies] = body->key;
+			fctx->offsets[fctx->nbodies] = fctx->pos + sizeof(size_t) +
+										   (ptr - data);
+			fctx->nbodies++;
+			fctx->pos += sizeof(size_t) + *size;
+			return data;
+		}
+		fctx->bodies_done = true;
+	}
+
+	{
+		QueryTextEntry *entry = hash_seq_search(&fctx->entries_seq);
+		char			tag = QTEXT_RECORD_ENTRY;
+		int64			last_used;
+		uint64			hits;
+
+		if (entry == NULL)
+			return NULL;
+
+		*size = sizeof(tag) + sizeof(entry->queryid) + sizeof(last_used) +
+				sizeof(hits) + sizeof(entry->text_key);
+		ptr = data = palloc(*size);
+		memcpy(ptr, &tag, sizeof(tag));
+		ptr += sizeof(tag);
+		memcpy(ptr, &entry->queryid, sizeof(entry->queryid));
+		ptr += sizeof(entry->queryid);
+		last_used = (int64) pg_atomic_read_u64(&entry->usage.last_used);
+		memcpy(ptr, &last_used, sizeof(last_used));
+		ptr += sizeof(last_used);
+		hits = pg_atomic_read_u64(&entry->usage.hits);
+		memcpy(ptr, &hits, sizeof(hits));
+		ptr += sizeof(hits);
+		memcpy(ptr, &entry->text_key, sizeof(entry->text_key));
+		fctx->pos += sizeof(size_t) + *size;
+		return data;
+	}
+}
+
+/*
+ * Write query texts into the file. If texts aren't resident, remove stored
+ * texts from the shared memory: since now they are read from the file.
+ */
+void
+aqo_qtexts_flush(void)
+{
+	QtextFlushCtx	ctx;
+	int				ret;
+	long			entries;
+	long			nbodies;
+	int				i;
+
+	dsa_init();
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
+
+	if (!aqo_state->qtexts_changed)
+		/* XXX: mull over forced mode. */
+		goto end;
+
+	nbodies = hash_get_num_entries(qtext_bodies_htab);
+	entries = nbodies + hash_get_num_entries(qtexts_htab);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.pos = AQO_FILE_HEADER_SIZE;
+	ctx.fd = -1;
+	ctx.keys = palloc(nbodies * sizeof(uint64));
+	ctx.offsets = palloc(nbodies * sizeof(int64));
+	hash_seq_init(&ctx.bodies_seq, qtext_bodies_htab);
+	hash_seq_init(&ctx.entries_seq, qtexts_htab);
+	ret = data_store(PGAQO_TEXT_FILE, PGAQO_TEXT_FILE_VERSION,
+					 _form_qtext_record_cb, entries,
+					 (void *) &ctx);
+	if (ctx.fd >= 0)
+		CloseTransientFile(ctx.fd);
+
+	if (ret != 0)
+	{
+		if (!ctx.bodies_done)
+			hash_seq_term(&ctx.bodies_seq);
+		hash_seq_term(&ctx.entries_seq);
+	}
+	else
+	{
+		for (i = 0; i < ctx.nbodies; i++)
+		{
+			QueryTextBody *body;
+
+			body = (QueryTextBody *) hash_search(qtext_bodies_htab,
+												 &ctx.keys[i], HASH_FIND, NULL);
+			Assert(body != NULL);
+			body->offset = ctx.offsets[i];
+
+			if (!querytext_resident && DsaPointerIsValid(body->dp))
+			{
+				dsa_free(qtext_dsa, body->dp);
+				body->dp = InvalidDsaPointer;
+			}
+		}
+
+		/* Hash table and disk storage are now consistent */
+		aqo_state->qtexts_changed = false;
+	}
+	pfree(ctx.keys);
+	pfree(ctx.offsets);
+
+end:
+	LWLockRelease(&aqo_state->qtexts_lock);
+}
+
+/*
+ * Getting a hash table iterator, return a newly allocated memory chunk and its
+ * size for subsequent writing into storage.
+ */
+static void *
+_form_data_record_cb(void *ctx, size_t *size)
+{
+	HASH_SEQ_STATUS	   *hash_seq = (HASH_SEQ_STATUS *) ctx;
+	DataEntry		   *entry;
+	char			   *data;
+	char			   *ptr,
+					   *dsa_ptr;
+	size_t				sz;
+
+	entry = hash_seq_search(hash_seq);
+	if (entry == NULL)
+		return NULL;
+
+	/* Size of data is DataEntry (without DSA pointer) plus size of DSA chunk */
+	sz = offsetof(DataEntry, data_dp) + _compute_data_dsa(entry);
+	ptr = data = palloc(sz);
+
+	/* Put the data into the chunk */
+
+	/* Plane copy of all bytes of hash table entry */
+	memcpy(ptr, entry, offsetof(DataEntry, data_dp));
+	ptr += offsetof(DataEntry, data_dp);
+
+	Assert(DsaPointerIsValid(entry->data_dp));
+	dsa_ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
+	Assert((sz - (ptr - data)) == _compute_data_dsa(entry));
+	memcpy(ptr, dsa_ptr, sz - (ptr - data));
+	*size = sz;
+	return data;
+}
+
+void
+aqo_data_flush(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	int				ret;
+	long			entries;
+
+	dsa_init();
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+
+	if (!aqo_state->data_changed)
+		/* XXX: mull over forced mode. */
+		goto end;
+
+	entries = hash_get_num_entries(data_htab);
+	hash_seq_init(&hash_seq, data_htab);
+	ret = data_store(PGAQO_DATA_FILE, PGAQO_DATA_FILE_VERSION,
+					 _form_data_record_cb, entries,
+					 (void *) &hash_seq);
+	if (ret != 0)
+		/*
+		 * Something happened and storing procedure hasn't finished walking
+		 * along all records of the hash table.
+		 */
+		hash_seq_term(&hash_seq);
+	else
+		/* Hash table and disk storage are now consistent */
+		aqo_state->data_changed = false;
+end:
+	LWLockRelease(&aqo_state->data_lock);
+}
+
+static void *
+_form_queries_record_cb(void *ctx, size_t *size)
+{
+	HASH_SEQ_STATUS *hash_seq = (HASH_SEQ_STATUS *) ctx;
+	QueriesEntry		*entry;
+
+	*size = sizeof(QueriesEntry);
+	entry = hash_seq_search(hash_seq);
+	if (entry == NULL)
+		return NULL;
+
+	return memcpy(palloc(*size), entry, *size);
+}
+
+void
+aqo_queries_flush(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	int				ret;
+	long			entries;
+
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+
+	if (!aqo_state->queries_changed)
+		goto end;
+
+	entries = hash_get_num_entries(queries_htab);
+	hash_seq_init(&hash_seq, queries_htab);
+	ret = data_store(PGAQO_QUERIES_FILE, PGAQO_QUERIES_FILE_VERSION,
+					 _form_queries_record_cb, entries,
+					 (void *) &hash_seq);
+	if (ret != 0)
+		hash_seq_term(&hash_seq);
+	else
+		/* Hash table and disk storage are now consistent */
+		aqo_state->queries_changed = false;
+
+end:
+	LWLockRelease(&aqo_state->queries_lock);
+}
+
+static int
+data_store(const char *filename, uint32 version, form_record_t callback,
+		   long nrecs, void *ctx)
+{
+	FILE   *file;
+	size_t	size;
+	uint32	counter = 0;
+	void   *data;
+	char   *tmpfile;
+
+	tmpfile = psprintf("%s.tmp", filename);
+	file = AllocateFile(tmpfile, PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(&PGAQO_FILE_HEADER, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&version, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&PGAQO_PG_MAJOR_VERSION, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&nrecs, sizeof(long), 1, file) != 1)
+		goto error;
+
+	while ((data = callback(ctx, &size)) != NULL)
+	{
+		/* TODO: Add CRC code ? */
+		if (fwrite(&size, sizeof(size), 1, file) != 1 ||
+			fwrite(data, size, 1, file) != 1)
+			goto error;
+		counter++;
+	}
+
+	Assert(counter == nrecs);
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	/* Parallel (re)writing into a file haven't happen. */
+	(void) durable_rename(tmpfile, filename, PANIC);
+	elog(LOG, "[AQO] %d records stored in file %s.", counter, filename);
+	return 0;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write AQO file \"%s\": %m", tmpfile)));
+
+	if (file)
+		FreeFile(file);
+	unlink(tmpfile);
+	pfree(tmpfile);
+	return -1;
+}
+
+static bool
+_deform_stat_record_cb(void *data, size_t size)
+{
+	bool		found;
+	StatEntry  *entry;
+	uint64		queryid;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->stat_lock, LW_EXCLUSIVE));
+	Assert(size == sizeof(StatEntry));
+
+	queryid = ((StatEntry *) data)->queryid;
+	entry = (StatEntry *) hash_search(stat_htab, &queryid, HASH_ENTER, &found);
+	Assert(!found && entry);
+	memcpy(entry, data, sizeof(StatEntry));
+	LWLockInitialize(&entry->lock, aqo_state->stat_trancheid);
+	usage_restore(&entry->usage, &((StatEntry *) data)->usage);
+	return true;
+}
+
+void
+aqo_stat_load(void)
+{
+	Assert(!LWLockHeldByMe(&aqo_state->stat_lock));
+
+	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
+
+	/* Load on postmaster sturtup. So no any concurrent actions possible here. */
+	Assert(hash_get_num_entries(stat_htab) == 0);
+
+	data_load(PGAQO_STAT_FILE, PGAQO_STAT_FILE_VERSION,
+			  _deform_stat_record_cb, NULL);
+
+	LWLockRelease(&aqo_state->stat_lock);
+}
+
+static bool
+_check_dsa_validity(dsa_pointer ptr)
+{
+	if (DsaPointerIsValid(ptr))
+		return true;
+
+	elog(LOG, "[AQO] DSA Pointer isn't valid. Is the memory limit exceeded?");
+	return false;
+}
+
+/* Position of the next record in the file of query texts during the load */
+static int64 qtexts_load_pos = 0;
+
+static bool
+_deform_qtexts_record_cb(void *data, size_t size)
+{
+	char   *ptr = (char *) data;
+	char	tag;
+	int64	offset = qtexts_load_pos + sizeof(size_t);
+	bool	found;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->qtexts_lock, LW_EXCLUSIVE));
+
+	qtexts_load_pos += sizeof(size_t) + size;
+	memcpy(&tag, ptr, sizeof(tag));
+	ptr += sizeof(tag);
+
+	if (tag == QTEXT_RECORD_BODY)
+	{
+		QueryTextBody  *body;
+		uint64			key;
+		char			compressed;
+
+		memcpy(&key, ptr, sizeof(key));
+		ptr += sizeof(key);
+		body = (QueryTextBody *) hash_search(qtext_bodies_htab, &key,
+											 HASH_ENTER_NULL, &found);
+		if (body == NULL)
+			return false;
+		Assert(!found);
+
+		memcpy(&body->rawlen, ptr, sizeof(body->rawlen));
+		ptr += sizeof(body->rawlen);
+		memcpy(&body->len, ptr, sizeof(body->len));
+		ptr += sizeof(body->len);
+		memcpy(&compressed, ptr, sizeof(compressed));
+		ptr += sizeof(compressed);
+		Assert(size == (ptr - (char *) data) + body->len);
+
+		body->compressed = compressed;
+		body->refcount = 0;
+		body->offset = offset + (ptr - (char *) data);
+		body->dp = InvalidDsaPointer;
+		body->check = 0;
+
+		if (body->rawlen > 0 && !compressed)
+			body->check = _qtext_check(ptr, body->rawlen);
+		else if (body->rawlen > 0)
+		{
+			char   *text = palloc(body->rawlen);
+
+			if (pglz_decompress(ptr, body->len, text, body->rawlen, true) ==
+																body->rawlen)
+				body->check = _qtext_check(text, body->rawlen);
+			pfree(text);
+		}
+
+		/* Zero length means a tombstone. Keep it for probing */
+		if (querytext_resident && body->rawlen > 0)
+		{
+			body->dp = dsa_allocate_extended(qtext_dsa, body->len,
+											 DSA_ALLOC_NO_OOM);
+			if (!_check_dsa_validity(body->dp))
+			{
+				/*
+				 * DSA stuck into problems. Rollback changes. Return false in
+				 * belief that caller recognize it and don't try to call us
+				 * more.
+				 */
+				(void) hash_search(qtext_bodies_htab, &key, HASH_REMOVE, NULL);
+				return false;
+			}
+			memcpy(dsa_get_address(qtext_dsa, body->dp), ptr, body->len);
+		}
+	}
+	else if (tag == QTEXT_RECORD_ENTRY)
+	{
+		QueryTextEntry *entry;
+		QueryTextBody  *body;
+		uint64			queryid;
+		int64			last_used;
+		uint64			hits;
+		uint64			key;
+
+		memcpy(&queryid, ptr, sizeof(queryid));
+		ptr += sizeof(queryid);
+		memcpy(&last_used, ptr, sizeof(last_used));
+		ptr += sizeof(last_used);
+		memcpy(&hits, ptr, sizeof(hits));
+		ptr += sizeof(hits);
+		memcpy(&key, ptr, sizeof(key));
+
+		body = (QueryTextBody *) hash_search(qtext_bodies_htab, &key,
+											 HASH_FIND, NULL);
+		if (body == NULL)
+			/* The body hasn't loaded. Skip the text. */
+			return true;
+
+		entry = (QueryTextEntry *) hash_search(qtexts_htab, &queryid,
+											   HASH_ENTER, &found);
+		Assert(!found);
+		entry->text_key = key;
+		body->refcount++;
+		usage_init(&entry->usage, (TimestampTz) last_used, hits);
+	}
+	else
+		return false;
+
+	return true;
+}
+
+void
+aqo_qtexts_load(void)
+{
+	uint64			queryid = 0;
+	bool			found;
+	HASH_SEQ_STATUS	hash_seq;
+	QueryTextBody  *body;
+	uint64		   *tombs;
+	int				ntombs;
+	int				i;
+
+	Assert(!LWLockHeldByMe(&aqo_state->qtexts_lock));
+	Assert(qtext_dsa != NULL);
+
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
+
+	if (hash_get_num_entries(qtexts_htab) != 0)
+	{
+		/* Someone have done it concurrently. */
+		elog(LOG, "[AQO] Another backend have loaded query texts concurrently.");
+		LWLockRelease(&aqo_state->qtexts_lock);
+		return;
+	}
+
+	qtexts_load_pos = AQO_FILE_HEADER_SIZE;
+	data_load(PGAQO_TEXT_FILE, PGAQO_TEXT_FILE_VERSION,
+			  _deform_qtexts_record_cb, NULL);
+
+	/*
+	 * Bury bodies without any query class. Tombstones can't be purged during
+	 * the scan, so collect their keys and purge afterwards.
+	 */
+	ntombs = 0;
+	tombs = palloc((hash_get_num_entries(qtext_bodies_htab) + 1) *
+				   sizeof(uint64));
+	hash_seq_init(&hash_seq, qtext_bodies_htab);
+	while ((body = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (body->refcount > 0)
+			continue;
+
+		(void) _qtext_body_bury(body);
+		tombs[ntombs++] = body->key;
+	}
+	for (i = 0; i < ntombs; i++)
+		_qtext_body_purge(tombs[i]);
+	pfree(tombs);
+
+	/* Check existence of default feature space */
+	(void) hash_search(qtexts_htab, &queryid, HASH_FIND, &found);
+
+	aqo_state->qtexts_changed = false; /* mem data consistent with disk */
+	LWLockRelease(&aqo_state->qtexts_lock);
+
+	if (!found)
+	{
+		if (!aqo_qtext_store(0, "COMMON feature space (do not delete!)"))
+			elog(PANIC, "[AQO] DSA Initialization was unsuccessful");
+	}
+}
+
+/*
+ * Getting a data chunk from a caller, add a record into the 'ML data'
+ * shmem hash table. Allocate and fill DSA chunk for variadic part of the data.
+ */
+static bool
+_deform_data_record_cb(void *data, size_t size)
+{
+	bool		found;
+	DataEntry  *fentry = (DataEntry *) data; /*Depends on a platform? */
+	DataEntry  *entry;
+	size_t		sz;
+	char	   *ptr = (char *) data,
+			   *dsa_ptr;
+
+	Assert(ptr != NULL);
+	Assert(LWLockHeldByMeInMode(&aqo_state->data_lock, LW_EXCLUSIVE));
+
+	entry = (DataEntry *) hash_search(data_htab, &fentry->key,
+									  HASH_ENTER, &found);
+	Assert(!found);
+
+	/* Copy fixed-size part of entry byte-by-byte even with caves */
+	memcpy(entry, fentry, offsetof(DataEntry, data_dp));
+	usage_restore(&entry->usage, &fentry->usage);
+	ptr += offsetof(DataEntry, data_dp);
+
+	sz = _compute_data_dsa(entry);
+	Assert(sz + offsetof(DataEntry, data_dp) == size);
+	entry->data_dp = dsa_allocate(data_dsa, sz);
+
+	if (!_check_dsa_validity(entry->data_dp))
+	{
+		/*
+		 * DSA stuck into problems. Rollback changes. Return false in belief
+		 * that caller recognize it and don't try to call us more.
+		 */
+		(void) hash_search(data_htab, &fentry->key, HASH_REMOVE, NULL);
+		return false;
+	}
+
+	dsa_ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
+	Assert(dsa_ptr != NULL);
+	memcpy(dsa_ptr, ptr, sz);
+	_reloids_index_add(&entry->key, entry->dbid, _data_entry_reloids(entry),
+					   entry->nrels);
+	return true;
+}
+
+void
+aqo_data_load(void)
+{
+	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
+	Assert(data_dsa != NULL);
+
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+
+	if (hash_get_num_entries(data_htab) != 0)
+	{
+		/* Someone have done it concurrently. */
+		elog(LOG, "[AQO] Another backend have loaded query data concurrently.");
+		LWLockRelease(&aqo_state->data_lock);
+		return;
+	}
+
+	data_load(PGAQO_DATA_FILE, PGAQO_DATA_FILE_VERSION,
+			  _deform_data_record_cb, NULL);
+
+	aqo_state->data_changed = false; /* mem data is consistent with disk */
+	LWLockRelease(&aqo_state->data_lock);
+}
+
+static bool
+_deform_queries_record_cb(void *data, size_t size)
+{
+	bool			found;
+	QueriesEntry  	*entry;
+	uint64			queryid;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->queries_lock, LW_EXCLUSIVE));
+	Assert(size == sizeof(QueriesEntry));
+
+	queryid = ((QueriesEntry *) data)->queryid;
+	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_ENTER, &found);
+	Assert(!found);
+	memcpy(entry, data, sizeof(QueriesEntry));
+	usage_restore(&entry->usage, &((QueriesEntry *) data)->usage);
+
+	/*
+	 * Don't mark the storage as changed: it is consistent with the disk.
+	 * Backends can't have cached settings before the load.
+	 */
+	return true;
+}
+
+void
+aqo_queries_load(void)
+{
+	bool	found;
+	uint64	queryid = 0;
+
+	Assert(!LWLockHeldByMe(&aqo_state->queries_lock));
+
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+
+	/* Load on postmaster startup. So no any concurrent actions possible here. */
+	Assert(hash_get_num_entries(queries_htab) == 0);
+
+	data_load(PGAQO_QUERIES_FILE, PGAQO_QUERIES_FILE_VERSION,
+			  _deform_queries_record_cb, NULL);
+
+	/* Check existence of default feature space */
+	(void) hash_search(queries_htab, &queryid, HASH_FIND, &found);
+
+	LWLockRelease(&aqo_state->queries_lock);
+	if (!found)
+	{
+		if (!aqo_queries_store(0, 0, 0, 0, 0, &aqo_queries_nulls))
+			elog(PANIC, "[AQO] aqo_queries initialization was unsuccessful");
+	}
+}
+
+static void
+data_load(const char *filename, uint32 version, deform_record_t callback,
+		  void *ctx)
+{
+	FILE   *file;
+	long	i;
+	uint32	header;
+	uint32	filever;
+	int32	pgver;
+	long	num;
+
+	file = AllocateFile(filename, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			goto read_error;
+		return;
+	}
+
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&filever, sizeof(uint32), 1, file) != 1 ||
+		fread(&pgver, sizeof(uint32), 1, file) != 1 ||
+		fread(&num, sizeof(long), 1, file) != 1)
+		goto read_error;
+
+	if (header != PGAQO_FILE_HEADER || filever != version ||
+		pgver != PGAQO_PG_MAJOR_VERSION)
+		goto data_error;
+
+	for (i = 0; i < num; i++)
+	{
+		void   *data;
+		size_t	size;
+		bool	res;
+
+		if (fread(&size, sizeof(size), 1, file) != 1)
+			goto read_error;
+		data = palloc(size);
+		if (fread(data, size, 1, file) != 1)
+			goto read_error;
+		res = callback(data, size);
+
+		if (!res)
+		{
+			/* Error detected. Do not try to read tails of the storage. */
+			elog(LOG, "[AQO] Because of an error skip %ld storage records.",
+				 num - i);
+			break;
+		}
+	}
+
+	FreeFile(file);
+
+	elog(LOG, "[AQO] %ld records loaded from file %s.", num, filename);
+	return;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read file \"%s\": %m", filename)));
+	goto fail;
+data_error:
+	ereport(LOG,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("ignoring invalid data in file \"%s\"", filename)));
+fail:
+	if (file)
+		FreeFile(file);
+	unlink(filename);
+}
+
+static void
+on_shmem_shutdown(int code, Datum arg)
+{
+	/*
+	 * XXX: It can be expensive to rewrite a file on each shutdown of a backend.
+	 */
+	aqo_qtexts_flush();
+	aqo_data_flush();
+}
+
+/*
+ * Initialize DSA memory for AQO shared data with variable length.
+ * On first call, create DSA segments and load data into hash table and DSA
+ * from disk.
+ */
+static void
+dsa_init()
+{
+	MemoryContext	old_context;
+
+	if (qtext_dsa)
+		return;
+
+	Assert(data_dsa == NULL);
+	old_context = MemoryContextSwitchTo(TopMemoryContext);
+	LWLockAcquire(&aqo_state->lock, LW_EXCLUSIVE);
+
+	/*
+	 * Query texts and ML data live in separate areas with their own limits.
+	 * So, a flood of long query texts can't push out learned models.
+	 */
+	if (aqo_state->qtexts_dsa_handler == DSM_HANDLE_INVALID)
+	{
+		Assert(aqo_state->data_dsa_handler == DSM_HANDLE_INVALID);
+
+		qtext_dsa = dsa_create(aqo_state->qtext_trancheid);
+		Assert(qtext_dsa != NULL);
+
+		if (querytext_dsm_size_max > 0)
+			dsa_set_size_limit(qtext_dsa,
+							   (size_t) querytext_dsm_size_max * 1024 * 1024);
+
+		dsa_pin(qtext_dsa);
+		aqo_state->qtexts_dsa_handler = dsa_get_handle(qtext_dsa);
+
+		data_dsa = dsa_create(aqo_state->data_trancheid);
+		Assert(data_dsa != NULL);
+
+		if (dsm_size_max > 0)
+			dsa_set_size_limit(data_dsa, (size_t) dsm_size_max * 1024 * 1024);
+
+		dsa_pin(data_dsa);
+		aqo_state->data_dsa_handler = dsa_get_handle(data_dsa);
+
+		/* Load and initialize query texts hash table */
+		aqo_qtexts_load();
+		aqo_data_load();
+	}
+	else
+	{
+		qtext_dsa = dsa_attach(aqo_state->qtexts_dsa_handler);
+		data_dsa = dsa_attach(aqo_state->data_dsa_handler);
+	}
+
+	dsa_pin_mapping(qtext_dsa);
+	dsa_pin_mapping(data_dsa);
+	MemoryContextSwitchTo(old_context);
+	LWLockRelease(&aqo_state->lock);
+
+	before_shmem_exit(on_shmem_shutdown, (Datum) 0);
+}
+
+/* ************************************************************************** */
+
+/*
+ * Read stored (maybe compressed) text of the body from the file of query
+ * texts. The file is opened on first call and must be closed by the caller.
+ * Returns NULL if the text can't be read.
+ */
+static char *
+_qtext_file_read(QueryTextBody *body, int *fd)
+{
+	char   *text;
+
+	Assert(LWLockHeldByMe(&aqo_state->qtexts_lock));
+
+	if (body->offset < 0)
+		return NULL;
+
+	if (*fd < 0 &&
+		(*fd = OpenTransientFile(PGAQO_TEXT_FILE, O_RDONLY | PG_BINARY)) < 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", PGAQO_TEXT_FILE)));
+		return NULL;
+	}
+
+	text = palloc(body->len);
+	if (pg_pread(*fd, text, body->len, body->offset) != body->len)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", PGAQO_TEXT_FILE)));
+		pfree(text);
+		return NULL;
+	}
+	return text;
+}
+
+/*
+ * Return a palloc'ed copy of the text. Non-resident texts are read from the
+ * file, see _qtext_file_read(). Returns NULL if the text is lost.
+ */
+static char *
+_qtext_body_get(QueryTextBody *body, int *fd)
+{
+	char   *stored;
+	char   *text;
+
+	Assert(LWLockHeldByMe(&aqo_state->qtexts_lock));
+
+	if (DsaPointerIsValid(body->dp))
+		stored = dsa_get_address(qtext_dsa, body->dp);
+	else if ((stored = _qtext_file_read(body, fd)) == NULL)
+		return NULL;
+
+	text = palloc(body->rawlen);
+	if (!body->compressed)
+		memcpy(text, stored, body->rawlen);
+	else if (pglz_decompress(stored, body->len, text, body->rawlen, true) !=
+																body->rawlen)
+	{
+		elog(LOG, "[AQO] Compressed query text " UINT64_FORMAT " is corrupted",
+			 body->key);
+		pfree(text);
+		text = NULL;
+	}
+
+	if (!DsaPointerIsValid(body->dp))
+		pfree(stored);
+	return text;
+}
+
+/*
+ * Remove tombstones from the tail of the probe chain, starting from the key.
+ * A tombstone in the middle of the chain must stay: lookups of the following
+ * bodies probe through it.
+ */
+static void
+_qtext_body_purge(uint64 key)
+{
+	QueryTextBody  *body;
+	uint64			next;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->qtexts_lock, LW_EXCLUSIVE));
+
+	while ((body = (QueryTextBody *) hash_search(qtext_bodies_htab, &key,
+												 HASH_FIND, NULL)) != NULL)
+	{
+		if (body->refcount > 0)
+			break;
+
+		next = key + 1;
+		if (hash_search(qtext_bodies_htab, &next, HASH_FIND, NULL) != NULL)
+			break;
+
+		(void) hash_search(qtext_bodies_htab, &key, HASH_REMOVE, NULL);
+		key--;
+	}
+}
+
+/*
+ * Another hash of the text, independent from the key of the body. Texts of
+ * the same length and the same check are considered as equal, if the stored
+ * one isn't resident: the file isn't read under the lock.
+ */
+static uint64
+_qtext_check(const char *text, int32 rawlen)
+{
+	return hash_bytes_extended((const unsigned char *) text, rawlen,
+							   QTEXT_CHECK_SEED);
+}
+
+/*
+ * Find a body with the same text or store a new one. Compress the text, if
+ * allowed. Returns NULL if no memory or no room in the hash table.
+ *
+ * Bodies with zero refcount are tombstones of released texts. Lookup probes
+ * through them, insertion reuses the first one of the chain.
+ */
+static QueryTextBody *
+_qtext_body_acquire(const char *text, int32 rawlen)
+{
+	QueryTextBody  *body;
+	uint64			key;
+	uint64			check = _qtext_check(text, rawlen);
+	uint64			free_key = 0;
+	bool			has_free = false;
+	bool			found;
+	char		   *stored = (char *) text;
+	int32			len = rawlen;
+	bool			compressed = false;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->qtexts_lock, LW_EXCLUSIVE));
+
+	/* Look for the same text. Probe next keys on collisions. */
+	key = hash_bytes_extended((const unsigned char *) text, rawlen, 0);
+	while ((body = (QueryTextBody *) hash_search(qtext_bodies_htab, &key,
+												 HASH_FIND, NULL)) != NULL)
+	{
+		if (body->refcount == 0)
+		{
+			if (!has_free)
+			{
+				free_key = key;
+				has_free = true;
+			}
+		}
+		else if (body->rawlen == rawlen && body->check == check)
+		{
+			char   *str;
+			bool	equal;
+
+			if (!DsaPointerIsValid(body->dp))
+				break;
+
+			/* The resident text is compared as is */
+			str = _qtext_body_get(body, NULL);
+			equal = (str != NULL && memcmp(str, text, rawlen) == 0);
+			if (str != NULL)
+				pfree(str);
+			if (equal)
+				break;
+		}
+		key++;
+	}
+
+	if (body != NULL)
+	{
+		body->refcount++;
+		return body;
+	}
+
+	if (has_free)
+		key = free_key;
+	else if (hash_get_num_entries(qtext_bodies_htab) >= fs_max_items)
+		return NULL;
+
+	if (querytext_compression)
+	{
+		char   *buf = palloc(PGLZ_MAX_OUTPUT(rawlen));
+		int32	clen;
+
+		clen = pglz_compress(text, rawlen, buf, PGLZ_strategy_default);
+		if (clen >= 0)
+		{
+			stored = buf;
+			len = clen;
+			compressed = true;
+		}
+		else
+			pfree(buf);
+	}
+
+	body = (QueryTextBody *) hash_search(qtext_bodies_htab, &key, HASH_ENTER,
+										 &found);
+	Assert(found == has_free);
+	body->dp = dsa_allocate_extended(qtext_dsa, len, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(body->dp))
+	{
+		/* Leave the tombstone, if any, in place */
+		if (!has_free)
+			(void) hash_search(qtext_bodies_htab, &key, HASH_REMOVE, NULL);
+		body = NULL;
+	}
+	else
+	{
+		memcpy(dsa_get_address(qtext_dsa, body->dp), stored, len);
+		body->refcount = 1;
+		body->rawlen = rawlen;
+		body->len = len;
+		body->compressed = compressed;
+		body->check = check;
+		body->offset = -1;
+	}
+
+	if (compressed)
+		pfree(stored);
+	return body;
+}
+
+/*
+ * Turn the body into a tombstone: free the text, but keep the hash table
+ * entry, until it isn't needed for probing.
+ */
+static size_t
+_qtext_body_bury(QueryTextBody *body)
+{
+	size_t	freed = 0;
+
+	Assert(body->refcount == 0);
+
+	if (DsaPointerIsValid(body->dp))
+	{
+		dsa_free(qtext_dsa, body->dp);
+		body->dp = InvalidDsaPointer;
+		freed = body->len;
+	}
+	body->rawlen = body->len = 0;
+	body->compressed = false;
+	body->check = 0;
+	body->offset = -1;
+	return freed;
+}
+
+/*
+ * Release the body of a query text. Returns number of bytes freed in the DSA
+ * area.
+ *
+ * Removing the body could break probe chains of the following keys, see
+ * _qtext_body_acquire(). So, leave a tombstone and remove it only at the tail
+ * of the chain.
+ */
+static size_t
+_qtext_body_release(uint64 key)
+{
+	QueryTextBody  *body;
+	size_t			freed;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->qtexts_lock, LW_EXCLUSIVE));
+
+	body = (QueryTextBody *) hash_search(qtext_bodies_htab, &key, HASH_FIND,
+										 NULL);
+	if (body == NULL || body->refcount <= 0)
+		elog(PANIC, "[AQO] Query text body " UINT64_FORMAT " doesn't exist",
+			 key);
+
+	if (--body->refcount > 0)
+		return 0;
+
+	freed = _qtext_body_bury(body);
+	_qtext_body_purge(key);
+	return freed;
+}
+
+typedef struct QtextVictim
+{
+	uint64		queryid;
+	TimestampTz	last_used;
+} QtextVictim;
+
+static int
+_qtext_victim_cmp(const void *a, const void *b)
+{
+	TimestampTz	ta = ((const QtextVictim *) a)->last_used;
+	TimestampTz	tb = ((const QtextVictim *) b)->last_used;
+
+	return (ta > tb) - (ta < tb);
+}
+
+/*
+ * Free the area of query texts for a new text of the given size. Remove least
+ * recently used texts, at least a tenth of the resident ones at once, to not
+ * repeat the eviction on each new query class. Texts, which aren't resident,
+ * don't occupy the area and aren't evicted. Default feature space and the
+ * class which we store the text for are kept.
+ * Returns number of removed texts. Caller must hold the lock exclusively.
+ */
+static int
+_qtexts_evict(uint64 queryid, size_t size)
+{
+	HASH_SEQ_STATUS		hash_seq;
+	QueryTextEntry	   *entry;
+	QtextVictim		   *victims;
+	long				nentries = hash_get_num_entries(qtexts_htab);
+	int					nvictims = 0;
+	int					nremoved = 0;
+	int					nfreed = 0;
+	size_t				freed = 0;
+	int					i;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->qtexts_lock, LW_EXCLUSIVE));
+
+	victims = palloc(nentries * sizeof(QtextVictim));
+	hash_seq_init(&hash_seq, qtexts_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		QueryTextBody  *body;
+
+		if (entry->queryid == 0 || entry->queryid == queryid)
+			continue;
+
+		body = (QueryTextBody *) hash_search(qtext_bodies_htab,
+											 &entry->text_key, HASH_FIND,
+											 NULL);
+		if (body == NULL || !DsaPointerIsValid(body->dp))
+			continue;
+
+		victims[nvictims].queryid = entry->queryid;
+		victims[nvictims].last_used =
+					(TimestampTz) pg_atomic_read_u64(&entry->usage.last_used);
+		nvictims++;
+	}
+	qsort(victims, nvictims, sizeof(QtextVictim), _qtext_victim_cmp);
+
+	/* A shared body frees the memory with the last of its texts only */
+	for (i = 0; i < nvictims && (freed < size || nfreed < nvictims / 10); i++)
+	{
+		size_t	released;
+
+		entry = (QueryTextEntry *) hash_search(qtexts_htab, &victims[i].queryid,
+											   HASH_FIND, NULL);
+		Assert(entry != NULL);
+
+		released = _qtext_body_release(entry->text_key);
+		(void) hash_search(qtexts_htab, &victims[i].queryid, HASH_REMOVE, NULL);
+		nremoved++;
+
+		if (released > 0)
+		{
+			freed += released;
+			nfreed++;
+		}
+	}
+	pfree(victims);
+
+	if (nremoved > 0)
+	{
+		aqo_state->qtexts_changed = true;
+		elog(LOG, "[AQO] Query texts storage is full: %d least recently used "
+			 "texts were evicted.", nremoved);
+	}
+	return nremoved;
+}
+
+/*
+ * XXX: Maybe merge with aqo_queries ?
+ */
+bool
+aqo_qtext_store(uint64 queryid, const char *query_string)
+{
+	QueryTextEntry *entry;
+	bool			found;
+	bool			tblOverflow;
+	HASHACTION		action;
+
+	Assert(!LWLockHeldByMe(&aqo_state->qtexts_lock));
+
+	if (query_string == NULL || querytext_max_size == 0)
+		return false;
+
+	dsa_init();
+
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
+
+	/* Check hash table overflow */
+	tblOverflow = hash_get_num_entries(qtexts_htab) < fs_max_items ? false : true;
+	action = tblOverflow ? HASH_FIND : HASH_ENTER;
+
+	entry = (QueryTextEntry *) hash_search(qtexts_htab, &queryid, action,
+										   &found);
+
+	/* Initialize entry on first usage */
+	if (!found)
+	{
+		size_t			size = strlen(query_string) + 1;
+		char		   *text = (char *) query_string;
+		QueryTextBody  *body;
+
+		if (action == HASH_FIND)
+		{
+			/*
+			 * Hash table is full. To avoid possible problems - don't try to add
+			 * more, just exit
+			 */
+			LWLockRelease(&aqo_state->qtexts_lock);
+			ereport(LOG,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("[AQO] Query texts storage is full. No more feature spaces can be added."),
+				 errhint("Increase value of aqo.fs_max_items on restart of the instance")));
+			return false;
+		}
+
+		entry->queryid = queryid;
+		if (size > querytext_max_size)
+		{
+			size = querytext_max_size;
+			text = palloc(size);
+			strlcpy(text, query_string, size);
+		}
+
+		body = _qtext_body_acquire(text, size);
+
+		/*
+		 * The area of query texts is full. Make room at the expense of the
+		 * least recently used texts.
+		 */
+		if (body == NULL && _qtexts_evict(queryid, size) > 0)
+			body = _qtext_body_acquire(text, size);
+
+		if (text != query_string)
+			pfree(text);
+
+		if (body == NULL)
+		{
+			/*
+			 * DSA stuck into problems. Rollback changes. Return false in belief
+			 * that caller recognize it and don't try to call us more.
+			 */
+			elog(LOG, "[AQO] Can't store the query text. Is the memory limit exceeded?");
+			(void) hash_search(qtexts_htab, &queryid, HASH_REMOVE, NULL);
+			LWLockRelease(&aqo_state->qtexts_lock);
+			return false;
+		}
+
+		entry->text_key = body->key;
+		usage_init(&entry->usage, GetCurrentTimestamp(), 0);
+		aqo_state->qtexts_changed = true;
+	}
+	LWLockRelease(&aqo_state->qtexts_lock);
+	return true;
+}
+
+Datum
+aqo_query_texts(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[QT_TOTAL_NCOLS];
+	bool				nulls[QT_TOTAL_NCOLS];
+	HASH_SEQ_STATUS		hash_seq;
+	QueryTextEntry	   *entry;
+	int					fd = -1;
+
+	Assert(!LWLockHeldByMe(&aqo_state->qtexts_lock));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == QT_TOTAL_NCOLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	dsa_init();
+	memset(nulls, 0, QT_TOTAL_NCOLS);
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, qtexts_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		QueryTextBody  *body;
+		char		   *ptr = NULL;
+
+		body = (QueryTextBody *) hash_search(qtext_bodies_htab,
+											 &entry->text_key, HASH_FIND, NULL);
+		Assert(body != NULL);
+		ptr = _qtext_body_get(body, &fd);
+
+		values[QT_QUERYID] = Int64GetDatum(entry->queryid);
+		nulls[QT_QUERY_STRING] = (ptr == NULL);
+		if (ptr != NULL)
+		{
+			values[QT_QUERY_STRING] = CStringGetTextDatum(ptr);
+			pfree(ptr);
+		}
+		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+	}
+
+	LWLockRelease(&aqo_state->qtexts_lock);
+	if (fd >= 0)
+		CloseTransientFile(fd);
+	return (Datum) 0;
+}
+
+static bool
+_aqo_stat_remove(uint64 queryid)
+{
+	bool		found;
+
+	Assert(!LWLockHeldByMe(&aqo_state->stat_lock));
+	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
+	(void) hash_search(stat_htab, &queryid, HASH_FIND, &found);
+
+	if (found)
+	{
+		(void) hash_search(stat_htab, &queryid, HASH_REMOVE, NULL);
+		aqo_state->stat_changed = true;
+	}
+
+	LWLockRelease(&aqo_state->stat_lock);
+
+	_plan_guard_remove(queryid);
+	return found;
+}
+
+static bool
+_aqo_queries_remove(uint64 queryid)
+{
+	bool	found;
+
+	Assert(!LWLockHeldByMe(&aqo_state->queries_lock));
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+	(void) hash_search(queries_htab, &queryid, HASH_FIND, &found);
+
+	if (found)
+	{
+		(void) hash_search(queries_htab, &queryid, HASH_REMOVE, NULL);
+		queries_storage_changed();
+	}
+
+	LWLockRelease(&aqo_state->queries_lock);
+	return found;
+}
+
+static bool
+_aqo_qtexts_remove(uint64 queryid)
+{
+	bool			found = false;
+	QueryTextEntry *entry;
+
+	dsa_init();
+
+	Assert(!LWLockHeldByMe(&aqo_state->qtexts_lock));
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
+
+	/*
+	 * Look for a record with this queryid. DSA fields must be freed before
+	 * deletion of the record.
+	 */
+	entry = (QueryTextEntry *) hash_search(qtexts_htab, &queryid, HASH_FIND,
+										   &found);
+	if (found)
+	{
+		/* Free DSA memory, allocated for this record */
+		(void) _qtext_body_release(entry->text_key);
+
+		(void) hash_search(qtexts_htab, &queryid, HASH_REMOVE, NULL);
+		aqo_state->qtexts_changed = true;
+	}
+
+	LWLockRelease(&aqo_state->qtexts_lock);
+	return found;
+}
+
+static bool
+_aqo_data_remove(data_key *key)
+{
+	DataEntry  *entry;
+	bool		found;
+
+	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+
+	entry = (DataEntry *) hash_search(data_htab, key, HASH_FIND, &found);
+	if (found)
+	{
+		/* Free DSA memory, allocated for this record */
+		_data_entry_release(entry);
+
+		if (!hash_search(data_htab, key, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] Inconsistent data hash table");
+
+		aqo_state->data_changed = true;
+	}
+
+	LWLockRelease(&aqo_state->data_lock);
+	_shadow_remove(key);
+	return found;
+}
+
+static long
+aqo_qtexts_reset(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	QueryTextEntry *entry;
+	long			num_remove = 0;
+	long			num_entries;
+
+	dsa_init();
+
+	Assert(!LWLockHeldByMe(&aqo_state->qtexts_lock));
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
+	num_entries = hash_get_num_entries(qtexts_htab);
+	hash_seq_init(&hash_seq, qtexts_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->queryid == 0)
+			continue;
+
+		(void) _qtext_body_release(entry->text_key);
+		if (!hash_search(qtexts_htab, &entry->queryid, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+		num_remove++;
+	}
+	aqo_state->qtexts_changed = true;
+	LWLockRelease(&aqo_state->qtexts_lock);
+	if (num_remove != num_entries - 1)
+		elog(ERROR, "[AQO] Query texts memory storage is corrupted or parallel access without a lock was detected.");
+
+	aqo_qtexts_flush();
+
+	return num_remove;
+}
+
+static size_t
+_compute_data_dsa(const DataEntry *entry)
+{
+	size_t	size = sizeof(data_key); /* header's size */
+
+	size += sizeof(double) * entry->rows * entry->cols; /* matrix */
+	size += 2 * sizeof(double) * entry->rows; /* targets, rfactors */
+
+	/* Model-specific payload */
+	size += sizeof(double) * aqo_model_routine(entry->model)->size(entry->cols);
+
+	/* Calculate memory size needed to store relation names */
+	size += entry->nrels * sizeof(Oid);
+	return size;
+}
+
+/*
+ * Get list of relations, stored at the tail of the DSA chunk of the entry.
+ */
+static Oid *
+_data_entry_reloids(const DataEntry *entry)
+{
+	char   *ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
+
+	Assert(ptr != NULL);
+	return (Oid *) (ptr + _compute_data_dsa(entry) - entry->nrels * sizeof(Oid));
+}
+
+/*
+ * Add the aqo_data entry into the reverse index of relations.
+ *
+ * If the index can't be extended because of memory limits, mark it as invalid.
+ * In this case cleanup will check the relations of each entry itself.
+ */
+static void
+_reloids_index_add(const data_key *key, Oid dbid, const Oid *reloids,
+				   int nrels)
+{
+	RelOidIndexKey	rkey = {.dbid = dbid};
+	int				i;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->data_lock, LW_EXCLUSIVE));
+
+	for (i = 0; i < nrels && aqo_state->reloids_index_valid; i++)
+	{
+		RelOidIndexEntry   *entry;
+		data_key		   *keys;
+		bool				found;
+
+		rkey.reloid = reloids[i];
+		entry = (RelOidIndexEntry *) hash_search(reloids_htab, &rkey,
+												 HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+		{
+			aqo_state->reloids_index_valid = false;
+			break;
+		}
+
+		if (!found)
+		{
+			entry->nkeys = 0;
+			entry->maxkeys = 0;
+			entry->keys_dp = InvalidDsaPointer;
+		}
+		else
+		{
+			Assert(entry->nkeys > 0);
+			keys = (data_key *) dsa_get_address(data_dsa, entry->keys_dp);
+
+			/* The relation is mentioned in the entry more than once */
+			if (memcmp(&keys[entry->nkeys - 1], key, sizeof(data_key)) == 0)
+				continue;
+		}
+
+		if (entry->nkeys == entry->maxkeys)
+		{
+			int			maxkeys = (entry->maxkeys > 0) ? entry->maxkeys * 2 : 4;
+			dsa_pointer	keys_dp;
+
+			keys_dp = dsa_allocate_extended(data_dsa, maxkeys * sizeof(data_key),
+											DSA_ALLOC_NO_OOM);
+			if (!DsaPointerIsValid(keys_dp))
+			{
+				if (entry->nkeys == 0)
+					(void) hash_search(reloids_htab, &rkey, HASH_REMOVE, NULL);
+				aqo_state->reloids_index_valid = false;
+				break;
+			}
+
+			if (entry->nkeys > 0)
+			{
+				memcpy(dsa_get_address(data_dsa, keys_dp),
+					   dsa_get_address(data_dsa, entry->keys_dp),
+					   entry->nkeys * sizeof(data_key));
+				dsa_free(data_dsa, entry->keys_dp);
+			}
+			entry->keys_dp = keys_dp;
+			entry->maxkeys = maxkeys;
+		}
+
+		keys = (data_key *) dsa_get_address(data_dsa, entry->keys_dp);
+		keys[entry->nkeys++] = *key;
+	}
+}
+
+/*
+ * Exclude the aqo_data entry from the reverse index of relations.
+ */
+static void
+_reloids_index_remove(const data_key *key, Oid dbid, const Oid *reloids,
+					  int nrels)
+{
+	RelOidIndexKey	rkey = {.dbid = dbid};
+	int				i;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->data_lock, LW_EXCLUSIVE));
+
+	for (i = 0; i < nrels; i++)
+	{
+		RelOidIndexEntry   *entry;
+		data_key		   *keys;
+		int					j;
+
+		rkey.reloid = reloids[i];
+		entry = (RelOidIndexEntry *) hash_search(reloids_htab, &rkey,
+												 HASH_FIND, NULL);
+		if (entry == NULL)
+			/* Already removed or the index is invalid */
+			continue;
+
+		keys = (data_key *) dsa_get_address(data_dsa, entry->keys_dp);
+		for (j = 0; j < entry->nkeys; j++)
+		{
+			if (memcmp(&keys[j], key, sizeof(data_key)) != 0)
+				continue;
+
+			keys[j] = keys[--entry->nkeys];
+			break;
+		}
+
+		if (entry->nkeys == 0)
+		{
+			dsa_free(data_dsa, entry->keys_dp);
+			(void) hash_search(reloids_htab, &rkey, HASH_REMOVE, NULL);
+		}
+	}
+}
+
+/*
+ * Remove all the entries of the reverse index and make it valid again.
+ */
+static void
+_reloids_index_reset(void)
+{
+	HASH_SEQ_STATUS		hash_seq;
+	RelOidIndexEntry   *entry;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->data_lock, LW_EXCLUSIVE));
+
+	hash_seq_init(&hash_seq, reloids_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (DsaPointerIsValid(entry->keys_dp))
+			dsa_free(data_dsa, entry->keys_dp);
+		if (!hash_search(reloids_htab, &entry->key, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+	}
+
+	aqo_state->reloids_index_valid = true;
+}
+
+/*
+ * Free DSA memory of the aqo_data entry and exclude it from the reverse index.
+ * Caller removes the entry from the hash table.
+ */
+static void
+_data_entry_release(DataEntry *entry)
+{
+	Assert(LWLockHeldByMeInMode(&aqo_state->data_lock, LW_EXCLUSIVE));
+	Assert(DsaPointerIsValid(entry->data_dp));
+
+	_reloids_index_remove(&entry->key, entry->dbid, _data_entry_reloids(entry),
+						  entry->nrels);
+	dsa_free(data_dsa, entry->data_dp);
+	entry->data_dp = InvalidDsaPointer;
+}
+
+/*
+ * Insert new record or update existed in the AQO data storage.
+ * Return true if data was changed.
+ */
+bool
+aqo_data_store(uint64 fs, int fss, AqoDataArgs *data, List *reloids)
+{
+	DataEntry  *entry;
+	bool		found;
+	data_key	key = {.fs = fs, .fss = fss};
+	int			i;
+	char	   *ptr;
+	ListCell   *lc;
+	size_t		size;
+	bool		tblOverflow;
+	HASHACTION	action;
+	bool		result;
+	int			psize;
+	Oid		   *old_reloids = NULL;
+	Oid			old_dbid = InvalidOid;
+	Oid		   *new_reloids;
+	/*
+	 * We should distinguish incoming data between internally
+	 * passed structured data(reloids) and externaly
+	 * passed data(plain arrays) from aqo_data_update() function.
+	 */
+	bool		is_raw_data = (reloids == NULL);
+	int			nrels = is_raw_data ? data->nrels : list_length(reloids);
+
+	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
+	Assert(data->rows > 0);
+
+	dsa_init();
+
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+
+	/* Check hash table overflow */
+	tblOverflow = hash_get_num_entries(data_htab) < fss_max_items ? false : true;
+	action = tblOverflow ? HASH_FIND : HASH_ENTER;
+
+	entry = (DataEntry *) hash_search(data_htab, &key, action, &found);
+
+	/* Initialize entry on first usage */
+	if (!found)
+	{
+		if (action == HASH_FIND)
+		{
+			/*
+			 * Hash table is full. To avoid possible problems - don't try to add
+			 * more, just exit
+			 */
+			LWLockRelease(&aqo_state->data_lock);
+			ereport(LOG,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("[AQO] Data storage is full. No more data can be added."),
+				 errhint("Increase value of aqo.fss_max_items on restart of the instance")));
+			return false;
+		}
+
+		entry->cols = data->cols;
+		entry->rows = data->rows;
+		entry->nrels = nrels;
+		entry->model = data->model;
+		usage_init(&entry->usage, GetCurrentStatementStartTimestamp(), 0);
+
+		size = _compute_data_dsa(entry);
+		entry->data_dp = dsa_allocate0(data_dsa, size);
+
+		if (!_check_dsa_validity(entry->data_dp))
+		{
+			/*
+			 * DSA stuck into problems. Rollback changes. Return false in belief
+			 * that caller recognize it and don't try to call us more.
+			 */
+			(void) hash_search(data_htab, &key, HASH_REMOVE, NULL);
+			LWLockRelease(&aqo_state->data_lock);
+			return false;
+		}
+	}
+
+	Assert(DsaPointerIsValid(entry->data_dp));
+
+	if (entry->cols != data->cols || entry->nrels != nrels)
+	{
+		/* Collision happened? */
+		elog(LOG, "[AQO] Does a collision happened? Check it if possible (fs: "
+			 UINT64_FORMAT", fss: %d).",
+			 fs, fss);
+		goto end;
+	}
+
+	if (found)
+	{
+		/* Remember relations of the entry to keep the reverse index actual */
+		old_reloids = palloc(nrels * sizeof(Oid));
+		memcpy(old_reloids, _data_entry_reloids(entry), nrels * sizeof(Oid));
+		old_dbid = entry->dbid;
+	}
+
+	if (entry->rows < data->rows || entry->model != data->model)
+	{
+		entry->rows = Max(entry->rows, data->rows);
+		entry->model = data->model;
+		size = _compute_data_dsa(entry);
+
+		/* Need to re-allocate DSA chunk */
+		dsa_free(data_dsa, entry->data_dp);
+		entry->data_dp = dsa_allocate0(data_dsa, size);
+
+		if (!_check_dsa_validity(entry->data_dp))
+		{
+			/*
+			 * DSA stuck into problems. Rollback changes. Return false in belief
+			 * that caller recognize it and don't try to call us more.
+			 */
+			if (old_reloids != NULL)
+				_reloids_index_remove(&key, old_dbid, old_reloids, nrels);
+			(void) hash_search(data_htab, &key, HASH_REMOVE, NULL);
+			LWLockRelease(&aqo_state->data_lock);
+			return false;
+		}
+	}
+	ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
+	Assert(ptr != NULL);
+
+	entry->err_sum = data->err_sum;
+	entry->nsteps = data->nsteps;
+	entry->dbid = MyDatabaseId;
+
+	/*
+	 * Copy AQO data into allocated DSA segment
+	 */
+
+	memcpy(ptr, &key, sizeof(data_key)); /* Just for debug */
+	ptr += sizeof(data_key);
+	if (entry->cols > 0)
+	{
+		for (i = 0; i < entry->rows; i++)
+		{
+			Assert(data->matrix[i]);
+			memcpy(ptr, data->matrix[i], sizeof(double) * data->cols);
+			ptr += sizeof(double) * data->cols;
+		}
+	}
+	/* copy targets into DSM storage */
+	memcpy(ptr, data->targets, sizeof(double) * entry->rows);
+	ptr += sizeof(double) * entry->rows;
+	/* copy rfactors into DSM storage */
+	memcpy(ptr, data->rfactors, sizeof(double) * entry->rows);
+	ptr += sizeof(double) * entry->rows;
+	/* copy the model into DSM storage, zeroes mean a model not learned */
+	psize = aqo_model_routine(entry->model)->size(entry->cols);
+	if (data->payload != NULL)
+		memcpy(ptr, data->payload, sizeof(double) * psize);
+	else
+		memset(ptr, 0, sizeof(double) * psize);
+	ptr += sizeof(double) * psize;
+	/* store list of relations. XXX: optimize ? */
+	if (is_raw_data)
+	{
+		memcpy(ptr, data->oids, nrels * sizeof(Oid));
+		ptr += nrels * sizeof(Oid);
+	}
+	else
+	{
+		foreach(lc, reloids)
+		{
+			Oid reloid = lfirst_oid(lc);
+
+			memcpy(ptr, &reloid, sizeof(Oid));
+			ptr += sizeof(Oid);
+		}
+	}
+
+	new_reloids = _data_entry_reloids(entry);
+	if (old_reloids == NULL)
+		_reloids_index_add(&key, entry->dbid, new_reloids, nrels);
+	else if (old_dbid != entry->dbid ||
+			 memcmp(old_reloids, new_reloids, nrels * sizeof(Oid)) != 0)
+	{
+		_reloids_index_remove(&key, old_dbid, old_reloids, nrels);
+		_reloids_index_add(&key, entry->dbid, new_reloids, nrels);
+	}
+
+	usage_touch(&entry->usage, GetCurrentStatementStartTimestamp(), 1);
+	aqo_state->data_changed = true;
+	Assert(entry->rows > 0);
+end:
+	result = aqo_state->data_changed;
+	LWLockRelease(&aqo_state->data_lock);
+	return result;
+}
+
+static double
+fs_distance(double *a, double *b, int len)
+{
+	double		res = 0;
+	int			i;
+
+	for (i = 0; i < len; ++i)
+		res += (a[i] - b[i]) * (a[i] - b[i]);
+	if (len != 0)
+		res = sqrt(res);
+	return res;
+}
+
+bool
+neirest_neighbor(double **matrix, int old_rows, double *neibour, int cols)
+{
+	int i;
+	for (i=0; i<old_rows; i++)
+	{
+		if (fs_distance(neibour, matrix[i], cols) == 0)
+			return true;
+	}
+	return false;
+}
+
+static void
+build_knn_matrix(OkNNrdata *data, const OkNNrdata *temp_data, double *features)
+{
+	Assert(data->cols == temp_data->cols);
+	Assert(data->matrix);
+
+	if (features != NULL)
+	{
+		int old_rows = data->rows;
+		int k = (old_rows < 0) ? 0 : old_rows;
+
+		if (k == 0)
+		{
+			/* Samples of other entries are merged, but not the models */
+			data->model = temp_data->model;
+			data->payload = temp_data->payload;
+			data->err_sum = temp_data->err_sum;
+			data->nsteps = temp_data->nsteps;
+		}
+
+		if (data->cols > 0)
+		{
+			int i;
+
+			Assert(data->cols == temp_data->cols);
+
+			for (i = 0; i < temp_data->rows; i++)
+			{
+				if (k < aqo_K && !neirest_neighbor(data->matrix, old_rows,
+												   temp_data->matrix[i],
+												   data->cols))
+				{
+					memcpy(data->matrix[k], temp_data->matrix[i], data->cols * sizeof(double));
+					data->rfactors[k] = temp_data->rfactors[i];
+					data->targets[k] = temp_data->targets[i];
+					k++;
+				}
+			}
+			data->rows = k;
+		}
+	}
+	else
+	{
+		if (data->rows > 0)
+			/* trivial strategy - use first suitable record and ignore others */
+			return;
+		memcpy(data, temp_data, sizeof(OkNNrdata));
+		if (data->cols > 0)
+		{
+			int i;
+
+			for (i = 0; i < data->rows; i++)
+			{
+				Assert(data->matrix[i]);
+				memcpy(data->matrix[i], temp_data->matrix[i], data->cols * sizeof(double));
+			}
+		}
+	}
+}
+
+static OkNNrdata *
+_fill_knn_data(const DataEntry *entry, List **reloids)
+{
+	OkNNrdata *data;
+	char	   *ptr;
+	int			i;
+	int			psize;
+	size_t		offset;
+	size_t		sz = _compute_data_dsa(entry);
+
+	data = OkNNr_allocate(entry->cols);
+	data->rows = entry->rows;
+	data->model = entry->model;
+	data->err_sum = entry->err_sum;
+	data->nsteps = entry->nsteps;
+	psize = aqo_model_routine(entry->model)->size(entry->cols);
+
+	ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
+
+	/* Check invariants */
+	Assert(entry->rows <= aqo_K);
+	Assert(ptr != NULL);
+	Assert(entry->key.fss == ((data_key *)ptr)->fss);
+	Assert(data->matrix);
+
+	ptr += sizeof(data_key);
+
+	if (entry->cols > 0)
+	{
+		for (i = 0; i < entry->rows; i++)
+		{
+			Assert(data->matrix[i]);
+			memcpy(data->matrix[i], ptr, sizeof(double) * data->cols);
+			ptr += sizeof(double) * data->cols;
+		}
+	}
+
+	/* copy targets from DSM storage */
+	memcpy(data->targets, ptr, sizeof(double) * entry->rows);
+	ptr += sizeof(double) * entry->rows;
+	offset = ptr - (char *) dsa_get_address(data_dsa, entry->data_dp);
+	Assert(offset < sz);
+
+	/* copy rfactors from DSM storage */
+	memcpy(data->rfactors, ptr, sizeof(double) * entry->rows);
+	ptr += sizeof(double) * entry->rows;
+
+	/* copy the model from DSM storage */
+	if (psize > 0)
+	{
+		data->payload = palloc(sizeof(double) * psize);
+		memcpy(data->payload, ptr, sizeof(double) * psize);
+		ptr += sizeof(double) * psize;
+	}
+	offset = ptr - (char *) dsa_get_address(data_dsa, entry->data_dp);
+	Assert(offset <= sz);
+
+	if (reloids == NULL)
+		/* Isn't needed to load reloids list */
+		return data;
+
+	/* store list of relations. XXX: optimize ? */
+	for (i = 0; i < entry->nrels; i++)
+	{
+		*reloids = lappend_oid(*reloids, ObjectIdGetDatum(*(Oid*)ptr));
+		ptr += sizeof(Oid);
+	}
+
+	offset = ptr - (char *) dsa_get_address(data_dsa, entry->data_dp);
+	if (offset != sz)
+		elog(PANIC, "[AQO] Shared memory ML storage is corrupted.");
+
+	return data;
+}
+
+/*
+ * By given feature space and subspace, build kNN data structure.
+ *
+ * If wideSearch is true - make seqscan on the hash table to see for relevant
+ * data across neighbours.
+ * If reloids is NULL - don't fill this list.
+ *
+ * Return false if the operation was unsuccessful.
+ */
+bool
+load_aqo_data(uint64 fs, int fss, OkNNrdata *data, List **reloids,
+			  bool wideSearch, double *features)
+{
+	DataEntry  *entry;
+	bool		found;
+	data_key	key = {.fs = fs, .fss = fss};
+	OkNNrdata  *temp_data;
+
+	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
+
+	dsa_init();
+
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+
+	if (!wideSearch)
+	{
+		entry = (DataEntry *) hash_search(data_htab, &key, HASH_FIND, &found);
+
+		if (!found)
+			goto end;
+
+		/* One entry with all correctly filled fields is found */
+		Assert(entry && entry->rows > 0);
+		Assert(DsaPointerIsValid(entry->data_dp));
+
+		if (entry->cols != data->cols)
+		{
+			/* Collision happened? */
+			elog(LOG, "[AQO] Does a collision happened? Check it if possible "
+				 "(fs: "UINT64_FORMAT", fss: %d).",
+				 fs, fss);
+			found = false; /* Sign of unsuccessful operation */
+			goto end;
+		}
+
+		temp_data = _fill_knn_data(entry, reloids);
+		usage_touch(&entry->usage, GetCurrentStatementStartTimestamp(), 1);
+		Assert(temp_data->rows > 0);
+		build_knn_matrix(data, temp_data, features);
+		Assert(data->rows > 0);
+	}
+	else
+	/* Iterate across all elements of the table. XXX: Maybe slow. */
+	{
+		HASH_SEQ_STATUS	hash_seq;
+		int				noids = -1;
+
+		found = false;
+		hash_seq_init(&hash_seq, data_htab);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			List *tmp_oids = NIL;
+
+			Assert(entry->rows > 0);
+
+			if (entry->key.fss != fss || entry->cols != data->cols)
+				continue;
+
+			temp_data = _fill_knn_data(entry, &tmp_oids);
+
+			if (data->rows > 0 && list_length(tmp_oids) != noids)
+			{
+				/* Dubious case. So log it and skip these data */
+				elog(LOG,
+					 "[AQO] different number depended oids for the same fss %d: "
+					 "%d and %d correspondingly.",
+					 fss, list_length(tmp_oids), noids);
+				Assert(noids >= 0);
+				list_free(tmp_oids);
+				continue;
+			}
 
-	/* Check existence of default feature space */
-	(void) hash_search(qtexts_htab, &queryid, HASH_FIND, &found);
+			noids = list_length(tmp_oids);
 
-	aqo_state->qtexts_changed = false; /* mem data consistent with disk */
-	LWLockRelease(&aqo_state->qtexts_lock);
+			if (reloids != NULL && *reloids == NIL)
+				*reloids = tmp_oids;
+			else
+				list_free(tmp_oids);
 
-	if (!found)
-	{
-		if (!aqo_qtext_store(0, "COMMON feature space (do not delete!)"))
-			elog(PANIC, "[AQO] DSA Initialization was unsuccessful");
+			build_knn_matrix(data, temp_data, NULL);
+			usage_touch(&entry->usage, GetCurrentStatementStartTimestamp(), 1);
+			found = true;
+		}
 	}
+
+	Assert(!found || (data->rows > 0 && data->rows <= aqo_K));
+end:
+	LWLockRelease(&aqo_state->data_lock);
+
+	return found;
 }
 
 /*
- * Getting a data chunk from a caller, add a record into the 'ML data'
- * shmem hash table. Allocate and fill DSA chunk for variadic part of the data.
+ * Batched version of the load_fss_ext().
+ *
+ * Resolve a set of subspaces of the feature space by a single pass under one
+ * shared lock acquisition. Caller passes keys in sorted order without
+ * duplicates. result[i] is set to the loaded data or to NULL, if nothing is
+ * stored for the fss[i].
+ *
+ * Return number of found entries.
  */
-static bool
-_deform_data_record_cb(void *data, size_t size)
+int
+load_aqo_data_batch(uint64 fs, int nkeys, const int *fss, OkNNrdata **result)
 {
-	bool		found;
-	DataEntry  *fentry = (DataEntry *) data; /*Depends on a platform? */
-	DataEntry  *entry;
-	size_t		sz;
-	char	   *ptr = (char *) data,
-			   *dsa_ptr;
+	data_key	key = {.fs = fs};
+	int			nfound = 0;
+	int			i;
+	TimestampTz	now;
 
-	Assert(ptr != NULL);
-	Assert(LWLockHeldByMeInMode(&aqo_state->data_lock, LW_EXCLUSIVE));
+	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
 
-	entry = (DataEntry *) hash_search(data_htab, &fentry->key,
-									  HASH_ENTER, &found);
-	Assert(!found);
+	if (nkeys <= 0)
+		return 0;
 
-	/* Copy fixed-size part of entry byte-by-byte even with caves */
-	memcpy(entry, fentry, offsetof(DataEntry, data_dp));
-	ptr += offsetof(DataEntry, data_dp);
+	dsa_init();
 
-	sz = _compute_data_dsa(entry);
-	Assert(sz + offsetof(DataEntry, data_dp) == size);
-	entry->data_dp = dsa_allocate(data_dsa, sz);
+	now = GetCurrentStatementStartTimestamp();
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
 
-	if (!_check_dsa_validity(entry->data_dp))
+	for (i = 0; i < nkeys; i++)
 	{
-		/*
-		 * DSA stuck into problems. Rollback changes. Return false in belief
-		 * that caller recognize it and don't try to call us more.
-		 */
-		(void) hash_search(data_htab, &fentry->key, HASH_REMOVE, NULL);
-		return false;
+		DataEntry *entry;
+
+		Assert(i == 0 || fss[i - 1] < fss[i]);
+
+		key.fss = fss[i];
+		entry = (DataEntry *) hash_search(data_htab, &key, HASH_FIND, NULL);
+
+		if (entry == NULL)
+		{
+			result[i] = NULL;
+			continue;
+		}
+
+		Assert(entry->rows > 0 && DsaPointerIsValid(entry->data_dp));
+		result[i] = _fill_knn_data(entry, NULL);
+		usage_touch(&entry->usage, now, 1);
+		nfound++;
 	}
 
-	dsa_ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
-	Assert(dsa_ptr != NULL);
-	memcpy(dsa_ptr, ptr, sz);
-	return true;
+	LWLockRelease(&aqo_state->data_lock);
+	return nfound;
 }
 
-void
-aqo_data_load(void)
+Datum
+aqo_data(PG_FUNCTION_ARGS)
 {
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[AD_TOTAL_NCOLS];
+	bool				nulls[AD_TOTAL_NCOLS];
+	HASH_SEQ_STATUS		hash_seq;
+	DataEntry		   *entry;
+
 	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-	Assert(data_dsa != NULL);
 
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
 
-	if (hash_get_num_entries(data_htab) != 0)
-	{
-		/* Someone have done it concurrently. */
-		elog(LOG, "[AQO] Another backend have loaded query data concurrently.");
-		LWLockRelease(&aqo_state->data_lock);
-		return;
-	}
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-	data_load(PGAQO_DATA_FILE, _deform_data_record_cb, NULL);
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == AD_TOTAL_NCOLS);
 
-	aqo_state->data_changed = false; /* mem data is consistent with disk */
-	LWLockRelease(&aqo_state->data_lock);
-}
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
 
-static bool
-_deform_queries_record_cb(void *data, size_t size)
-{
-	bool			found;
-	QueriesEntry  	*entry;
-	uint64			queryid;
+	MemoryContextSwitchTo(oldcontext);
 
-	Assert(LWLockHeldByMeInMode(&aqo_state->queries_lock, LW_EXCLUSIVE));
-	Assert(size == sizeof(QueriesEntry));
+	dsa_init();
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, data_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		char *ptr;
+		const AqoModelRoutine *routine;
+		int psize;
 
-	queryid = ((QueriesEntry *) data)->queryid;
-	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_ENTER, &found);
-	Assert(!found);
-	memcpy(entry, data, sizeof(QueriesEntry));
-	return true;
-}
+		memset(nulls, 0, AD_TOTAL_NCOLS);
 
-void
-aqo_queries_load(void)
-{
-	bool	found;
-	uint64	queryid = 0;
+		values[AD_FS] = Int64GetDatum(entry->key.fs);
+		values[AD_FSS] = Int32GetDatum((int) entry->key.fss);
+		values[AD_NFEATURES] = Int32GetDatum(entry->cols);
 
-	Assert(!LWLockHeldByMe(&aqo_state->queries_lock));
+		/* Fill values from the DSA data chunk */
+		Assert(DsaPointerIsValid(entry->data_dp));
+		ptr = dsa_get_address(data_dsa, entry->data_dp);
+		Assert(entry->key.fs == ((data_key*)ptr)->fs && entry->key.fss == ((data_key*)ptr)->fss);
+		ptr += sizeof(data_key);
 
-	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+		if (entry->cols > 0)
+			values[AD_FEATURES] = PointerGetDatum(form_matrix((double *) ptr,
+													entry->rows, entry->cols));
+		else
+			nulls[AD_FEATURES] = true;
 
-	/* Load on postmaster startup. So no any concurrent actions possible here. */
-	Assert(hash_get_num_entries(queries_htab) == 0);
+		ptr += sizeof(double) * entry->rows * entry->cols;
+		values[AD_TARGETS] = PointerGetDatum(form_vector((double *)ptr, entry->rows));
+		ptr += sizeof(double) * entry->rows;
+		values[AD_RELIABILITY] = PointerGetDatum(form_vector((double *)ptr, entry->rows));
+		ptr += sizeof(double) * entry->rows;
 
-	data_load(PGAQO_QUERIES_FILE, _deform_queries_record_cb, NULL);
+		routine = aqo_model_routine(entry->model);
+		values[AD_MODEL] = CStringGetTextDatum(routine->name);
+		psize = routine->size(entry->cols);
+		if (psize > 0)
+			values[AD_PAYLOAD] = PointerGetDatum(form_vector((double *) ptr,
+															 psize));
+		else
+			nulls[AD_PAYLOAD] = true;
+		ptr += sizeof(double) * psize;
 
-	/* Check existence of default feature space */
-	(void) hash_search(queries_htab, &queryid, HASH_FIND, &found);
+		if (entry->nrels > 0)
+		{
+			Datum	   *elems;
+			ArrayType  *array;
+			int			i;
 
-	LWLockRelease(&aqo_state->queries_lock);
-	if (!found)
-	{
-		if (!aqo_queries_store(0, 0, 0, 0, 0, &aqo_queries_nulls))
-			elog(PANIC, "[AQO] aqo_queries initialization was unsuccessful");
-	}
-}
+			elems = palloc(sizeof(*elems) * entry->nrels);
+			for(i = 0; i < entry->nrels; i++)
+			{
+				elems[i] = ObjectIdGetDatum(*(Oid *)ptr);
+				ptr += sizeof(Oid);
+			}
 
-static void
-data_load(const char *filename, deform_record_t callback, void *ctx)
-{
-	FILE   *file;
-	long	i;
-	uint32	header;
-	int32	pgver;
-	long	num;
+			array = construct_array(elems, entry->nrels, OIDOID,
+									sizeof(Oid), true, TYPALIGN_INT);
+			values[AD_OIDS] = PointerGetDatum(array);
+		}
+		else
+			nulls[AD_OIDS] = true;
 
-	file = AllocateFile(filename, PG_BINARY_R);
-	if (file == NULL)
-	{
-		if (errno != ENOENT)
-			goto read_error;
-		return;
+		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
 	}
 
-	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
-		fread(&pgver, sizeof(uint32), 1, file) != 1 ||
-		fread(&num, sizeof(long), 1, file) != 1)
-		goto read_error;
+	LWLockRelease(&aqo_state->data_lock);
+	return (Datum) 0;
+}
 
-	if (header != PGAQO_FILE_HEADER || pgver != PGAQO_PG_MAJOR_VERSION)
-		goto data_error;
+static long
+_aqo_data_clean(uint64 fs)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	DataEntry	   *entry;
+	long			removed = 0;
 
-	for (i = 0; i < num; i++)
-	{
-		void   *data;
-		size_t	size;
-		bool	res;
+	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
 
-		if (fread(&size, sizeof(size), 1, file) != 1)
-			goto read_error;
-		data = palloc(size);
-		if (fread(data, size, 1, file) != 1)
-			goto read_error;
-		res = callback(data, size);
+	hash_seq_init(&hash_seq, data_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.fs != fs)
+			continue;
 
-		if (!res)
-		{
-			/* Error detected. Do not try to read tails of the storage. */
-			elog(LOG, "[AQO] Because of an error skip %ld storage records.",
-				 num - i);
-			break;
-		}
+		_data_entry_release(entry);
+		if (!hash_search(data_htab, &entry->key, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+		removed++;
 	}
 
-	FreeFile(file);
+	LWLockRelease(&aqo_state->data_lock);
+	return removed;
+}
+
+/*
+ * Make the knowledge of the aqo_data entry less reliable: the data it was
+ * learned on has drifted. Reliability of each sample is decayed, so the next
+ * executions replace it faster. A model built over the samples is reset to be
+ * fitted again. Zero decay removes the entry at all.
+ * Returns true if the entry was removed.
+ */
+static bool
+_data_entry_decay(DataEntry *entry, double decay)
+{
+	char   *ptr;
+	double *rfactors;
+	int		psize;
+	int		i;
+
+	Assert(LWLockHeldByMeInMode(&aqo_state->data_lock, LW_EXCLUSIVE));
 
-	elog(LOG, "[AQO] %ld records loaded from file %s.", num, filename);
-	return;
+	if (decay <= 0.)
+	{
+		_data_entry_release(entry);
+		if (!hash_search(data_htab, &entry->key, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+		return true;
+	}
 
-read_error:
-	ereport(LOG,
-			(errcode_for_file_access(),
-			 errmsg("could not read file \"%s\": %m", filename)));
-	goto fail;
-data_error:
-	ereport(LOG,
-			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-			 errmsg("ignoring invalid data in file \"%s\"", filename)));
-fail:
-	if (file)
-		FreeFile(file);
-	unlink(filename);
-}
+	ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
+	ptr += sizeof(data_key) + sizeof(double) * entry->rows * entry->cols;
+	rfactors = (double *) (ptr + sizeof(double) * entry->rows);
 
-static void
-on_shmem_shutdown(int code, Datum arg)
-{
 	/*
-	 * XXX: It can be expensive to rewrite a file on each shutdown of a backend.
+	 * Don't go below the minimum reliability: the learning rate of a new
+	 * sample is inversely proportional to the reliability of the stored one.
 	 */
-	aqo_qtexts_flush();
-	aqo_data_flush();
+	for (i = 0; i < entry->rows; i++)
+		rfactors[i] = Max(rfactors[i] * decay, RELIABILITY_MIN);
+
+	psize = aqo_model_routine(entry->model)->size(entry->cols);
+	memset(rfactors + entry->rows, 0, sizeof(double) * psize);
+
+	/* Let the adaptive learning rate grow back */
+	entry->err_sum *= decay;
+	entry->nsteps = (int64) (entry->nsteps * decay);
+	return false;
 }
 
 /*
- * Initialize DSA memory for AQO shared data with variable length.
- * On first call, create DSA segments and load data into hash table and DSA
- * from disk.
+ * Sizes of the relations of the current database have changed a lot, so the
+ * knowledge depending on them is stale. Decay it by the
+ * aqo.knowledge_drift_decay factor.
+ * Returns number of the affected aqo_data entries.
  */
-static void
-dsa_init()
+int
+aqo_data_decay_relations(const Oid *reloids, int nrels)
 {
-	MemoryContext	old_context;
+	HASHCTL			hash_ctl;
+	HTAB		   *keys_htab;
+	HASH_SEQ_STATUS	hash_seq;
+	DataEntry	   *entry;
+	data_key	   *key;
+	RelOidIndexKey	rkey = {.dbid = MyDatabaseId};
+	int				naffected = 0;
+	int				i;
 
-	if (qtext_dsa)
-		return;
+	if (nrels <= 0)
+		return 0;
 
-	Assert(data_dsa == NULL && data_dsa == NULL);
-	old_context = MemoryContextSwitchTo(TopMemoryContext);
-	LWLockAcquire(&aqo_state->lock, LW_EXCLUSIVE);
+	dsa_init();
 
-	if (aqo_state->qtexts_dsa_handler == DSM_HANDLE_INVALID)
-	{
-		Assert(aqo_state->data_dsa_handler == DSM_HANDLE_INVALID);
+	hash_ctl.keysize = sizeof(data_key);
+	hash_ctl.entrysize = sizeof(data_key);
+	hash_ctl.hcxt = CurrentMemoryContext;
+	keys_htab = hash_create("AQO drifted records", 128, &hash_ctl,
+							HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 
-		qtext_dsa = dsa_create(aqo_state->qtext_trancheid);
-		Assert(qtext_dsa != NULL);
+	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
 
-		if (dsm_size_max > 0)
-			dsa_set_size_limit(qtext_dsa, dsm_size_max * 1024 * 1024);
+	/* Collect the records first: a removal changes the reverse index */
+	if (aqo_state->reloids_index_valid)
+	{
+		for (i = 0; i < nrels; i++)
+		{
+			RelOidIndexEntry   *rentry;
+			data_key		   *keys;
+			int					j;
+
+			rkey.reloid = reloids[i];
+			rentry = (RelOidIndexEntry *) hash_search(reloids_htab, &rkey,
+													  HASH_FIND, NULL);
+			if (rentry == NULL)
+				continue;
 
-		dsa_pin(qtext_dsa);
-		aqo_state->qtexts_dsa_handler = dsa_get_handle(qtext_dsa);
+			keys = (data_key *) dsa_get_address(data_dsa, rentry->keys_dp);
+			for (j = 0; j < rentry->nkeys; j++)
+				(void) hash_search(keys_htab, &keys[j], HASH_ENTER, NULL);
+		}
+	}
+	else
+	{
+		hash_seq_init(&hash_seq, data_htab);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			Oid	   *oids = _data_entry_reloids(entry);
+			int		j;
 
-		data_dsa = qtext_dsa;
-		aqo_state->data_dsa_handler = dsa_get_handle(data_dsa);
+			if (entry->dbid != MyDatabaseId)
+				continue;
 
-		/* Load and initialize query texts hash table */
-		aqo_qtexts_load();
-		aqo_data_load();
+			for (i = 0; i < entry->nrels; i++)
+			{
+				for (j = 0; j < nrels; j++)
+					if (oids[i] == reloids[j])
+						break;
+
+				if (j < nrels)
+				{
+					(void) hash_search(keys_htab, &entry->key, HASH_ENTER, NULL);
+					break;
+				}
+			}
+		}
 	}
-	else
+
+	hash_seq_init(&hash_seq, keys_htab);
+	while ((key = hash_seq_search(&hash_seq)) != NULL)
 	{
-		qtext_dsa = dsa_attach(aqo_state->qtexts_dsa_handler);
-		data_dsa = qtext_dsa;
+		entry = (DataEntry *) hash_search(data_htab, key, HASH_FIND, NULL);
+		if (entry == NULL)
+			continue;
+
+		(void) _data_entry_decay(entry, knowledge_drift_decay);
+		naffected++;
 	}
 
-	dsa_pin_mapping(qtext_dsa);
-	MemoryContextSwitchTo(old_context);
-	LWLockRelease(&aqo_state->lock);
+	if (naffected > 0)
+		aqo_state->data_changed = true;
+	LWLockRelease(&aqo_state->data_lock);
 
-	before_shmem_exit(on_shmem_shutdown, (Datum) 0);
+	hash_destroy(keys_htab);
+	return naffected;
 }
 
-/* ************************************************************************** */
-
 /*
- * XXX: Maybe merge with aqo_queries ?
+ * Cardinality errors of the query class have jumped: the knowledge of its
+ * feature space is stale. Decay it by the aqo.knowledge_drift_decay factor.
+ * Returns number of the affected aqo_data entries.
  */
-bool
-aqo_qtext_store(uint64 queryid, const char *query_string)
+int
+aqo_data_decay_fs(uint64 fs)
 {
-	QueryTextEntry *entry;
-	bool			found;
-	bool			tblOverflow;
-	HASHACTION		action;
+	HASH_SEQ_STATUS	hash_seq;
+	DataEntry	   *entry;
+	int				naffected = 0;
 
-	Assert(!LWLockHeldByMe(&aqo_state->qtexts_lock));
+	dsa_init();
 
-	if (query_string == NULL || querytext_max_size == 0)
-		return false;
+	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
 
-	dsa_init();
+	hash_seq_init(&hash_seq, data_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.fs != fs)
+			continue;
 
-	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
+		(void) _data_entry_decay(entry, knowledge_drift_decay);
+		naffected++;
+	}
 
-	/* Check hash table overflow */
-	tblOverflow = hash_get_num_entries(qtexts_htab) < fs_max_items ? false : true;
-	action = tblOverflow ? HASH_FIND : HASH_ENTER;
+	if (naffected > 0)
+		aqo_state->data_changed = true;
+	LWLockRelease(&aqo_state->data_lock);
+	return naffected;
+}
 
-	entry = (QueryTextEntry *) hash_search(qtexts_htab, &queryid, action,
-										   &found);
+/*
+ * Get relations of the current database, the ML knowledge depends on.
+ * Returns NULL if there are no such relations.
+ */
+Oid *
+aqo_data_reloids(int *nrels)
+{
+	HASH_SEQ_STATUS		hash_seq;
+	Oid				   *reloids = NULL;
+	int					n = 0;
 
-	/* Initialize entry on first usage */
-	if (!found)
+	dsa_init();
+
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	if (aqo_state->reloids_index_valid)
 	{
-		size_t size = strlen(query_string) + 1;
-		char *strptr;
+		RelOidIndexEntry   *rentry;
 
-		if (action == HASH_FIND)
+		if (hash_get_num_entries(reloids_htab) > 0)
+			reloids = palloc(hash_get_num_entries(reloids_htab) * sizeof(Oid));
+
+		hash_seq_init(&hash_seq, reloids_htab);
+		while ((rentry = hash_seq_search(&hash_seq)) != NULL)
 		{
-			/*
-			 * Hash table is full. To avoid possible problems - don't try to add
-			 * more, just exit
-			 */
-			LWLockRelease(&aqo_state->qtexts_lock);
-			ereport(LOG,
-				(errcode(ERRCODE_OUT_OF_MEMORY),
-				 errmsg("[AQO] Query texts storage is full. No more feature spaces can be added."),
-				 errhint("Increase value of aqo.fs_max_items on restart of the instance")));
-			return false;
+			if (rentry->key.dbid == MyDatabaseId)
+				reloids[n++] = rentry->key.reloid;
 		}
+	}
+	else
+	{
+		HASHCTL		hash_ctl;
+		HTAB	   *rels_htab;
+		DataEntry  *entry;
+		Oid		   *reloid;
 
-		entry->queryid = queryid;
-		size = size > querytext_max_size ? querytext_max_size : size;
-		entry->qtext_dp = dsa_allocate(qtext_dsa, size);
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(Oid);
+		hash_ctl.hcxt = CurrentMemoryContext;
+		rels_htab = hash_create("AQO knowledge relations", 128, &hash_ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 
-		if (!_check_dsa_validity(entry->qtext_dp))
+		hash_seq_init(&hash_seq, data_htab);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
 		{
-			/*
-			 * DSA stuck into problems. Rollback changes. Return false in belief
-			 * that caller recognize it and don't try to call us more.
-			 */
-			(void) hash_search(qtexts_htab, &queryid, HASH_REMOVE, NULL);
-			LWLockRelease(&aqo_state->qtexts_lock);
-			return false;
+			Oid	   *oids = _data_entry_reloids(entry);
+			int		i;
+
+			if (entry->dbid != MyDatabaseId)
+				continue;
+
+			for (i = 0; i < entry->nrels; i++)
+				(void) hash_search(rels_htab, &oids[i], HASH_ENTER, NULL);
 		}
 
-		strptr = (char *) dsa_get_address(qtext_dsa, entry->qtext_dp);
-		strlcpy(strptr, query_string, size);
-		aqo_state->qtexts_changed = true;
+		if (hash_get_num_entries(rels_htab) > 0)
+			reloids = palloc(hash_get_num_entries(rels_htab) * sizeof(Oid));
+
+		hash_seq_init(&hash_seq, rels_htab);
+		while ((reloid = hash_seq_search(&hash_seq)) != NULL)
+			reloids[n++] = *reloid;
+		hash_destroy(rels_htab);
 	}
-	LWLockRelease(&aqo_state->qtexts_lock);
-	return true;
+	LWLockRelease(&aqo_state->data_lock);
+
+	*nrels = n;
+	return reloids;
+}
+
+static long
+aqo_data_reset(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	DataEntry	   *entry;
+	long			num_remove = 0;
+	long			num_entries;
+
+	dsa_init();
+
+	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	num_entries = hash_get_num_entries(data_htab);
+	hash_seq_init(&hash_seq, data_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		_data_entry_release(entry);
+		if (!hash_search(data_htab, &entry->key, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+		num_remove++;
+	}
+
+	/* The data storage is empty, so the reverse index is consistent again */
+	Assert(hash_get_num_entries(reloids_htab) == 0 ||
+		   !aqo_state->reloids_index_valid);
+	_reloids_index_reset();
+
+	if (num_remove > 0)
+		aqo_state->data_changed = true;
+	LWLockRelease(&aqo_state->data_lock);
+	if (num_remove != num_entries)
+		elog(ERROR, "[AQO] Query ML memory storage is corrupted or parallel access without a lock has detected.");
+
+	aqo_data_flush();
+
+	return num_remove;
 }
 
 Datum
-aqo_query_texts(PG_FUNCTION_ARGS)
+aqo_queries(PG_FUNCTION_ARGS)
 {
 	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	TupleDesc			tupDesc;
 	MemoryContext		per_query_ctx;
 	MemoryContext		oldcontext;
 	Tuplestorestate	   *tupstore;
-	Datum				values[QT_TOTAL_NCOLS];
-	bool				nulls[QT_TOTAL_NCOLS];
+	Datum				values[AQ_TOTAL_NCOLS + 1];
+	bool				nulls[AQ_TOTAL_NCOLS + 1];
 	HASH_SEQ_STATUS		hash_seq;
-	QueryTextEntry	   *entry;
-
-	Assert(!LWLockHeldByMe(&aqo_state->qtexts_lock));
+	QueriesEntry	   *entry;
 
 	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -1159,7 +4329,7 @@ aqo_query_texts(PG_FUNCTION_ARGS)
 	/* Build a tuple descriptor for our result type */
 	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
 		elog(ERROR, "return type must be a row type");
-	Assert(tupDesc->natts == QT_TOTAL_NCOLS);
+	Assert(tupDesc->natts == AQ_TOTAL_NCOLS);
 
 	tupstore = tuplestore_begin_heap(true, false, work_mem);
 	rsinfo->returnMode = SFRM_Materialize;
@@ -1168,1207 +4338,1261 @@ aqo_query_texts(PG_FUNCTION_ARGS)
 
 	MemoryContextSwitchTo(oldcontext);
 
-	dsa_init();
-	memset(nulls, 0, QT_TOTAL_NCOLS);
-	LWLockAcquire(&aqo_state->qtexts_lock, LW_SHARED);
-	hash_seq_init(&hash_seq, qtexts_htab);
+	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, queries_htab);
 	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		char *ptr;
-
-		Assert(DsaPointerIsValid(entry->qtext_dp));
-		ptr = dsa_get_address(qtext_dsa, entry->qtext_dp);
-		values[QT_QUERYID] = Int64GetDatum(entry->queryid);
-		values[QT_QUERY_STRING] = CStringGetTextDatum(ptr);
-		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
-	}
-
-	LWLockRelease(&aqo_state->qtexts_lock);
-	return (Datum) 0;
-}
-
-static bool
-_aqo_stat_remove(uint64 queryid)
-{
-	bool		found;
-
-	Assert(!LWLockHeldByMe(&aqo_state->stat_lock));
-	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
-	(void) hash_search(stat_htab, &queryid, HASH_FIND, &found);
-
-	if (found)
-	{
-		(void) hash_search(stat_htab, &queryid, HASH_REMOVE, NULL);
-		aqo_state->stat_changed = true;
-	}
-
-	LWLockRelease(&aqo_state->stat_lock);
-	return found;
-}
-
-static bool
-_aqo_queries_remove(uint64 queryid)
-{
-	bool	found;
-
-	Assert(!LWLockHeldByMe(&aqo_state->queries_lock));
-	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
-	(void) hash_search(queries_htab, &queryid, HASH_FIND, &found);
-
-	if (found)
-	{
-		(void) hash_search(queries_htab, &queryid, HASH_REMOVE, NULL);
-		aqo_state->queries_changed = true;
+		memset(nulls, 0, AQ_TOTAL_NCOLS + 1);
+
+		values[AQ_QUERYID] = Int64GetDatum(entry->queryid);
+		values[AQ_FS] = Int64GetDatum(entry->fs);
+		values[AQ_LEARN_AQO] = BoolGetDatum(entry->learn_aqo);
+		values[AQ_USE_AQO] = BoolGetDatum(entry->use_aqo);
+		values[AQ_AUTO_TUNING] = BoolGetDatum(entry->auto_tuning);
+		values[AQ_SMART_TIMEOUT] = Int64GetDatum(entry->smart_timeout);
+		values[AQ_COUNT_INCREASE_TIMEOUT] = Int64GetDatum(entry->count_increase_timeout);
+		if (entry->jit == AQO_JIT_AUTO)
+			nulls[AQ_JIT] = true;
+		else
+			values[AQ_JIT] = BoolGetDatum(entry->jit == AQO_JIT_ON);
+		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
 	}
 
 	LWLockRelease(&aqo_state->queries_lock);
-	return found;
+	return (Datum) 0;
 }
 
-static bool
-_aqo_qtexts_remove(uint64 queryid)
+bool
+aqo_queries_store(uint64 queryid,
+				  uint64 fs, bool learn_aqo, bool use_aqo, bool auto_tuning,
+				  AqoQueriesNullArgs *null_args)
 {
-	bool			found = false;
-	QueryTextEntry *entry;
+	QueriesEntry   *entry;
+	bool			found;
+	bool		tblOverflow;
+	HASHACTION	action;
+	uint64		old_fs = 0;
+	bool		old_learn_aqo = false;
+	bool		old_use_aqo = false;
+	bool		old_auto_tuning = false;
+	int64		old_smart_timeout = 0;
+	int64		old_count_increase_timeout = 0;
 
-	dsa_init();
+	/* Insert is allowed if no args are NULL. */
+	bool safe_insert =
+		(!null_args->fs_is_null && !null_args->learn_aqo_is_null &&
+		 !null_args->use_aqo_is_null && !null_args->auto_tuning_is_null);
 
-	Assert(!LWLockHeldByMe(&aqo_state->qtexts_lock));
-	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
+	Assert(queries_htab);
 
-	/*
-	 * Look for a record with this queryid. DSA fields must be freed before
-	 * deletion of the record.
-	 */
-	entry = (QueryTextEntry *) hash_search(qtexts_htab, &queryid, HASH_FIND,
-										   &found);
-	if (found)
-	{
-		/* Free DSA memory, allocated for this record */
-		Assert(DsaPointerIsValid(entry->qtext_dp));
-		dsa_free(qtext_dsa, entry->qtext_dp);
+	/* Guard for default feature space */
+	Assert(queryid != 0 || (fs == 0 && learn_aqo == false &&
+		   use_aqo == false && auto_tuning == false));
 
-		(void) hash_search(qtexts_htab, &queryid, HASH_REMOVE, NULL);
-		aqo_state->qtexts_changed = true;
-	}
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
 
-	LWLockRelease(&aqo_state->qtexts_lock);
-	return found;
-}
+	/* Check hash table overflow */
+	tblOverflow = hash_get_num_entries(queries_htab) < fs_max_items ? false : true;
+	action = (tblOverflow || !safe_insert) ? HASH_FIND : HASH_ENTER;
 
-static bool
-_aqo_data_remove(data_key *key)
-{
-	DataEntry  *entry;
-	bool		found;
+	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, action,
+										 &found);
 
-	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+		/* Initialize entry on first usage */
+	if (!found && action == HASH_FIND)
+	{
+		/*
+		 * Hash table is full. To avoid possible problems - don't try to add
+		 * more, just exit
+		 */
+		LWLockRelease(&aqo_state->queries_lock);
+		ereport(LOG,
+			(errcode(ERRCODE_OUT_OF_MEMORY),
+			 errmsg("[AQO] Queries storage is full. No more feature spaces can be added."),
+			 errhint("Increase value of aqo.fs_max_items on restart of the instance")));
+		return false;
+	}
 
-	entry = (DataEntry *) hash_search(data_htab, key, HASH_FIND, &found);
-	if (found)
+	if (!found)
 	{
-		/* Free DSA memory, allocated for this record */
-		Assert(DsaPointerIsValid(entry->data_dp));
-		dsa_free(data_dsa, entry->data_dp);
-		entry->data_dp = InvalidDsaPointer;
+		usage_init(&entry->usage, GetCurrentTimestamp(), 0);
+		entry->jit = AQO_JIT_AUTO;
+	}
+	else
+	{
+		old_fs = entry->fs;
+		old_learn_aqo = entry->learn_aqo;
+		old_use_aqo = entry->use_aqo;
+		old_auto_tuning = entry->auto_tuning;
+		old_smart_timeout = entry->smart_timeout;
+		old_count_increase_timeout = entry->count_increase_timeout;
+	}
 
-		if (!hash_search(data_htab, key, HASH_REMOVE, NULL))
-			elog(PANIC, "[AQO] Inconsistent data hash table");
+	if (!null_args->fs_is_null)
+		entry->fs = fs;
+	if (!null_args->learn_aqo_is_null)
+		entry->learn_aqo = learn_aqo;
+	if (!null_args->use_aqo_is_null)
+		entry->use_aqo = use_aqo;
+	if (!null_args->auto_tuning_is_null)
+		entry->auto_tuning = auto_tuning;
+	if (!null_args->smart_timeout)
+		entry->smart_timeout = 0;
+	if (!null_args->count_increase_timeout)
+		entry->count_increase_timeout = 0;
 
-		aqo_state->data_changed = true;
-	}
+	if (entry->learn_aqo || entry->use_aqo || entry->auto_tuning)
+		/* Remove the class from cache of deactivated queries */
+		hash_search(deactivated_queries, &queryid, HASH_REMOVE, NULL);
 
-	LWLockRelease(&aqo_state->data_lock);
-	return found;
+	/* Don't invalidate caches of backends, if nothing has changed */
+	if (!found)
+		queries_storage_added();
+	else if (entry->fs != old_fs || entry->learn_aqo != old_learn_aqo ||
+			 entry->use_aqo != old_use_aqo ||
+			 entry->auto_tuning != old_auto_tuning ||
+			 entry->smart_timeout != old_smart_timeout ||
+			 entry->count_increase_timeout != old_count_increase_timeout)
+		queries_storage_changed();
+	LWLockRelease(&aqo_state->queries_lock);
+	return true;
 }
 
 static long
-aqo_qtexts_reset(void)
+aqo_queries_reset(void)
 {
-	HASH_SEQ_STATUS	hash_seq;
-	QueryTextEntry *entry;
-	long			num_remove = 0;
-	long			num_entries;
-
-	dsa_init();
+	HASH_SEQ_STATUS		hash_seq;
+	QueriesEntry	   *entry;
+	long				num_remove = 0;
+	long				num_entries;
 
-	Assert(!LWLockHeldByMe(&aqo_state->qtexts_lock));
-	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
-	num_entries = hash_get_num_entries(qtexts_htab);
-	hash_seq_init(&hash_seq, qtexts_htab);
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+	num_entries = hash_get_num_entries(queries_htab);
+	hash_seq_init(&hash_seq, queries_htab);
 	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
 		if (entry->queryid == 0)
+			/* Don't remove default feature space */
 			continue;
 
-		Assert(DsaPointerIsValid(entry->qtext_dp));
-		dsa_free(qtext_dsa, entry->qtext_dp);
-		if (!hash_search(qtexts_htab, &entry->queryid, HASH_REMOVE, NULL))
+		if (!hash_search(queries_htab, &entry->queryid, HASH_REMOVE, NULL))
 			elog(PANIC, "[AQO] hash table corrupted");
 		num_remove++;
 	}
-	aqo_state->qtexts_changed = true;
-	LWLockRelease(&aqo_state->qtexts_lock);
-	if (num_remove != num_entries - 1)
-		elog(ERROR, "[AQO] Query texts memory storage is corrupted or parallel access without a lock was detected.");
 
-	aqo_qtexts_flush();
+	if (num_remove > 0)
+		queries_storage_changed();
 
-	return num_remove;
-}
+	LWLockRelease(&aqo_state->queries_lock);
 
-static size_t
-_compute_data_dsa(const DataEntry *entry)
-{
-	size_t	size = sizeof(data_key); /* header's size */
+	if (num_remove != num_entries - 1)
+		elog(ERROR, "[AQO] Queries memory storage is corrupted or parallel access without a lock has detected.");
 
-	size += sizeof(double) * entry->rows * entry->cols; /* matrix */
-	size += 2 * sizeof(double) * entry->rows; /* targets, rfactors */
+	aqo_queries_flush();
 
-	/* Calculate memory size needed to store relation names */
-	size += entry->nrels * sizeof(Oid);
-	return size;
+	return num_remove;
 }
 
-/*
- * Insert new record or update existed in the AQO data storage.
- * Return true if data was changed.
- */
-bool
-aqo_data_store(uint64 fs, int fss, AqoDataArgs *data, List *reloids)
+Datum
+aqo_enable_query(PG_FUNCTION_ARGS)
 {
-	DataEntry  *entry;
-	bool		found;
-	data_key	key = {.fs = fs, .fss = fss};
-	int			i;
-	char	   *ptr;
-	ListCell   *lc;
-	size_t		size;
-	bool		tblOverflow;
-	HASHACTION	action;
-	bool		result;
-	/*
-	 * We should distinguish incoming data between internally
-	 * passed structured data(reloids) and externaly
-	 * passed data(plain arrays) from aqo_data_update() function.
-	 */
-	bool		is_raw_data = (reloids == NULL);
-	int			nrels = is_raw_data ? data->nrels : list_length(reloids);
-
-	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-	Assert(data->rows > 0);
-
-	dsa_init();
+	uint64			queryid = (uint64) PG_GETARG_INT64(0);
+	QueriesEntry   *entry;
+	bool			found;
 
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	Assert(queries_htab);
 
-	/* Check hash table overflow */
-	tblOverflow = hash_get_num_entries(data_htab) < fss_max_items ? false : true;
-	action = tblOverflow ? HASH_FIND : HASH_ENTER;
+	if (queryid == 0)
+		elog(ERROR, "[AQO] Default class can't be updated.");
 
-	entry = (DataEntry *) hash_search(data_htab, &key, action, &found);
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_FIND, &found);
 
-	/* Initialize entry on first usage */
-	if (!found)
+	if (found)
 	{
-		if (action == HASH_FIND)
-		{
-			/*
-			 * Hash table is full. To avoid possible problems - don't try to add
-			 * more, just exit
-			 */
-			LWLockRelease(&aqo_state->data_lock);
-			ereport(LOG,
-				(errcode(ERRCODE_OUT_OF_MEMORY),
-				 errmsg("[AQO] Data storage is full. No more data can be added."),
-				 errhint("Increase value of aqo.fss_max_items on restart of the instance")));
-			return false;
-		}
+		entry->learn_aqo = true;
+		entry->use_aqo = true;
+		if (aqo_mode == AQO_MODE_INTELLIGENT)
+			entry->auto_tuning = true;
+		queries_storage_changed();
+	}
+	else
+		elog(ERROR, "[AQO] Entry with queryid "INT64_FORMAT
+			 " not contained in table", (int64) queryid);
 
-		entry->cols = data->cols;
-		entry->rows = data->rows;
-		entry->nrels = nrels;
+	hash_search(deactivated_queries, &queryid, HASH_REMOVE, NULL);
+	LWLockRelease(&aqo_state->queries_lock);
+	PG_RETURN_VOID();
+}
 
-		size = _compute_data_dsa(entry);
-		entry->data_dp = dsa_allocate0(data_dsa, size);
+/*
+ * Set JIT usage for the query class. NULL value returns the choice to the
+ * planner and the auto tuning.
+ */
+Datum
+aqo_set_class_jit(PG_FUNCTION_ARGS)
+{
+	uint64			queryid;
+	QueriesEntry   *entry;
 
-		if (!_check_dsa_validity(entry->data_dp))
-		{
-			/*
-			 * DSA stuck into problems. Rollback changes. Return false in belief
-			 * that caller recognize it and don't try to call us more.
-			 */
-			(void) hash_search(data_htab, &key, HASH_REMOVE, NULL);
-			LWLockRelease(&aqo_state->data_lock);
-			return false;
-		}
-	}
+	if (PG_ARGISNULL(0))
+		PG_RETURN_BOOL(false);
 
-	Assert(DsaPointerIsValid(entry->data_dp));
+	queryid = (uint64) PG_GETARG_INT64(0);
+	if (queryid == 0)
+		elog(ERROR, "[AQO] Default class can't be updated.");
 
-	if (entry->cols != data->cols || entry->nrels != nrels)
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_FIND,
+										 NULL);
+	if (entry != NULL)
 	{
-		/* Collision happened? */
-		elog(LOG, "[AQO] Does a collision happened? Check it if possible (fs: "
-			 UINT64_FORMAT", fss: %d).",
-			 fs, fss);
-		goto end;
+		if (PG_ARGISNULL(1))
+			entry->jit = AQO_JIT_AUTO;
+		else
+			entry->jit = PG_GETARG_BOOL(1) ? AQO_JIT_ON : AQO_JIT_OFF;
+		queries_storage_changed();
 	}
+	LWLockRelease(&aqo_state->queries_lock);
 
-	if (entry->rows < data->rows)
-	{
-		entry->rows = data->rows;
-		size = _compute_data_dsa(entry);
+	PG_RETURN_BOOL(entry != NULL);
+}
 
-		/* Need to re-allocate DSA chunk */
-		dsa_free(data_dsa, entry->data_dp);
-		entry->data_dp = dsa_allocate0(data_dsa, size);
+Datum
+aqo_disable_query(PG_FUNCTION_ARGS)
+{
+	uint64			queryid = (uint64) PG_GETARG_INT64(0);
+	QueriesEntry   *entry;
+	bool			found;
 
-		if (!_check_dsa_validity(entry->data_dp))
-		{
-			/*
-			 * DSA stuck into problems. Rollback changes. Return false in belief
-			 * that caller recognize it and don't try to call us more.
-			 */
-			(void) hash_search(data_htab, &key, HASH_REMOVE, NULL);
-			LWLockRelease(&aqo_state->data_lock);
-			return false;
-		}
-	}
-	ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
-	Assert(ptr != NULL);
+	Assert(queries_htab);
 
-	/*
-	 * Copy AQO data into allocated DSA segment
-	 */
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_FIND, &found);
 
-	memcpy(ptr, &key, sizeof(data_key)); /* Just for debug */
-	ptr += sizeof(data_key);
-	if (entry->cols > 0)
-	{
-		for (i = 0; i < entry->rows; i++)
-		{
-			Assert(data->matrix[i]);
-			memcpy(ptr, data->matrix[i], sizeof(double) * data->cols);
-			ptr += sizeof(double) * data->cols;
-		}
-	}
-	/* copy targets into DSM storage */
-	memcpy(ptr, data->targets, sizeof(double) * entry->rows);
-	ptr += sizeof(double) * entry->rows;
-	/* copy rfactors into DSM storage */
-	memcpy(ptr, data->rfactors, sizeof(double) * entry->rows);
-	ptr += sizeof(double) * entry->rows;
-	/* store list of relations. XXX: optimize ? */
-	if (is_raw_data)
+	if(found)
 	{
-		memcpy(ptr, data->oids, nrels * sizeof(Oid));
-		ptr += nrels * sizeof(Oid);
+		entry->learn_aqo = false;
+		entry->use_aqo = false;
+		entry->auto_tuning = false;
+		queries_storage_changed();
 	}
 	else
 	{
-		foreach(lc, reloids)
-		{
-			Oid reloid = lfirst_oid(lc);
-
-			memcpy(ptr, &reloid, sizeof(Oid));
-			ptr += sizeof(Oid);
-		}
+		elog(ERROR, "[AQO] Entry with "INT64_FORMAT" not contained in table",
+			 (int64) queryid);
 	}
-	aqo_state->data_changed = true;
-	Assert(entry->rows > 0);
-end:
-	result = aqo_state->data_changed;
-	LWLockRelease(&aqo_state->data_lock);
-	return result;
+	LWLockRelease(&aqo_state->queries_lock);
+	PG_RETURN_VOID();
 }
 
-static double
-fs_distance(double *a, double *b, int len)
+/*
+ * Must be called under exclusive queries_lock after any change of the queries
+ * storage.
+ */
+static void
+queries_storage_changed(void)
 {
-	double		res = 0;
-	int			i;
+	Assert(LWLockHeldByMeInMode(&aqo_state->queries_lock, LW_EXCLUSIVE));
 
-	for (i = 0; i < len; ++i)
-		res += (a[i] - b[i]) * (a[i] - b[i]);
-	if (len != 0)
-		res = sqrt(res);
-	return res;
+	aqo_state->queries_changed = true;
+	pg_atomic_fetch_add_u64(&aqo_state->queries_generation, 1);
 }
 
-bool
-neirest_neighbor(double **matrix, int old_rows, double *neibour, int cols)
+/*
+ * Must be called under exclusive queries_lock after an insertion of a new
+ * query class. Cached settings of other classes stay valid.
+ */
+static void
+queries_storage_added(void)
 {
-	int i;
-	for (i=0; i<old_rows; i++)
-	{
-		if (fs_distance(neibour, matrix[i], cols) == 0)
-			return true;
-	}
-	return false;
+	Assert(LWLockHeldByMeInMode(&aqo_state->queries_lock, LW_EXCLUSIVE));
+
+	aqo_state->queries_changed = true;
+	pg_atomic_fetch_add_u64(&aqo_state->queries_inserts, 1);
 }
 
-static void
-build_knn_matrix(OkNNrdata *data, const OkNNrdata *temp_data, double *features)
+/*
+ * Find settings of the query class.
+ *
+ * Planner calls it for each query, so settings are cached in the backend and
+ * the shared lock is acquired only if the queries storage has been changed
+ * since the last lookup. Negative results are cached too, because most of
+ * queries in the controlled and frozen modes are unknown for AQO.
+ */
+bool
+aqo_queries_find(uint64 queryid, QueryContextData *ctx)
 {
-	Assert(data->cols == temp_data->cols);
-	Assert(data->matrix);
-
-	if (features != NULL)
-	{
-		int old_rows = data->rows;
-		int k = (old_rows < 0) ? 0 : old_rows;
+	QueriesCacheEntry  *centry;
+	QueriesEntry	   *entry;
+	uint64				generation;
+	uint64				inserts;
+	bool				found;
+	TimestampTz			now = GetCurrentStatementStartTimestamp();
 
-		if (data->cols > 0)
-		{
-			int i;
+	Assert(queries_htab);
 
-			Assert(data->cols == temp_data->cols);
+	/* It's ok to see slightly outdated values here */
+	generation = pg_atomic_read_u64(&aqo_state->queries_generation);
+	inserts = pg_atomic_read_u64(&aqo_state->queries_inserts);
 
-			for (i = 0; i < temp_data->rows; i++)
-			{
-				if (k < aqo_K && !neirest_neighbor(data->matrix, old_rows,
-												   temp_data->matrix[i],
-												   data->cols))
-				{
-					memcpy(data->matrix[k], temp_data->matrix[i], data->cols * sizeof(double));
-					data->rfactors[k] = temp_data->rfactors[i];
-					data->targets[k] = temp_data->targets[i];
-					k++;
-				}
-			}
-			data->rows = k;
-		}
-	}
-	else
+	if (queries_cache == NULL || generation != queries_cache_generation ||
+		hash_get_num_entries(queries_cache) >= fs_max_items)
 	{
-		if (data->rows > 0)
-			/* trivial strategy - use first suitable record and ignore others */
-			return;
-		memcpy(data, temp_data, sizeof(OkNNrdata));
-		if (data->cols > 0)
-		{
-			int i;
-
-			for (i = 0; i < data->rows; i++)
-			{
-				Assert(data->matrix[i]);
-				memcpy(data->matrix[i], temp_data->matrix[i], data->cols * sizeof(double));
-			}
-		}
-	}
-}
+		HASHCTL ctl;
 
-static OkNNrdata *
-_fill_knn_data(const DataEntry *entry, List **reloids)
-{
-	OkNNrdata *data;
-	char	   *ptr;
-	int			i;
-	size_t		offset;
-	size_t		sz = _compute_data_dsa(entry);
+		if (queries_cache != NULL)
+			hash_destroy(queries_cache);
 
-	data = OkNNr_allocate(entry->cols);
-	data->rows = entry->rows;
+		ctl.keysize = sizeof(uint64);
+		ctl.entrysize = sizeof(QueriesCacheEntry);
+		ctl.hcxt = AQOTopMemCtx;
+		queries_cache = hash_create("AQO queries cache", 128, &ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		queries_cache_generation = generation;
+	}
 
-	ptr = (char *) dsa_get_address(data_dsa, entry->data_dp);
+	centry = (QueriesCacheEntry *) hash_search(queries_cache, &queryid,
+											   HASH_FIND, &found);
 
-	/* Check invariants */
-	Assert(entry->rows <= aqo_K);
-	Assert(ptr != NULL);
-	Assert(entry->key.fss == ((data_key *)ptr)->fss);
-	Assert(data->matrix);
+	/* The class could be added since the lookup */
+	if (found && !centry->found && centry->inserts != inserts)
+		found = false;
 
-	ptr += sizeof(data_key);
+	if (!found)
+	{
+		/*
+		 * The generation was read before the lock acquisition. So, if somebody
+		 * changes the storage concurrently, the copy will be invalidated on the
+		 * next lookup.
+		 */
+		LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
+		entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_FIND,
+											 &found);
+		centry = (QueriesCacheEntry *) hash_search(queries_cache, &queryid,
+												   HASH_ENTER, NULL);
+		centry->found = found;
+		centry->inserts = inserts;
+		if (found)
+		{
+			centry->learn_aqo = entry->learn_aqo;
+			centry->use_aqo = entry->use_aqo;
+			centry->auto_tuning = entry->auto_tuning;
+			centry->smart_timeout = entry->smart_timeout;
+			centry->count_increase_timeout = entry->count_increase_timeout;
+			centry->jit = entry->jit;
+		}
+		LWLockRelease(&aqo_state->queries_lock);
 
-	if (entry->cols > 0)
+		if (centry->found)
+			queries_touch(queryid, now, 1);
+		centry->touched = now;
+		centry->nhits = 0;
+	}
+	else if (centry->found)
 	{
-		for (i = 0; i < entry->rows; i++)
+		/* Report usage of the class to the shared storage from time to time */
+		centry->nhits++;
+		if (TimestampDifferenceExceeds(centry->touched, now,
+									   QUERIES_TOUCH_INTERVAL))
 		{
-			Assert(data->matrix[i]);
-			memcpy(data->matrix[i], ptr, sizeof(double) * data->cols);
-			ptr += sizeof(double) * data->cols;
+			queries_touch(queryid, now, centry->nhits);
+			centry->touched = now;
+			centry->nhits = 0;
 		}
 	}
 
-	/* copy targets from DSM storage */
-	memcpy(data->targets, ptr, sizeof(double) * entry->rows);
-	ptr += sizeof(double) * entry->rows;
-	offset = ptr - (char *) dsa_get_address(data_dsa, entry->data_dp);
-	Assert(offset < sz);
-
-	/* copy rfactors from DSM storage */
-	memcpy(data->rfactors, ptr, sizeof(double) * entry->rows);
-	ptr += sizeof(double) * entry->rows;
-	offset = ptr - (char *) dsa_get_address(data_dsa, entry->data_dp);
-	Assert(offset <= sz);
-
-	if (reloids == NULL)
-		/* Isn't needed to load reloids list */
-		return data;
-
-	/* store list of relations. XXX: optimize ? */
-	for (i = 0; i < entry->nrels; i++)
+	if (centry->found)
 	{
-		*reloids = lappend_oid(*reloids, ObjectIdGetDatum(*(Oid*)ptr));
-		ptr += sizeof(Oid);
+		ctx->query_hash = centry->queryid;
+		ctx->learn_aqo = centry->learn_aqo;
+		ctx->use_aqo = centry->use_aqo;
+		ctx->auto_tuning = centry->auto_tuning;
+		ctx->smart_timeout = centry->smart_timeout;
+		ctx->count_increase_timeout = centry->count_increase_timeout;
+		ctx->jit = centry->jit;
 	}
+	return centry->found;
+}
 
-	offset = ptr - (char *) dsa_get_address(data_dsa, entry->data_dp);
-	if (offset != sz)
-		elog(PANIC, "[AQO] Shared memory ML storage is corrupted.");
+/*
+ * Register hits of the query class, accumulated by the backend. The query text
+ * shares the class usage.
+ */
+static void
+queries_touch(uint64 queryid, TimestampTz now, uint64 nhits)
+{
+	QueriesEntry   *entry;
+	QueryTextEntry *tentry;
 
-	return data;
+	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
+	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_FIND,
+										 NULL);
+	if (entry != NULL)
+		usage_touch(&entry->usage, now, nhits);
+	LWLockRelease(&aqo_state->queries_lock);
+
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_SHARED);
+	tentry = (QueryTextEntry *) hash_search(qtexts_htab, &queryid, HASH_FIND,
+											NULL);
+	if (tentry != NULL)
+		usage_touch(&tentry->usage, now, nhits);
+	LWLockRelease(&aqo_state->qtexts_lock);
 }
 
 /*
- * By given feature space and subspace, build kNN data structure.
- *
- * If wideSearch is true - make seqscan on the hash table to see for relevant
- * data across neighbours.
- * If reloids is NULL - don't fill this list.
- *
- * Return false if the operation was unsuccessful.
+ * Function for update and save value of smart statement timeout
+ * for query in aqu_queries table
  */
 bool
-load_aqo_data(uint64 fs, int fss, OkNNrdata *data, List **reloids,
-			  bool wideSearch, double *features)
+update_query_timeout(uint64 queryid, int64 smart_timeout)
 {
-	DataEntry  *entry;
-	bool		found;
-	data_key	key = {.fs = fs, .fss = fss};
-	OkNNrdata  *temp_data;
-
-	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-
-	dsa_init();
+	QueriesEntry   *entry;
+	bool			found;
+	bool		tblOverflow;
+	HASHACTION	action;
 
-	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	Assert(queries_htab);
 
-	if (!wideSearch)
-	{
-		entry = (DataEntry *) hash_search(data_htab, &key, HASH_FIND, &found);
+	/* Guard for default feature space */
+	Assert(queryid != 0);
 
-		if (!found)
-			goto end;
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
 
-		/* One entry with all correctly filled fields is found */
-		Assert(entry && entry->rows > 0);
-		Assert(DsaPointerIsValid(entry->data_dp));
+	/* Check hash table overflow */
+	tblOverflow = hash_get_num_entries(queries_htab) < fs_max_items ? false : true;
+	action = tblOverflow ? HASH_FIND : HASH_ENTER;
 
-		if (entry->cols != data->cols)
-		{
-			/* Collision happened? */
-			elog(LOG, "[AQO] Does a collision happened? Check it if possible "
-				 "(fs: "UINT64_FORMAT", fss: %d).",
-				 fs, fss);
-			found = false; /* Sign of unsuccessful operation */
-			goto end;
-		}
+	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, action,
+										 &found);
 
-		temp_data = _fill_knn_data(entry, reloids);
-		Assert(temp_data->rows > 0);
-		build_knn_matrix(data, temp_data, features);
-		Assert(data->rows > 0);
-	}
-	else
-	/* Iterate across all elements of the table. XXX: Maybe slow. */
+		/* Initialize entry on first usage */
+	if (!found && action == HASH_FIND)
 	{
-		HASH_SEQ_STATUS	hash_seq;
-		int				noids = -1;
-
-		found = false;
-		hash_seq_init(&hash_seq, data_htab);
-		while ((entry = hash_seq_search(&hash_seq)) != NULL)
-		{
-			List *tmp_oids = NIL;
+		/*
+		 * Hash table is full. To avoid possible problems - don't try to add
+		 * more, just exit
+		 */
+		LWLockRelease(&aqo_state->queries_lock);
+		return false;
+	}
 
-			Assert(entry->rows > 0);
+	if (!found)
+	{
+		usage_init(&entry->usage, GetCurrentTimestamp(), 0);
+		entry->jit = AQO_JIT_AUTO;
+	}
 
-			if (entry->key.fss != fss || entry->cols != data->cols)
-				continue;
+	entry->smart_timeout = smart_timeout;
+	entry->count_increase_timeout = entry->count_increase_timeout + 1;
+	queries_storage_changed();
 
-			temp_data = _fill_knn_data(entry, &tmp_oids);
+	LWLockRelease(&aqo_state->queries_lock);
+	return true;
+}
 
-			if (data->rows > 0 && list_length(tmp_oids) != noids)
-			{
-				/* Dubious case. So log it and skip these data */
-				elog(LOG,
-					 "[AQO] different number depended oids for the same fss %d: "
-					 "%d and %d correspondingly.",
-					 fss, list_length(tmp_oids), noids);
-				Assert(noids >= 0);
-				list_free(tmp_oids);
-				continue;
-			}
+/*
+ * Update AQO preferences for a given queryid value.
+ * if incoming param is null - leave it unchanged.
+ * if forced is false, do nothing if query with such ID isn't exists yet.
+ * Return true if operation have done some changes.
+ */
+Datum
+aqo_queries_update(PG_FUNCTION_ARGS)
+{
+	uint64			queryid;
+	uint64			fs = 0;
+	bool			learn_aqo = false;
+	bool			use_aqo = false;
+	bool			auto_tuning = false;
 
-			noids = list_length(tmp_oids);
+	AqoQueriesNullArgs	null_args =
+		{ PG_ARGISNULL(AQ_FS), PG_ARGISNULL(AQ_LEARN_AQO),
+		  PG_ARGISNULL(AQ_USE_AQO), PG_ARGISNULL(AQ_AUTO_TUNING) };
 
-			if (reloids != NULL && *reloids == NIL)
-				*reloids = tmp_oids;
-			else
-				list_free(tmp_oids);
+	if (PG_ARGISNULL(AQ_QUERYID))
+		PG_RETURN_BOOL(false);
 
-			build_knn_matrix(data, temp_data, NULL);
-			found = true;
-		}
-	}
+	queryid = PG_GETARG_INT64(AQ_QUERYID);
+	if (queryid == 0)
+		/* Do nothing for default feature space */
+		PG_RETURN_BOOL(false);
 
-	Assert(!found || (data->rows > 0 && data->rows <= aqo_K));
-end:
-	LWLockRelease(&aqo_state->data_lock);
+	if (!null_args.fs_is_null)
+		fs = PG_GETARG_INT64(AQ_FS);
+	if (!null_args.learn_aqo_is_null)
+		learn_aqo = PG_GETARG_BOOL(AQ_LEARN_AQO);
+	if (!null_args.use_aqo_is_null)
+		use_aqo = PG_GETARG_BOOL(AQ_USE_AQO);
+	if (!null_args.auto_tuning_is_null)
+		auto_tuning = PG_GETARG_BOOL(AQ_AUTO_TUNING);
 
-	return found;
+	PG_RETURN_BOOL(aqo_queries_store(queryid,
+									 fs, learn_aqo, use_aqo, auto_tuning,
+									 &null_args));
 }
 
 Datum
-aqo_data(PG_FUNCTION_ARGS)
+aqo_reset(PG_FUNCTION_ARGS)
 {
-	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	TupleDesc			tupDesc;
-	MemoryContext		per_query_ctx;
-	MemoryContext		oldcontext;
-	Tuplestorestate	   *tupstore;
-	Datum				values[AD_TOTAL_NCOLS];
-	bool				nulls[AD_TOTAL_NCOLS];
-	HASH_SEQ_STATUS		hash_seq;
-	DataEntry		   *entry;
+	long counter = 0;
 
-	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
+	counter += aqo_stat_reset();
+	counter += aqo_qtexts_reset();
+	counter += aqo_data_reset();
+	counter += aqo_queries_reset();
+	_relio_reset();
+	_shadow_reset();
 
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not allowed in this context")));
+	/* Cleanup cache of deactivated queries */
+	reset_deactivated_queries();
 
-	/* Switch into long-lived context to construct returned data structures */
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	PG_RETURN_INT64(counter);
+}
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
-	Assert(tupDesc->natts == AD_TOTAL_NCOLS);
+#include "utils/syscache.h"
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupDesc;
+/*
+ * State of a feature space during the cleanup.
+ */
+typedef struct CleanupFSEntry
+{
+	uint64	fs;
 
-	MemoryContextSwitchTo(oldcontext);
+	bool	has_junk;	/* Some fss links to a dropped relation */
+	bool	has_data;	/* Some fss remains after the removal */
+	List   *fss;		/* Records to remove */
+} CleanupFSEntry;
 
-	dsa_init();
-	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
-	hash_seq_init(&hash_seq, data_htab);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		char *ptr;
+typedef struct CleanupRelEntry
+{
+	Oid		reloid;
+	bool	dropped;
+} CleanupRelEntry;
 
-		memset(nulls, 0, AD_TOTAL_NCOLS);
+typedef struct CleanupClass
+{
+	uint64	queryid;
+	uint64	fs;
+} CleanupClass;
 
-		values[AD_FS] = Int64GetDatum(entry->key.fs);
-		values[AD_FSS] = Int32GetDatum((int) entry->key.fss);
-		values[AD_NFEATURES] = Int32GetDatum(entry->cols);
+/*
+ * Rebuild the reverse index of relations, invalidated because of memory
+ * limits. Returns false, if the index is still invalid.
+ */
+static bool
+_reloids_index_rebuild(void)
+{
+	HASH_SEQ_STATUS	hash_seq;
+	DataEntry	   *entry;
+	bool			valid;
 
-		/* Fill values from the DSA data chunk */
-		Assert(DsaPointerIsValid(entry->data_dp));
-		ptr = dsa_get_address(data_dsa, entry->data_dp);
-		Assert(entry->key.fs == ((data_key*)ptr)->fs && entry->key.fss == ((data_key*)ptr)->fss);
-		ptr += sizeof(data_key);
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	valid = aqo_state->reloids_index_valid;
+	LWLockRelease(&aqo_state->data_lock);
 
-		if (entry->cols > 0)
-			values[AD_FEATURES] = PointerGetDatum(form_matrix((double *) ptr,
-													entry->rows, entry->cols));
-		else
-			nulls[AD_FEATURES] = true;
+	if (valid)
+		return true;
 
-		ptr += sizeof(double) * entry->rows * entry->cols;
-		values[AD_TARGETS] = PointerGetDatum(form_vector((double *)ptr, entry->rows));
-		ptr += sizeof(double) * entry->rows;
-		values[AD_RELIABILITY] = PointerGetDatum(form_vector((double *)ptr, entry->rows));
-		ptr += sizeof(double) * entry->rows;
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	if (!aqo_state->reloids_index_valid)
+	{
+		_reloids_index_reset();
 
-		if (entry->nrels > 0)
+		hash_seq_init(&hash_seq, data_htab);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
 		{
-			Datum	   *elems;
-			ArrayType  *array;
-			int			i;
-
-			elems = palloc(sizeof(*elems) * entry->nrels);
-			for(i = 0; i < entry->nrels; i++)
+			_reloids_index_add(&entry->key, entry->dbid,
+							   _data_entry_reloids(entry), entry->nrels);
+			if (!aqo_state->reloids_index_valid)
 			{
-				elems[i] = ObjectIdGetDatum(*(Oid *)ptr);
-				ptr += sizeof(Oid);
+				hash_seq_term(&hash_seq);
+				break;
 			}
-
-			array = construct_array(elems, entry->nrels, OIDOID,
-									sizeof(Oid), true, TYPALIGN_INT);
-			values[AD_OIDS] = PointerGetDatum(array);
 		}
-		else
-			nulls[AD_OIDS] = true;
 
-		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+		if (!aqo_state->reloids_index_valid)
+		{
+			/* Don't waste the memory on the incomplete index */
+			_reloids_index_reset();
+			aqo_state->reloids_index_valid = false;
+			elog(LOG, "[AQO] Not enough memory to rebuild the reverse index "
+				 "of relations");
+		}
 	}
-
+	valid = aqo_state->reloids_index_valid;
 	LWLockRelease(&aqo_state->data_lock);
-	return (Datum) 0;
+
+	return valid;
 }
 
-static long
-_aqo_data_clean(uint64 fs)
+/*
+ * Get the next batch of relations of the database, the ML data depends on: not
+ * more than aqo.cleanup_batch_size relations, starting from the cursor in the
+ * order of OIDs. *last is set, if the batch reaches the end of the index.
+ */
+static Oid *
+_cleanup_next_batch(Oid dbid, Oid cursor, int *nreloids, bool *last)
 {
-	HASH_SEQ_STATUS	hash_seq;
-	DataEntry	   *entry;
-	long			removed = 0;
+	HASH_SEQ_STATUS		hash_seq;
+	RelOidIndexEntry   *rentry;
+	Oid				   *reloids;
+	int					n = 0;
 
-	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	Assert(LWLockHeldByMe(&aqo_state->data_lock));
 
-	hash_seq_init(&hash_seq, data_htab);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	reloids = palloc((hash_get_num_entries(reloids_htab) + 1) * sizeof(Oid));
+	hash_seq_init(&hash_seq, reloids_htab);
+	while ((rentry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		if (entry->key.fs != fs)
-			continue;
-
-		Assert(DsaPointerIsValid(entry->data_dp));
-		dsa_free(data_dsa, entry->data_dp);
-		entry->data_dp = InvalidDsaPointer;
-		if (!hash_search(data_htab, &entry->key, HASH_REMOVE, NULL))
-			elog(PANIC, "[AQO] hash table corrupted");
-		removed++;
+		if (rentry->key.dbid == dbid && rentry->key.reloid >= cursor)
+			reloids[n++] = rentry->key.reloid;
 	}
 
-	LWLockRelease(&aqo_state->data_lock);
-	return removed;
+	*last = (n <= aqo_cleanup_batch_size);
+	if (!*last)
+		qsort(reloids, n, sizeof(Oid), oid_cmp);
+	*nreloids = Min(n, aqo_cleanup_batch_size);
+	return reloids;
 }
 
-static long
-aqo_data_reset(void)
+/*
+ * Collect keys of the records, which depend on the relations, dropped in the
+ * database.
+ */
+static void
+_cleanup_junk_collect(HTAB *junk_htab, Oid dbid, const Oid *dropped,
+					  int ndropped)
 {
 	HASH_SEQ_STATUS	hash_seq;
 	DataEntry	   *entry;
-	long			num_remove = 0;
-	long			num_entries;
+	RelOidIndexKey	rkey = {.dbid = dbid};
+	int				i;
 
-	dsa_init();
+	if (ndropped == 0)
+		return;
 
-	Assert(!LWLockHeldByMe(&aqo_state->data_lock));
-	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
-	num_entries = hash_get_num_entries(data_htab);
-	hash_seq_init(&hash_seq, data_htab);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	if (aqo_state->reloids_index_valid)
 	{
-		Assert(DsaPointerIsValid(entry->data_dp));
-		dsa_free(data_dsa, entry->data_dp);
-		if (!hash_search(data_htab, &entry->key, HASH_REMOVE, NULL))
-			elog(PANIC, "[AQO] hash table corrupted");
-		num_remove++;
+		for (i = 0; i < ndropped; i++)
+		{
+			RelOidIndexEntry   *rentry;
+			data_key		   *keys;
+			int					j;
+
+			rkey.reloid = dropped[i];
+			rentry = (RelOidIndexEntry *) hash_search(reloids_htab, &rkey,
+													  HASH_FIND, NULL);
+			if (rentry == NULL)
+				continue;
+
+			keys = (data_key *) dsa_get_address(data_dsa, rentry->keys_dp);
+			for (j = 0; j < rentry->nkeys; j++)
+				(void) hash_search(junk_htab, &keys[j], HASH_ENTER, NULL);
+		}
 	}
+	else
+	{
+		/* The index was invalidated concurrently */
+		hash_seq_init(&hash_seq, data_htab);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			Oid	   *oids = _data_entry_reloids(entry);
+			int		j;
 
-	if (num_remove > 0)
-		aqo_state->data_changed = true;
-	LWLockRelease(&aqo_state->data_lock);
-	if (num_remove != num_entries)
-		elog(ERROR, "[AQO] Query ML memory storage is corrupted or parallel access without a lock has detected.");
+			if (entry->dbid != dbid)
+				continue;
 
-	aqo_data_flush();
+			for (i = 0; i < entry->nrels; i++)
+			{
+				for (j = 0; j < ndropped; j++)
+					if (oids[i] == dropped[j])
+						break;
 
-	return num_remove;
+				if (j < ndropped)
+				{
+					(void) hash_search(junk_htab, &entry->key, HASH_ENTER,
+									   NULL);
+					break;
+				}
+			}
+		}
+	}
+	LWLockRelease(&aqo_state->data_lock);
 }
 
-Datum
-aqo_queries(PG_FUNCTION_ARGS)
+/*
+ * Collect keys of the records, which depend on the dropped relations, without
+ * the reverse index. Check existence of each relation in the syscache only
+ * once.
+ */
+static void
+_cleanup_junk_scan(HTAB *junk_htab)
 {
-	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	TupleDesc			tupDesc;
-	MemoryContext		per_query_ctx;
-	MemoryContext		oldcontext;
-	Tuplestorestate	   *tupstore;
-	Datum				values[AQ_TOTAL_NCOLS + 1];
-	bool				nulls[AQ_TOTAL_NCOLS + 1];
+	HASHCTL				ctl;
+	HTAB			   *rels_htab;
 	HASH_SEQ_STATUS		hash_seq;
-	QueriesEntry	   *entry;
-
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not allowed in this context")));
+	DataEntry		   *entry;
+	CleanupRelEntry	   *relentry;
+	int					i;
 
-	/* Switch into long-lived context to construct returned data structures */
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(CleanupRelEntry);
+	ctl.hcxt = CurrentMemoryContext;
+	rels_htab = hash_create("AQO cleanup relations", 128, &ctl,
+							HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
-	Assert(tupDesc->natts == AQ_TOTAL_NCOLS);
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, data_htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Oid	   *oids = _data_entry_reloids(entry);
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupDesc;
+		/* The syscache knows only relations of the current database */
+		if (entry->dbid != MyDatabaseId)
+			continue;
 
-	MemoryContextSwitchTo(oldcontext);
+		for (i = 0; i < entry->nrels; i++)
+		{
+			bool	found;
 
-	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
-	hash_seq_init(&hash_seq, queries_htab);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		memset(nulls, 0, AQ_TOTAL_NCOLS + 1);
+			relentry = (CleanupRelEntry *) hash_search(rels_htab, &oids[i],
+													   HASH_ENTER, &found);
+			if (!found)
+				relentry->dropped =
+					!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(oids[i]));
 
-		values[AQ_QUERYID] = Int64GetDatum(entry->queryid);
-		values[AQ_FS] = Int64GetDatum(entry->fs);
-		values[AQ_LEARN_AQO] = BoolGetDatum(entry->learn_aqo);
-		values[AQ_USE_AQO] = BoolGetDatum(entry->use_aqo);
-		values[AQ_AUTO_TUNING] = BoolGetDatum(entry->auto_tuning);
-		values[AQ_SMART_TIMEOUT] = Int64GetDatum(entry->smart_timeout);
-		values[AQ_COUNT_INCREASE_TIMEOUT] = Int64GetDatum(entry->count_increase_timeout);
-		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+			if (relentry->dropped)
+			{
+				(void) hash_search(junk_htab, &entry->key, HASH_ENTER, NULL);
+				break;
+			}
+		}
 	}
+	LWLockRelease(&aqo_state->data_lock);
 
-	LWLockRelease(&aqo_state->queries_lock);
-	return (Datum) 0;
+	hash_destroy(rels_htab);
 }
 
-bool
-aqo_queries_store(uint64 queryid,
-				  uint64 fs, bool learn_aqo, bool use_aqo, bool auto_tuning,
-				  AqoQueriesNullArgs *null_args)
+/*
+ * Remove the junk records of aqo_data. Consider only feature spaces of
+ * existed query classes.
+ * If gentle is TRUE, remove these records only. Another case, remove all
+ * records with the same fs from aqo_data.
+ * If no one record in aqo_data remains for the (not default) fs - remove the
+ * class from aqo_queries, aqo_query_stat and aqo_query_texts. With the sweep
+ * flag, check all the classes, not only the classes with junk records.
+ */
+static void
+_cleanup_junk_remove(bool gentle, HTAB *junk_htab, bool sweep,
+					 int *fs_num, int *fss_num)
 {
-	QueriesEntry   *entry;
-	bool			found;
-	bool		tblOverflow;
-	HASHACTION	action;
-
-	/* Insert is allowed if no args are NULL. */
-	bool safe_insert =
-		(!null_args->fs_is_null && !null_args->learn_aqo_is_null &&
-		 !null_args->use_aqo_is_null && !null_args->auto_tuning_is_null);
-
-	Assert(queries_htab);
+	HASHCTL				ctl;
+	HTAB			   *fs_htab;
+	HASH_SEQ_STATUS		hash_seq;
+	QueriesEntry	   *qentry;
+	DataEntry		   *dentry;
+	CleanupFSEntry	   *fentry;
+	CleanupClass	   *classes;
+	data_key		   *key;
+	int					nclasses = 0;
+	bool				has_junk = false;
+	ListCell		   *lc;
+	int					i;
+
+	ctl.keysize = sizeof(uint64);
+	ctl.entrysize = sizeof(CleanupFSEntry);
+	ctl.hcxt = CurrentMemoryContext;
+	fs_htab = hash_create("AQO cleanup feature spaces", 128, &ctl,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* Remember query classes and their feature spaces */
+	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
+	classes = palloc(hash_get_num_entries(queries_htab) * sizeof(CleanupClass));
+	hash_seq_init(&hash_seq, queries_htab);
+	while ((qentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		bool	found;
 
-	/* Guard for default feature space */
-	Assert(queryid != 0 || (fs == 0 && learn_aqo == false &&
-		   use_aqo == false && auto_tuning == false));
+		classes[nclasses].queryid = qentry->queryid;
+		classes[nclasses].fs = qentry->fs;
+		nclasses++;
 
-	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+		fentry = (CleanupFSEntry *) hash_search(fs_htab, &qentry->fs,
+												HASH_ENTER, &found);
+		if (!found)
+		{
+			fentry->has_junk = false;
+			fentry->has_data = false;
+			fentry->fss = NIL;
+		}
+	}
+	LWLockRelease(&aqo_state->queries_lock);
 
-	/* Check hash table overflow */
-	tblOverflow = hash_get_num_entries(queries_htab) < fs_max_items ? false : true;
-	action = (tblOverflow || !safe_insert) ? HASH_FIND : HASH_ENTER;
+	hash_seq_init(&hash_seq, junk_htab);
+	while ((key = hash_seq_search(&hash_seq)) != NULL)
+	{
+		fentry = (CleanupFSEntry *) hash_search(fs_htab, &key->fs,
+												HASH_FIND, NULL);
+		if (fentry == NULL)
+			/* Don't touch data of feature spaces without a query class */
+			continue;
 
-	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, action,
-										 &found);
+		fentry->has_junk = true;
+		has_junk = true;
+		if (gentle)
+			fentry->fss = lappend_int(fentry->fss, key->fss);
+	}
 
-		/* Initialize entry on first usage */
-	if (!found && action == HASH_FIND)
+	if (has_junk && !gentle)
 	{
 		/*
-		 * Hash table is full. To avoid possible problems - don't try to add
-		 * more, just exit
+		 * In forced mode remove all child FSSes even some of them are still
+		 * link to existed tables.
 		 */
-		LWLockRelease(&aqo_state->queries_lock);
-		ereport(LOG,
-			(errcode(ERRCODE_OUT_OF_MEMORY),
-			 errmsg("[AQO] Queries storage is full. No more feature spaces can be added."),
-			 errhint("Increase value of aqo.fs_max_items on restart of the instance")));
-		return false;
+		LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+		hash_seq_init(&hash_seq, data_htab);
+		while ((dentry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			fentry = (CleanupFSEntry *) hash_search(fs_htab, &dentry->key.fs,
+													HASH_FIND, NULL);
+			if (fentry != NULL && fentry->has_junk)
+				fentry->fss = lappend_int(fentry->fss, dentry->key.fss);
+		}
+		LWLockRelease(&aqo_state->data_lock);
 	}
 
-	if (!null_args->fs_is_null)
-		entry->fs = fs;
-	if (!null_args->learn_aqo_is_null)
-		entry->learn_aqo = learn_aqo;
-	if (!null_args->use_aqo_is_null)
-		entry->use_aqo = use_aqo;
-	if (!null_args->auto_tuning_is_null)
-		entry->auto_tuning = auto_tuning;
-	if (!null_args->smart_timeout)
-		entry->smart_timeout = 0;
-	if (!null_args->count_increase_timeout)
-		entry->count_increase_timeout = 0;
-
-	if (entry->learn_aqo || entry->use_aqo || entry->auto_tuning)
-		/* Remove the class from cache of deactivated queries */
-		hash_search(deactivated_queries, &queryid, HASH_REMOVE, NULL);
+	/* Remove junk records from aqo_data */
+	hash_seq_init(&hash_seq, fs_htab);
+	while ((fentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		foreach(lc, fentry->fss)
+		{
+			data_key	key = {.fs = fentry->fs, .fss = lfirst_int(lc)};
 
-	aqo_state->queries_changed = true;
-	aqo_state->queries_changed = true;
-	LWLockRelease(&aqo_state->queries_lock);
-	return true;
-}
+			(*fss_num) += (int) _aqo_data_remove(&key);
+		}
+	}
 
-static long
-aqo_queries_reset(void)
-{
-	HASH_SEQ_STATUS		hash_seq;
-	QueriesEntry	   *entry;
-	long				num_remove = 0;
-	long				num_entries;
+	if (!has_junk && !sweep)
+		goto end;
 
-	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
-	num_entries = hash_get_num_entries(queries_htab);
-	hash_seq_init(&hash_seq, queries_htab);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	/* Find feature spaces, left without data */
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, data_htab);
+	while ((dentry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		if (entry->queryid == 0)
-			/* Don't remove default feature space */
-			continue;
+		if (dentry->nrels <= 0)
+		{
+			/*
+			 * Impossible case. We don't use AQO for so simple or synthetic
+			 * data. Just detect errors in this logic.
+			 */
+			ereport(PANIC,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("AQO detected incorrect behaviour: fs="
+					 UINT64_FORMAT" fss=%d",
+					dentry->key.fs, (int32) dentry->key.fss)));
+		}
 
-		if (!hash_search(queries_htab, &entry->queryid, HASH_REMOVE, NULL))
-			elog(PANIC, "[AQO] hash table corrupted");
-		num_remove++;
+		fentry = (CleanupFSEntry *) hash_search(fs_htab, &dentry->key.fs,
+												HASH_FIND, NULL);
+		if (fentry != NULL)
+			fentry->has_data = true;
 	}
+	LWLockRelease(&aqo_state->data_lock);
 
-	if (num_remove > 0)
-		aqo_state->queries_changed = true;
+	for (i = 0; i < nclasses; i++)
+	{
+		fentry = (CleanupFSEntry *) hash_search(fs_htab, &classes[i].fs,
+												HASH_FIND, NULL);
+		Assert(fentry != NULL);
 
-	LWLockRelease(&aqo_state->queries_lock);
+		/*
+		 * If no one live FSS exists, remove the class totally. Don't touch
+		 * default query class.
+		 */
+		if (classes[i].fs != 0 && (fentry->has_junk || sweep) &&
+			!fentry->has_data)
+		{
+			/* Query Stat */
+			_aqo_stat_remove(classes[i].queryid);
 
-	if (num_remove != num_entries - 1)
-		elog(ERROR, "[AQO] Queries memory storage is corrupted or parallel access without a lock has detected.");
+			/* Query text */
+			_aqo_qtexts_remove(classes[i].queryid);
 
-	aqo_queries_flush();
+			/* Query class preferences */
+			(*fs_num) += (int) _aqo_queries_remove(classes[i].queryid);
+		}
+	}
 
-	return num_remove;
+end:
+	pfree(classes);
+	hash_destroy(fs_htab);
 }
 
-Datum
-aqo_enable_query(PG_FUNCTION_ARGS)
+static HTAB *
+_cleanup_junk_create(void)
 {
-	uint64			queryid = (uint64) PG_GETARG_INT64(0);
-	QueriesEntry   *entry;
-	bool			found;
-
-	Assert(queries_htab);
-
-	if (queryid == 0)
-		elog(ERROR, "[AQO] Default class can't be updated.");
-
-	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
-	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_FIND, &found);
+	HASHCTL		ctl;
 
-	if (found)
-	{
-		entry->learn_aqo = true;
-		entry->use_aqo = true;
-		if (aqo_mode == AQO_MODE_INTELLIGENT)
-			entry->auto_tuning = true;
-	}
-	else
-		elog(ERROR, "[AQO] Entry with queryid "INT64_FORMAT
-			 " not contained in table", (int64) queryid);
+	ctl.keysize = sizeof(data_key);
+	ctl.entrysize = sizeof(data_key);
+	ctl.hcxt = CurrentMemoryContext;
+	return hash_create("AQO cleanup junk records", 128, &ctl,
+					   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
 
-	hash_search(deactivated_queries, &queryid, HASH_REMOVE, NULL);
-	LWLockRelease(&aqo_state->queries_lock);
-	PG_RETURN_VOID();
+/*
+ * The best place to flush updated AQO storage: calling the routine, user
+ * realizes how heavy it is.
+ */
+static void
+_cleanup_flush(void)
+{
+	aqo_stat_flush();
+	aqo_data_flush();
+	aqo_qtexts_flush();
+	aqo_queries_flush();
 }
 
-Datum
-aqo_disable_query(PG_FUNCTION_ARGS)
+/*
+ * Make a step of the cleanup of the knowledge, related to the dropped
+ * relations: check the next batch of relations of the reverse index. The
+ * cursor of the cleanup persists in the shared memory, so the next call
+ * continues from the place, where this call has stopped, even if it was made
+ * by another backend.
+ * The syscache is asked once per relation and no locks are held during the
+ * lookups. Only the records, which depend on dropped relations, are looked
+ * into.
+ * Returns true, if the pass over all the relations is completed. At the end
+ * of the pass the classes, left without any data, are removed too.
+ */
+bool
+cleanup_aqo_database(bool gentle, int *fs_num, int *fss_num)
 {
-	uint64			queryid = (uint64) PG_GETARG_INT64(0);
-	QueriesEntry   *entry;
-	bool			found;
+	HTAB	   *junk_htab;
+	Oid		   *reloids;
+	int			nreloids;
+	int			ndropped = 0;
+	Oid			cursor;
+	Oid			next;
+	bool		last;
+	int			i;
 
-	Assert(queries_htab);
+	/* Call it because we might touch DSA segments during the cleanup */
+	dsa_init();
 
-	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
-	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_FIND, &found);
+	*fs_num = 0;
+	*fss_num = 0;
 
-	if(found)
-	{
-		entry->learn_aqo = false;
-		entry->use_aqo = false;
-		entry->auto_tuning = false;
-	}
-	else
+	junk_htab = _cleanup_junk_create();
+
+	if (!_reloids_index_rebuild())
 	{
-		elog(ERROR, "[AQO] Entry with "INT64_FORMAT" not contained in table",
-			 (int64) queryid);
+		/* Check relations of each record at once */
+		_cleanup_junk_scan(junk_htab);
+		_cleanup_junk_remove(gentle, junk_htab, true, fs_num, fss_num);
+		hash_destroy(junk_htab);
+		return true;
 	}
-	LWLockRelease(&aqo_state->queries_lock);
-	PG_RETURN_VOID();
-}
 
-bool
-aqo_queries_find(uint64 queryid, QueryContextData *ctx)
-{
-	bool			found;
-	QueriesEntry   *entry;
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	cursor = aqo_state->cleanup_cursor;
+	reloids = _cleanup_next_batch(MyDatabaseId, cursor, &nreloids, &last);
+	LWLockRelease(&aqo_state->data_lock);
 
-	Assert(queries_htab);
+	next = (last || nreloids == 0) ? InvalidOid : reloids[nreloids - 1] + 1;
 
-	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
-	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_FIND, &found);
-	if (found)
+	/* Don't hold the lock during the syscache lookups */
+	for (i = 0; i < nreloids; i++)
 	{
-		ctx->query_hash = entry->queryid;
-		ctx->learn_aqo = entry->learn_aqo;
-		ctx->use_aqo = entry->use_aqo;
-		ctx->auto_tuning = entry->auto_tuning;
-		ctx->smart_timeout = entry->smart_timeout;
-		ctx->count_increase_timeout = entry->count_increase_timeout;
+		if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(reloids[i])))
+			reloids[ndropped++] = reloids[i];
 	}
-	LWLockRelease(&aqo_state->queries_lock);
-	return found;
+
+	_cleanup_junk_collect(junk_htab, MyDatabaseId, reloids, ndropped);
+	_cleanup_junk_remove(gentle, junk_htab, last, fs_num, fss_num);
+
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	/* A concurrent cleanup could move the cursor already */
+	if (aqo_state->cleanup_cursor == cursor)
+		aqo_state->cleanup_cursor = next;
+	LWLockRelease(&aqo_state->data_lock);
+
+	pfree(reloids);
+	hash_destroy(junk_htab);
+	return last;
 }
 
 /*
- * Function for update and save value of smart statement timeout
- * for query in aqu_queries table
+ * Gentle cleanup of the knowledge, related to the relations, dropped in the
+ * database. Doesn't need a database connection.
  */
-bool
-update_query_timeout(uint64 queryid, int64 smart_timeout)
+void
+aqo_cleanup_dropped(Oid dbid, const Oid *reloids, int nreloids,
+					int *fs_num, int *fss_num)
 {
-	QueriesEntry   *entry;
-	bool			found;
-	bool		tblOverflow;
-	HASHACTION	action;
+	HTAB	   *junk_htab;
 
-	Assert(queries_htab);
+	dsa_init();
 
-	/* Guard for default feature space */
-	Assert(queryid != 0);
+	*fs_num = 0;
+	*fss_num = 0;
 
-	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
+	junk_htab = _cleanup_junk_create();
+	_cleanup_junk_collect(junk_htab, dbid, reloids, nreloids);
+	_cleanup_junk_remove(true, junk_htab, true, fs_num, fss_num);
+	hash_destroy(junk_htab);
 
-	/* Check hash table overflow */
-	tblOverflow = hash_get_num_entries(queries_htab) < fs_max_items ? false : true;
-	action = tblOverflow ? HASH_FIND : HASH_ENTER;
+	_relio_remove(dbid, reloids, nreloids);
+	_cleanup_flush();
+}
 
-	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, action,
-										 &found);
+Datum
+aqo_cleanup(PG_FUNCTION_ARGS)
+{
+	int					fs_num = 0;
+	int					fss_num = 0;
+	Oid					start;
+	bool				wrapped = false;
+	TupleDesc			tupDesc;
+	HeapTuple			tuple;
+	Datum				result;
+	Datum				values[2];
+	bool				nulls[2] = {0, 0};
 
-		/* Initialize entry on first usage */
-	if (!found && action == HASH_FIND)
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupDesc->natts == 2);
+
+	/*
+	 * Make forced cleanup: if at least one fss isn't actual, remove parent FS
+	 * and all its FSSes.
+	 * Main idea of such behaviour here is, if a table was deleted, we have
+	 * little chance to use this class in future. Only one use case here can be
+	 * a reason: to use it as a base for search data in a set of neighbours.
+	 * But, invent another UI function for such logic.
+	 *
+	 * Make a full pass over the relations in batches, starting from the
+	 * cursor. Locks aren't held between the batches. If the call is
+	 * cancelled, the next one continues from the place, where it stopped.
+	 */
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	start = aqo_state->cleanup_cursor;
+	LWLockRelease(&aqo_state->data_lock);
+
+	for (;;)
 	{
-		/*
-		 * Hash table is full. To avoid possible problems - don't try to add
-		 * more, just exit
-		 */
-		LWLockRelease(&aqo_state->queries_lock);
-		return false;
+		int		nfs;
+		int		nfss;
+		bool	last;
+		Oid		cursor;
+
+		CHECK_FOR_INTERRUPTS();
+
+		last = cleanup_aqo_database(false, &nfs, &nfss);
+		fs_num += nfs;
+		fss_num += nfss;
+
+		if (last)
+		{
+			if (start == InvalidOid || wrapped)
+				break;
+
+			/* Check relations before the start */
+			wrapped = true;
+			continue;
+		}
+
+		LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+		cursor = aqo_state->cleanup_cursor;
+		LWLockRelease(&aqo_state->data_lock);
+
+		if (wrapped && cursor >= start)
+			break;
 	}
+	_cleanup_flush();
 
-	entry->smart_timeout = smart_timeout;
-	entry->count_increase_timeout = entry->count_increase_timeout + 1;
+	values[0] = Int32GetDatum(fs_num);
+	values[1] = Int32GetDatum(fss_num);
 
-	LWLockRelease(&aqo_state->queries_lock);
-	return true;
+	tuple = heap_form_tuple(tupDesc, values, nulls);
+	result = HeapTupleGetDatum(tuple);
+
+	PG_RETURN_DATUM(result);
 }
 
 /*
- * Update AQO preferences for a given queryid value.
- * if incoming param is null - leave it unchanged.
- * if forced is false, do nothing if query with such ID isn't exists yet.
- * Return true if operation have done some changes.
+ * XXX: Maybe to allow usage of NULL value to make a reset?
  */
 Datum
-aqo_queries_update(PG_FUNCTION_ARGS)
+aqo_drop_class(PG_FUNCTION_ARGS)
 {
-	uint64			queryid;
-	uint64			fs = 0;
-	bool			learn_aqo = false;
-	bool			use_aqo = false;
-	bool			auto_tuning = false;
-
-	AqoQueriesNullArgs	null_args =
-		{ PG_ARGISNULL(AQ_FS), PG_ARGISNULL(AQ_LEARN_AQO),
-		  PG_ARGISNULL(AQ_USE_AQO), PG_ARGISNULL(AQ_AUTO_TUNING) };
-
-	if (PG_ARGISNULL(AQ_QUERYID))
-		PG_RETURN_BOOL(false);
+	uint64			queryid = PG_GETARG_INT64(0);
+	bool			found;
+	QueriesEntry   *entry;
+	uint64			fs;
+	long			cnt;
 
-	queryid = PG_GETARG_INT64(AQ_QUERYID);
 	if (queryid == 0)
-		/* Do nothing for default feature space */
-		PG_RETURN_BOOL(false);
+		elog(ERROR, "[AQO] Cannot remove basic class "INT64_FORMAT".",
+			 (int64) queryid);
 
-	if (!null_args.fs_is_null)
-		fs = PG_GETARG_INT64(AQ_FS);
-	if (!null_args.learn_aqo_is_null)
-		learn_aqo = PG_GETARG_BOOL(AQ_LEARN_AQO);
-	if (!null_args.use_aqo_is_null)
-		use_aqo = PG_GETARG_BOOL(AQ_USE_AQO);
-	if (!null_args.auto_tuning_is_null)
-		auto_tuning = PG_GETARG_BOOL(AQ_AUTO_TUNING);
+	/* Extract FS value for the queryid */
+	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
+	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_FIND,
+										 &found);
+	if (!found)
+		elog(ERROR, "[AQO] Nothing to remove for the class "INT64_FORMAT".",
+			 (int64) queryid);
 
-	PG_RETURN_BOOL(aqo_queries_store(queryid,
-									 fs, learn_aqo, use_aqo, auto_tuning,
-									 &null_args));
-}
+	fs = entry->fs;
+	LWLockRelease(&aqo_state->queries_lock);
 
-Datum
-aqo_reset(PG_FUNCTION_ARGS)
-{
-	long counter = 0;
+	if (fs == 0)
+		elog(ERROR, "[AQO] Cannot remove class "INT64_FORMAT" with default FS.",
+			 (int64) queryid);
+	if (fs != queryid)
+		elog(WARNING,
+			 "[AQO] Removing query class has non-generic feature space value: "
+			 "id = "INT64_FORMAT", fs = "UINT64_FORMAT".", (int64) queryid, fs);
 
-	counter += aqo_stat_reset();
-	counter += aqo_qtexts_reset();
-	counter += aqo_data_reset();
-	counter += aqo_queries_reset();
+	/* Now, remove all data related to the class */
+	_aqo_queries_remove(queryid);
+	_aqo_stat_remove(queryid);
+	_aqo_qtexts_remove(queryid);
+	cnt = _aqo_data_clean(fs);
 
-	/* Cleanup cache of deactivated queries */
-	reset_deactivated_queries();
+	/* Immediately save changes to permanent storage. */
+	aqo_stat_flush();
+	aqo_data_flush();
+	aqo_qtexts_flush();
+	aqo_queries_flush();
 
-	PG_RETURN_INT64(counter);
+	PG_RETURN_INT32(cnt);
 }
 
-#include "utils/syscache.h"
-
 /*
- * Scan aqo_queries. For each FS lookup aqo_data records: detect a record, where
- * list of oids links to deleted tables.
- * If
- *
- * Scan aqo_data hash table. Detect a record, where list of oids links to
- * deleted tables. If gentle is TRUE, remove this record only. Another case,
- * remove all records with the same (not default) fs from aqo_data.
- * Scan aqo_queries. If no one record in aqo_data exists for this fs - remove
- * the record from aqo_queries, aqo_query_stat and aqo_query_texts.
+ * Remove knowledge which wasn't used since the horizon. Each storage drops its
+ * own expired entries. Stat and text of an expired query class go away
+ * together with the class. Default query class is never removed.
  */
 void
-cleanup_aqo_database(bool gentle, int *fs_num, int *fss_num)
+aqo_expire_knowledge(TimestampTz horizon, int *fs_num, int *fss_num)
 {
 	HASH_SEQ_STATUS	hash_seq;
-	QueriesEntry   *entry;
-
-	/* Call it because we might touch DSA segments during the cleanup */
+	QueriesEntry   *qentry;
+	StatEntry	   *sentry;
+	QueryTextEntry *tentry;
+	DataEntry	   *dentry;
+	List		   *classes = NIL;
+	ListCell	   *lc;
+	long			nremoved;
+
+	/* Call it because we free DSA chunks of texts and data */
 	dsa_init();
 
 	*fs_num = 0;
 	*fss_num = 0;
 
-	/*
-	 * It's a long haul. So, make seq scan without any lock. It is possible
-	 * because only this operation can delete data from hash table.
-	 */
+	LWLockAcquire(&aqo_state->queries_lock, LW_EXCLUSIVE);
 	hash_seq_init(&hash_seq, queries_htab);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	while ((qentry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		HASH_SEQ_STATUS	hash_seq2;
-		DataEntry	   *dentry;
-		List		   *junk_fss = NIL;
-		List		   *actual_fss = NIL;
-		ListCell	   *lc;
-
-		/* Scan aqo_data for any junk records related to this FS */
-		hash_seq_init(&hash_seq2, data_htab);
-		while ((dentry = hash_seq_search(&hash_seq2)) != NULL)
-		{
-			char *ptr;
-
-			if (entry->fs != dentry->key.fs)
-				/* Another FS */
-				continue;
-
-			LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
-
-			Assert(DsaPointerIsValid(dentry->data_dp));
-			ptr = dsa_get_address(data_dsa, dentry->data_dp);
-
-			ptr += sizeof(data_key);
-			ptr += sizeof(double) * dentry->rows * dentry->cols;
-			ptr += sizeof(double) * 2 * dentry->rows;
-
-			if (dentry->nrels > 0)
-			{
-				int			i;
+		if (qentry->queryid == 0 || !usage_expired(&qentry->usage, horizon))
+			continue;
 
-				/* Check each OID to be existed. */
-				for(i = 0; i < dentry->nrels; i++)
-				{
-					Oid reloid = ObjectIdGetDatum(*(Oid *)ptr);
+		classes = lappend_uint64(classes, qentry->queryid);
+		if (!hash_search(queries_htab, &qentry->queryid, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+		(*fs_num)++;
+	}
+	if (*fs_num > 0)
+		queries_storage_changed();
+	LWLockRelease(&aqo_state->queries_lock);
 
-					if (!SearchSysCacheExists1(RELOID, reloid))
-						/* Remember this value */
-						junk_fss = list_append_unique_int(junk_fss,
-														  dentry->key.fss);
-					else
-						actual_fss = list_append_unique_int(actual_fss,
-															dentry->key.fss);
+	/* Remove stat and texts of expired classes */
+	foreach(lc, classes)
+	{
+		uint64 queryid = *(uint64 *) lfirst(lc);
 
-					ptr += sizeof(Oid);
-				}
-			}
-			else
-			{
-				/*
-				 * Impossible case. We don't use AQO for so simple or synthetic
-				 * data. Just detect errors in this logic.
-				 */
-				ereport(PANIC,
-						(errcode(ERRCODE_INTERNAL_ERROR),
-						 errmsg("AQO detected incorrect behaviour: fs="
-						 UINT64_FORMAT" fss=%d",
-						dentry->key.fs, (int32) dentry->key.fss)));
-			}
+		_aqo_stat_remove(queryid);
+		_aqo_qtexts_remove(queryid);
+	}
 
-			LWLockRelease(&aqo_state->data_lock);
-		}
+	nremoved = 0;
+	LWLockAcquire(&aqo_state->stat_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, stat_htab);
+	while ((sentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!usage_expired(&sentry->usage, horizon))
+			continue;
 
-		/*
-		 * In forced mode remove all child FSSes even some of them are still
-		 * link to existed tables.
-		 */
-		if (junk_fss != NIL && !gentle)
-			junk_fss = list_concat(junk_fss, actual_fss);
+		if (!hash_search(stat_htab, &sentry->queryid, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+		nremoved++;
+	}
+	if (nremoved > 0)
+		aqo_state->stat_changed = true;
+	LWLockRelease(&aqo_state->stat_lock);
 
-		/* Remove junk records from aqo_data */
-		foreach(lc, junk_fss)
-		{
-			data_key	key = {.fs = entry->fs, .fss = lfirst_int(lc)};
-			(*fss_num) += (int) _aqo_data_remove(&key);
-		}
+	nremoved = 0;
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, qtexts_htab);
+	while ((tentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (tentry->queryid == 0 || !usage_expired(&tentry->usage, horizon))
+			continue;
 
-		/*
-		 * If no one live FSS exists, remove the class totally. Don't touch
-		 * default query class.
-		 */
-		if (entry->fs != 0 && (actual_fss == NIL || (junk_fss != NIL && !gentle)))
-		{
-			/* Query Stat */
-			_aqo_stat_remove(entry->queryid);
+		(void) _qtext_body_release(tentry->text_key);
+		if (!hash_search(qtexts_htab, &tentry->queryid, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+		nremoved++;
+	}
+	if (nremoved > 0)
+		aqo_state->qtexts_changed = true;
+	LWLockRelease(&aqo_state->qtexts_lock);
 
-			/* Query text */
-			_aqo_qtexts_remove(entry->queryid);
+	LWLockAcquire(&aqo_state->data_lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, data_htab);
+	while ((dentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!usage_expired(&dentry->usage, horizon))
+			continue;
 
-			/* Query class preferences */
-			(*fs_num) += (int) _aqo_queries_remove(entry->queryid);
-		}
+		_data_entry_release(dentry);
+		if (!hash_search(data_htab, &dentry->key, HASH_REMOVE, NULL))
+			elog(PANIC, "[AQO] hash table corrupted");
+		(*fss_num)++;
 	}
+	if (*fss_num > 0)
+		aqo_state->data_changed = true;
+	LWLockRelease(&aqo_state->data_lock);
+
+	list_free_deep(classes);
 
-	/*
-	 * The best place to flush updated AQO storage: calling the routine, user
-	 * realizes how heavy it is.
-	 */
 	aqo_stat_flush();
 	aqo_data_flush();
 	aqo_qtexts_flush();
 	aqo_queries_flush();
 }
 
+/*
+ * Remove knowledge which wasn't used during the given interval.
+ * Returns number of removed query classes and feature subspaces.
+ */
 Datum
-aqo_cleanup(PG_FUNCTION_ARGS)
+aqo_expire(PG_FUNCTION_ARGS)
 {
+	Interval		   *age = PG_GETARG_INTERVAL_P(0);
+	TimestampTz			horizon;
 	int					fs_num;
 	int					fss_num;
 	TupleDesc			tupDesc;
 	HeapTuple			tuple;
-	Datum				result;
 	Datum				values[2];
 	bool				nulls[2] = {0, 0};
 
@@ -2377,73 +5601,145 @@ aqo_cleanup(PG_FUNCTION_ARGS)
 
 	Assert(tupDesc->natts == 2);
 
-	/*
-	 * Make forced cleanup: if at least one fss isn't actual, remove parent FS
-	 * and all its FSSes.
-	 * Main idea of such behaviour here is, if a table was deleted, we have
-	 * little chance to use this class in future. Only one use case here can be
-	 * a reason: to use it as a base for search data in a set of neighbours.
-	 * But, invent another UI function for such logic.
-	 */
-	cleanup_aqo_database(false, &fs_num, &fss_num);
+	horizon = DatumGetTimestampTz(
+						DirectFunctionCall2(timestamptz_mi_interval,
+											TimestampTzGetDatum(GetCurrentTimestamp()),
+											IntervalPGetDatum(age)));
+	aqo_expire_knowledge(horizon, &fs_num, &fss_num);
 
 	values[0] = Int32GetDatum(fs_num);
 	values[1] = Int32GetDatum(fss_num);
-
 	tuple = heap_form_tuple(tupDesc, values, nulls);
-	result = HeapTupleGetDatum(tuple);
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
 
-	PG_RETURN_DATUM(result);
+/* Age buckets of the aqo_knowledge_age() report */
+static const struct
+{
+	const char *name;
+	int64		max_age;
+} age_buckets[] =
+{
+	{"1 hour", USECS_PER_HOUR},
+	{"1 day", USECS_PER_DAY},
+	{"1 week", 7 * USECS_PER_DAY},
+	{"1 month", 30 * USECS_PER_DAY},
+	{"older", PG_INT64_MAX}
+};
+
+#define AGE_NBUCKETS	((int) lengthof(age_buckets))
+
+typedef struct AgeHistogram
+{
+	int64	entries[AGE_NBUCKETS];
+	uint64	hits[AGE_NBUCKETS];
+} AgeHistogram;
+
+static void
+_age_histogram_add(AgeHistogram *hist, AqoUsage *usage, TimestampTz now)
+{
+	int64	age = now - (TimestampTz) pg_atomic_read_u64(&usage->last_used);
+	int		i;
+
+	for (i = 0; i < AGE_NBUCKETS - 1 && age >= age_buckets[i].max_age; i++)
+		;
+
+	hist->entries[i]++;
+	hist->hits[i] += pg_atomic_read_u64(&usage->hits);
 }
 
 /*
- * XXX: Maybe to allow usage of NULL value to make a reset?
+ * Show how many entries of each storage were used last time within an hour,
+ * a day and so on. Helps to choose the aqo.fs_max_items, aqo.fss_max_items
+ * and aqo.knowledge_ttl values.
  */
 Datum
-aqo_drop_class(PG_FUNCTION_ARGS)
+aqo_knowledge_age(PG_FUNCTION_ARGS)
 {
-	uint64			queryid = PG_GETARG_INT64(0);
-	bool			found;
-	QueriesEntry   *entry;
-	uint64			fs;
-	long			cnt;
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[KA_TOTAL_NCOLS];
+	bool				nulls[KA_TOTAL_NCOLS] = {0};
+	HASH_SEQ_STATUS		hash_seq;
+	AgeHistogram		hist[4];
+	const char		   *names[4] = {"queries", "query_texts", "query_stat",
+									"data"};
+	TimestampTz			now = GetCurrentTimestamp();
+	QueriesEntry	   *qentry;
+	QueryTextEntry	   *tentry;
+	StatEntry		   *sentry;
+	DataEntry		   *dentry;
+	int					i;
+	int					j;
 
-	if (queryid == 0)
-		elog(ERROR, "[AQO] Cannot remove basic class "INT64_FORMAT".",
-			 (int64) queryid);
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
 
-	/* Extract FS value for the queryid */
-	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
-	entry = (QueriesEntry *) hash_search(queries_htab, &queryid, HASH_FIND,
-										 &found);
-	if (!found)
-		elog(ERROR, "[AQO] Nothing to remove for the class "INT64_FORMAT".",
-			 (int64) queryid);
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-	fs = entry->fs;
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == KA_TOTAL_NCOLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(hist, 0, sizeof(hist));
+
+	LWLockAcquire(&aqo_state->queries_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, queries_htab);
+	while ((qentry = hash_seq_search(&hash_seq)) != NULL)
+		_age_histogram_add(&hist[0], &qentry->usage, now);
 	LWLockRelease(&aqo_state->queries_lock);
 
-	if (fs == 0)
-		elog(ERROR, "[AQO] Cannot remove class "INT64_FORMAT" with default FS.",
-			 (int64) queryid);
-	if (fs != queryid)
-		elog(WARNING,
-			 "[AQO] Removing query class has non-generic feature space value: "
-			 "id = "INT64_FORMAT", fs = "UINT64_FORMAT".", (int64) queryid, fs);
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, qtexts_htab);
+	while ((tentry = hash_seq_search(&hash_seq)) != NULL)
+		_age_histogram_add(&hist[1], &tentry->usage, now);
+	LWLockRelease(&aqo_state->qtexts_lock);
 
-	/* Now, remove all data related to the class */
-	_aqo_queries_remove(queryid);
-	_aqo_stat_remove(queryid);
-	_aqo_qtexts_remove(queryid);
-	cnt = _aqo_data_clean(fs);
+	LWLockAcquire(&aqo_state->stat_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, stat_htab);
+	while ((sentry = hash_seq_search(&hash_seq)) != NULL)
+		_age_histogram_add(&hist[2], &sentry->usage, now);
+	LWLockRelease(&aqo_state->stat_lock);
 
-	/* Immediately save changes to permanent storage. */
-	aqo_stat_flush();
-	aqo_data_flush();
-	aqo_qtexts_flush();
-	aqo_queries_flush();
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, data_htab);
+	while ((dentry = hash_seq_search(&hash_seq)) != NULL)
+		_age_histogram_add(&hist[3], &dentry->usage, now);
+	LWLockRelease(&aqo_state->data_lock);
 
-	PG_RETURN_INT32(cnt);
+	for (i = 0; i < lengthof(hist); i++)
+	{
+		for (j = 0; j < AGE_NBUCKETS; j++)
+		{
+			values[KA_STORE] = CStringGetTextDatum(names[i]);
+			values[KA_AGE] = CStringGetTextDatum(age_buckets[j].name);
+			values[KA_ENTRIES] = Int64GetDatum(hist[i].entries[j]);
+			values[KA_HITS] = Int64GetDatum((int64) hist[i].hits[j]);
+			tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
 }
 
 typedef enum {
@@ -2468,6 +5764,7 @@ aqo_cardinality_error(PG_FUNCTION_ARGS)
 	HASH_SEQ_STATUS		hash_seq;
 	QueriesEntry	   *qentry;
 	StatEntry		   *sentry;
+	StatEntry			stat;
 	int					counter = 0;
 
 	/* check to see if caller supports us returning a tuplestore */
@@ -2515,6 +5812,11 @@ aqo_cardinality_error(PG_FUNCTION_ARGS)
 			/* Statistics not found by some reason. Just go further */
 			continue;
 
+		LWLockAcquire(&sentry->lock, LW_SHARED);
+		memcpy(&stat, sentry, sizeof(StatEntry));
+		LWLockRelease(&sentry->lock);
+		sentry = &stat;
+
 		nvals = controlled ? sentry->cur_stat_slot_aqo : sentry->cur_stat_slot;
 		if (nvals == 0)
 			/* No one stat slot filled */
@@ -2559,6 +5861,7 @@ aqo_execution_time(PG_FUNCTION_ARGS)
 	HASH_SEQ_STATUS		hash_seq;
 	QueriesEntry	   *qentry;
 	StatEntry		   *sentry;
+	StatEntry			stat;
 	int					counter = 0;
 
 	/* check to see if caller supports us returning a tuplestore */
@@ -2607,6 +5910,11 @@ aqo_execution_time(PG_FUNCTION_ARGS)
 			/* Statistics not found by some reason. Just go further */
 			continue;
 
+		LWLockAcquire(&sentry->lock, LW_SHARED);
+		memcpy(&stat, sentry, sizeof(StatEntry));
+		LWLockRelease(&sentry->lock);
+		sentry = &stat;
+
 		nvals = controlled ? sentry->cur_stat_slot_aqo : sentry->cur_stat_slot;
 		if (nvals == 0)
 			/* No one stat slot filled */
@@ -2826,5 +6134,194 @@ aqo_data_update(PG_FUNCTION_ARGS)
 	data_arg.oids = (Oid *) ARR_DATA_PTR(arr);
 	data_arg.nrels = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
 
+	/* Init the model. NULL payload means the model isn't learned yet. */
+	data_arg.model = PG_ARGISNULL(AD_MODEL) ? AQO_MODEL_KNN :
+					aqo_model_by_name(text_to_cstring(PG_GETARG_TEXT_PP(AD_MODEL)));
+	if (data_arg.model < 0)
+		PG_RETURN_BOOL(false);
+	data_arg.payload = NULL;
+	if (!PG_ARGISNULL(AD_PAYLOAD))
+	{
+		int psize = init_dbl_array(&data_arg.payload,
+								   PG_GETARG_ARRAYTYPE_P(AD_PAYLOAD));
+
+		if (psize != aqo_model_routine(data_arg.model)->size(data_arg.cols))
+			PG_RETURN_BOOL(false);
+	}
+
+	/* The adaptive learning starts afresh */
+	data_arg.err_sum = 0.;
+	data_arg.nsteps = 0;
+
 	PG_RETURN_BOOL(aqo_data_store(fs, fss, &data_arg, NULL));
 }
+
+/*
+ * Offline harness of the learning. Replays recorded samples of a feature
+ * subspace one by one: shows the prediction, made before the learning of a
+ * sample, and the learning parameters after it. Uses current settings of
+ * aqo.model and aqo.adaptive_learning. The storage isn't touched.
+ */
+Datum
+aqo_learning_replay(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[LR_TOTAL_NCOLS];
+	bool				nulls[LR_TOTAL_NCOLS];
+	ArrayType		   *arr;
+	double			   *targets;
+	int					nsamples;
+	int					ncols;
+	OkNNrdata		   *data;
+	int					i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	arr = PG_GETARG_ARRAYTYPE_P(0);
+	nsamples = init_dbl_array(&targets, PG_GETARG_ARRAYTYPE_P(1));
+	if (nsamples <= 0 || ARR_HASNULL(arr) || ARR_NDIM(arr) != 2 ||
+		ARR_DIMS(arr)[0] != nsamples)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("features must be a matrix with a row for each target")));
+	ncols = ARR_DIMS(arr)[1];
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == LR_TOTAL_NCOLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	data = OkNNr_allocate(ncols);
+	data->rows = 0;
+	for (i = 0; i < nsamples; i++)
+	{
+		double *features = (double *) ARR_DATA_PTR(arr) + i * ncols;
+		double	prediction;
+
+		memset(nulls, 0, LR_TOTAL_NCOLS);
+		prediction = aqo_model_predict(data, features, NULL);
+		values[LR_STEP] = Int32GetDatum(i + 1);
+		if (prediction < 0.)
+		{
+			nulls[LR_PREDICTION] = true;
+			nulls[LR_ERROR] = true;
+		}
+		else
+		{
+			values[LR_PREDICTION] = Float8GetDatum(prediction);
+			values[LR_ERROR] = Float8GetDatum(fabs(prediction - targets[i]));
+		}
+
+		data->rows = aqo_model_learn(data, features, targets[i],
+									 RELIABILITY_MAX);
+		values[LR_LEARNING_RATE] = Float8GetDatum(OkNNr_learning_rate(data));
+		values[LR_SELECTION_THRESHOLD] =
+								Float8GetDatum(OkNNr_selection_threshold(data));
+		tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Show sizes of DSA areas of query texts and ML data. Allocated size is the
+ * memory, reserved by an area. Used size is the size of the stored knowledge.
+ */
+Datum
+aqo_dsa_usage(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc			tupDesc;
+	MemoryContext		per_query_ctx;
+	MemoryContext		oldcontext;
+	Tuplestorestate	   *tupstore;
+	Datum				values[DU_TOTAL_NCOLS];
+	bool				nulls[DU_TOTAL_NCOLS] = {0};
+	HASH_SEQ_STATUS		hash_seq;
+	QueryTextBody	   *body;
+	DataEntry		   *dentry;
+	RelOidIndexEntry   *rentry;
+	int64				qtexts_used = 0;
+	int64				data_used = 0;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	Assert(tupDesc->natts == DU_TOTAL_NCOLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupDesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	dsa_init();
+
+	LWLockAcquire(&aqo_state->qtexts_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, qtext_bodies_htab);
+	while ((body = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (DsaPointerIsValid(body->dp))
+			qtexts_used += body->len;
+	}
+	LWLockRelease(&aqo_state->qtexts_lock);
+
+	LWLockAcquire(&aqo_state->data_lock, LW_SHARED);
+	hash_seq_init(&hash_seq, data_htab);
+	while ((dentry = hash_seq_search(&hash_seq)) != NULL)
+		data_used += _compute_data_dsa(dentry);
+	hash_seq_init(&hash_seq, reloids_htab);
+	while ((rentry = hash_seq_search(&hash_seq)) != NULL)
+		data_used += rentry->maxkeys * sizeof(data_key);
+	LWLockRelease(&aqo_state->data_lock);
+
+	values[DU_NAME] = CStringGetTextDatum("AQO Query Texts DSA");
+	values[DU_ALLOCATED] = Int64GetDatum(dsa_get_total_size(qtext_dsa));
+	values[DU_USED] = Int64GetDatum(qtexts_used);
+	tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+
+	values[DU_NAME] = CStringGetTextDatum("AQO Data DSA");
+	values[DU_ALLOCATED] = Int64GetDatum(dsa_get_total_size(data_dsa));
+	values[DU_USED] = Int64GetDatum(data_used);
+	tuplestore_putvalues(tupstore, tupDesc, values, nulls);
+
+	return (Datum) 0;
+}
@@ -1,7 +1,10 @@
 #ifndef STORAGE_H
 #define STORAGE_H
 
+#include "datatype/timestamp.h"
 #include "nodes/pg_list.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
 #include "utils/array.h"
 #include "utils/dsa.h" /* Public structs have links to DSA memory blocks */
 
@@ -10,6 +13,48 @@
 
 #define STAT_SAMPLE_SIZE	(20)
 
+/*
+ * Log-bucketed histogram of a time, in seconds. Each power of two is split
+ * into AQO_HIST_SUBBUCKETS buckets, starting from AQO_HIST_MIN_VALUE. So,
+ * relative error of a percentile doesn't exceed 20%. The last bucket collects
+ * all the values above the range (about an hour). Counts decay, see
+ * aqo_hist_add().
+ */
+#define AQO_HIST_NBUCKETS		(64)
+#define AQO_HIST_SUBBUCKETS		(2)
+#define AQO_HIST_MIN_VALUE		(1e-6)
+#define AQO_HIST_DECAY_COUNT	(1000)
+
+typedef struct AqoHistogram
+{
+	int64	count;
+	uint32	buckets[AQO_HIST_NBUCKETS];
+} AqoHistogram;
+
+/*
+ * Arm of the auto tuning bandit: executions with or without AQO. Sample mean
+ * and variance of log-time (planning plus execution) by the Welford's method.
+ */
+typedef struct AqoBanditArm
+{
+	int64	n;
+	double	mean;
+	double	m2;		/* sum of squared deviations from the mean */
+	double	recent;	/* exponentially weighted mean, to detect a drift */
+} AqoBanditArm;
+
+/*
+ * Usage accounting of an entry of the knowledge base. Readers update it under
+ * a shared lock of the storage, so the fields are atomic. Changes of these
+ * fields don't mark the storage as changed: they reach the disk only with
+ * changes of the data itself.
+ */
+typedef struct AqoUsage
+{
+	pg_atomic_uint64	last_used;	/* TimestampTz of the last access */
+	pg_atomic_uint64	hits;		/* Number of accesses */
+} AqoUsage;
+
 /*
  * Storage struct for AQO statistics
  * It is mostly needed for auto tuning feature. With auto tuning mode aqo
@@ -22,6 +67,15 @@ typedef struct StatEntry
 {
 	uint64	queryid; /* The key in the hash table, should be the first field ever */
 
+	/*
+	 * Protects fields below. Writers hold stat_lock in shared mode, so
+	 * executions of different classes don't serialize on the global lock.
+	 * An update does a lot of math, so it isn't a spinlock.
+	 */
+	LWLock	lock;
+
+	AqoUsage	usage;
+
 	int64	execs_with_aqo;
 	int64	execs_without_aqo;
 
@@ -34,8 +88,50 @@ typedef struct StatEntry
 	double	exec_time_aqo[STAT_SAMPLE_SIZE];
 	double	plan_time_aqo[STAT_SAMPLE_SIZE];
 	double	est_error_aqo[STAT_SAMPLE_SIZE];
+
+	/* Distributions of all the executions of the class */
+	AqoHistogram	exec_hist;
+	AqoHistogram	plan_hist;
+	AqoHistogram	exec_hist_aqo;
+	AqoHistogram	plan_hist_aqo;
+
+	/* State of the auto tuning bandit */
+	AqoBanditArm	arm;
+	AqoBanditArm	arm_aqo;
+	double			regret;	/* time lost on the worse arm, in seconds */
+
+	/* Executions with and without planning, to choose plan_cache_mode */
+	AqoBanditArm	arm_planned;
+	AqoBanditArm	arm_cached;
+
+	/* Executions with and without JIT */
+	AqoBanditArm	arm_jit;
+	AqoBanditArm	arm_nojit;
+
+	/* Memory demand of the plan nodes which spilled to disk */
+	int64	nspills;
+	double	work_mem;	/* work_mem, enough to avoid the spills, in kB */
+
+	/*
+	 * Parallel workers of Gather and Gather Merge nodes. Exponentially
+	 * decayed sums over executions with AQO_WORKERS_DECAY.
+	 */
+	double	ngathers;
+	double	workers_planned;
+	double	workers_launched;
+
+	/*
+	 * Shadow predictions, made while the class is planned with the native
+	 * estimates: number of plan nodes and sums of absolute errors of both
+	 * estimates in the log scale.
+	 */
+	int64	shadow_nobjects;
+	double	shadow_error_aqo;
+	double	shadow_error_native;
 } StatEntry;
 
+#define AQO_WORKERS_DECAY	(0.9)
+
 /*
  * Auxiliary struct, used for passing arguments
  * to aqo_stat_store() function.
@@ -54,21 +150,55 @@ typedef struct AqoStatArgs
 	double	*exec_time_aqo;
 	double	*plan_time_aqo;
 	double	*est_error_aqo;
+
+	bool	jit;	/* Was the plan JIT-compiled? Only for the append mode */
+	double	work_mem;	/* work_mem needed by spilled nodes, kB, or 0 */
+
+	/* Parallel workers of the executed Gather nodes */
+	int		ngathers;
+	int		workers_planned;
+	int		workers_launched;
+
+	/* Errors of the shadow predictions of the execution */
+	int		shadow_nobjects;
+	double	shadow_error_aqo;
+	double	shadow_error_native;
 } AqoStatArgs;
 
 /*
  * Storage entry for query texts.
  * Query strings may have very different sizes. So, in hash table we store only
- * link to DSA-allocated memory.
+ * a key of the text body. Identical texts of different query classes share
+ * the same body.
  */
 typedef struct QueryTextEntry
 {
 	uint64	queryid;
+	uint64	text_key;
 
-	/* Link to DSA-allocated memory block. Can be shared across backends */
-	dsa_pointer qtext_dp;
+	AqoUsage	usage;
 } QueryTextEntry;
 
+/*
+ * Body of a query text. The text may be compressed. If it isn't resident, it
+ * is read from the file of query texts on demand.
+ */
+typedef struct QueryTextBody
+{
+	uint64		key;		/* hash of the text, linear probing on collisions */
+	int			refcount;	/* number of query classes, sharing the text */
+	int32		rawlen;		/* length of the text, including trailing zero */
+	int32		len;		/* size of the stored text */
+	bool		compressed;
+	uint64		check;		/* another hash of the text, see _qtext_check() */
+
+	/* Link to DSA-allocated memory block. Invalid, if the text isn't resident */
+	dsa_pointer	dp;
+
+	/* Position of the text in the file. -1, if the text hasn't flushed yet */
+	int64		offset;
+} QueryTextBody;
+
 typedef struct data_key
 {
 	uint64	fs;
@@ -83,15 +213,124 @@ typedef struct DataEntry
 	int cols; /* aka nfeatures */
 	int rows; /* aka number of equations */
 	int nrels;
+	int model; /* AqoModelKind, defines size of the payload */
+	Oid dbid; /* database of the relations, which the data was learned on */
+
+	/* State of the adaptive learning, see OkNNr_learn() */
+	double	err_sum;
+	int64	nsteps;
+
+	AqoUsage	usage;
 
 	/*
 	 * Link to DSA-allocated memory block. Can be shared across backends.
 	 * Contains:
-	 * matrix[][], targets[], reliability[], oids.
+	 * matrix[][], targets[], reliability[], payload[], oids.
 	 */
 	dsa_pointer data_dp;
 } DataEntry;
 
+/*
+ * Reverse index of the ML data: entries of aqo_data which depend on the
+ * relation. Allows to find knowledge related to dropped relations without
+ * a scan of the whole storage. Protected by the data_lock.
+ * OIDs of relations are unique within a database only.
+ */
+typedef struct RelOidIndexKey
+{
+	Oid			dbid;
+	Oid			reloid;
+} RelOidIndexKey;
+
+typedef struct RelOidIndexEntry
+{
+	RelOidIndexKey	key;
+
+	int			nkeys;
+	int			maxkeys;
+	dsa_pointer	keys_dp; /* DSA-allocated array data_key[maxkeys] */
+} RelOidIndexEntry;
+
+/*
+ * Plan regression guard. For each query class we track a few recently
+ * executed plans, identified by a hash of the plan shape, and a moving
+ * average of their execution time. Predictions of the best known plan are
+ * kept as a snapshot. If a new plan is much slower than the best one, the
+ * class is planned with the snapshot for a while.
+ */
+#define AQO_PLAN_GUARD_NPLANS	(4)
+#define AQO_PLAN_GUARD_NFSS		(32)	/* max plan nodes in a snapshot */
+#define AQO_PLAN_GUARD_WINDOW	(8)		/* smoothing of the execution time */
+#define AQO_PLAN_GUARD_PIN_EXECS	(100)
+
+typedef struct AqoPlanStat
+{
+	uint64	planid;		/* hash of the plan shape, 0 - the slot is empty */
+	int64	nexecs;
+	int64	last_exec;	/* number of the last execution of the class */
+	double	exec_time;	/* moving average of the execution time */
+} AqoPlanStat;
+
+typedef struct PlanGuardEntry
+{
+	uint64	queryid;
+
+	int64		nexecs;
+	AqoPlanStat	plans[AQO_PLAN_GUARD_NPLANS];
+
+	/* Snapshot of predictions which produced the good plan */
+	uint64	good_planid;	/* 0, if there is no snapshot */
+	int		nfss;
+	int		fss[AQO_PLAN_GUARD_NFSS];
+	double	rows[AQO_PLAN_GUARD_NFSS];	/* -1, if the planner's own estimate used */
+
+	int		pin_left; /* executions to plan with the snapshot */
+} PlanGuardEntry;
+
+/*
+ * Buffer cache behaviour of a relation for a kind of access. Counters of hit
+ * and read blocks decay, so the hit ratio follows the recent workload. Isn't
+ * stored on disk: the state of the cache doesn't survive a restart anyway.
+ */
+typedef enum
+{
+	AQO_ACCESS_SEQ = 0,		/* sequential scans */
+	AQO_ACCESS_RANDOM,		/* index and bitmap scans */
+	AQO_ACCESS_KINDS
+} AqoRelAccess;
+
+#define AQO_RELIO_DECAY		(0.9)	/* per a learned scan */
+#define AQO_RELIO_MIN_BLOCKS	(100.)	/* needed to trust the ratio */
+
+typedef struct RelIOKey
+{
+	Oid		dbid;
+	Oid		relid;
+	int		access;	/* AqoRelAccess */
+} RelIOKey;
+
+typedef struct RelIOEntry
+{
+	RelIOKey	key;
+
+	int64		nscans;
+	double		hits;
+	double		reads;
+} RelIOEntry;
+
+/*
+ * Errors of the shadow predictions for a feature subspace, accumulated like
+ * in the StatEntry. Isn't stored on disk.
+ */
+typedef struct ShadowEntry
+{
+	data_key	key;
+
+	int64		nobjects;
+	double		error_aqo;
+	double		error_native;
+} ShadowEntry;
+
 typedef struct QueriesEntry
 {
 	uint64	queryid;
@@ -103,6 +342,10 @@ typedef struct QueriesEntry
 
 	int64	smart_timeout;
 	int64	count_increase_timeout;
+
+	int		jit;	/* AQO_JIT setting of the class */
+
+	AqoUsage	usage;
 } QueriesEntry;
 
 /*
@@ -127,17 +370,53 @@ extern AqoQueriesNullArgs aqo_queries_nulls;
 
 extern int querytext_max_size;
 extern int dsm_size_max;
+extern int querytext_dsm_size_max;
+extern bool querytext_compression;
+extern bool querytext_resident;
+extern int knowledge_ttl;
+extern double plan_regression_threshold;
+extern int plan_regression_min_execs;
+extern double knowledge_drift_threshold;
+extern double knowledge_drift_decay;
+extern int aqo_cleanup_batch_size;
 
 extern HTAB *stat_htab;
 extern HTAB *qtexts_htab;
+extern HTAB *qtext_bodies_htab;
 extern HTAB *queries_htab; /* TODO */
 extern HTAB *data_htab; /* TODO */
+extern HTAB *reloids_htab;
+extern HTAB *plan_guard_htab;
+extern HTAB *relio_htab;
+extern HTAB *shadow_htab;
 
+extern void aqo_hist_add(AqoHistogram *hist, double value);
+extern void aqo_bandit_observe(AqoBanditArm *played, AqoBanditArm *other,
+							   double *regret, double plan_time,
+							   double exec_time);
+extern double aqo_bandit_expected_time(const AqoBanditArm *arm);
+extern void aqo_bandit_arm_add(AqoBanditArm *arm, double time);
+extern void aqo_plan_cache_observe(StatEntry *entry, double plan_time,
+								   double exec_time, bool forget);
+extern void aqo_jit_observe(StatEntry *entry, bool jit, double exec_time);
+extern double aqo_hist_percentile(const AqoHistogram *hist, double p);
 extern StatEntry *aqo_stat_store(uint64 queryid, bool use_aqo,
 								 AqoStatArgs *stat_arg, bool append_mode);
+extern bool aqo_stat_find(uint64 queryid, StatEntry *stat);
 extern void aqo_stat_flush(void);
 extern void aqo_stat_load(void);
 
+extern void aqo_plan_guard_store(uint64 queryid, uint64 planid,
+								 double exec_time, int nfss, const int *fss,
+								 const double *rows);
+extern int aqo_plan_guard_snapshot(uint64 queryid, int *fss, double *rows);
+
+extern void aqo_relio_store(Oid relid, int access, double hits, double reads);
+extern double aqo_relio_hit_ratio(Oid relid, int access);
+
+extern void aqo_shadow_store(uint64 fs, int fss, double error_aqo,
+							 double error_native);
+
 extern bool aqo_qtext_store(uint64 queryid, const char *query_string);
 extern void aqo_qtexts_flush(void);
 extern void aqo_qtexts_load(void);
@@ -146,8 +425,13 @@ extern bool aqo_data_store(uint64 fs, int fss, AqoDataArgs *data,
 						   List *reloids);
 extern bool load_aqo_data(uint64 fs, int fss, OkNNrdata *data, List **reloids,
 						  bool wideSearch, double *features);
+extern int load_aqo_data_batch(uint64 fs, int nkeys, const int *fss,
+							   OkNNrdata **result);
 extern void aqo_data_flush(void);
 extern void aqo_data_load(void);
+extern int aqo_data_decay_relations(const Oid *reloids, int nrels);
+extern int aqo_data_decay_fs(uint64 fs);
+extern Oid *aqo_data_reloids(int *nrels);
 
 extern bool aqo_queries_find(uint64 queryid, QueryContextData *ctx);
 extern bool aqo_queries_store(uint64 queryid, uint64 fs, bool learn_aqo,
@@ -164,6 +448,10 @@ extern void init_deactivated_queries_storage(void);
 extern bool query_is_deactivated(uint64 query_hash);
 extern void add_deactivated_query(uint64 query_hash);
 
-extern void cleanup_aqo_database(bool gentle, int *fs_num, int *fss_num);
+extern bool cleanup_aqo_database(bool gentle, int *fs_num, int *fss_num);
+extern void aqo_cleanup_dropped(Oid dbid, const Oid *reloids, int nreloids,
+								int *fs_num, int *fss_num);
+extern void aqo_expire_knowledge(TimestampTz horizon, int *fs_num,
+								 int *fss_num);
 
 #endif /* STORAGE_H */
@@ -0,0 +1,94 @@
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More tests => 8;
+
+# Query texts aren't resident: they are read from the storage file on demand.
+my $node = PostgreSQL::Test::Cluster->new('nonresident');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+						shared_preload_libraries = 'aqo'
+						aqo.mode = 'learn'
+						aqo.querytext_resident = 'off'
+						aqo.join_threshold = 0
+						log_statement = 'ddl'
+					});
+
+# Disable connection default settings, forced by PGOPTIONS in AQO Makefile
+$ENV{PGOPTIONS}="";
+
+my $res;
+$node->start();
+$node->safe_psql('postgres', "
+	CREATE EXTENSION aqo;
+	CREATE TABLE t1 AS SELECT x AS a FROM generate_series(1, 100) x;
+	CREATE TABLE t2 AS SELECT x AS a FROM generate_series(1, 100) x;
+	ANALYZE t1, t2;
+");
+
+# Two classes share the same text, others have their own texts
+$node->safe_psql('postgres', "
+	SELECT aqo_query_texts_update(1, repeat('SELECT 1; ', 50));
+	SELECT aqo_query_texts_update(2, repeat('SELECT 1; ', 50));
+	SELECT count(*) FROM t1 WHERE a < 10;
+	SELECT count(*) FROM t1 WHERE a < 10 AND a > 1;
+	SELECT count(*) FROM t2 WHERE a < 10;
+	SELECT count(*) FROM t2 WHERE a < 10 AND a > 1;
+");
+my $texts = $node->safe_psql('postgres', "
+	SELECT queryid, md5(query_text) FROM aqo_query_texts ORDER BY queryid
+");
+
+# After the restart texts are read from the file only
+$node->restart();
+$res = $node->safe_psql('postgres', "
+	SELECT used_size FROM aqo_dsa_usage() WHERE name = 'AQO Query Texts DSA'
+");
+is($res, 0, "texts aren't resident after the restart");
+$res = $node->safe_psql('postgres', "
+	SELECT queryid, md5(query_text) FROM aqo_query_texts ORDER BY queryid
+");
+is($res, $texts, "texts are read from the file");
+
+# Release texts of the dropped table. Remaining texts must still be found.
+$node->safe_psql('postgres', "DROP TABLE t1");
+$res = $node->safe_psql('postgres', "SELECT nfs > 0 FROM aqo_cleanup()");
+is($res, 't', "classes of the dropped table are removed");
+$texts = $node->safe_psql('postgres', "
+	SELECT queryid, md5(query_text) FROM aqo_query_texts ORDER BY queryid
+");
+$res = $node->safe_psql('postgres', "
+	SELECT count(*) FROM aqo_query_texts WHERE query_text LIKE '%t2%'
+");
+is($res, 2, "texts of the alive table are kept");
+
+# Storing a known text reuses the body instead of a new one
+$node->safe_psql('postgres', "
+	SELECT aqo_query_texts_update(3, repeat('SELECT 1; ', 50));
+	SELECT count(*) FROM t2 WHERE a < 10;
+");
+$res = $node->safe_psql('postgres', "
+	SELECT used_size FROM aqo_dsa_usage() WHERE name = 'AQO Query Texts DSA'
+");
+is($res, 0, "known texts aren't stored again");
+$res = $node->safe_psql('postgres', "
+	SELECT count(DISTINCT query_text) FROM aqo_query_texts
+	WHERE queryid IN (1, 2, 3)
+");
+is($res, 1, "text is shared by classes");
+
+# Released bodies are kept on disk consistently with the remaining ones
+$node->restart();
+$res = $node->safe_psql('postgres', "
+	SELECT queryid, md5(query_text) FROM aqo_query_texts
+	WHERE queryid <> 3 ORDER BY queryid
+");
+is($res, $texts, "texts survive the restart after releasing");
+$res = $node->safe_psql('postgres', "
+	SELECT count(*) FROM aqo_query_texts WHERE query_text IS NULL
+");
+is($res, 0, "no text is lost");
+
+$node->stop();